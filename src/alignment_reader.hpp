@@ -0,0 +1,699 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cctype>
+#include <algorithm>
+#include <cstring>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include "xstrom.hpp"
+#include "state_matrix.hpp"
+#include "mapped_file.hpp"
+
+namespace strom
+    {
+
+    class AlignmentReader
+        {
+        public:
+            typedef std::vector<std::string>    taxon_names_t;
+            typedef std::map<std::string, std::string>  charsets_t;
+
+            enum format_t
+                {
+                UnknownFormat   = 0,
+                FastaFormat     = 1,
+                PhylipFormat    = 2,
+                NexusFormat     = 3
+                };
+
+                                        AlignmentReader();
+                                        ~AlignmentReader();
+
+            bool                        readFile(const std::string filename, taxon_names_t & taxon_names, StateMatrix & columns);
+            format_t                    getFormat() const;
+            std::string                 getFormatName() const;
+            const charsets_t &          getCharsets() const;
+
+        private:
+
+            class Unsupported {};
+
+            void                        clear();
+            format_t                    detectFormat() const;
+            void                        initStateTable();
+            void                        setStateCode(char ch, int state);
+            int                         decodeState(char ch) const;
+
+            void                        readFasta(taxon_names_t & taxon_names, StateMatrix & columns);
+            void                        readPhylip(taxon_names_t & taxon_names, StateMatrix & columns);
+            void                        readNexus(taxon_names_t & taxon_names, StateMatrix & columns);
+            void                        readNexusFormatCommand();
+            void                        readNexusSetsBlock();
+            void                        readNexusMatrix(taxon_names_t & taxon_names, StateMatrix & columns);
+            void                        readSequence(unsigned taxon, unsigned seqlen, StateMatrix & columns, bool skip_comments);
+
+            void                        skipWhitespace();
+            void                        skipWhitespaceAndComments();
+            void                        skipToEndOfCommand();
+            void                        skipBlock();
+            std::string                 nextToken();
+            std::string                 nextWord();
+            unsigned                    nextUnsigned(const std::string what);
+            void                        expectToken(const std::string expected);
+
+            MappedFile                  _file;
+            std::string                 _filename;
+            const char *                _begin;
+            const char *                _p;
+            const char *                _end;
+            format_t                    _format;
+
+            unsigned                    _ntax;
+            unsigned                    _nchar;
+            char                        _gap;
+            char                        _missing;
+            int                         _state_table[256];
+            charsets_t                  _charsets;
+
+            static const int            _invalid_state;
+
+        public:
+
+            typedef std::shared_ptr< AlignmentReader > SharedPtr;
+        };
+
+inline AlignmentReader::AlignmentReader()
+    {
+    //std::cout << "Constructing an AlignmentReader" << std::endl;
+    clear();
+    }
+
+inline AlignmentReader::~AlignmentReader()
+    {
+    //std::cout << "Destroying an AlignmentReader" << std::endl;
+    }
+
+inline void AlignmentReader::clear()
+    {
+    _file.close();
+    _filename   = "";
+    _begin      = 0;
+    _p          = 0;
+    _end        = 0;
+    _format     = UnknownFormat;
+    _ntax       = 0;
+    _nchar      = 0;
+    _gap        = '-';
+    _missing    = '?';
+    _charsets.clear();
+    initStateTable();
+    }
+
+inline AlignmentReader::format_t AlignmentReader::getFormat() const
+    {
+    return _format;
+    }
+
+inline const AlignmentReader::charsets_t & AlignmentReader::getCharsets() const
+    {
+    return _charsets;
+    }
+
+inline std::string AlignmentReader::getFormatName() const
+    {
+    switch (_format)
+        {
+        case FastaFormat:   return "FASTA";
+        case PhylipFormat:  return "relaxed PHYLIP";
+        case NexusFormat:   return "NEXUS";
+        default:            return "unknown";
+        }
+    }
+
+inline void AlignmentReader::initStateTable()
+    {
+    // A, C, G and T/U are states 0-3; N, X, gaps and missing data are all
+    // state 4 (completely missing); the remaining IUPAC ambiguity codes get
+    // the state codes defined by StateMatrix::nucleotideState
+    for (unsigned i = 0; i < 256; ++i)
+        _state_table[i] = _invalid_state;
+    std::string symbols = "ACGTMRWSYKVHDBN";
+    std::vector<unsigned> masks = {1, 2, 4, 8, 3, 5, 9, 6, 10, 12, 7, 11, 13, 14, 15};
+    for (unsigned i = 0; i < symbols.size(); ++i)
+        setStateCode(symbols[i], (int)StateMatrix::nucleotideState(masks[i]));
+    setStateCode('U', decodeState('T'));
+    setStateCode('X', decodeState('N'));
+    _state_table[(unsigned char)'-'] = StateMatrix::_missing_nucleotide;
+    _state_table[(unsigned char)'?'] = StateMatrix::_missing_nucleotide;
+    }
+
+inline void AlignmentReader::setStateCode(char ch, int state)
+    {
+    _state_table[(unsigned char)std::toupper(ch)] = state;
+    _state_table[(unsigned char)std::tolower(ch)] = state;
+    }
+
+inline int AlignmentReader::decodeState(char ch) const
+    {
+    return _state_table[(unsigned char)ch];
+    }
+
+inline bool AlignmentReader::readFile(const std::string filename, taxon_names_t & taxon_names, StateMatrix & columns)
+    {
+    // Reads a FASTA, relaxed (sequential) PHYLIP, or simple NEXUS nucleotide alignment
+    // directly from a memory-mapped file into columns, which is laid out with one row
+    // per site and one column per taxon. Returns false, leaving taxon_names and
+    // columns untouched, if the file uses features not handled here, in which case
+    // the caller should fall back to NCL. Throws XStrom if the file is malformed.
+    clear();
+    _filename = filename;
+    _file.open(filename);
+    _begin  = _file.getData();
+    _p      = _begin;
+    _end    = _begin + _file.getSize();
+    _format = detectFormat();
+
+    taxon_names_t names;
+    StateMatrix matrix;
+    try
+        {
+        switch (_format)
+            {
+            case FastaFormat:
+                readFasta(names, matrix);
+                break;
+            case PhylipFormat:
+                readPhylip(names, matrix);
+                break;
+            case NexusFormat:
+                readNexus(names, matrix);
+                break;
+            default:
+                throw Unsupported();
+            }
+        }
+    catch (Unsupported &)
+        {
+        _file.close();
+        return false;
+        }
+    _file.close();
+
+    taxon_names.swap(names);
+    columns.swap(matrix);
+    return true;
+    }
+
+inline AlignmentReader::format_t AlignmentReader::detectFormat() const
+    {
+    const char * p = _begin;
+    while (p < _end && std::isspace((unsigned char)*p))
+        ++p;
+    if (p == _end)
+        return UnknownFormat;
+    if (*p == '>')
+        return FastaFormat;
+    if (_end - p >= 6 && boost::iequals(std::string(p, 6), "#nexus"))
+        return NexusFormat;
+    if (std::isdigit((unsigned char)*p))
+        return PhylipFormat;
+    return UnknownFormat;
+    }
+
+inline void AlignmentReader::skipWhitespace()
+    {
+    while (_p < _end && std::isspace((unsigned char)*_p))
+        ++_p;
+    }
+
+inline void AlignmentReader::skipWhitespaceAndComments()
+    {
+    // NEXUS comments are enclosed in square brackets and may be nested
+    skipWhitespace();
+    while (_p < _end && *_p == '[')
+        {
+        unsigned depth = 0;
+        do
+            {
+            if (*_p == '[')
+                ++depth;
+            else if (*_p == ']')
+                --depth;
+            ++_p;
+            }
+        while (_p < _end && depth > 0);
+        if (depth > 0)
+            throw XStrom(boost::str(boost::format("Unterminated comment in file \"%s\"") % _filename));
+        skipWhitespace();
+        }
+    }
+
+inline std::string AlignmentReader::nextToken()
+    {
+    // Returns the next NEXUS token: a single punctuation character, a quoted
+    // string (quotes removed), or a run of other non-whitespace characters.
+    // Returns an empty string at the end of the file.
+    skipWhitespaceAndComments();
+    if (_p == _end)
+        return "";
+
+    std::string token;
+    char ch = *_p;
+    if (ch == '\'' || ch == '"')
+        {
+        // quoted token; a doubled quote character stands for the quote itself
+        char quote = ch;
+        ++_p;
+        while (true)
+            {
+            if (_p == _end)
+                throw XStrom(boost::str(boost::format("Unterminated quoted token in file \"%s\"") % _filename));
+            if (*_p == quote)
+                {
+                if (_p + 1 < _end && *(_p + 1) == quote)
+                    {
+                    token += quote;
+                    _p += 2;
+                    continue;
+                    }
+                ++_p;
+                break;
+                }
+            token += *_p++;
+            }
+        return token;
+        }
+
+    if (std::strchr(";=,", ch))
+        {
+        ++_p;
+        return std::string(1, ch);
+        }
+
+    while (_p < _end && !std::isspace((unsigned char)*_p) && !std::strchr(";=,['\"", *_p))
+        token += *_p++;
+    return token;
+    }
+
+inline std::string AlignmentReader::nextWord()
+    {
+    // Returns the next token, converting underscores in unquoted
+    // tokens to spaces as required by the NEXUS standard (and done by NCL)
+    skipWhitespaceAndComments();
+    bool quoted = (_p < _end && (*_p == '\'' || *_p == '"'));
+    std::string token = nextToken();
+    if (!quoted)
+        std::replace(token.begin(), token.end(), '_', ' ');
+    return token;
+    }
+
+inline unsigned AlignmentReader::nextUnsigned(const std::string what)
+    {
+    std::string token = nextToken();
+    if (token.empty() || token.find_first_not_of("0123456789") != std::string::npos)
+        throw XStrom(boost::str(boost::format("Expecting %s to be a positive integer but found \"%s\" in file \"%s\"") % what % token % _filename));
+    return (unsigned)std::stoul(token);
+    }
+
+inline void AlignmentReader::expectToken(const std::string expected)
+    {
+    std::string token = nextToken();
+    if (!boost::iequals(token, expected))
+        throw XStrom(boost::str(boost::format("Expecting \"%s\" but found \"%s\" in file \"%s\"") % expected % token % _filename));
+    }
+
+inline void AlignmentReader::skipToEndOfCommand()
+    {
+    std::string token;
+    do
+        {
+        token = nextToken();
+        if (token.empty())
+            throw XStrom(boost::str(boost::format("Unexpected end of file \"%s\" (missing semicolon)") % _filename));
+        }
+    while (token != ";");
+    }
+
+inline void AlignmentReader::skipBlock()
+    {
+    // Skips commands up to and including "end;" or "endblock;"
+    while (true)
+        {
+        std::string token = nextToken();
+        if (token.empty())
+            throw XStrom(boost::str(boost::format("Unexpected end of file \"%s\" (missing end of block)") % _filename));
+        if (boost::iequals(token, "end") || boost::iequals(token, "endblock"))
+            {
+            expectToken(";");
+            return;
+            }
+        if (token != ";")
+            skipToEndOfCommand();
+        }
+    }
+
+inline void AlignmentReader::readSequence(unsigned taxon, unsigned seqlen, StateMatrix & columns, bool skip_comments)
+    {
+    // Decodes exactly seqlen states for taxon, ignoring whitespace (and NEXUS comments)
+    for (unsigned k = 0; k < seqlen; ++k)
+        {
+        if (skip_comments)
+            skipWhitespaceAndComments();
+        else
+            skipWhitespace();
+        if (_p == _end || *_p == ';' || (_format == FastaFormat && *_p == '>'))
+            throw XStrom(boost::str(boost::format("Sequence for taxon %d ended after %d sites but expecting %d in file \"%s\"") % (taxon+1) % k % seqlen % _filename));
+
+        char ch = *_p;
+        int state = decodeState(ch);
+        if (state == _invalid_state)
+            {
+            // polymorphisms and other NEXUS extensions are left to NCL
+            if (_format == NexusFormat && std::strchr("({", ch))
+                throw Unsupported();
+            throw XStrom(boost::str(boost::format("Invalid nucleotide state '%c' for taxon %d at site %d in file \"%s\"") % ch % (taxon+1) % (k+1) % _filename));
+            }
+        columns.setState(k, taxon, state);
+        ++_p;
+        }
+    }
+
+inline void AlignmentReader::readFasta(taxon_names_t & taxon_names, StateMatrix & columns)
+    {
+    // First pass: count records and the number of states in the first record,
+    // so that columns can be allocated before any states are decoded
+    unsigned ntax = 0;
+    unsigned seqlen = 0;
+    const char * p = _begin;
+    while (p < _end)
+        {
+        const char * eol = (const char *)std::memchr(p, '\n', _end - p);
+        if (!eol)
+            eol = _end;
+        if (*p == '>')
+            ++ntax;
+        else if (ntax == 1)
+            {
+            for (const char * q = p; q < eol; ++q)
+                {
+                if (!std::isspace((unsigned char)*q))
+                    ++seqlen;
+                }
+            }
+        p = eol + 1;
+        }
+    if (ntax == 0 || seqlen == 0)
+        throw XStrom(boost::str(boost::format("No sequences found in FASTA file \"%s\"") % _filename));
+
+    // Second pass: decode states directly into columns
+    columns.resize(seqlen, ntax, true, 1);
+    taxon_names.resize(ntax);
+    for (unsigned t = 0; t < ntax; ++t)
+        {
+        skipWhitespace();
+        assert(_p < _end && *_p == '>');
+        const char * eol = (const char *)std::memchr(_p, '\n', _end - _p);
+        if (!eol)
+            eol = _end;
+        taxon_names[t] = boost::trim_copy(std::string(_p + 1, eol));
+        _p = eol;
+
+        readSequence(t, seqlen, columns, false);
+
+        skipWhitespace();
+        if (_p < _end && *_p != '>')
+            throw XStrom(boost::str(boost::format("Sequence for taxon %d (\"%s\") is longer than the first sequence (%d sites) in FASTA file \"%s\"") % (t+1) % taxon_names[t] % seqlen % _filename));
+        }
+    _ntax = ntax;
+    _nchar = seqlen;
+    }
+
+inline void AlignmentReader::readPhylip(taxon_names_t & taxon_names, StateMatrix & columns)
+    {
+    // Relaxed sequential PHYLIP: "ntax nchar" followed by one row per taxon, each
+    // consisting of a name without spaces and nchar states (which may span lines)
+    skipWhitespace();
+    _ntax  = nextUnsigned("number of taxa");
+    _nchar = nextUnsigned("number of sites");
+    if (_ntax == 0 || _nchar == 0)
+        throw XStrom(boost::str(boost::format("PHYLIP file \"%s\" specifies an empty alignment") % _filename));
+
+    columns.resize(_nchar, _ntax, true, 1);
+    taxon_names.resize(_ntax);
+    for (unsigned t = 0; t < _ntax; ++t)
+        {
+        skipWhitespace();
+        const char * name_start = _p;
+        while (_p < _end && !std::isspace((unsigned char)*_p))
+            ++_p;
+        if (_p == name_start)
+            throw XStrom(boost::str(boost::format("PHYLIP file \"%s\" ended before the row for taxon %d") % _filename % (t+1)));
+        taxon_names[t] = std::string(name_start, _p);
+        readSequence(t, _nchar, columns, false);
+        }
+
+    skipWhitespace();
+    if (_p < _end)
+        throw XStrom(boost::str(boost::format("Unexpected text after the last row of PHYLIP file \"%s\" (interleaved PHYLIP is not supported)") % _filename));
+    }
+
+inline void AlignmentReader::readNexus(taxon_names_t & taxon_names, StateMatrix & columns)
+    {
+    // Handles a TAXA block followed by a CHARACTERS block, or a single DATA block,
+    // holding a non-interleaved DNA/RNA matrix. Charsets are read from SETS and
+    // ASSUMPTIONS blocks. Other blocks are skipped.
+    skipWhitespace();
+    _p += 6;    // skip "#nexus"
+    bool found_matrix = false;
+    taxon_names_t taxlabels;
+    while (true)
+        {
+        std::string token = nextToken();
+        if (token.empty())
+            break;
+        if (!boost::iequals(token, "begin"))
+            throw XStrom(boost::str(boost::format("Expecting \"begin\" but found \"%s\" in file \"%s\"") % token % _filename));
+        std::string block_name = nextToken();
+        expectToken(";");
+
+        if (boost::iequals(block_name, "taxa"))
+            {
+            if (!taxlabels.empty())
+                throw Unsupported();
+            while (true)
+                {
+                std::string command = nextToken();
+                if (boost::iequals(command, "end") || boost::iequals(command, "endblock"))
+                    {
+                    expectToken(";");
+                    break;
+                    }
+                else if (boost::iequals(command, "dimensions"))
+                    {
+                    expectToken("ntax");
+                    expectToken("=");
+                    _ntax = nextUnsigned("ntax");
+                    expectToken(";");
+                    }
+                else if (boost::iequals(command, "taxlabels"))
+                    {
+                    for (std::string label = nextWord(); label != ";"; label = nextWord())
+                        {
+                        if (label.empty())
+                            throw XStrom(boost::str(boost::format("Unexpected end of file \"%s\" in taxlabels command") % _filename));
+                        taxlabels.push_back(label);
+                        }
+                    }
+                else
+                    throw Unsupported();
+                }
+            if (taxlabels.size() != _ntax)
+                throw XStrom(boost::str(boost::format("Expecting %d taxon labels but found %d in file \"%s\"") % _ntax % taxlabels.size() % _filename));
+            }
+        else if (boost::iequals(block_name, "characters") || boost::iequals(block_name, "data"))
+            {
+            if (found_matrix)
+                throw Unsupported();
+            bool is_data_block = boost::iequals(block_name, "data");
+            if (!is_data_block && taxlabels.empty())
+                throw Unsupported();
+            while (true)
+                {
+                std::string command = nextToken();
+                if (boost::iequals(command, "end") || boost::iequals(command, "endblock"))
+                    {
+                    expectToken(";");
+                    break;
+                    }
+                else if (boost::iequals(command, "dimensions"))
+                    {
+                    for (std::string subcommand = nextToken(); subcommand != ";"; subcommand = nextToken())
+                        {
+                        if (boost::iequals(subcommand, "ntax"))
+                            {
+                            expectToken("=");
+                            unsigned ntax = nextUnsigned("ntax");
+                            if (!is_data_block && ntax != _ntax)
+                                throw Unsupported();
+                            _ntax = ntax;
+                            }
+                        else if (boost::iequals(subcommand, "nchar"))
+                            {
+                            expectToken("=");
+                            _nchar = nextUnsigned("nchar");
+                            }
+                        else
+                            throw Unsupported();
+                        }
+                    }
+                else if (boost::iequals(command, "format"))
+                    readNexusFormatCommand();
+                else if (boost::iequals(command, "matrix"))
+                    {
+                    if (!is_data_block)
+                        taxon_names = taxlabels;
+                    readNexusMatrix(taxon_names, columns);
+                    found_matrix = true;
+                    }
+                else
+                    throw Unsupported();
+                }
+            }
+        else if (boost::iequals(block_name, "sets") || boost::iequals(block_name, "assumptions"))
+            readNexusSetsBlock();
+        else
+            skipBlock();
+        }
+
+    if (!found_matrix)
+        throw Unsupported();
+    }
+
+inline void AlignmentReader::readNexusSetsBlock()
+    {
+    // Stores the site list of each "charset name = sites;" command (e.g. "1-1234\3 1300-.");
+    // other commands are skipped
+    while (true)
+        {
+        std::string command = nextToken();
+        if (command.empty())
+            throw XStrom(boost::str(boost::format("Unexpected end of file \"%s\" in sets block") % _filename));
+        if (boost::iequals(command, "end") || boost::iequals(command, "endblock"))
+            {
+            expectToken(";");
+            break;
+            }
+        else if (boost::iequals(command, "charset"))
+            {
+            std::string name = nextToken();
+            if (name == "*")
+                name = nextToken();
+            expectToken("=");
+            std::string sites;
+            for (std::string token = nextToken(); token != ";"; token = nextToken())
+                {
+                if (token.empty())
+                    throw XStrom(boost::str(boost::format("Unexpected end of file \"%s\" in charset command") % _filename));
+                sites += (sites.empty() ? "" : " ") + token;
+                }
+            _charsets[name] = sites;
+            }
+        else
+            skipToEndOfCommand();
+        }
+    }
+
+inline void AlignmentReader::readNexusFormatCommand()
+    {
+    for (std::string subcommand = nextToken(); subcommand != ";"; subcommand = nextToken())
+        {
+        if (subcommand.empty())
+            throw XStrom(boost::str(boost::format("Unexpected end of file \"%s\" in format command") % _filename));
+
+        // interleave, matchchar, symbols, transpose, etc., are left to NCL
+        if (!boost::iequals(subcommand, "datatype") && !boost::iequals(subcommand, "gap") && !boost::iequals(subcommand, "missing") && !boost::iequals(subcommand, "equate"))
+            throw Unsupported();
+        expectToken("=");
+        std::string value = nextToken();
+        if (boost::iequals(subcommand, "datatype"))
+            {
+            if (!boost::iequals(value, "dna") && !boost::iequals(value, "rna") && !boost::iequals(value, "nucleotide"))
+                throw Unsupported();
+            }
+        else if (boost::iequals(subcommand, "gap") && value.size() == 1)
+            {
+            _gap = value[0];
+            _state_table[(unsigned char)_gap] = StateMatrix::_missing_nucleotide;
+            }
+        else if (boost::iequals(subcommand, "missing") && value.size() == 1)
+            {
+            _missing = value[0];
+            _state_table[(unsigned char)_missing] = StateMatrix::_missing_nucleotide;
+            }
+        else if (boost::iequals(subcommand, "equate"))
+            {
+            // e.g. equate="S=? Y=?" with single-symbol right-hand sides
+            std::vector<std::string> pairs;
+            boost::split(pairs, value, boost::is_space(), boost::token_compress_on);
+            for (auto & pr : pairs)
+                {
+                if (pr.empty())
+                    continue;
+                if (pr.size() != 3 || pr[1] != '=' || decodeState(pr[2]) == _invalid_state)
+                    throw Unsupported();
+                setStateCode(pr[0], decodeState(pr[2]));
+                }
+            }
+        else
+            throw Unsupported();
+        }
+    }
+
+inline void AlignmentReader::readNexusMatrix(taxon_names_t & taxon_names, StateMatrix & columns)
+    {
+    if (_ntax == 0 || _nchar == 0)
+        throw XStrom(boost::str(boost::format("Matrix command encountered before ntax and nchar were specified in file \"%s\"") % _filename));
+
+    // Rows must be decoded in taxa block order even if the matrix lists them in another order
+    std::map<std::string, unsigned> taxon_index;
+    bool have_labels = !taxon_names.empty();
+    if (have_labels)
+        {
+        for (unsigned t = 0; t < _ntax; ++t)
+            taxon_index[taxon_names[t]] = t;
+        }
+    else
+        taxon_names.resize(_ntax);
+
+    columns.resize(_nchar, _ntax, true, 1);
+    std::vector<bool> seen(_ntax, false);
+    for (unsigned i = 0; i < _ntax; ++i)
+        {
+        std::string name = nextWord();
+        if (name.empty() || name == ";")
+            throw XStrom(boost::str(boost::format("Expecting %d rows in matrix but found only %d in file \"%s\"") % _ntax % i % _filename));
+
+        unsigned t = i;
+        if (have_labels)
+            {
+            auto it = taxon_index.find(name);
+            if (it == taxon_index.end())
+                throw XStrom(boost::str(boost::format("Taxon \"%s\" in matrix not found in taxa block in file \"%s\"") % name % _filename));
+            t = it->second;
+            if (seen[t])
+                throw Unsupported();    // interleaved matrix
+            }
+        else
+            taxon_names[t] = name;
+        seen[t] = true;
+
+        readSequence(t, _nchar, columns, true);
+        }
+
+    expectToken(";");
+    }
+
+    }
@@ -1,17 +1,28 @@
 #pragma once
 
+#include <map>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <chrono>
 #include <memory>
 #include <boost/format.hpp>
 #include "lot.hpp"
+#include "checkpoint.hpp"
 #include "data.hpp"
 #include "tree.hpp"
 #include "likelihood.hpp"
 #include "tree_manip.hpp"
 #include "gamma_shape_updater.hpp"
+#include "pinvar_updater.hpp"
+#include "model_block_updater.hpp"
 #include "statefreq_updater.hpp"
 #include "exchangeability_updater.hpp"
 #include "tree_updater.hpp"
+#include "spr_updater.hpp"
 #include "tree_length_updater.hpp"
+#include "edge_length_updater.hpp"
+#include "hmc_updater.hpp"
 
 namespace strom
     {
@@ -39,9 +50,17 @@ namespace strom
             void                                    setTreeManip(TreeManip::SharedPtr tm);
             void                                    setLikelihood(typename Likelihood::SharedPtr likelihood);
             void                                    setLot(typename Lot::SharedPtr lot);
+            void                                    setScheduler(bool random_scan, bool adapt_weights);
+            void                                    setUpdaterWeights(const std::map<std::string, double> & weights);
+            void                                    setTopologyUpdater(bool use_spr, bool tbr, unsigned radius);
+            void                                    setEdgeLengthUpdater(bool use_edge_updater);
+            void                                    setHMCUpdater(bool use_hmc, unsigned nsteps);
+            void                                    setModelBlockUpdater(bool use_model_block);
 
             TreeManip::SharedPtr                    getTreeManip();
             Model::SharedPtr                        getModel();
+            const std::vector<Model::SharedPtr> &   getModels() const;
+            Likelihood::SharedPtr                   getLikelihood();
 
             void                                    setHeatingPower(double p);
             double                                  getHeatingPower() const;
@@ -52,24 +71,58 @@ namespace strom
             std::vector<std::string>                getUpdaterNames() const;
             std::vector<double>                     getAcceptPercentages() const;
             std::vector<double>                     getLambdas() const;
+            std::vector<double>                     getWeights() const;
+            std::vector<double>                     getSecondsPerUpdate() const;
             void                                    setLambdas(std::vector<double> & v);
 
             double                                  calcLogLikelihood() const;
             double                                  calcLogJointPrior() const;
 
+            void                                    saveState(Checkpoint & checkpoint) const;
+            void                                    restoreState(Checkpoint & checkpoint);
+
             typedef std::shared_ptr< Chain >        SharedPtr;
 
         private:
 
+            void                                    createUpdaters();
+            double                                  getUpdaterWeight(const std::string kind) const;
+            Updater::SharedPtr                      chooseUpdater() const;
+            void                                    adaptWeights();
+
             Likelihood::SharedPtr               _likelihood;
             TreeManip::SharedPtr                _tree_manipulator;
+            Lot::SharedPtr                      _lot;
 
-            GammaShapeUpdater::SharedPtr        _shape_updater;
-            StateFreqUpdater::SharedPtr         _statefreq_updater;
-            ExchangeabilityUpdater::SharedPtr   _exchangeability_updater;
-            TreeUpdater::SharedPtr              _tree_updater;
+            std::vector<Updater::SharedPtr>     _updaters;
             TreeLengthUpdater::SharedPtr        _tree_length_updater;
 
+            // random-scan scheduling: weights of kinds of updater (see createUpdaters) as
+            // specified, and the weights of the updaters before adaptation
+            bool                                _random_scan;
+            bool                                _adapting_weights;
+            bool                                _tuning;
+            std::map<std::string, double>       _updater_weights;
+            std::vector<double>                 _initial_weights;
+
+            static const unsigned               _weight_adapt_interval;
+
+            // topology moves: SPR (or, if _tbr, TBR) moves at most _spr_radius nodes away
+            bool                                _use_spr;
+            bool                                _tbr;
+            unsigned                            _spr_radius;
+
+            // whether edge lengths are also updated one at a time (see EdgeLengthUpdater)
+            bool                                _use_edge_updater;
+
+            // whether all edge lengths are also updated jointly by Hamiltonian Monte Carlo,
+            // with at most this many leapfrog steps (see HMCUpdater)
+            bool                                _use_hmc;
+            unsigned                            _hmc_steps;
+
+            // whether the model parameters of each subset are updated jointly (see ModelBlockUpdater)
+            bool                                _use_model_block;
+
             unsigned                            _chain_index;
             double                              _heating_power;
             double                              _log_likelihood;
@@ -96,14 +149,21 @@ inline Model::SharedPtr Chain::getModel()
     return _likelihood->getModel();
     }
 
+inline const std::vector<Model::SharedPtr> & Chain::getModels() const
+    {
+    return _likelihood->getModels();
+    }
+
+inline Likelihood::SharedPtr Chain::getLikelihood()
+    {
+    return _likelihood;
+    }
+
 inline void Chain::setHeatingPower(double p)
     {
     _heating_power = p;
-    _shape_updater->setHeatingPower(p);
-    _statefreq_updater->setHeatingPower(p);
-    _exchangeability_updater->setHeatingPower(p);
-    _tree_updater->setHeatingPower(p);
-    _tree_length_updater->setHeatingPower(p);
+    for (auto u : _updaters)
+        u->setHeatingPower(p);
     }
 
 inline double Chain::getHeatingPower() const
@@ -124,62 +184,109 @@ inline double Chain::getChainIndex() const
 inline std::vector<std::string> Chain::getUpdaterNames() const
     {
     std::vector<std::string> v;
-    v.push_back(_shape_updater->getUpdaterName());
-    v.push_back(_statefreq_updater->getUpdaterName());
-    v.push_back(_exchangeability_updater->getUpdaterName());
-    v.push_back(_tree_updater->getUpdaterName());
-    v.push_back(_tree_length_updater->getUpdaterName());
+    for (auto u : _updaters)
+        v.push_back(u->getUpdaterName());
     return v;
     }
 
 inline std::vector<double> Chain::getAcceptPercentages() const
     {
     std::vector<double> v;
-    v.push_back(_shape_updater->getAcceptPct());
-    v.push_back(_statefreq_updater->getAcceptPct());
-    v.push_back(_exchangeability_updater->getAcceptPct());
-    v.push_back(_tree_updater->getAcceptPct());
-    v.push_back(_tree_length_updater->getAcceptPct());
+    for (auto u : _updaters)
+        v.push_back(u->getAcceptPct());
     return v;
     }
 
 inline std::vector<double> Chain::getLambdas() const
     {
     std::vector<double> v;
-    v.push_back(_shape_updater->getLambda());
-    v.push_back(_statefreq_updater->getLambda());
-    v.push_back(_exchangeability_updater->getLambda());
-    v.push_back(_tree_updater->getLambda());
-    v.push_back(_tree_length_updater->getLambda());
+    for (auto u : _updaters)
+        v.push_back(u->getLambda());
+    return v;
+    }
+
+inline std::vector<double> Chain::getWeights() const
+    {
+    std::vector<double> v;
+    for (auto u : _updaters)
+        v.push_back(u->getWeight());
+    return v;
+    }
+
+inline std::vector<double> Chain::getSecondsPerUpdate() const
+    {
+    std::vector<double> v;
+    for (auto u : _updaters)
+        v.push_back(u->getSecondsPerUpdate());
     return v;
     }
 
 inline void Chain::setLambdas(std::vector<double> & v)
     {
-    assert(v.size() >= 4);
-    _shape_updater->setLambda(v[0]);
-    _statefreq_updater->setLambda(v[1]);
-    _exchangeability_updater->setLambda(v[2]);
-    _tree_updater->setLambda(v[3]);
-    _tree_length_updater->setLambda(v[3]);
+    // Every chain has the same updaters in the same order
+    assert(v.size() == _updaters.size());
+    for (unsigned i = 0; i < _updaters.size(); ++i)
+        _updaters[i]->setLambda(v[i]);
     }
 
 inline void Chain::startTuning()
     {
-    _shape_updater->setTuning(true);
-    _statefreq_updater->setTuning(true);
-    _exchangeability_updater->setTuning(true);
-    _tree_updater->setTuning(true);
-    _tree_length_updater->setTuning(true);
+    _tuning = true;
+    for (auto u : _updaters)
+        u->setTuning(true);
     }
 
 inline void Chain::stopTuning()
     {
-    _shape_updater->setTuning(false);
-    _statefreq_updater->setTuning(false);
-    _exchangeability_updater->setTuning(false);
-    _tree_updater->setTuning(false);
-    _tree_length_updater->setTuning(false);
+    _tuning = false;
+    for (auto u : _updaters)
+        u->setTuning(false);
+    }
+
+inline void Chain::setScheduler(bool random_scan, bool adapt_weights)
+    {
+    // Weights are adapted only by a random scan, and only while tuning
+    _random_scan = random_scan;
+    _adapting_weights = random_scan && adapt_weights;
+    }
+
+inline void Chain::setUpdaterWeights(const std::map<std::string, double> & weights)
+    {
+    // Must be called before setLikelihood, which creates the updaters
+    _updater_weights = weights;
+    }
+
+inline void Chain::setTopologyUpdater(bool use_spr, bool tbr, unsigned radius)
+    {
+    // Must be called before setLikelihood, which creates the updaters
+    _use_spr = use_spr;
+    _tbr = tbr;
+    _spr_radius = radius;
+    }
+
+inline void Chain::setEdgeLengthUpdater(bool use_edge_updater)
+    {
+    // Must be called before setLikelihood, which creates the updaters
+    _use_edge_updater = use_edge_updater;
+    }
+
+inline void Chain::setHMCUpdater(bool use_hmc, unsigned nsteps)
+    {
+    // Must be called before setLikelihood, which creates the updaters
+    _use_hmc = use_hmc;
+    _hmc_steps = nsteps;
+    }
+
+inline void Chain::setModelBlockUpdater(bool use_model_block)
+    {
+    // Must be called before setLikelihood, which creates the updaters
+    _use_model_block = use_model_block;
+    }
+
+inline double Chain::getUpdaterWeight(const std::string kind) const
+    {
+    std::map<std::string, double>::const_iterator it = _updater_weights.find(kind);
+    return (it == _updater_weights.end() ? 1.0 : it->second);
     }
 
 inline void Chain::setTreeFromNewick(std::string & newick)
@@ -188,77 +295,185 @@ inline void Chain::setTreeFromNewick(std::string & newick)
         _tree_manipulator.reset(new TreeManip);
     _tree_manipulator->buildFromNewick(newick, false, false);
 
-    _shape_updater->setTreeManip(_tree_manipulator);
-    _statefreq_updater->setTreeManip(_tree_manipulator);
-    _exchangeability_updater->setTreeManip(_tree_manipulator);
-    _tree_updater->setTreeManip(_tree_manipulator);
-    _tree_length_updater->setTreeManip(_tree_manipulator);
+    for (auto u : _updaters)
+        u->setTreeManip(_tree_manipulator);
     }
 
 inline void Chain::setLikelihood(typename Likelihood::SharedPtr likelihood)
     {
     _likelihood = likelihood;
-    _shape_updater->setLikelihood(likelihood);
-    _statefreq_updater->setLikelihood(likelihood);
-    _exchangeability_updater->setLikelihood(likelihood);
-    _tree_updater->setLikelihood(likelihood);
-    _tree_length_updater->setLikelihood(likelihood);
+    createUpdaters();
     }
 
 inline void Chain::setLot(typename Lot::SharedPtr lot)
     {
-    _shape_updater->setLot(lot);
-    _statefreq_updater->setLot(lot);
-    _exchangeability_updater->setLot(lot);
-    _tree_updater->setLot(lot);
-    _tree_length_updater->setLot(lot);
+    _lot = lot;
+    for (auto u : _updaters)
+        u->setLot(lot);
     }
 
 inline void Chain::clear()
     {
     _log_likelihood = 0.0;
+    _updaters.clear();
+    _tree_length_updater.reset();
+    _chain_index = 0;
+    _random_scan = false;
+    _adapting_weights = false;
+    _updater_weights.clear();
+    _initial_weights.clear();
+    _use_spr = false;
+    _tbr = false;
+    _spr_radius = 0;
+    _use_edge_updater = false;
+    _use_hmc = false;
+    _hmc_steps = 10;
+    _use_model_block = false;
+    setHeatingPower(1.0);
+    startTuning();
+    }
 
-    _shape_updater.reset(new GammaShapeUpdater);
-    _shape_updater->setLambda(1.0);
-    _shape_updater->setTargetAcceptanceRate(0.3);
-    _shape_updater->setPriorParameters({1.0, 1.0});
-
-    _statefreq_updater.reset(new StateFreqUpdater);
-    _statefreq_updater->setLambda(0.001);
-    _statefreq_updater->setTargetAcceptanceRate(0.3);
-    _statefreq_updater->setPriorParameters({1.0, 1.0, 1.0, 1.0});
-
-    _exchangeability_updater.reset(new ExchangeabilityUpdater);
-    _exchangeability_updater->setLambda(0.001);
-    _exchangeability_updater->setTargetAcceptanceRate(0.3);
-    _exchangeability_updater->setPriorParameters({1.0, 1.0, 1.0, 1.0, 1.0, 1.0});
+inline void Chain::createUpdaters()
+    {
+    // Model parameters of each partition subset get their own updaters (only
+    // those applicable to the model of the subset are kept), or share one block
+    // updater, followed by the updaters shared by all subsets that modify the tree
+    assert(_likelihood);
+    _updaters.clear();
+
+    Data::SharedPtr data = _likelihood->getData();
+    for (unsigned subset = 0; subset < _likelihood->getNumSubsets(); ++subset)
+        {
+        std::vector<Updater::SharedPtr> subset_updaters;
+
+        GammaShapeUpdater::SharedPtr shape_updater(new GammaShapeUpdater);
+        shape_updater->setLambda(1.0);
+        shape_updater->setTargetAcceptanceRate(0.3);
+        shape_updater->setPriorParameters({1.0, 1.0});
+        shape_updater->setWeight(getUpdaterWeight("shape"));
+        subset_updaters.push_back(shape_updater);
+
+        StateFreqUpdater::SharedPtr statefreq_updater(new StateFreqUpdater);
+        statefreq_updater->setLambda(0.001);
+        statefreq_updater->setTargetAcceptanceRate(0.3);
+        statefreq_updater->setPriorParameters({1.0, 1.0, 1.0, 1.0});
+        statefreq_updater->setWeight(getUpdaterWeight("statefreq"));
+        subset_updaters.push_back(statefreq_updater);
+
+        ExchangeabilityUpdater::SharedPtr exchangeability_updater(new ExchangeabilityUpdater);
+        exchangeability_updater->setLambda(0.001);
+        exchangeability_updater->setTargetAcceptanceRate(0.3);
+        Model::submodel_t constraint = _likelihood->getModel(subset)->getSubmodelConstraint();
+        if (constraint == Model::SubmodelHKY || constraint == Model::SubmodelK80)
+            exchangeability_updater->setPriorParameters({1.0, 1.0});
+        else
+            exchangeability_updater->setPriorParameters({1.0, 1.0, 1.0, 1.0, 1.0, 1.0});
+        exchangeability_updater->setWeight(getUpdaterWeight("exchangeability"));
+        subset_updaters.push_back(exchangeability_updater);
+
+        PinvarUpdater::SharedPtr pinvar_updater(new PinvarUpdater);
+        pinvar_updater->setLambda(0.5);
+        pinvar_updater->setTargetAcceptanceRate(0.3);
+        pinvar_updater->setPriorParameters({1.0, 1.0});
+        pinvar_updater->setWeight(getUpdaterWeight("pinvar"));
+        subset_updaters.push_back(pinvar_updater);
+
+        for (auto u : subset_updaters)
+            {
+            u->setLikelihood(_likelihood);
+            u->setSubset(subset, data ? data->getSubsetName(subset) : std::string());
+            if (u->isApplicable() && !_use_model_block)
+                _updaters.push_back(u);
+            }
+
+        if (_use_model_block)
+            {
+            ModelBlockUpdater::SharedPtr block_updater(new ModelBlockUpdater);
+            block_updater->setLambda(1.0);
+            block_updater->setTargetAcceptanceRate(0.25);
+            block_updater->setComponents(
+                statefreq_updater->isApplicable() ? statefreq_updater : StateFreqUpdater::SharedPtr(),
+                exchangeability_updater->isApplicable() ? exchangeability_updater : ExchangeabilityUpdater::SharedPtr(),
+                shape_updater->isApplicable() ? shape_updater : GammaShapeUpdater::SharedPtr(),
+                pinvar_updater->isApplicable() ? pinvar_updater : PinvarUpdater::SharedPtr());
+            block_updater->setWeight(getUpdaterWeight("model"));
+            block_updater->setLikelihood(_likelihood);
+            block_updater->setSubset(subset, data ? data->getSubsetName(subset) : std::string());
+            if (block_updater->isApplicable())
+                _updaters.push_back(block_updater);
+            }
+        }
 
     double tree_length_shape = 1.0;
     double tree_length_scale = 10.0;
     double dirichlet_param   = 1.0;
 
-    _tree_updater.reset(new TreeUpdater);
-    _tree_updater->setLambda(0.2);
-    _tree_updater->setTargetAcceptanceRate(0.3);
-    _tree_updater->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+    TreeUpdater::SharedPtr tree_updater(new TreeUpdater);
+    tree_updater->setLambda(0.2);
+    tree_updater->setTargetAcceptanceRate(0.3);
+    tree_updater->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+    tree_updater->setWeight(getUpdaterWeight("tree"));
+    tree_updater->setLikelihood(_likelihood);
+    _updaters.push_back(tree_updater);
+
+    if (_use_spr)
+        {
+        SPRUpdater::SharedPtr spr_updater(new SPRUpdater);
+        spr_updater->setTBR(_tbr);
+        spr_updater->setRadius(_spr_radius);
+        spr_updater->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+        spr_updater->setWeight(getUpdaterWeight("spr"));
+        spr_updater->setLikelihood(_likelihood);
+        _updaters.push_back(spr_updater);
+        }
+
+    if (_use_edge_updater)
+        {
+        EdgeLengthUpdater::SharedPtr edge_length_updater(new EdgeLengthUpdater);
+        edge_length_updater->setLambda(1.0);
+        edge_length_updater->setTargetAcceptanceRate(0.3);
+        edge_length_updater->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+        edge_length_updater->setWeight(getUpdaterWeight("edgelength"));
+        edge_length_updater->setLikelihood(_likelihood);
+        _updaters.push_back(edge_length_updater);
+        }
+
+    if (_use_hmc)
+        {
+        HMCUpdater::SharedPtr hmc_updater(new HMCUpdater);
+        hmc_updater->setLambda(0.05);
+        hmc_updater->setTargetAcceptanceRate(0.65);
+        hmc_updater->setNumSteps(_hmc_steps);
+        hmc_updater->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+        hmc_updater->setWeight(getUpdaterWeight("hmc"));
+        hmc_updater->setLikelihood(_likelihood);
+        _updaters.push_back(hmc_updater);
+        }
 
     _tree_length_updater.reset(new TreeLengthUpdater);
     _tree_length_updater->setLambda(0.2);
     _tree_length_updater->setTargetAcceptanceRate(0.3);
     _tree_length_updater->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+    _tree_length_updater->setWeight(getUpdaterWeight("treelength"));
+    _tree_length_updater->setLikelihood(_likelihood);
+    _updaters.push_back(_tree_length_updater);
 
-    _chain_index = 0;
-    setHeatingPower(1.0);
-    startTuning();
+    _initial_weights.clear();
+    for (auto u : _updaters)
+        {
+        u->setTreeManip(_tree_manipulator);
+        u->setLot(_lot);
+        u->setHeatingPower(_heating_power);
+        _initial_weights.push_back(u->getWeight());
+        }
+    if (_random_scan && std::accumulate(_initial_weights.begin(), _initial_weights.end(), 0.0) <= 0.0)
+        throw XStrom("at least one updater must have a positive weight");
     }
 
 inline void Chain::start()
     {
-    _shape_updater->pullCurrentStateFromModel();
-    _statefreq_updater->pullCurrentStateFromModel();
-    _exchangeability_updater->pullCurrentStateFromModel();
-    _tree_updater->pullCurrentStateFromModel();
-    _tree_length_updater->pullCurrentStateFromModel();
+    for (auto u : _updaters)
+        u->pullCurrentStateFromModel();
     _log_likelihood = calcLogLikelihood();
     }
 
@@ -268,29 +483,213 @@ inline void Chain::stop()
 
 inline double Chain::calcLogLikelihood() const
     {
-    return _shape_updater->calcLogLikelihood();
+    return _likelihood->calcLogLikelihood(_tree_manipulator->getTree());
     }
 
 inline double Chain::calcLogJointPrior() const
     {
+    // The tree length updater shares its prior with the tree updater
     double lnP = 0.0;
-    lnP += _shape_updater->calcLogPrior();
-    lnP += _statefreq_updater->calcLogPrior();
-    lnP += _exchangeability_updater->calcLogPrior();
-    lnP += _tree_updater->calcLogPrior();
-    //lnP += _tree_length_updater->calcLogPrior();
+    for (auto u : _updaters)
+        {
+        if (u != _tree_length_updater)
+            lnP += u->calcLogPrior();
+        }
     return lnP;
     }
 
+inline void Chain::saveState(Checkpoint & checkpoint) const
+    {
+    // Everything the next step depends on: the tree (its shape as a newick string, and the
+    // edge lengths in preorder exactly), model parameters, the precision and scaling state of
+    // the likelihood, tuning state of the updaters, heat and the log-likelihood tracked by
+    // the chain
+    checkpoint.write(_chain_index);
+    checkpoint.write(_heating_power);
+    checkpoint.write(_log_likelihood);
+    checkpoint.write(_tuning);
+
+    std::vector<double> edge_lengths;
+    _tree_manipulator->getEdgeLengths(edge_lengths);
+    checkpoint.write(_tree_manipulator->makeNewick(5));
+    checkpoint.write(edge_lengths);
+
+    const std::vector<Model::SharedPtr> & models = getModels();
+    checkpoint.write((unsigned)models.size());
+    for (auto & model : models)
+        {
+        checkpoint.write(model->getStateFreqs());
+        checkpoint.write(model->getExchangeabilities());
+        checkpoint.write(model->getGammaShape());
+        checkpoint.write(model->getPinvar());
+        }
+    _likelihood->saveState(checkpoint);
+
+    checkpoint.write((unsigned)_updaters.size());
+    for (auto u : _updaters)
+        u->saveState(checkpoint);
+    }
+
+inline void Chain::restoreState(Checkpoint & checkpoint)
+    {
+    // Must be called after start, and with the options used when the checkpoint was saved
+    double heating_power = 1.0;
+    checkpoint.read(_chain_index);
+    checkpoint.read(heating_power);
+    checkpoint.read(_log_likelihood);
+    checkpoint.read(_tuning);
+    setHeatingPower(heating_power);
+
+    std::string newick;
+    std::vector<double> edge_lengths;
+    checkpoint.read(newick);
+    checkpoint.read(edge_lengths);
+    setTreeFromNewick(newick);
+    _tree_manipulator->setEdgeLengths(edge_lengths);
+
+    const std::vector<Model::SharedPtr> & models = getModels();
+    unsigned nmodels = 0;
+    checkpoint.read(nmodels);
+    if (nmodels != models.size())
+        throw XStrom(boost::str(boost::format("checkpoint has %d partition subsets but the data have %d") % nmodels % models.size()));
+    for (auto & model : models)
+        {
+        std::vector<double> state_freqs;
+        std::vector<double> exchangeabilities;
+        double shape = 0.0;
+        double pinvar = 0.0;
+        checkpoint.read(state_freqs);
+        checkpoint.read(exchangeabilities);
+        checkpoint.read(shape);
+        checkpoint.read(pinvar);
+        model->setExchangeabilitiesAndStateFreqs(exchangeabilities, state_freqs);
+        model->setGammaShape(shape);
+        if (model->isInvarModel())
+            model->setPinvar(pinvar);
+        }
+    _likelihood->restoreState(checkpoint);
+
+    unsigned nupdaters = 0;
+    checkpoint.read(nupdaters);
+    if (nupdaters != _updaters.size())
+        throw XStrom(boost::str(boost::format("checkpoint has %d updaters per chain but there are %d (were the same options used?)") % nupdaters % _updaters.size()));
+    for (auto u : _updaters)
+        {
+        u->restoreState(checkpoint);
+        u->setHeatingPower(_heating_power);
+        u->pullCurrentStateFromModel();
+        }
+    }
+
+inline Updater::SharedPtr Chain::chooseUpdater() const
+    {
+    double total = 0.0;
+    for (auto u : _updaters)
+        total += u->getWeight();
+    double r = _lot->uniform()*total;
+    for (auto u : _updaters)
+        {
+        r -= u->getWeight();
+        if (r < 0.0 && u->getWeight() > 0.0)
+            return u;
+        }
+
+    // Rounding error: choose the last updater with a positive weight
+    for (auto u : boost::adaptors::reverse(_updaters))
+        {
+        if (u->getWeight() > 0.0)
+            return u;
+        }
+    assert(false);
+    return _updaters.back();
+    }
+
+inline void Chain::adaptWeights()
+    {
+    // An updater whose state summary has lag-1 autocorrelation rho between its successive
+    // updates yields about (1 - rho)/(1 + rho) effective samples per update, so dividing
+    // its initial weight by this brings every updater to the same number of effective
+    // samples, which maximizes the smallest number of effective samples per second. (Each
+    // iteration makes the same number of updates, so the measured costs of updates only
+    // determine how many iterations take a second, not which weights are best.) Weights
+    // stay within a factor of 10 of their initial values and keep the same sum.
+    const unsigned min_updates = 10;
+    const double min_efficiency = 0.01;
+    const double max_change = 10.0;
+    std::vector<double> weights = getWeights();
+    for (unsigned i = 0; i < _updaters.size(); ++i)
+        {
+        Updater::SharedPtr u = _updaters[i];
+        if (_initial_weights[i] == 0.0 || u->getNumTimedUpdates() < min_updates)
+            continue;
+        double rho = u->getLag1Autocorrelation();
+        double efficiency = std::max(min_efficiency, (1.0 - rho)/(1.0 + rho));
+        weights[i] = _initial_weights[i]/efficiency;
+        }
+
+    // Rescaling after clamping could move weights past their bounds again, so instead find
+    // by bisection the scaler for which the clamped, scaled weights have the initial sum
+    // (that sum is a continuous, nondecreasing function of the scaler). The smallest ratio
+    // of bound to weight clamps every weight to its lower bound and the largest clamps every
+    // weight to its upper bound, so the sum lies between a tenth and ten times the target.
+    double target = std::accumulate(_initial_weights.begin(), _initial_weights.end(), 0.0);
+    double lo_scaler = std::numeric_limits<double>::max();
+    double hi_scaler = 0.0;
+    for (unsigned i = 0; i < _updaters.size(); ++i)
+        {
+        if (_initial_weights[i] > 0.0 && weights[i] > 0.0)
+            {
+            lo_scaler = std::min(lo_scaler, _initial_weights[i]/(max_change*weights[i]));
+            hi_scaler = std::max(hi_scaler, max_change*_initial_weights[i]/weights[i]);
+            }
+        }
+    if (hi_scaler == 0.0)
+        return;
+    auto clamped = [&](unsigned i, double scaler)
+        {
+        if (_initial_weights[i] == 0.0)
+            return 0.0;
+        return std::min(max_change*_initial_weights[i], std::max(_initial_weights[i]/max_change, scaler*weights[i]));
+        };
+    for (unsigned step = 0; step < 100; ++step)
+        {
+        double scaler = std::sqrt(lo_scaler*hi_scaler);
+        double total = 0.0;
+        for (unsigned i = 0; i < _updaters.size(); ++i)
+            total += clamped(i, scaler);
+        if (total < target)
+            lo_scaler = scaler;
+        else
+            hi_scaler = scaler;
+        }
+
+    double scaler = std::sqrt(lo_scaler*hi_scaler);
+    for (unsigned i = 0; i < _updaters.size(); ++i)
+        {
+        _updaters[i]->setWeight(clamped(i, scaler));
+        _updaters[i]->resetUpdateStats();
+        }
+    }
+
 inline void Chain::nextStep(int iteration)
     {
-    Model::SharedPtr model = getModel();
-    if (model->getGammaNCateg() > 1)
-        _log_likelihood = _shape_updater->update(_log_likelihood);
-    _log_likelihood = _statefreq_updater->update(_log_likelihood);
-    _log_likelihood = _exchangeability_updater->update(_log_likelihood);
-    _log_likelihood = _tree_updater->update(_log_likelihood);
-    _log_likelihood = _tree_length_updater->update(_log_likelihood);
+    // A fixed scan updates with every updater once, in order; a random scan makes the same
+    // number of updates, each by an updater chosen with probability proportional to its
+    // weight, so an iteration (and hence the sampling frequency) means the same amount of
+    // work either way. Weights only change while tuning, so the chain is a fixed random-scan
+    // sampler once sampling begins.
+    unsigned nupdates = (unsigned)_updaters.size();
+    for (unsigned i = 0; i < nupdates; ++i)
+        {
+        Updater::SharedPtr u = (_random_scan ? chooseUpdater() : _updaters[i]);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        _log_likelihood = u->update(_log_likelihood);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        u->recordUpdateStats(elapsed.count(), _log_likelihood);
+        }
+
+    if (_adapting_weights && _tuning && iteration > 0 && iteration % _weight_adapt_interval == 0)
+        adaptWeights();
     }
 
 }
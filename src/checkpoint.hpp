@@ -0,0 +1,251 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <boost/format.hpp>
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class Checkpoint
+        {
+        public:
+                                        Checkpoint();
+                                        ~Checkpoint();
+
+            void                        openForWriting(const std::string & filename);
+            void                        commit();
+            void                        openForReading(const std::string & filename);
+            void                        close();
+
+            static std::string          getPreviousFileName(const std::string & filename);
+
+            void                        write(unsigned x);
+            void                        write(int x);
+            void                        write(bool x);
+            void                        write(double x);
+            void                        write(const std::string & s);
+            void                        write(const std::vector<double> & v);
+            void                        write(const std::vector<unsigned> & v);
+            void                        write(const std::vector<int> & v);
+
+            void                        read(unsigned & x);
+            void                        read(int & x);
+            void                        read(bool & x);
+            void                        read(double & x);
+            void                        read(std::string & s);
+            void                        read(std::vector<double> & v);
+            void                        read(std::vector<unsigned> & v);
+            void                        read(std::vector<int> & v);
+
+        private:
+
+            void                        writeBytes(const void * data, std::size_t nbytes);
+            void                        readBytes(void * data, std::size_t nbytes);
+
+            std::string                 _file_name;
+            std::string                 _temporary_file_name;
+            std::ofstream               _outfile;
+            std::ifstream               _infile;
+
+            static const std::string    _magic;
+            static const unsigned       _version;
+
+        public:
+
+            typedef std::shared_ptr< Checkpoint > SharedPtr;
+        };
+
+inline Checkpoint::Checkpoint()
+    {
+    //std::cout << "Constructing a Checkpoint" << std::endl;
+    }
+
+inline Checkpoint::~Checkpoint()
+    {
+    //std::cout << "Destroying a Checkpoint" << std::endl;
+    }
+
+inline void Checkpoint::openForWriting(const std::string & filename)
+    {
+    // The checkpoint is written to a temporary file that commit renames over the previous
+    // checkpoint, so a job stopped while writing leaves the previous checkpoint intact
+    _file_name = filename;
+    _temporary_file_name = filename + ".tmp";
+    _outfile.open(_temporary_file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!_outfile.is_open())
+        throw XStrom(boost::str(boost::format("Could not open checkpoint file \"%s\"") % _temporary_file_name));
+    writeBytes(_magic.data(), _magic.size());
+    write(_version);
+    }
+
+inline std::string Checkpoint::getPreviousFileName(const std::string & filename)
+    {
+    return filename + ".prev";
+    }
+
+inline void Checkpoint::commit()
+    {
+    // The checkpoint replaced is kept as the previous one, for processes of a run that must
+    // go back to the last checkpoint all of them finished (see Strom::restoreCheckpoint)
+    _outfile.close();
+    if (_outfile.fail())
+        throw XStrom(boost::str(boost::format("Could not write checkpoint file \"%s\"") % _temporary_file_name));
+    std::string previous_file_name = getPreviousFileName(_file_name);
+    if (std::rename(_file_name.c_str(), previous_file_name.c_str()) != 0 && errno != ENOENT)
+        throw XStrom(boost::str(boost::format("Could not keep the previous checkpoint as \"%s\" (%s)") % previous_file_name % std::strerror(errno)));
+    if (std::rename(_temporary_file_name.c_str(), _file_name.c_str()) != 0)
+        throw XStrom(boost::str(boost::format("Could not replace checkpoint file \"%s\" (%s)") % _file_name % std::strerror(errno)));
+    }
+
+inline void Checkpoint::openForReading(const std::string & filename)
+    {
+    _file_name = filename;
+    _infile.open(_file_name.c_str(), std::ios::in | std::ios::binary);
+    if (!_infile.is_open())
+        throw XStrom(boost::str(boost::format("Could not open checkpoint file \"%s\"") % _file_name));
+    std::string magic(_magic.size(), '\0');
+    readBytes(&magic[0], magic.size());
+    unsigned version = 0;
+    read(version);
+    if (magic != _magic || version != _version)
+        throw XStrom(boost::str(boost::format("\"%s\" is not a checkpoint file written by this version of the program") % _file_name));
+    }
+
+inline void Checkpoint::close()
+    {
+    if (_infile.is_open())
+        _infile.close();
+    if (_outfile.is_open())
+        _outfile.close();
+    }
+
+inline void Checkpoint::writeBytes(const void * data, std::size_t nbytes)
+    {
+    // Values are stored in native byte order: checkpoints are only read on the
+    // machine (or kind of machine) that wrote them
+    _outfile.write(static_cast<const char *>(data), nbytes);
+    if (!_outfile)
+        throw XStrom(boost::str(boost::format("Could not write checkpoint file \"%s\"") % _temporary_file_name));
+    }
+
+inline void Checkpoint::readBytes(void * data, std::size_t nbytes)
+    {
+    _infile.read(static_cast<char *>(data), nbytes);
+    if (!_infile)
+        throw XStrom(boost::str(boost::format("Checkpoint file \"%s\" is truncated or damaged") % _file_name));
+    }
+
+inline void Checkpoint::write(unsigned x)
+    {
+    writeBytes(&x, sizeof(x));
+    }
+
+inline void Checkpoint::write(int x)
+    {
+    writeBytes(&x, sizeof(x));
+    }
+
+inline void Checkpoint::write(bool x)
+    {
+    char c = (x ? 1 : 0);
+    writeBytes(&c, sizeof(c));
+    }
+
+inline void Checkpoint::write(double x)
+    {
+    writeBytes(&x, sizeof(x));
+    }
+
+inline void Checkpoint::write(const std::string & s)
+    {
+    write((unsigned)s.size());
+    writeBytes(s.data(), s.size());
+    }
+
+inline void Checkpoint::write(const std::vector<double> & v)
+    {
+    write((unsigned)v.size());
+    if (!v.empty())
+        writeBytes(&v[0], v.size()*sizeof(double));
+    }
+
+inline void Checkpoint::write(const std::vector<unsigned> & v)
+    {
+    write((unsigned)v.size());
+    if (!v.empty())
+        writeBytes(&v[0], v.size()*sizeof(unsigned));
+    }
+
+inline void Checkpoint::write(const std::vector<int> & v)
+    {
+    write((unsigned)v.size());
+    if (!v.empty())
+        writeBytes(&v[0], v.size()*sizeof(int));
+    }
+
+inline void Checkpoint::read(unsigned & x)
+    {
+    readBytes(&x, sizeof(x));
+    }
+
+inline void Checkpoint::read(int & x)
+    {
+    readBytes(&x, sizeof(x));
+    }
+
+inline void Checkpoint::read(bool & x)
+    {
+    char c = 0;
+    readBytes(&c, sizeof(c));
+    x = (c != 0);
+    }
+
+inline void Checkpoint::read(double & x)
+    {
+    readBytes(&x, sizeof(x));
+    }
+
+inline void Checkpoint::read(std::string & s)
+    {
+    unsigned n = 0;
+    read(n);
+    s.assign(n, '\0');
+    if (n > 0)
+        readBytes(&s[0], n);
+    }
+
+inline void Checkpoint::read(std::vector<double> & v)
+    {
+    unsigned n = 0;
+    read(n);
+    v.resize(n);
+    if (n > 0)
+        readBytes(&v[0], n*sizeof(double));
+    }
+
+inline void Checkpoint::read(std::vector<unsigned> & v)
+    {
+    unsigned n = 0;
+    read(n);
+    v.resize(n);
+    if (n > 0)
+        readBytes(&v[0], n*sizeof(unsigned));
+    }
+
+inline void Checkpoint::read(std::vector<int> & v)
+    {
+    unsigned n = 0;
+    read(n);
+    v.resize(n);
+    if (n > 0)
+        readBytes(&v[0], n*sizeof(int));
+    }
+
+}
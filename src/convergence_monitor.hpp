@@ -0,0 +1,365 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <algorithm>
+#include <boost/format.hpp>
+#include "split.hpp"
+#include "tree_manip.hpp"
+#include "checkpoint.hpp"
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class ConvergenceMonitor
+        {
+        public:
+                                        ConvergenceMonitor();
+                                        ~ConvergenceMonitor();
+
+            void                        clear();
+            void                        setQuantityNames(const std::vector<std::string> & names);
+            void                        addSample(const std::vector<double> & values, const std::string & newick, std::vector<std::string> & split_patterns);
+
+            unsigned                    getNumSamples() const;
+            unsigned                    getNumQuantities() const;
+            const std::string &         getQuantityName(unsigned i) const;
+            bool                        isFixed(unsigned i) const;
+            double                      calcESS(unsigned i) const;
+            double                      calcMinESS(unsigned & which) const;
+            double                      calcMaxSplitDifference() const;
+
+            void                        saveState(Checkpoint & checkpoint) const;
+            void                        restoreState(Checkpoint & checkpoint);
+
+        private:
+
+            // Running mean and sum of squared deviations of the values of one quantity, and
+            // the sums of its values in consecutive batches of batch_size samples (the last,
+            // partial, batch kept separately)
+            struct BatchMeans
+                {
+                unsigned                n;
+                double                  mean;
+                double                  sumsq;
+                unsigned                batch_size;
+                std::vector<double>     batch_sums;
+                double                  partial_sum;
+                unsigned                partial_count;
+                };
+
+            static void                 addValue(BatchMeans & quantity, double x);
+            static double               calcESS(const BatchMeans & quantity);
+            static void                 addCounts(const std::vector<unsigned> & counts, std::vector<unsigned> & total);
+
+            std::vector<std::string>    _names;
+            std::vector<BatchMeans>     _quantities;
+
+            // Splits (by their pattern representation) are numbered as they are first seen,
+            // and the number of trees containing each split (by its number) is counted in
+            // consecutive blocks of _split_block_size trees, merged like the batches of the
+            // quantities (the last, partial, block kept separately)
+            std::map<std::string, unsigned>         _split_ids;
+            unsigned                                _num_samples;
+            unsigned                                _split_block_size;
+            std::vector< std::vector<unsigned> >    _split_blocks;
+            std::vector<unsigned>                   _partial_split_counts;
+            unsigned                                _partial_block_count;
+            TreeManip                               _tree_manipulator;
+
+            static const unsigned       _max_batches;
+
+        public:
+
+            typedef std::shared_ptr< ConvergenceMonitor > SharedPtr;
+        };
+
+inline ConvergenceMonitor::ConvergenceMonitor()
+    {
+    //std::cout << "Constructing a ConvergenceMonitor" << std::endl;
+    clear();
+    }
+
+inline ConvergenceMonitor::~ConvergenceMonitor()
+    {
+    //std::cout << "Destroying a ConvergenceMonitor" << std::endl;
+    }
+
+inline void ConvergenceMonitor::clear()
+    {
+    _names.clear();
+    _quantities.clear();
+    _split_ids.clear();
+    _num_samples = 0;
+    _split_block_size = 1;
+    _split_blocks.clear();
+    _partial_split_counts.clear();
+    _partial_block_count = 0;
+    }
+
+inline void ConvergenceMonitor::setQuantityNames(const std::vector<std::string> & names)
+    {
+    // Forgets any samples already added
+    clear();
+    _names = names;
+    BatchMeans empty = {0, 0.0, 0.0, 1, std::vector<double>(), 0.0, 0};
+    _quantities.assign(names.size(), empty);
+    }
+
+inline void ConvergenceMonitor::addSample(const std::vector<double> & values, const std::string & newick, std::vector<std::string> & split_patterns)
+    {
+    // The pattern representations of the splits of the tree are also passed back to the
+    // caller (for SplitComparison::addSplits), so each tree is only read once
+    if (values.size() != _quantities.size())
+        throw XStrom(boost::str(boost::format("expected %d values to monitor but got %d") % _quantities.size() % values.size()));
+    for (unsigned i = 0; i < values.size(); ++i)
+        addValue(_quantities[i], values[i]);
+
+    std::set<Split> splits;
+    _tree_manipulator.buildFromNewick(newick, false, false);
+    _tree_manipulator.storeSplits(splits);
+    split_patterns.clear();
+    for (auto & split : splits)
+        {
+        split_patterns.push_back(split.createPatternRepresentation());
+        auto inserted = _split_ids.insert(std::make_pair(split_patterns.back(), (unsigned)_split_ids.size()));
+        unsigned id = inserted.first->second;
+        if (id >= _partial_split_counts.size())
+            _partial_split_counts.resize(id + 1, 0);
+        _partial_split_counts[id]++;
+        }
+    ++_num_samples;
+
+    // Blocks are merged in pairs when there are _max_batches of them (see addValue)
+    if (++_partial_block_count == _split_block_size)
+        {
+        _split_blocks.push_back(_partial_split_counts);
+        _partial_split_counts.clear();
+        _partial_block_count = 0;
+        if (_split_blocks.size() == _max_batches)
+            {
+            for (unsigned k = 0; k < _max_batches/2; ++k)
+                {
+                _split_blocks[k].swap(_split_blocks[2*k]);
+                addCounts(_split_blocks[2*k + 1], _split_blocks[k]);
+                }
+            _split_blocks.resize(_max_batches/2);
+            _split_block_size *= 2;
+            }
+        }
+    }
+
+inline void ConvergenceMonitor::addCounts(const std::vector<unsigned> & counts, std::vector<unsigned> & total)
+    {
+    // Adds counts to total element by element (either may be shorter, missing counts being 0)
+    if (counts.size() > total.size())
+        total.resize(counts.size(), 0);
+    for (unsigned id = 0; id < counts.size(); ++id)
+        total[id] += counts[id];
+    }
+
+inline void ConvergenceMonitor::addValue(BatchMeans & quantity, double x)
+    {
+    // Welford's updates of the mean and sum of squared deviations
+    ++quantity.n;
+    double delta = x - quantity.mean;
+    quantity.mean += delta/quantity.n;
+    quantity.sumsq += delta*(x - quantity.mean);
+
+    // When there are _max_batches complete batches, adjacent pairs are merged, so that
+    // there are always between _max_batches/2 and _max_batches of them and the batch
+    // size grows in proportion to the number of samples (few, long batches, because
+    // batches shorter than the autocorrelation time of a quantity overstate its ESS)
+    quantity.partial_sum += x;
+    if (++quantity.partial_count == quantity.batch_size)
+        {
+        quantity.batch_sums.push_back(quantity.partial_sum);
+        quantity.partial_sum = 0.0;
+        quantity.partial_count = 0;
+        if (quantity.batch_sums.size() == _max_batches)
+            {
+            for (unsigned k = 0; k < _max_batches/2; ++k)
+                quantity.batch_sums[k] = quantity.batch_sums[2*k] + quantity.batch_sums[2*k + 1];
+            quantity.batch_sums.resize(_max_batches/2);
+            quantity.batch_size *= 2;
+            }
+        }
+    }
+
+inline unsigned ConvergenceMonitor::getNumSamples() const
+    {
+    return _num_samples;
+    }
+
+inline unsigned ConvergenceMonitor::getNumQuantities() const
+    {
+    return (unsigned)_names.size();
+    }
+
+inline const std::string & ConvergenceMonitor::getQuantityName(unsigned i) const
+    {
+    assert(i < _names.size());
+    return _names[i];
+    }
+
+inline bool ConvergenceMonitor::isFixed(unsigned i) const
+    {
+    // Quantities that never changed (parameters not being updated) have no ESS
+    assert(i < _quantities.size());
+    return _quantities[i].n > 0 && _quantities[i].sumsq == 0.0;
+    }
+
+inline double ConvergenceMonitor::calcESS(unsigned i) const
+    {
+    assert(i < _quantities.size());
+    return calcESS(_quantities[i]);
+    }
+
+inline double ConvergenceMonitor::calcESS(const BatchMeans & quantity)
+    {
+    // Batch means estimate: the variance of the mean of n samples is about b s_b^2/n,
+    // where s_b^2 is the variance of the means of batches of b samples (long enough to be
+    // nearly independent), whereas it would be s^2/n for independent samples with variance
+    // s^2; so ESS = n s^2/(b s_b^2)
+    unsigned nbatches = (unsigned)quantity.batch_sums.size();
+    if (nbatches < 2 || quantity.n < 2)
+        return 0.0;
+    double b = quantity.batch_size;
+    double mean = 0.0;
+    for (auto sum : quantity.batch_sums)
+        mean += sum/b;
+    mean /= nbatches;
+    double batch_variance = 0.0;
+    for (auto sum : quantity.batch_sums)
+        batch_variance += (sum/b - mean)*(sum/b - mean);
+    batch_variance /= (nbatches - 1.0);
+    double variance = quantity.sumsq/(quantity.n - 1.0);
+    if (batch_variance == 0.0)
+        return (double)quantity.n;
+    return quantity.n*variance/(b*batch_variance);
+    }
+
+inline double ConvergenceMonitor::calcMinESS(unsigned & which) const
+    {
+    // Smallest ESS of the quantities that are not fixed (which is set to its index)
+    double min_ess = std::numeric_limits<double>::max();
+    which = 0;
+    for (unsigned i = 0; i < _quantities.size(); ++i)
+        {
+        if (isFixed(i))
+            continue;
+        double ess = calcESS(_quantities[i]);
+        if (ess < min_ess)
+            {
+            min_ess = ess;
+            which = i;
+            }
+        }
+    return min_ess;
+    }
+
+inline double ConvergenceMonitor::calcMaxSplitDifference() const
+    {
+    // Largest difference between the frequencies of a split in the first and second
+    // halves of the complete blocks of trees sampled so far (the latest even number of
+    // them, so 0 until there are two); splits present in every tree or in none contribute
+    // nothing, so this measures whether the sample of topologies has stopped changing
+    unsigned nblocks = (unsigned)_split_blocks.size();
+    unsigned half = nblocks/2;
+    if (half == 0)
+        return 0.0;
+    std::vector<unsigned> first;
+    std::vector<unsigned> second;
+    for (unsigned b = 0; b < 2*half; ++b)
+        addCounts(_split_blocks[nblocks - 2*half + b], (b < half ? first : second));
+    first.resize(_split_ids.size(), 0);
+    second.resize(_split_ids.size(), 0);
+    double ntrees = (double)half*_split_block_size;
+    double max_difference = 0.0;
+    for (unsigned id = 0; id < first.size(); ++id)
+        max_difference = std::max(max_difference, std::fabs((double)first[id] - (double)second[id])/ntrees);
+    return max_difference;
+    }
+
+inline void ConvergenceMonitor::saveState(Checkpoint & checkpoint) const
+    {
+    checkpoint.write((unsigned)_names.size());
+    for (unsigned i = 0; i < _names.size(); ++i)
+        {
+        const BatchMeans & quantity = _quantities[i];
+        checkpoint.write(_names[i]);
+        checkpoint.write(quantity.n);
+        checkpoint.write(quantity.mean);
+        checkpoint.write(quantity.sumsq);
+        checkpoint.write(quantity.batch_size);
+        checkpoint.write(quantity.batch_sums);
+        checkpoint.write(quantity.partial_sum);
+        checkpoint.write(quantity.partial_count);
+        }
+
+    // Split patterns in the order they were numbered
+    std::vector<std::string> patterns(_split_ids.size());
+    for (auto & pattern_id : _split_ids)
+        patterns[pattern_id.second] = pattern_id.first;
+    checkpoint.write((unsigned)patterns.size());
+    for (auto & pattern : patterns)
+        checkpoint.write(pattern);
+    checkpoint.write(_num_samples);
+    checkpoint.write(_split_block_size);
+    checkpoint.write((unsigned)_split_blocks.size());
+    for (auto & counts : _split_blocks)
+        checkpoint.write(counts);
+    checkpoint.write(_partial_split_counts);
+    checkpoint.write(_partial_block_count);
+    }
+
+inline void ConvergenceMonitor::restoreState(Checkpoint & checkpoint)
+    {
+    // The quantity names must already have been set, to those in the checkpoint
+    unsigned nquantities = 0;
+    checkpoint.read(nquantities);
+    if (nquantities != _names.size())
+        throw XStrom(boost::str(boost::format("checkpoint monitors %d quantities but there are %d (were the same options used?)") % nquantities % _names.size()));
+    for (unsigned i = 0; i < _names.size(); ++i)
+        {
+        BatchMeans & quantity = _quantities[i];
+        std::string name;
+        checkpoint.read(name);
+        if (name != _names[i])
+            throw XStrom(boost::str(boost::format("checkpoint monitors \"%s\" where \"%s\" was expected (were the same options used?)") % name % _names[i]));
+        checkpoint.read(quantity.n);
+        checkpoint.read(quantity.mean);
+        checkpoint.read(quantity.sumsq);
+        checkpoint.read(quantity.batch_size);
+        checkpoint.read(quantity.batch_sums);
+        checkpoint.read(quantity.partial_sum);
+        checkpoint.read(quantity.partial_count);
+        }
+
+    unsigned nsplits = 0;
+    checkpoint.read(nsplits);
+    _split_ids.clear();
+    for (unsigned id = 0; id < nsplits; ++id)
+        {
+        std::string pattern;
+        checkpoint.read(pattern);
+        _split_ids[pattern] = id;
+        }
+    unsigned nblocks = 0;
+    checkpoint.read(_num_samples);
+    checkpoint.read(_split_block_size);
+    checkpoint.read(nblocks);
+    _split_blocks.assign(nblocks, std::vector<unsigned>());
+    for (auto & counts : _split_blocks)
+        checkpoint.read(counts);
+    checkpoint.read(_partial_split_counts);
+    checkpoint.read(_partial_block_count);
+    }
+
+}
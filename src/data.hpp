@@ -6,8 +6,19 @@
 #include <numeric>
 #include <map>
 #include <regex>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cassert>
+#include <algorithm>
+#include <unordered_map>
 #include <boost/format.hpp>
 #include "xstrom.hpp"
+#include "state_matrix.hpp"
+#include "mapped_file.hpp"
+#include "alignment_reader.hpp"
+#include "partition.hpp"
 
 #include "ncl/nxsmultiformat.h"
 
@@ -17,43 +28,79 @@ class Data
     {
 	public:
         typedef std::vector<double>             pattern_counts_t;
+        typedef std::vector<unsigned char>      constant_masks_t;
         typedef std::vector<std::string>        taxon_names_t;
         typedef std::vector<int>                pattern_t;
-        typedef std::map< pattern_t, unsigned > pattern_map_t;
-        typedef std::vector< pattern_t >        data_matrix_t;
+        typedef StateMatrix                     data_matrix_t;
+        typedef std::unordered_multimap< std::uint64_t, unsigned > pattern_hash_t;
+        typedef std::vector< std::pair<unsigned, unsigned> >       pattern_tally_t;
         typedef std::shared_ptr< Data >         SharedPtr;
 
                                                 Data();
                                                 ~Data();
 
+        void                                    useCache(bool use_cache, bool rebuild_cache, const std::string cache_dir);
+        void                                    setPartition(Partition::SharedPtr partition);
+        Partition::SharedPtr                    getPartition();
         void                                    getDataFromFile(const std::string filename);
 
         const pattern_counts_t &                getPatternCounts() const;
         const taxon_names_t &                   getTaxonNames() const;
         const data_matrix_t &                   getDataMatrix() const;
+        const constant_masks_t &                getConstantMasks() const;
 
         void                                    clear();
         unsigned                                getNumPatterns() const;
         unsigned                                getSeqLen() const;
         unsigned                                getNumTaxa() const;
+        unsigned                                getNumConstantPatterns() const;
+
+        unsigned                                getNumSubsets() const;
+        std::string                             getSubsetName(unsigned subset) const;
+        unsigned                                getSubsetBegin(unsigned subset) const;
+        unsigned                                getSubsetEnd(unsigned subset) const;
+        unsigned                                getSubsetNumPatterns(unsigned subset) const;
+        unsigned                                getSubsetNumSites(unsigned subset) const;
 
         std::string                             createTaxaBlock() const;
         std::string                             createTranslateStatement() const;
 
     private:
 
-        void                                    updatePatternMap(Data::pattern_t & pattern);
-        void                                    compressPatterns();
+        static std::uint64_t                    calcDigest(const void * bytes, std::size_t nbytes);
+        static void                             tallyPattern(const StateMatrix & columns, unsigned site, unsigned count, pattern_hash_t & hash, pattern_tally_t & tally);
+        static void                             tallyChunk(const StateMatrix & columns, unsigned first_site, unsigned last_site, pattern_tally_t & tally);
+        static void                             tallyColumns(const StateMatrix & columns, pattern_tally_t & tally);
+        void                                    compressPatterns(const StateMatrix & columns, const Partition::charsets_t & charsets);
+        void                                    findConstantPatterns();
+
+        void                                    readNexusFile(const std::string filename);
+        bool                                    readCache(const std::string cache_file_name, std::uint64_t source_digest);
+        void                                    writeCache(const std::string cache_file_name, std::uint64_t source_digest) const;
+        std::string                             getCacheFileName(const std::string filename) const;
+
+        static const unsigned                   _min_sites_per_thread;
+        static const unsigned                   _cache_version;
+
+        bool                                    _using_cache;
+        bool                                    _rebuild_cache;
+        std::string                             _cache_dir;
 
-        pattern_map_t                           _pattern_map;       // used as workspace
         pattern_counts_t                        _pattern_counts;
         taxon_names_t                           _taxon_names;
         data_matrix_t                           _data_matrix;
+        constant_masks_t                        _constant_masks;
+        Partition::SharedPtr                    _partition;
+        std::vector<unsigned>                   _subset_end;
     };
 
 inline Data::Data()
     {
     //std::cout << "Creating Data object" << std::endl;
+    _using_cache    = false;
+    _rebuild_cache  = false;
+    _cache_dir      = ".";
+    _partition.reset(new Partition());
     }
 
 inline Data::~Data()
@@ -61,6 +108,24 @@ inline Data::~Data()
     //std::cout << "Destroying Data object" << std::endl;
     }
 
+inline void Data::useCache(bool use_cache, bool rebuild_cache, const std::string cache_dir)
+    {
+    _using_cache    = use_cache;
+    _rebuild_cache  = rebuild_cache;
+    _cache_dir      = cache_dir;
+    }
+
+inline void Data::setPartition(Partition::SharedPtr partition)
+    {
+    // Must be called before getDataFromFile; all sites form a single subset by default
+    _partition = partition;
+    }
+
+inline Partition::SharedPtr Data::getPartition()
+    {
+    return _partition;
+    }
+
 inline const Data::pattern_counts_t & Data::getPatternCounts() const
 	{
 	return _pattern_counts;
@@ -76,12 +141,18 @@ inline const Data::data_matrix_t & Data::getDataMatrix() const
 	return _data_matrix;
 	}
 
+inline const Data::constant_masks_t & Data::getConstantMasks() const
+	{
+	return _constant_masks;
+	}
+
 inline void Data::clear()
     {
-    _pattern_map.clear();
     _pattern_counts.clear();
     _taxon_names.clear();
     _data_matrix.clear();
+    _constant_masks.clear();
+    _subset_end.clear();
     }
 
 inline unsigned Data::getNumPatterns() const
@@ -94,91 +165,298 @@ inline unsigned Data::getNumTaxa() const
     return (unsigned)_taxon_names.size();
     }
 
+inline unsigned Data::getNumConstantPatterns() const
+    {
+    return (unsigned)std::count_if(_constant_masks.begin(), _constant_masks.end(), [](unsigned char mask) {return mask != 0;});
+    }
+
+inline unsigned Data::getNumSubsets() const
+    {
+    return (unsigned)_subset_end.size();
+    }
+
+inline std::string Data::getSubsetName(unsigned subset) const
+    {
+    return _partition->getSubsetName(subset);
+    }
+
+inline unsigned Data::getSubsetBegin(unsigned subset) const
+    {
+    // Patterns of each subset occupy a contiguous block of columns in _data_matrix
+    assert(subset < _subset_end.size());
+    return (subset == 0 ? 0 : _subset_end[subset-1]);
+    }
+
+inline unsigned Data::getSubsetEnd(unsigned subset) const
+    {
+    assert(subset < _subset_end.size());
+    return _subset_end[subset];
+    }
+
+inline unsigned Data::getSubsetNumPatterns(unsigned subset) const
+    {
+    return getSubsetEnd(subset) - getSubsetBegin(subset);
+    }
+
+inline unsigned Data::getSubsetNumSites(unsigned subset) const
+    {
+    return (unsigned)std::accumulate(_pattern_counts.begin() + getSubsetBegin(subset), _pattern_counts.begin() + getSubsetEnd(subset), 0.0);
+    }
+
 inline unsigned Data::getSeqLen() const
     {
     return (unsigned)std::accumulate(_pattern_counts.begin(), _pattern_counts.end(), 0);
     }
 
-inline void Data::compressPatterns()
+inline std::uint64_t Data::calcDigest(const void * bytes, std::size_t nbytes)
     {
-    // sanity checks
-    if (_data_matrix.empty())
-        throw XStrom("Attempted to compress an empty data matrix");
-    if (_data_matrix[0].size() < getSeqLen())
-        throw XStrom("Attempted to compress an already compressed data matrix");
-
-    // create map with keys equal to patterns and values equal to site counts
-    _pattern_map.clear();
+    // 64-bit FNV-1a hash (used for packed columns and for whole files)
+    const unsigned char * p = (const unsigned char *)bytes;
+    std::uint64_t h = 14695981039346656037ULL;
+    for (std::size_t j = 0; j < nbytes; ++j)
+        {
+        h ^= p[j];
+        h *= 1099511628211ULL;
+        }
+    return h;
+    }
 
-    std::vector<int> pattern;
-    unsigned ntaxa = (unsigned)_data_matrix.size();
-    unsigned seqlen = (unsigned)_data_matrix[0].size();
-    for (unsigned i = 0; i < seqlen; ++i)
+inline void Data::tallyPattern(const StateMatrix & columns, unsigned site, unsigned count, pattern_hash_t & hash, pattern_tally_t & tally)
+    {
+    // If the pattern at site is not already in tally, append it with the supplied count.
+    // If it does exist, add count to its current value. Columns with equal digests are
+    // compared byte by byte, so hash collisions cannot merge distinct patterns.
+    std::size_t nbytes = columns.getRowBytes();
+    const StateMatrix::byte_t * column = columns.getRowPtr(site);
+    std::uint64_t digest = calcDigest(column, nbytes);
+    auto range = hash.equal_range(digest);
+    for (auto it = range.first; it != range.second; ++it)
         {
-        // Create vector representing pattern at site i
-        pattern.clear();
-        for (unsigned j = 0; j < ntaxa; ++j)
+        std::pair<unsigned, unsigned> & entry = tally[it->second];
+        if (std::memcmp(column, columns.getRowPtr(entry.first), nbytes) == 0)
             {
-            pattern.push_back(_data_matrix[j][i]);
+            // this pattern has already been seen
+            entry.second += count;
+            return;
             }
-
-        // Add this pattern to pattern_counts
-        updatePatternMap(pattern);
         }
 
-    // resize _pattern_counts
-    unsigned npatterns = (unsigned)_pattern_map.size();
-    _pattern_counts.resize(npatterns);
+    // this pattern has not yet been seen
+    hash.insert(pattern_hash_t::value_type(digest, (unsigned)tally.size()));
+    tally.push_back(std::make_pair(site, count));
+    }
 
-    // resize _data_matrix so that we can use operator[] to assign values
-    _data_matrix.resize(ntaxa);
-    for (auto & row : _data_matrix)
+inline void Data::tallyChunk(const StateMatrix & columns, unsigned first_site, unsigned last_site, pattern_tally_t & tally)
+    {
+    // Tally the distinct patterns among sites [first_site, last_site). Each entry in tally
+    // holds the first site at which the pattern was seen and the number of sites having it.
+    pattern_hash_t hash;
+    for (unsigned i = first_site; i < last_site; ++i)
+        tallyPattern(columns, i, 1, hash, tally);
+    }
+
+inline void Data::tallyColumns(const StateMatrix & columns, pattern_tally_t & tally)
+    {
+    // Tallies the distinct columns (rows of the site-major matrix columns), in
+    // lexicographic order, compressing contiguous chunks of sites concurrently,
+    // each thread using its own hash table
+    unsigned seqlen = columns.getNumRows();
+    unsigned nthreads = std::max(1U, std::thread::hardware_concurrency());
+    nthreads = std::min(nthreads, std::max(1U, seqlen/_min_sites_per_thread));
+    std::vector<pattern_tally_t> chunk_tallies(nthreads);
+    if (nthreads == 1)
+        tallyChunk(columns, 0, seqlen, chunk_tallies[0]);
+    else
         {
-        row.resize(npatterns);
+        std::vector<std::thread> threads;
+        unsigned chunk_size = (seqlen + nthreads - 1)/nthreads;
+        for (unsigned t = 0; t < nthreads; ++t)
+            {
+            unsigned first_site = std::min(seqlen, t*chunk_size);
+            unsigned last_site  = std::min(seqlen, first_site + chunk_size);
+            threads.push_back(std::thread(&Data::tallyChunk, std::cref(columns), first_site, last_site, std::ref(chunk_tallies[t])));
+            }
+        for (auto & t : threads)
+            t.join();
         }
 
-    unsigned j = 0;
-    for (auto & pc : _pattern_map)
+    // Merge the per-thread tallies into a single tally
+    tally.clear();
+    if (nthreads == 1)
+        tally.swap(chunk_tallies[0]);
+    else
         {
-        _pattern_counts[j] = pc.second;
+        pattern_hash_t hash;
+        for (auto & chunk_tally : chunk_tallies)
+            {
+            for (auto & entry : chunk_tally)
+                tallyPattern(columns, entry.first, entry.second, hash, tally);
+            pattern_tally_t().swap(chunk_tally);
+            }
+        }
+
+    // Sort distinct patterns lexicographically so that the order of patterns
+    // does not depend on the number of threads used
+    // (packed columns compare byte by byte in the same order as the unpacked states)
+    std::size_t nbytes = columns.getRowBytes();
+    std::sort(tally.begin(), tally.end(), [&columns, nbytes](const std::pair<unsigned, unsigned> & a, const std::pair<unsigned, unsigned> & b) {
+        return std::memcmp(columns.getRowPtr(a.first), columns.getRowPtr(b.first), nbytes) < 0;
+        });
+    }
+
+inline void Data::compressPatterns(const StateMatrix & columns, const Partition::charsets_t & charsets)
+    {
+    // The raw alignment is supplied transposed, with one row per site, so that
+    // the packed states of each column are contiguous and can be hashed directly
+    unsigned seqlen = columns.getNumRows();
+    unsigned ntaxa = columns.getNumCols();
 
-        unsigned i = 0;
-        for (auto sc : pc.first)
+    // sanity checks
+    if (seqlen == 0 || ntaxa == 0)
+        throw XStrom("Attempted to compress an empty data matrix");
+    if (ntaxa != getNumTaxa())
+        throw XStrom(boost::str(boost::format("Data matrix has %d taxa but expecting %d") % ntaxa % getNumTaxa()));
+
+    // Each subset is compressed separately so that its patterns form a contiguous block
+    _partition->finalize(seqlen, charsets);
+    const Partition::site_subsets_t & site_subsets = _partition->getSiteSubsets();
+    unsigned nsubsets = _partition->getNumSubsets();
+    std::vector<StateMatrix> subset_patterns(nsubsets);
+    std::vector<pattern_tally_t> subset_tallies(nsubsets);
+    for (unsigned s = 0; s < nsubsets; ++s)
+        {
+        // Gather the columns of subset s (unless all sites are in the one subset)
+        const StateMatrix * subset_columns = &columns;
+        StateMatrix gathered;
+        if (nsubsets > 1)
             {
-            _data_matrix[i][j] = sc;
-            ++i;
+            unsigned nsites = (unsigned)std::count(site_subsets.begin(), site_subsets.end(), s);
+            if (nsites == 0)
+                throw XStrom(boost::str(boost::format("Subset \"%s\" contains no sites") % _partition->getSubsetName(s)));
+            gathered.resize(nsites, ntaxa, columns.isNibblePacked(), 1);
+            unsigned k = 0;
+            for (unsigned i = 0; i < seqlen; ++i)
+                {
+                if (site_subsets[i] == s)
+                    std::memcpy(gathered.getRowPtr(k++), columns.getRowPtr(i), columns.getRowBytes());
+                }
+            subset_columns = &gathered;
             }
 
-        ++j;
+        tallyColumns(*subset_columns, subset_tallies[s]);
+
+        // Keep only one copy of each distinct column
+        pattern_tally_t & tally = subset_tallies[s];
+        subset_patterns[s].resize((unsigned)tally.size(), ntaxa, columns.isNibblePacked(), 1);
+        for (unsigned j = 0; j < tally.size(); ++j)
+            std::memcpy(subset_patterns[s].getRowPtr(j), subset_columns->getRowPtr(tally[j].first), columns.getRowBytes());
         }
 
-    // Everything has been transferred to _data_matrix and _pattern_counts, so can now free this memory
-    _pattern_map.clear();
+    // resize _pattern_counts
+    unsigned npatterns = 0;
+    for (auto & tally : subset_tallies)
+        npatterns += (unsigned)tally.size();
+    _pattern_counts.resize(npatterns);
+    _subset_end.resize(nsubsets);
+
+    // _data_matrix holds one row per taxon and one column per pattern
+    _data_matrix.resize(ntaxa, npatterns, columns.isNibblePacked(), StateMatrix::_alignment);
+
+    unsigned j = 0;
+    for (unsigned s = 0; s < nsubsets; ++s)
+        {
+        for (unsigned k = 0; k < subset_tallies[s].size(); ++k)
+            {
+            _pattern_counts[j] = subset_tallies[s][k].second;
+
+            for (unsigned i = 0; i < ntaxa; ++i)
+                {
+                _data_matrix.setState(i, j, subset_patterns[s].getState(k, i));
+                }
+
+            ++j;
+            }
+        _subset_end[s] = j;
+        }
 
     unsigned total_num_sites = std::accumulate(_pattern_counts.begin(), _pattern_counts.end(), 0);
     if (seqlen != total_num_sites)
         throw XStrom(boost::str(boost::format("Total number of sites before compaction (%d) not equal to toal number of sites after (%d)") % seqlen % total_num_sites));
     }
 
-inline void Data::updatePatternMap(Data::pattern_t & pattern)
+inline void Data::findConstantPatterns()
     {
-    // If pattern is not already in pattern_map, insert it and set value to 1.
-    // If it does exist, increment its current value.
-    // (see item 24, p. 110, in Meyers' Efficient STL for more info on the technique used here)
-    pattern_map_t::iterator lowb = _pattern_map.lower_bound(pattern);
-    if (lowb != _pattern_map.end() && !(_pattern_map.key_comp()(pattern, lowb->first)))
+    // A pattern is constant if at least one nucleotide is consistent with the state of
+    // every taxon (missing data and ambiguities are consistent with several). Its entry
+    // in _constant_masks holds the nucleotides it could be constant for (see
+    // StateMatrix::nucleotideMask); the entry for a variable pattern is 0.
+    unsigned ntaxa = _data_matrix.getNumRows();
+    unsigned npatterns = _data_matrix.getNumCols();
+    _constant_masks.assign(npatterns, 0x0F);
+    std::vector<int> v;
+    for (unsigned i = 0; i < ntaxa; ++i)
         {
-        // this pattern has already been seen
-        lowb->second += 1;
+        _data_matrix.copyRow(i, v);
+        for (unsigned j = 0; j < npatterns; ++j)
+            _constant_masks[j] &= StateMatrix::nucleotideMask(v[j]);
         }
-    else
+    }
+
+inline void Data::getDataFromFile(const std::string filename)
+    {
+    // If caching, look for a binary cache of the compressed patterns made from
+    // a source file with identical contents, and skip parsing entirely if found
+    std::uint64_t source_digest = 0;
+    std::string cache_file_name = getCacheFileName(filename);
+    if (_using_cache)
         {
-        // this pattern has not yet been seen
-        _pattern_map.insert(lowb, pattern_map_t::value_type(pattern, 1));
+        MappedFile source(filename);
+        source_digest = calcDigest(source.getData(), source.getSize());
+
+        // The cache is only valid for the same subset definitions
+        std::string subsets = _partition->describe();
+        source_digest = (source_digest*1099511628211ULL) ^ calcDigest(subsets.data(), subsets.size());
+        if (!_rebuild_cache && readCache(cache_file_name, source_digest))
+            {
+            std::cout << boost::str(boost::format("Read compressed data from cache file \"%s\"") % cache_file_name) << std::endl;
+            findConstantPatterns();
+            return;
+            }
+        }
+
+    // Try the native readers first, falling back to NCL for files they do not handle
+    AlignmentReader reader;
+    taxon_names_t taxon_names;
+    StateMatrix columns;
+    if (reader.readFile(filename, taxon_names, columns))
+        {
+        // Commit to storing new data
+        clear();
+        _taxon_names.swap(taxon_names);
+        compressPatterns(columns, reader.getCharsets());
         }
+    else
+        readNexusFile(filename);
+    findConstantPatterns();
+
+    if (_using_cache)
+        writeCache(cache_file_name, source_digest);
     }
 
-inline void Data::getDataFromFile(const std::string filename)
+inline std::string Data::getCacheFileName(const std::string filename) const
+    {
+    // The cache is written to the cache directory rather than next to the data file,
+    // which may be in a directory that is read-only or shared with other users
+    std::string::size_type slash = filename.find_last_of('/');
+    std::string base = (slash == std::string::npos ? filename : filename.substr(slash + 1));
+    if (_cache_dir.empty())
+        return base + ".cache";
+    if (_cache_dir.back() == '/')
+        return _cache_dir + base + ".cache";
+    return _cache_dir + "/" + base + ".cache";
+    }
+
+inline void Data::readNexusFile(const std::string filename)
     {
     // See http://phylo.bio.ku.edu/ncldocs/v2.1/funcdocs/index.html for documentation
     //
@@ -207,6 +485,7 @@ inline void Data::getDataFromFile(const std::string filename)
 
     // Commit to storing new data
     clear();
+    StateMatrix columns;
 
     int numTaxaBlocks = nexusReader.GetNumTaxaBlocks();
     for (int i = 0; i < numTaxaBlocks; ++i)
@@ -224,18 +503,34 @@ inline void Data::getDataFromFile(const std::string filename)
             const NxsCharactersBlock * charBlock = nexusReader.GetCharactersBlock(taxaBlock, j);
             std::string charBlockTitle = taxaBlock->GetTitle();
 
-            _data_matrix.resize(ntax);
+            // Store the raw alignment transposed (one tightly packed row per site) with
+            // two states per byte, which is all that is needed for nucleotide state codes 0-14
+            unsigned seqlen = (ntax > 0 ? (unsigned)charBlock->GetDiscreteMatrixRow(0).size() : 0);
+            columns.resize(seqlen, ntax, true, 1);
+            const NxsDiscreteDatatypeMapper * mapper = (seqlen > 0 ? charBlock->GetDatatypeMapperForChar(0) : 0);
             for (unsigned t = 0; t < ntax; ++t)
                 {
                 const NxsDiscreteStateRow & row = charBlock->GetDiscreteMatrixRow(t);
-                unsigned seqlen = (unsigned)row.size();
-                _data_matrix[t].resize(seqlen);
+                if (row.size() != seqlen)
+                    throw XStrom(boost::str(boost::format("Sequence for taxon %d has length %d but expecting %d") % (t+1) % row.size() % seqlen));
                 unsigned k = 0;
                 for (auto state_code : row) {
+                    // gaps and missing data (negative) are state 4; ambiguities (> 3)
+                    // are translated via the set of nucleotides they stand for
                     if (state_code < 0)
-                        _data_matrix[t][k++] = 4;
+                        columns.setState(k++, t, StateMatrix::_missing_nucleotide);
+                    else if (state_code <= 3)
+                        columns.setState(k++, t, state_code);
                     else
-                        _data_matrix[t][k++] = state_code;
+                        {
+                        unsigned mask = 0;
+                        for (auto s : mapper->GetStateSetForCode(state_code))
+                            {
+                            if (s >= 0 && s <= 3)
+                                mask |= (1 << s);
+                            }
+                        columns.setState(k++, t, StateMatrix::nucleotideState(mask));
+                        }
                     }
                 }
 
@@ -245,8 +540,148 @@ inline void Data::getDataFromFile(const std::string filename)
     // No longer any need to store raw data from nexus file
     nexusReader.DeleteBlocksFromFactories();
 
-    // Compress _data_matrix so that it holds only unique patterns (counts stored in _pattern_counts)
-    compressPatterns();
+    // Compress columns into _data_matrix so that it holds only unique patterns (counts stored in _pattern_counts)
+    // (charsets are only read by the native NEXUS reader)
+    compressPatterns(columns, Partition::charsets_t());
+    }
+
+inline bool Data::readCache(const std::string cache_file_name, std::uint64_t source_digest)
+    {
+    // Cache file layout (all integers in native byte order):
+    //   "STROMDAT"                         8-byte magic number
+    //   uint32 version, uint64 digest      cache format version and digest of source file
+    //   uint32 ntaxa, uint32 npatterns     dimensions of _data_matrix
+    //   uint32 nibble_packed               nonzero if states are stored two per byte
+    //   ntaxa x (uint32 length, chars)     taxon names
+    //   npatterns x double                 _pattern_counts
+    //   uint32 nsubsets, nsubsets x uint32 _subset_end
+    //   ntaxa x packed row                 _data_matrix rows without padding
+    // Returns false (leaving this object untouched) if the cache is missing, stale or malformed.
+    struct stat sb;
+    if (::stat(cache_file_name.c_str(), &sb) != 0)
+        return false;
+
+    MappedFile cache(cache_file_name);
+    const char * p = cache.getData();
+    const char * end = p + cache.getSize();
+
+    auto fetch = [&p, end](void * dest, std::size_t nbytes) {
+        if ((std::size_t)(end - p) < nbytes)
+            return false;
+        std::memcpy(dest, p, nbytes);
+        p += nbytes;
+        return true;
+        };
+
+    char magic[8];
+    std::uint32_t version = 0;
+    std::uint64_t digest = 0;
+    std::uint32_t ntaxa = 0;
+    std::uint32_t npatterns = 0;
+    std::uint32_t nibble_packed = 0;
+    if (!p || !fetch(magic, 8) || std::memcmp(magic, "STROMDAT", 8) != 0)
+        return false;
+    if (!fetch(&version, sizeof(version)) || version != _cache_version)
+        return false;
+    if (!fetch(&digest, sizeof(digest)) || digest != source_digest)
+        return false;
+    if (!fetch(&ntaxa, sizeof(ntaxa)) || !fetch(&npatterns, sizeof(npatterns)) || !fetch(&nibble_packed, sizeof(nibble_packed)))
+        return false;
+    if (ntaxa == 0 || npatterns == 0)
+        return false;
+
+    taxon_names_t taxon_names(ntaxa);
+    for (auto & nm : taxon_names)
+        {
+        std::uint32_t length = 0;
+        if (!fetch(&length, sizeof(length)) || (std::size_t)(end - p) < length)
+            return false;
+        nm.assign(p, length);
+        p += length;
+        }
+
+    pattern_counts_t pattern_counts(npatterns);
+    if (!fetch(&pattern_counts[0], npatterns*sizeof(double)))
+        return false;
+
+    std::uint32_t nsubsets = 0;
+    if (!fetch(&nsubsets, sizeof(nsubsets)) || nsubsets != _partition->getNumSubsets())
+        return false;
+    std::vector<unsigned> subset_end(nsubsets);
+    for (auto & end_pattern : subset_end)
+        {
+        std::uint32_t e = 0;
+        if (!fetch(&e, sizeof(e)))
+            return false;
+        end_pattern = e;
+        }
+    if (subset_end.back() != npatterns)
+        return false;
+
+    StateMatrix data_matrix;
+    data_matrix.resize(ntaxa, npatterns, nibble_packed != 0, StateMatrix::_alignment);
+    for (unsigned i = 0; i < ntaxa; ++i)
+        {
+        if (!fetch(data_matrix.getRowPtr(i), data_matrix.getRowBytes()))
+            return false;
+        }
+    if (p != end)
+        return false;
+
+    // Commit to storing new data
+    clear();
+    _taxon_names.swap(taxon_names);
+    _pattern_counts.swap(pattern_counts);
+    _data_matrix.swap(data_matrix);
+    _subset_end.swap(subset_end);
+    return true;
+    }
+
+inline void Data::writeCache(const std::string cache_file_name, std::uint64_t source_digest) const
+    {
+    // Write to a temporary file and rename it so that an interrupted run
+    // never leaves a truncated cache behind (see readCache for the layout)
+    std::string tmp_file_name = cache_file_name + ".tmp";
+    std::ofstream cache(tmp_file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!cache.is_open())
+        {
+        std::cerr << boost::str(boost::format("Warning: could not create data cache file \"%s\"") % cache_file_name) << std::endl;
+        return;
+        }
+
+    std::uint32_t version = _cache_version;
+    std::uint32_t ntaxa = _data_matrix.getNumRows();
+    std::uint32_t npatterns = _data_matrix.getNumCols();
+    std::uint32_t nibble_packed = (_data_matrix.isNibblePacked() ? 1 : 0);
+    cache.write("STROMDAT", 8);
+    cache.write((const char *)&version, sizeof(version));
+    cache.write((const char *)&source_digest, sizeof(source_digest));
+    cache.write((const char *)&ntaxa, sizeof(ntaxa));
+    cache.write((const char *)&npatterns, sizeof(npatterns));
+    cache.write((const char *)&nibble_packed, sizeof(nibble_packed));
+    for (auto & nm : _taxon_names)
+        {
+        std::uint32_t length = (std::uint32_t)nm.size();
+        cache.write((const char *)&length, sizeof(length));
+        cache.write(nm.c_str(), length);
+        }
+    cache.write((const char *)&_pattern_counts[0], npatterns*sizeof(double));
+    std::uint32_t nsubsets = (std::uint32_t)_subset_end.size();
+    cache.write((const char *)&nsubsets, sizeof(nsubsets));
+    for (auto end_pattern : _subset_end)
+        {
+        std::uint32_t e = end_pattern;
+        cache.write((const char *)&e, sizeof(e));
+        }
+    for (unsigned i = 0; i < ntaxa; ++i)
+        cache.write((const char *)_data_matrix.getRowPtr(i), _data_matrix.getRowBytes());
+    cache.close();
+
+    if (!cache || std::rename(tmp_file_name.c_str(), cache_file_name.c_str()) != 0)
+        {
+        std::remove(tmp_file_name.c_str());
+        std::cerr << boost::str(boost::format("Warning: could not write data cache file \"%s\"") % cache_file_name) << std::endl;
+        }
     }
 
 inline std::string Data::createTaxaBlock() const
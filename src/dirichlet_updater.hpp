@@ -18,6 +18,7 @@ namespace strom
 
             void                                clear();
             double                              calcLogPrior() const;
+            virtual double                      getStateSummary(double log_likelihood) const;
 
         protected:
 
@@ -75,6 +76,15 @@ inline double DirichletUpdater::calcLogPrior() const
     return log_prior;
     }
 
+inline double DirichletUpdater::getStateSummary(double log_likelihood) const
+    {
+    // Sum of log proportions, which changes whenever any proportion does
+    double s = 0.0;
+    for (auto p : _curr_point)
+        s += std::log(p);
+    return s;
+    }
+
 inline void DirichletUpdater::proposeNewState()
     {
     // Save length of _curr_point.
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cmath>
+#include "updater.hpp"
+
+namespace strom
+{
+
+    class EdgeLengthUpdater : public Updater
+    {
+        public:
+
+                                        EdgeLengthUpdater();
+                                        ~EdgeLengthUpdater();
+
+            virtual void                clear();
+            virtual double              update(double prev_lnL);
+
+            virtual double              calcLogPrior() const;
+            virtual double              getStateSummary(double log_likelihood) const;
+
+        private:
+
+            virtual void                pullCurrentStateFromModel();
+            virtual void                pushCurrentStateToModel() const;
+            virtual void                proposeNewState();
+            virtual void                revert();
+
+            void                        updateEdge(Node * nd, double log_likelihood, Likelihood::edge_function_t & edge_log_likelihood);
+            double                      calcLogPriorRatio(double curr_length, double new_length) const;
+            double                      calcLogJacobianRatio(double curr_length, double new_length) const;
+
+            double                      _tree_length;
+
+        public:
+
+            typedef std::shared_ptr< EdgeLengthUpdater > SharedPtr;
+    };
+
+inline EdgeLengthUpdater::EdgeLengthUpdater()
+    {
+    // std::cout << "Creating an EdgeLengthUpdater..." << std::endl;
+    clear();
+    _name = "Edge Length";
+    }
+
+inline EdgeLengthUpdater::~EdgeLengthUpdater()
+    {
+    // std::cout << "Destroying an EdgeLengthUpdater..." << std::endl;
+    }
+
+inline void EdgeLengthUpdater::clear()
+    {
+    Updater::clear();
+    _tree_length = 0.0;
+    reset();
+    }
+
+inline double EdgeLengthUpdater::calcLogPrior() const
+    {
+    return Updater::calcEdgeLengthPrior();
+    }
+
+inline double EdgeLengthUpdater::getStateSummary(double log_likelihood) const
+    {
+    return std::log(_tree_length);
+    }
+
+inline double EdgeLengthUpdater::update(double prev_lnL)
+    {
+    // Proposes a new length for every edge in turn (a multiplier move, one Metropolis-
+    // Hastings step per edge), each evaluated by Likelihood::visitEdges from the partials
+    // on either side of the edge rather than from a full pass over the tree. Acceptance
+    // rates and lambda refer to single edges. The log-likelihood returned is recomputed
+    // by the chain's own instances, so that it is comparable with those of other updaters.
+    _tree_length = _tree_manipulator->calcTreeLength();
+    _likelihood->visitEdges(_tree_manipulator->getTree(), [this](Node * nd, double log_likelihood, Likelihood::edge_function_t edge_log_likelihood)
+        {
+        updateEdge(nd, log_likelihood, edge_log_likelihood);
+        });
+    reset();
+    return calcLogLikelihood();
+    }
+
+inline void EdgeLengthUpdater::updateEdge(Node * nd, double log_likelihood, Likelihood::edge_function_t & edge_log_likelihood)
+    {
+    double curr_length = nd->getEdgeLength();
+    double m = exp(_lambda*(_lot->uniform() - 0.5));
+    double new_length = m*curr_length;
+
+    double first_derivative = 0.0;
+    double second_derivative = 0.0;
+    double new_log_likelihood = edge_log_likelihood(new_length, first_derivative, second_derivative);
+    double log_diff = log(m) + calcLogJacobianRatio(curr_length, new_length);
+    log_diff += _heating_power*(new_log_likelihood - log_likelihood + calcLogPriorRatio(curr_length, new_length));
+
+    bool accept = (_lot->logUniform() <= log_diff);
+    if (accept)
+        {
+        nd->setEdgeLength(new_length);
+        _tree_length += nd->getEdgeLength() - curr_length;
+        _naccepts++;
+        }
+    tune(accept);
+    }
+
+inline double EdgeLengthUpdater::calcLogPriorRatio(double curr_length, double new_length) const
+    {
+    // Change in the log of the Gamma-Dirichlet prior (see Updater::calcEdgeLengthPrior) when
+    // one edge changes length: the proportions of all edges change, but only through the
+    // tree length, so this takes constant time
+    double a = _prior_parameters[0];
+    double b = _prior_parameters[1];
+    double c = _prior_parameters[2];
+    Tree::SharedPtr tree = _tree_manipulator->getTree();
+    double n = tree->numLeaves();
+    double num_edges = 2.0*n - (tree->isRooted() ? 2.0 : 3.0);
+
+    double new_tree_length = _tree_length + new_length - curr_length;
+    double log_tree_length_ratio = log(new_tree_length) - log(_tree_length);
+    double log_prior_ratio = (a - 1.0)*log_tree_length_ratio - (new_tree_length - _tree_length)/b;
+    log_prior_ratio += (c - 1.0)*(log(new_length) - log(curr_length) - num_edges*log_tree_length_ratio);
+    return log_prior_ratio;
+    }
+
+inline double EdgeLengthUpdater::calcLogJacobianRatio(double curr_length, double new_length) const
+    {
+    // The prior is a density for the tree length and edge length proportions, whereas this
+    // move changes one edge length; the Jacobian of that change of variables, TL^-(num_edges - 1),
+    // is not part of the (heated) posterior
+    Tree::SharedPtr tree = _tree_manipulator->getTree();
+    double n = tree->numLeaves();
+    double num_edges = 2.0*n - (tree->isRooted() ? 2.0 : 3.0);
+    double new_tree_length = _tree_length + new_length - curr_length;
+    return -(num_edges - 1.0)*(log(new_tree_length) - log(_tree_length));
+    }
+
+inline void EdgeLengthUpdater::pullCurrentStateFromModel()
+    {
+    }
+
+inline void EdgeLengthUpdater::pushCurrentStateToModel() const
+    {
+    }
+
+inline void EdgeLengthUpdater::proposeNewState()
+    {
+    // Not used: update proposes and accepts or rejects a new length for each edge itself
+    }
+
+inline void EdgeLengthUpdater::revert()
+    {
+    }
+
+}
@@ -12,10 +12,16 @@ namespace strom
                                         ExchangeabilityUpdater();
                                         ~ExchangeabilityUpdater();
 
+            virtual bool                isApplicable() const;
             virtual void                pullCurrentStateFromModel();
             virtual void                pushCurrentStateToModel() const;
 
             std::vector<double>         getCurrentPoint() const;
+            void                        setCurrentPoint(const std::vector<double> & point);
+
+        private:
+
+            bool                        isTransitionTransversion() const;
 
         public:
             typedef std::shared_ptr< ExchangeabilityUpdater > SharedPtr;
@@ -38,20 +44,49 @@ inline std::vector<double> ExchangeabilityUpdater::getCurrentPoint() const
     return _curr_point;
     }
 
+inline void ExchangeabilityUpdater::setCurrentPoint(const std::vector<double> & point)
+    {
+    _curr_point = point;
+    }
+
+inline bool ExchangeabilityUpdater::isApplicable() const
+    {
+    // Exchangeabilities are all equal under JC69
+    return _likelihood->getModel(_subset)->getSubmodelConstraint() != Model::SubmodelJC69;
+    }
+
+inline bool ExchangeabilityUpdater::isTransitionTransversion() const
+    {
+    Model::submodel_t constraint = _likelihood->getModel(_subset)->getSubmodelConstraint();
+    return constraint == Model::SubmodelHKY || constraint == Model::SubmodelK80;
+    }
+
 inline void ExchangeabilityUpdater::pullCurrentStateFromModel()
     {
-    Model::SharedPtr model = _likelihood->getModel();
+    // Under HKY and K80 the point updated is the share of the exchangeabilities
+    // belonging to the two transitions and to the four transversions
+    Model::SharedPtr model = _likelihood->getModel(_subset);
     const std::vector<double> & xchg = model->getExchangeabilities();
-    _curr_point.assign(xchg.begin(), xchg.end());
+    if (isTransitionTransversion())
+        _curr_point = {xchg[1] + xchg[4], xchg[0] + xchg[2] + xchg[3] + xchg[5]};
+    else
+        _curr_point.assign(xchg.begin(), xchg.end());
     }
 
 inline void ExchangeabilityUpdater::pushCurrentStateToModel() const
     {
     // sanity checks
-    assert(_curr_point.size() == 6);
+    assert(_curr_point.size() == (isTransitionTransversion() ? 2 : 6));
     assert(fabs(std::accumulate(_curr_point.begin(), _curr_point.end(), 0.0) - 1.0) < 1.e-8);
 
-    Model::SharedPtr model = _likelihood->getModel();
-    model->setExchangeabilities(_curr_point);
+    Model::SharedPtr model = _likelihood->getModel(_subset);
+    if (isTransitionTransversion())
+        {
+        double ts = _curr_point[0]/2.0;
+        double tv = _curr_point[1]/4.0;
+        model->setExchangeabilities({tv, ts, tv, tv, ts, tv});
+        }
+    else
+        model->setExchangeabilities(_curr_point);
     }
 }
@@ -15,6 +15,8 @@ namespace strom
 
             virtual void                clear();
             virtual double              calcLogPrior() const;
+            virtual bool                isApplicable() const;
+            virtual double              getStateSummary(double log_likelihood) const;
 
             // mandatory overrides of pure virtual functions
             virtual void                pullCurrentStateFromModel();
@@ -23,6 +25,7 @@ namespace strom
             virtual void                revert();
 
             double                      getCurrentPoint() const;
+            void                        setCurrentPoint(double point);
 
         private:
 
@@ -50,6 +53,11 @@ inline double GammaShapeUpdater::getCurrentPoint() const
     return _curr_point;
     }
 
+inline void GammaShapeUpdater::setCurrentPoint(double point)
+    {
+    _curr_point = point;
+    }
+
 inline void GammaShapeUpdater::clear()
     {
     Updater::clear();
@@ -72,15 +80,26 @@ inline double GammaShapeUpdater::calcLogPrior() const
     return log_prior;
     }
 
+inline bool GammaShapeUpdater::isApplicable() const
+    {
+    // The shape matters only if there is more than one rate category
+    return _likelihood->getModel(_subset)->getGammaNCateg() > 1;
+    }
+
+inline double GammaShapeUpdater::getStateSummary(double log_likelihood) const
+    {
+    return std::log(_curr_point);
+    }
+
 inline void GammaShapeUpdater::pullCurrentStateFromModel()
     {
-    Model::SharedPtr gtr = _likelihood->getModel();
+    Model::SharedPtr gtr = _likelihood->getModel(_subset);
     _curr_point = gtr->getGammaShape();
     }
 
 inline void GammaShapeUpdater::pushCurrentStateToModel() const
     {
-    Model::SharedPtr gtr = _likelihood->getModel();
+    Model::SharedPtr gtr = _likelihood->getModel(_subset);
     gtr->setGammaShape(_curr_point);
     }
 
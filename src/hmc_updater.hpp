@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "updater.hpp"
+
+namespace strom
+{
+
+    class HMCUpdater : public Updater
+    {
+        public:
+
+                                        HMCUpdater();
+                                        ~HMCUpdater();
+
+            virtual void                clear();
+            virtual double              update(double prev_lnL);
+
+            void                        setNumSteps(unsigned nsteps);
+
+            virtual double              calcLogPrior() const;
+            virtual double              getStateSummary(double log_likelihood) const;
+
+        private:
+
+            virtual void                pullCurrentStateFromModel();
+            virtual void                pushCurrentStateToModel() const;
+            virtual void                proposeNewState();
+            virtual void                revert();
+
+            double                      calcLogPosterior(std::vector<double> & gradient) const;
+
+            unsigned                    _nsteps;
+            std::vector<double>         _log_lengths;
+            std::vector<double>         _prev_edge_lengths;
+
+        public:
+
+            typedef std::shared_ptr< HMCUpdater > SharedPtr;
+    };
+
+inline HMCUpdater::HMCUpdater()
+    {
+    // std::cout << "Creating an HMCUpdater..." << std::endl;
+    clear();
+    _name = "Edge Lengths (HMC)";
+    }
+
+inline HMCUpdater::~HMCUpdater()
+    {
+    // std::cout << "Destroying an HMCUpdater..." << std::endl;
+    }
+
+inline void HMCUpdater::clear()
+    {
+    Updater::clear();
+    _nsteps = 10;
+    _log_lengths.clear();
+    _prev_edge_lengths.clear();
+    reset();
+    }
+
+inline void HMCUpdater::setNumSteps(unsigned nsteps)
+    {
+    if (nsteps < 1)
+        throw XStrom("the number of leapfrog steps of the HMC updater must be at least 1");
+    _nsteps = nsteps;
+    }
+
+inline double HMCUpdater::calcLogPrior() const
+    {
+    return Updater::calcEdgeLengthPrior();
+    }
+
+inline double HMCUpdater::getStateSummary(double log_likelihood) const
+    {
+    return std::log(_tree_manipulator->calcTreeLength());
+    }
+
+inline void HMCUpdater::pullCurrentStateFromModel()
+    {
+    // The edge lengths themselves are saved so that a rejected trajectory restores them exactly
+    _tree_manipulator->getEdgeLengths(_prev_edge_lengths);
+    _log_lengths.clear();
+    for (auto edge_length : _prev_edge_lengths)
+        _log_lengths.push_back(log(edge_length));
+    }
+
+inline void HMCUpdater::pushCurrentStateToModel() const
+    {
+    std::vector<double> edge_lengths;
+    for (auto log_length : _log_lengths)
+        edge_lengths.push_back(exp(log_length));
+    _tree_manipulator->setEdgeLengths(edge_lengths);
+    }
+
+inline double HMCUpdater::calcLogPosterior(std::vector<double> & gradient) const
+    {
+    // Returns the log of the (heated) posterior density of the log edge lengths in the
+    // tree, and in gradient its derivatives with respect to them (in preorder). The prior
+    // is a density for the tree length TL and edge length proportions, so the density of
+    // the log edge lengths includes the Jacobian TL^-(num_edges - 1) prod(edge lengths).
+    double log_likelihood = _likelihood->calcEdgeLengthGradient(_tree_manipulator->getTree(), gradient);
+    double log_posterior = _heating_power*(log_likelihood + calcLogPrior());
+
+    double a = _prior_parameters[0];
+    double b = _prior_parameters[1];
+    double c = _prior_parameters[2];
+    double TL = _tree_manipulator->calcTreeLength();
+    std::vector<double> edge_lengths;
+    _tree_manipulator->getEdgeLengths(edge_lengths);
+    double num_edges = (double)edge_lengths.size();
+    log_posterior -= (num_edges - 1.0)*log(TL);
+    for (unsigned i = 0; i < edge_lengths.size(); ++i)
+        {
+        double edge_length = edge_lengths[i];
+        double d_log_prior = (a - 1.0)/TL - 1.0/b + (c - 1.0)*(1.0/edge_length - num_edges/TL);
+        double d_log_jacobian = -(num_edges - 1.0)/TL;
+        gradient[i] = edge_length*(_heating_power*(gradient[i] + d_log_prior) + d_log_jacobian) + 1.0;
+        log_posterior += log(edge_length);
+        }
+    return log_posterior;
+    }
+
+inline double HMCUpdater::update(double prev_lnL)
+    {
+    // Hamiltonian Monte Carlo on all log edge lengths jointly, with unit masses and step
+    // size _lambda (tuned like the window of other updaters, toward a higher acceptance
+    // rate). The number of leapfrog steps is drawn uniformly from 1 to _nsteps to avoid
+    // periodic trajectories. Each step needs the gradient of the log-likelihood, which
+    // Likelihood::calcEdgeLengthGradient computes in time linear in the size of the tree.
+    // Node::setEdgeLength clamps edge lengths at Node::_smallest_edge_length, so a log edge
+    // length that would cross log of that bound is reflected back (and its momentum
+    // reversed), which keeps the energies computed at the point the trajectory reaches and
+    // leaves the integrator reversible and volume preserving.
+    const double min_log_length = std::log(Node::_smallest_edge_length);
+    pullCurrentStateFromModel();
+    unsigned n = (unsigned)_log_lengths.size();
+
+    std::vector<double> momentum(n, 0.0);
+    double kinetic = 0.0;
+    for (unsigned i = 0; i < n; ++i)
+        {
+        momentum[i] = _lot->normal();
+        kinetic += 0.5*momentum[i]*momentum[i];
+        }
+
+    std::vector<double> gradient;
+    double prev_log_posterior = calcLogPosterior(gradient);
+    double log_posterior = prev_log_posterior;
+    unsigned nsteps = 1 + (unsigned)std::floor(_lot->uniform()*_nsteps);
+    for (unsigned step = 0; step < nsteps; ++step)
+        {
+        for (unsigned i = 0; i < n; ++i)
+            {
+            momentum[i] += 0.5*_lambda*gradient[i];
+            _log_lengths[i] += _lambda*momentum[i];
+            if (_log_lengths[i] < min_log_length)
+                {
+                _log_lengths[i] = 2.0*min_log_length - _log_lengths[i];
+                momentum[i] = -momentum[i];
+                }
+            }
+        pushCurrentStateToModel();
+        log_posterior = calcLogPosterior(gradient);
+        for (unsigned i = 0; i < n; ++i)
+            momentum[i] += 0.5*_lambda*gradient[i];
+        }
+
+    double new_kinetic = 0.0;
+    for (auto p : momentum)
+        new_kinetic += 0.5*p*p;
+
+    double log_diff = (log_posterior - new_kinetic) - (prev_log_posterior - kinetic);
+    bool accept = (std::isfinite(log_diff) && _lot->logUniform() <= log_diff);
+    double log_likelihood = prev_lnL;
+    if (accept)
+        {
+        _naccepts++;
+        log_likelihood = calcLogLikelihood();
+        }
+    else
+        revert();
+
+    tune(accept);
+    reset();
+    return log_likelihood;
+    }
+
+inline void HMCUpdater::proposeNewState()
+    {
+    // Not used: update makes the whole trajectory itself
+    }
+
+inline void HMCUpdater::revert()
+    {
+    _tree_manipulator->setEdgeLengths(_prev_edge_lengths);
+    }
+
+}
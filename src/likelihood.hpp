@@ -1,6 +1,17 @@
 #pragma once
 
 #include <map>
+#include <tuple>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <unistd.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 #include <boost/shared_ptr.hpp>
@@ -8,6 +19,8 @@
 #include "libhmsbeagle/beagle.h"
 #include "data.hpp"
 #include "model.hpp"
+#include "thread_pool.hpp"
+#include "checkpoint.hpp"
 #include "xstrom.hpp"
 
 namespace strom {
@@ -15,64 +28,253 @@ namespace strom {
 class Likelihood
     {
     public:
+        enum scaling_policy_t
+            {
+            ScaleAlways         = 0,
+            ScaleEveryKLevels   = 1,
+            ScaleDynamic        = 2
+            };
+
                                     Likelihood();
                                     ~Likelihood();
 
         void                        useStoredData(bool using_data);
+        void                        useSinglePrecision(bool single, double tolerance, unsigned check_freq);
+        bool                        isSinglePrecision() const;
+        void                        setScalingPolicy(scaling_policy_t policy, unsigned interval, unsigned check_freq, double tolerance);
+        std::string                 describeScaling() const;
+
+        void                        saveState(Checkpoint & checkpoint);
+        void                        restoreState(Checkpoint & checkpoint);
 
         std::string                 availableResources();
+        void                        tuneBeagleLib(typename Tree::SharedPtr t, unsigned nreps);
+        static void                 readTunedFlags(const std::string file_name);
+        static void                 writeTunedFlags(const std::string file_name);
 
         double                      calcLogLikelihood(typename Tree::SharedPtr t);
+        std::vector<double>         calcLogLikelihoods(const std::vector<typename Tree::SharedPtr> & trees);
+        double                      optimizeEdgeLengths(typename Tree::SharedPtr t, double tolerance, unsigned max_sweeps);
+
+        // Log-likelihood, and its first and second derivatives, for a length of one edge (see visitEdges)
+        typedef std::function<double(double, double &, double &)> edge_function_t;
+        typedef std::function<void(Node *, double, edge_function_t)> edge_visitor_t;
+        double                      visitEdges(typename Tree::SharedPtr t, edge_visitor_t visitor);
+        double                      calcEdgeLengthGradient(typename Tree::SharedPtr t, std::vector<double> & gradient);
 
         void                        setData(Data::SharedPtr d);
         Data::SharedPtr             getData();
 
+        void                        setThreadPool(ThreadPool::SharedPtr pool);
+
         void                        setModel(Model::SharedPtr model);
+        void                        setModels(const std::vector<Model::SharedPtr> & models);
         Model::SharedPtr            getModel();
+        Model::SharedPtr            getModel(unsigned subset);
+        const std::vector<Model::SharedPtr> & getModels() const;
+        unsigned                    getNumSubsets() const;
 
 
     private:
 
+        // Partials are identified by the partials of the two children they were computed
+        // from (the leaf number or, for an internal node, a number unique to each
+        // computation) and the lengths of the edges to them (see makeSubtreeKey)
+        typedef std::tuple<std::size_t, double, std::size_t, double> subtree_key_t;
+
+        // Partials buffers of an instance identified by the key of the partials they hold.
+        // Buffer k (partials buffer _ntaxa + k, scale buffer k + 1) holds the partials whose
+        // key is buffer_subtrees[k], numbered buffer_contents[k], if buffer_last_used[k] > 0.
+        // Instances with one have twice as many partials buffers as a tree has internal
+        // nodes, so that the partials of subtrees computed for one tree can be reused for
+        // the next.
+        struct SubtreeCache
+            {
+            unsigned                            clock;
+            std::map<subtree_key_t, unsigned>   subtree_buffers;
+            std::vector<subtree_key_t>          buffer_subtrees;
+            std::vector<unsigned>               buffer_last_used;
+            std::vector<std::size_t>            buffer_contents;
+            std::size_t                         next_contents;
+            };
+
+        // Everything BeagleLib needs to compute the log-likelihood of one partition subset
+        struct Subset
+            {
+            Model::SharedPtr        model;
+            int                     instance;
+            int                     reference_instance;
+            unsigned                first_pattern;
+            unsigned                npatterns;
+            std::vector<bool>       tip_partials;
+            unsigned                num_tip_partials;
+            std::vector<int>        operations;
+            std::vector<int>        pmatrix_index;
+            std::vector<double>     edge_lengths;
+            std::vector<double>     site_log_likelihoods;
+
+            int                     uploaded_instance;
+            unsigned                uploaded_version;
+
+            bool                    single_precision;
+            unsigned                num_evaluations;
+
+            scaling_policy_t        scaling_policy;
+            bool                    scalers_cached;
+            unsigned                num_scaled_evaluations;
+            unsigned                num_rescales;
+
+            // log-likelihood last computed, and the tree and model it was computed for
+            bool                    valid;
+            double                  log_likelihood;
+            std::vector<double>     tree_signature;
+            unsigned                model_version;
+
+            // partials saved in the working instance (see defineCachedOperations) for the
+            // model version they were computed for; buffer_factors[k] is true if the partials
+            // last computed in buffer k were divided by the factors in its scale buffer, and
+            // buffer_rescaled[k] if those factors were computed along with them
+            int                     cached_instance;
+            unsigned                cached_model_version;
+            SubtreeCache            cache;
+            std::vector<bool>       buffer_factors;
+            std::vector<bool>       buffer_rescaled;
+            std::vector<int>        scalers;
+            };
+
+        // An instance used by calcLogLikelihoods, which rescales every buffer of its subtree cache
+        struct BatchInstance
+            {
+            unsigned                        subset;
+            int                             instance;
+            bool                            uploaded;
+            unsigned                        model_version;
+            SubtreeCache                    cache;
+            std::vector<double>             site_log_likelihoods;
+            };
+
+        // An instance used by optimizeEdgeLengths, which also has a partials buffer for
+        // every node holding the partials of the rest of the tree, as seen from the far
+        // end of the edge below the node (see upperBuffer). Per-pattern vectors hold the
+        // log-likelihoods (of the variable-rate component if +I) for the current edge
+        // lengths, their differences from the unscaled values BeagleLib reports for the
+        // edge being optimized, and the derivatives with respect to its length. Instances
+        // kept for visitEdges are sent the model again when its version changes.
+        struct OptimizationInstance
+            {
+            unsigned                        subset;
+            int                             instance;
+            unsigned                        model_version;
+            std::vector<double>             site_log_likelihoods;
+            std::vector<double>             edge_site_log_likelihoods;
+            std::vector<double>             site_offsets;
+            std::vector<double>             first_derivatives;
+            std::vector<double>             second_derivatives;
+            };
+
         void                        initBeagleLib();
-        void                        setTipStates();
-        void                        setPatternWeights();
-        void                        setDiscreteGammaShape();
-        void                        setModelRateMatrix();
-        void                        defineOperations(typename Tree::SharedPtr t);
-        void                        updateTransitionMatrices();
-        void                        calculatePartials();
-
-        int                         _instance;
+        void                        initSubsets();
+        int                         newInstance(unsigned s, unsigned num_internal_buffers, long preference_flags, long requirement_flags, BeagleInstanceDetails & instance_details);
+        int                         createInstance(unsigned s, unsigned num_internal_buffers, long preference_flags, long requirement_flags);
+        void                        getInstanceFlags(long & preference_flags, long & requirement_flags) const;
+        bool                        hasInstances() const;
+        void                        finalizeInstances();
+        void                        finalizeInstance(unsigned s);
+        long                        precisionFlags(long requirement_flags) const;
+        double                      calcSubsetsLogLikelihood(typename Tree::SharedPtr t);
+        void                        initBatchInstances(unsigned nchunks);
+        void                        calcBatchLogLikelihoods(BatchInstance & batch, const std::vector<typename Tree::SharedPtr> & trees, unsigned first, unsigned last, std::vector<double> & log_likelihoods);
+        void                        initOptimizationInstances(std::vector<OptimizationInstance> & optimization);
+        void                        initEdgeInstances();
+        double                      calcOptimizationPartials(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t);
+        void                        updateOptimizationPartial(std::vector<OptimizationInstance> & optimization, int destination, int child1, int matrix1, int child2, int matrix2);
+        double                      calcEdgeDerivatives(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t, Node * nd, double edge_length, bool new_edge, double & first_derivative, double & second_derivative);
+        double                      sumSiteLogLikelihoods(const OptimizationInstance & optimization, double & first_derivative, double & second_derivative) const;
+        void                        optimizeEdgeLength(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t, Node * nd);
+        void                        visitSubtree(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t, Node * nd, std::function<void(Node *)> visit, bool changing_lengths);
+        int                         upperBuffer(typename Tree::SharedPtr t, Node * nd) const;
+        int                         edgeMatrix(typename Tree::SharedPtr t, Node * nd) const;
+        void                        runTasks(unsigned ntasks, ThreadPool::task_t task);
+        double                      calcSubsetLogLikelihood(unsigned s, typename Tree::SharedPtr t);
+        double                      calcInstanceLogLikelihood(unsigned s, typename Tree::SharedPtr t);
+        double                      computeLogLikelihood(unsigned s, typename Tree::SharedPtr t, scaling_policy_t scaling);
+        double                      checkPrecision(unsigned s, typename Tree::SharedPtr t, double log_likelihood);
+        void                        switchToDoublePrecision(unsigned s);
+        void                        initPartialsCache(unsigned s);
+        void                        discardCaches();
+        static void                 resetSubtreeCache(SubtreeCache & cache, unsigned num_buffers, unsigned ntaxa);
+        static subtree_key_t        makeSubtreeKey(std::size_t left_contents, double left_edge_length, std::size_t right_contents, double right_edge_length);
+        static unsigned             findSubtreeBuffer(SubtreeCache & cache, const subtree_key_t & key, bool & found);
+        std::string                 getDatasetShape() const;
+        static void                 calcTreeSignature(typename Tree::SharedPtr t, std::vector<double> & signature);
+        static std::string          flagsAsString(long flags);
+        static std::string          getHostName();
+        void                        setTipStates(unsigned s, int instance);
+        void                        setPatternWeights(unsigned s, int instance);
+        void                        setDiscreteGammaShape(unsigned s, int instance);
+        void                        setModelRateMatrix(unsigned s, int instance, bool derivatives);
+        void                        defineOperations(unsigned s, typename Tree::SharedPtr t, scaling_policy_t scaling);
+        int                         defineCachedOperations(unsigned s, typename Tree::SharedPtr t, scaling_policy_t scaling);
+        void                        updateTransitionMatrices(unsigned s, int instance, const std::vector<int> & pmatrix_index, const std::vector<double> & edge_lengths);
+        void                        calculatePartials(unsigned s, scaling_policy_t scaling);
+        void                        calculateCachedPartials(unsigned s);
+        double                      addInvariableSites(unsigned s, int instance, std::vector<double> & site_log_likelihoods, double log_likelihood);
+
         std::map<int, std::string>  _beagle_error;
-        std::vector<int>            _operations;
-        std::vector<int>            _pmatrix_index;
-        std::vector<double>         _edge_lengths;
+        std::vector<Subset>         _subsets;
+        std::vector<BatchInstance>  _batch_instances;
+        std::vector<OptimizationInstance> _edge_instances;
 
         Data::SharedPtr             _data;
-        Model::SharedPtr            _model;
+        std::vector<Model::SharedPtr> _models;
+        ThreadPool::SharedPtr       _thread_pool;
         unsigned                    _ntaxa;
         unsigned                    _nstates;
         unsigned                    _npatterns;
         bool                        _rooted;
         bool                        _prefer_gpu;
+        long                        _preference_flags;
+        long                        _requirement_flags;
 
         bool                        _using_data;
 
+        bool                        _single_precision;
+        double                      _precision_tolerance;
+        unsigned                    _precision_check_freq;
+
+        scaling_policy_t            _requested_scaling_policy;
+        unsigned                    _scaling_interval;
+        unsigned                    _scaling_check_freq;
+        double                      _scaling_tolerance;
+
+        typedef std::map< std::string, std::pair<long, long> > tuned_flags_map_t;
+        static tuned_flags_map_t    _tuned_flags;
+
     public:
         typedef std::shared_ptr< Likelihood > SharedPtr;
     };
 
 inline Likelihood::Likelihood()
     {
-    _instance   = -1;
     _ntaxa      = 0;
     _nstates    = 0;
     _npatterns  = 0;
     _rooted     = false;
     _prefer_gpu = false;
     _using_data = true;
-    _model      = Model::SharedPtr(new Model());
+    _models.assign(1, Model::SharedPtr(new Model()));
+
+    _preference_flags  = BEAGLE_FLAG_PROCESSOR_CPU;
+    _requirement_flags = BEAGLE_FLAG_PRECISION_DOUBLE | BEAGLE_FLAG_SCALING_MANUAL;
+
+    _single_precision       = false;
+    _precision_tolerance    = 0.01;
+    _precision_check_freq   = 100;
 
+    _requested_scaling_policy   = ScaleAlways;
+    _scaling_interval           = 1;
+    _scaling_check_freq         = 100;
+    _scaling_tolerance          = 1.e-6;
 
     // store BeagleLib error codes so that useful
     // error messages may be provided to the user
@@ -91,11 +293,13 @@ inline Likelihood::Likelihood()
 
 inline Likelihood::~Likelihood()
     {
-    if (_instance >= 0)
+    try
         {
-        int code = beagleFinalizeInstance(_instance);
-        if (code != 0)
-            std::cerr << boost::str(boost::format("Likelihood destructor failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]) << std::endl;
+        finalizeInstances();
+        }
+    catch (XStrom & x)
+        {
+        std::cerr << "Likelihood destructor: " << x.what() << std::endl;
         }
     //std::cout << "Destroying a Likelihood" << std::endl;
     }
@@ -124,29 +328,38 @@ inline Data::SharedPtr Likelihood::getData()
 inline void Likelihood::setData(Data::SharedPtr data)
     {
     _data = data;
-    if (_instance >= 0)
+    if (hasInstances())
         {
         // initBeagleLib function was previously called, so
-        // finalize existing instance and create new one
-        int code = beagleFinalizeInstance(_instance);
-        if (code != 0)
-            throw XStrom(boost::str(boost::format("Likelihood setData function failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]));
-        _instance = -1;
+        // finalize existing instances and create new ones
+        finalizeInstances();
         assert(_ntaxa > 0 && _nstates > 0 && _npatterns > 0);
         initBeagleLib();
         }
     }
 
+inline void Likelihood::setThreadPool(ThreadPool::SharedPtr pool)
+    {
+    // Subsets are evaluated concurrently using the threads of pool (which
+    // may be shared with other Likelihood objects, but not used concurrently)
+    _thread_pool = pool;
+    }
+
 inline void Likelihood::setModel(Model::SharedPtr model)
     {
-    _model = model;
-    if (_instance >= 0)
+    setModels(std::vector<Model::SharedPtr>(1, model));
+    }
+
+inline void Likelihood::setModels(const std::vector<Model::SharedPtr> & models)
+    {
+    // One model for each subset of the data partition, in the order the
+    // subsets were defined; models are not shared among subsets
+    assert(!models.empty());
+    _models = models;
+    if (hasInstances())
         {
-        // init function was previously called, so set the model and create new BeagleLib instance
-        int code = beagleFinalizeInstance(_instance);
-        if (code != 0)
-            throw XStrom(boost::str(boost::format("Likelihood setModel function failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]));
-        _instance = -1;
+        // init function was previously called, so set the models and create new BeagleLib instances
+        finalizeInstances();
         assert(_ntaxa > 0 && _nstates > 0 && _npatterns > 0);
         initBeagleLib();
         }
@@ -154,7 +367,23 @@ inline void Likelihood::setModel(Model::SharedPtr model)
 
 inline Model::SharedPtr Likelihood::getModel()
     {
-    return _model;
+    return _models[0];
+    }
+
+inline Model::SharedPtr Likelihood::getModel(unsigned subset)
+    {
+    assert(subset < _models.size());
+    return _models[subset];
+    }
+
+inline const std::vector<Model::SharedPtr> & Likelihood::getModels() const
+    {
+    return _models;
+    }
+
+inline unsigned Likelihood::getNumSubsets() const
+    {
+    return (unsigned)_models.size();
     }
 
 inline void Likelihood::useStoredData(bool using_data)
@@ -162,10 +391,351 @@ inline void Likelihood::useStoredData(bool using_data)
     _using_data = using_data;
     }
 
+inline std::string Likelihood::flagsAsString(long flags)
+    {
+    std::vector<std::string> names;
+    if (flags & BEAGLE_FLAG_PROCESSOR_CPU)       names.push_back("CPU");
+    if (flags & BEAGLE_FLAG_PROCESSOR_GPU)       names.push_back("GPU");
+    if (flags & BEAGLE_FLAG_PRECISION_SINGLE)    names.push_back("SINGLE");
+    if (flags & BEAGLE_FLAG_PRECISION_DOUBLE)    names.push_back("DOUBLE");
+    if (flags & BEAGLE_FLAG_VECTOR_NONE)         names.push_back("VECTOR_NONE");
+    if (flags & BEAGLE_FLAG_VECTOR_SSE)          names.push_back("VECTOR_SSE");
+    if (flags & BEAGLE_FLAG_VECTOR_AVX)          names.push_back("VECTOR_AVX");
+    if (flags & BEAGLE_FLAG_THREADING_NONE)      names.push_back("THREADING_NONE");
+    if (flags & BEAGLE_FLAG_THREADING_OPENMP)    names.push_back("THREADING_OPENMP");
+    if (flags & BEAGLE_FLAG_THREADING_CPP)       names.push_back("THREADING_CPP");
+    if (flags & BEAGLE_FLAG_SCALING_MANUAL)      names.push_back("SCALING_MANUAL");
+    if (flags & BEAGLE_FLAG_SCALING_AUTO)        names.push_back("SCALING_AUTO");
+    if (flags & BEAGLE_FLAG_SCALING_ALWAYS)      names.push_back("SCALING_ALWAYS");
+    if (flags & BEAGLE_FLAG_SCALING_DYNAMIC)     names.push_back("SCALING_DYNAMIC");
+    return boost::algorithm::join(names, " ");
+    }
+
+inline std::string Likelihood::getDatasetShape() const
+    {
+    // Key used to share tuned BeagleLib flags among instances computing likelihoods for the same data
+    std::vector<std::string> patterns;
+    std::vector<std::string> categories;
+    for (auto & sub : _subsets)
+        {
+        patterns.push_back(std::to_string(sub.npatterns));
+        categories.push_back(std::to_string(sub.model->_num_categ));
+        }
+    return boost::str(boost::format("%d taxa, %s patterns, %d states, %s categories, %s precision") % _ntaxa % boost::algorithm::join(patterns, "+") % _nstates % boost::algorithm::join(categories, "+") % (_single_precision ? "single" : "double"));
+    }
+
+inline int Likelihood::newInstance(unsigned s, unsigned num_internal_buffers, long preference_flags, long requirement_flags, BeagleInstanceDetails & instance_details)
+    {
+    // Creates an instance for subset s with num_internal_buffers partials buffers (and as
+    // many scale buffers) for internal nodes, returning the instance or a BeagleLib error code.
+    // Two matrices beyond those needed for the edges receive derivatives (see optimizeEdgeLengths).
+    Subset & sub = _subsets[s];
+    unsigned num_transition_probs = (_rooted ? (2*_ntaxa - 2) : (2*_ntaxa - 3)) + 2;
+
+    return beagleCreateInstance(
+         _ntaxa,                                        // tips
+         num_internal_buffers + sub.num_tip_partials,   // partials
+         _ntaxa - sub.num_tip_partials,                 // sequences
+         _nstates,                  // states
+         sub.npatterns,             // patterns
+         1,                         // models
+         num_transition_probs,      // transition matrices
+         sub.model->_num_categ,     // rate categories
+         num_internal_buffers + 1,  // scale buffers
+         NULL,                      // resource restrictions
+         0,                         // length of resource list
+         preference_flags,          // preferred flags
+         requirement_flags,         // required flags
+         &instance_details);        // pointer for details
+    }
+
+inline int Likelihood::createInstance(unsigned s, unsigned num_internal_buffers, long preference_flags, long requirement_flags)
+    {
+    BeagleInstanceDetails instance_details;
+    int instance = newInstance(s, num_internal_buffers, preference_flags, requirement_flags, instance_details);
+    if (instance < 0)
+        {
+        // beagleCreateInstance returns one of the following:
+        //   valid instance (0, 1, 2, ...)
+        //   error code (negative integer)
+        throw XStrom(boost::str(boost::format("Likelihood init function failed to create BeagleLib instance (BeagleLib error code was %d: %s)") % instance % _beagle_error[instance]));
+        }
+
+    setTipStates(s, instance);
+    setPatternWeights(s, instance);
+    return instance;
+    }
+
+inline bool Likelihood::hasInstances() const
+    {
+    return (!_subsets.empty() && _subsets[0].instance >= 0);
+    }
+
+inline void Likelihood::finalizeInstances()
+    {
+    // Finalizes the instances of every subset, reporting the first failure
+    // only after all have been attempted
+    std::string msg;
+    for (unsigned s = 0; s < _subsets.size(); ++s)
+        {
+        try
+            {
+            finalizeInstance(s);
+            }
+        catch (XStrom & x)
+            {
+            if (msg.empty())
+                msg = x.what();
+            }
+        }
+    for (auto & batch : _batch_instances)
+        {
+        int code = beagleFinalizeInstance(batch.instance);
+        if (code != 0 && msg.empty())
+            msg = boost::str(boost::format("Likelihood failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]);
+        }
+    _batch_instances.clear();
+    for (auto & opt : _edge_instances)
+        {
+        int code = beagleFinalizeInstance(opt.instance);
+        if (code != 0 && msg.empty())
+            msg = boost::str(boost::format("Likelihood failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]);
+        }
+    _edge_instances.clear();
+    if (!msg.empty())
+        throw XStrom(msg);
+    }
+
+inline void Likelihood::finalizeInstance(unsigned s)
+    {
+    // Finalizes both the working instance and, if one exists, the double-precision reference instance
+    Subset & sub = _subsets[s];
+    int code = 0;
+    if (sub.instance >= 0)
+        code = beagleFinalizeInstance(sub.instance);
+    if (sub.reference_instance >= 0)
+        {
+        int ref_code = beagleFinalizeInstance(sub.reference_instance);
+        if (code == 0)
+            code = ref_code;
+        }
+    sub.instance = -1;
+    sub.reference_instance = -1;
+    sub.uploaded_instance = -1;
+    sub.cached_instance = -1;
+    sub.valid = false;
+    if (code != 0)
+        throw XStrom(boost::str(boost::format("Likelihood failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]));
+    }
+
+inline void Likelihood::useSinglePrecision(bool single, double tolerance, unsigned check_freq)
+    {
+    // In single precision mode, every check_freq-th log-likelihood (and any that is not
+    // finite) is recomputed using a double-precision reference instance. The first time
+    // the two differ by more than tolerance log units, that subset reverts to double precision.
+    if (hasInstances())
+        throw XStrom("useSinglePrecision must be called before the first likelihood calculation");
+    _single_precision       = single;
+    _precision_tolerance    = tolerance;
+    _precision_check_freq   = (check_freq > 0 ? check_freq : 1);
+    }
+
+inline bool Likelihood::isSinglePrecision() const
+    {
+    // True if any subset is still being computed in single precision
+    if (_subsets.empty())
+        return _single_precision;
+    for (auto & sub : _subsets)
+        if (sub.single_precision)
+            return true;
+    return false;
+    }
+
+inline void Likelihood::setScalingPolicy(scaling_policy_t policy, unsigned interval, unsigned check_freq, double tolerance)
+    {
+    // ScaleAlways rescales the partials of every internal node in every evaluation.
+    // ScaleEveryKLevels rescales only internal nodes whose height above the tips is a
+    // multiple of interval. ScaleDynamic recomputes scale factors only when needed,
+    // otherwise dividing partials by the factors cached at the last rescaling.
+    // Every check_freq-th evaluation using a policy other than ScaleAlways is compared
+    // with a fully rescaled calculation, and the policy of that subset reverts to
+    // ScaleAlways if the two log-likelihoods differ by more than tolerance.
+    if (interval < 1)
+        throw XStrom("scaling interval must be a positive integer greater than 0");
+    _requested_scaling_policy   = policy;
+    _scaling_interval           = interval;
+    _scaling_check_freq         = (check_freq > 0 ? check_freq : 1);
+    _scaling_tolerance          = tolerance;
+    for (auto & sub : _subsets)
+        {
+        sub.scaling_policy          = policy;
+        sub.scalers_cached          = false;
+        sub.num_scaled_evaluations  = 0;
+        sub.num_rescales            = 0;
+        }
+    }
+
+inline void Likelihood::saveState(Checkpoint & checkpoint)
+    {
+    // Saves the precision and scaling policy each subset has adapted to, and the counts of
+    // evaluations that decide when they are next checked. Partials, scale factors and
+    // log-likelihoods saved from earlier evaluations are then forgotten, as they are by
+    // restoreState, so that a run continues from here exactly as one resumed from checkpoint.
+    checkpoint.write((unsigned)_subsets.size());
+    for (auto & sub : _subsets)
+        {
+        checkpoint.write(sub.single_precision);
+        checkpoint.write(sub.num_evaluations);
+        checkpoint.write((unsigned)sub.scaling_policy);
+        checkpoint.write(sub.num_scaled_evaluations);
+        checkpoint.write(sub.num_rescales);
+        }
+    discardCaches();
+    }
+
+inline void Likelihood::restoreState(Checkpoint & checkpoint)
+    {
+    // Must be called with the settings used when the checkpoint was saved
+    if (_using_data)
+        initBeagleLib(); // this is a no-op if valid instances already exist
+    unsigned nsubsets = 0;
+    checkpoint.read(nsubsets);
+    if (nsubsets != _subsets.size())
+        throw XStrom(boost::str(boost::format("checkpoint has likelihood settings for %d partition subsets but there are %d") % nsubsets % _subsets.size()));
+    for (unsigned s = 0; s < nsubsets; ++s)
+        {
+        Subset & sub = _subsets[s];
+        bool single_precision = false;
+        unsigned scaling_policy = 0;
+        checkpoint.read(single_precision);
+        checkpoint.read(sub.num_evaluations);
+        checkpoint.read(scaling_policy);
+        checkpoint.read(sub.num_scaled_evaluations);
+        checkpoint.read(sub.num_rescales);
+        if (single_precision && !sub.single_precision)
+            throw XStrom("checkpoint was saved using single precision (were the same options used?)");
+        if (sub.single_precision && !single_precision)
+            switchToDoublePrecision(s);
+        if (scaling_policy > ScaleDynamic)
+            throw XStrom("checkpoint has an unknown scaling policy");
+        sub.scaling_policy = (scaling_policy_t)scaling_policy;
+        }
+    discardCaches();
+    }
+
+inline void Likelihood::discardCaches()
+    {
+    // Forgets partials, scale factors and log-likelihoods saved from earlier evaluations,
+    // so that the next evaluation of each subset rescales partials at every node
+    for (unsigned s = 0; s < _subsets.size(); ++s)
+        {
+        Subset & sub = _subsets[s];
+        sub.valid = false;
+        sub.tree_signature.clear();
+        sub.scalers_cached = false;
+        if (sub.instance >= 0)
+            initPartialsCache(s);
+        }
+    }
+
+inline std::string Likelihood::describeScaling() const
+    {
+    std::string s;
+    if (_requested_scaling_policy == ScaleAlways)
+        s = "Scaling policy: rescale at every internal node";
+    else if (_requested_scaling_policy == ScaleEveryKLevels)
+        s = boost::str(boost::format("Scaling policy: rescale every %d levels above the tips") % _scaling_interval);
+    else
+        s = "Scaling policy: dynamic (reuse cached scale factors until underflow)";
+    if (_requested_scaling_policy != ScaleAlways)
+        s += boost::str(boost::format("\n  checked against full rescaling every %d evaluations (tolerance %g)") % _scaling_check_freq % _scaling_tolerance);
+
+    unsigned num_scaled_evaluations = 0;
+    unsigned num_rescales = 0;
+    std::vector<std::string> reverted;
+    for (unsigned i = 0; i < _subsets.size(); ++i)
+        {
+        num_scaled_evaluations += _subsets[i].num_scaled_evaluations;
+        num_rescales += _subsets[i].num_rescales;
+        if (_subsets[i].scaling_policy != _requested_scaling_policy)
+            reverted.push_back(_data->getSubsetName(i));
+        }
+    if (num_scaled_evaluations > 0)
+        s += boost::str(boost::format("\n  %d evaluations, %d full rescalings") % num_scaled_evaluations % num_rescales);
+    if (!reverted.empty() && _subsets.size() > 1)
+        s += boost::str(boost::format("\n  subsets %s reverted to rescaling at every internal node because the tolerance was exceeded") % boost::algorithm::join(reverted, ", "));
+    else if (!reverted.empty())
+        s += "\n  reverted to rescaling at every internal node because the tolerance was exceeded";
+    return s;
+    }
+
+inline long Likelihood::precisionFlags(long requirement_flags) const
+    {
+    requirement_flags &= ~(BEAGLE_FLAG_PRECISION_SINGLE | BEAGLE_FLAG_PRECISION_DOUBLE);
+    return requirement_flags | (_single_precision ? BEAGLE_FLAG_PRECISION_SINGLE : BEAGLE_FLAG_PRECISION_DOUBLE);
+    }
+
+inline void Likelihood::initSubsets()
+    {
+    // Sets up one Subset for each subset of the data partition, deciding
+    // which taxa need tip partials in each
+    assert(_data);
+    unsigned nsubsets = _data->getNumSubsets();
+    if (_models.size() != nsubsets)
+        throw XStrom(boost::str(boost::format("data partition has %d subsets but %d models were supplied") % nsubsets % _models.size()));
+
+    const Data::data_matrix_t & data_matrix = _data->getDataMatrix();
+    _subsets.resize(nsubsets);
+    std::vector<int> v;
+    for (unsigned s = 0; s < nsubsets; ++s)
+        {
+        Subset & sub = _subsets[s];
+        sub.model                   = _models[s];
+        sub.instance                = -1;
+        sub.reference_instance      = -1;
+        sub.uploaded_instance       = -1;
+        sub.uploaded_version        = 0;
+        sub.cached_instance         = -1;
+        sub.cached_model_version    = 0;
+        sub.first_pattern           = _data->getSubsetBegin(s);
+        sub.npatterns               = _data->getSubsetNumPatterns(s);
+        sub.single_precision        = _single_precision;
+        sub.num_evaluations         = 0;
+        sub.scaling_policy          = _requested_scaling_policy;
+        sub.scalers_cached          = false;
+        sub.num_scaled_evaluations  = 0;
+        sub.num_rescales            = 0;
+        sub.valid                   = false;
+        sub.log_likelihood          = 0.0;
+        sub.tree_signature.clear();
+        sub.model_version           = 0;
+
+        // Taxa with partial ambiguities (e.g. R or Y) in this subset need tip partials;
+        // all others can use compact tip states (in which state 4 means completely missing)
+        sub.tip_partials.assign(_ntaxa, false);
+        sub.num_tip_partials = 0;
+        for (unsigned i = 0; i < _ntaxa; ++i)
+            {
+            if (!data_matrix.hasStateAbove(i, StateMatrix::_missing_nucleotide))
+                continue;
+            data_matrix.copyRow(i, v);
+            for (unsigned k = sub.first_pattern; k < sub.first_pattern + sub.npatterns; ++k)
+                {
+                if ((unsigned)v[k] > StateMatrix::_missing_nucleotide)
+                    {
+                    sub.tip_partials[i] = true;
+                    ++sub.num_tip_partials;
+                    break;
+                    }
+                }
+            }
+        }
+    }
+
 inline void Likelihood::initBeagleLib()
     {
-    // a non-operation ("no-op") if a valid instance has already been created
-    if (_instance >= 0)
+    // a non-operation ("no-op") if valid instances have already been created
+    if (hasInstances())
         return;
 
     assert(_data);
@@ -174,81 +744,284 @@ inline void Likelihood::initBeagleLib()
     _npatterns  = _data->getNumPatterns();
     _nstates    = 4;
     _rooted     = false;
-    _prefer_gpu = false;
+    initSubsets();
 
     std::cout << "Sequence length:    " << _data->getSeqLen() << std::endl;
     std::cout << "Number of taxa:     " << _ntaxa << std::endl;
     std::cout << "Number of patterns: " << _npatterns << std::endl;
+    unsigned num_tip_partials = 0;
+    for (unsigned s = 0; s < _subsets.size(); ++s)
+        {
+        if (_subsets.size() > 1)
+            std::cout << boost::str(boost::format("  subset %s: %d sites, %d patterns") % _data->getSubsetName(s) % _data->getSubsetNumSites(s) % _subsets[s].npatterns) << std::endl;
+        num_tip_partials = std::max(num_tip_partials, _subsets[s].num_tip_partials);
+        }
+    if (num_tip_partials > 0)
+        std::cout << "Taxa with partial ambiguities: " << num_tip_partials << std::endl;
+    std::cout << "Constant patterns:  " << _data->getNumConstantPatterns() << std::endl;
 
-    unsigned num_internals        = (_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
-    unsigned num_transition_probs = (_rooted ? (2*_ntaxa - 2) : (2*_ntaxa - 3));
-
+    long preferenceFlags  = 0;
     long requirementFlags = 0;
-    requirementFlags |= BEAGLE_FLAG_PRECISION_DOUBLE;
+    getInstanceFlags(preferenceFlags, requirementFlags);
+
+    // Instances have room for the partials of two trees (see defineCachedOperations)
+    unsigned num_internals = (_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
+    for (unsigned s = 0; s < _subsets.size(); ++s)
+        {
+        Subset & sub = _subsets[s];
+
+        // Create the double-precision instance used to check single-precision results
+        if (_single_precision)
+            sub.reference_instance = createInstance(s, 2*num_internals, preferenceFlags, (requirementFlags & ~BEAGLE_FLAG_PRECISION_SINGLE) | BEAGLE_FLAG_PRECISION_DOUBLE);
+
+        sub.instance = createInstance(s, 2*num_internals, preferenceFlags, precisionFlags(requirementFlags));
+        initPartialsCache(s);
+
+        // A new instance has no scale factors that could be reused
+        sub.scalers_cached = false;
+        sub.valid = false;
+        }
+
+    //std::cout << boost::str(boost::format("BeagleLib instances (%d) created.") % _subsets.size()) << std::endl;
+    }
 
-    long preferenceFlags = 0;
+inline void Likelihood::getInstanceFlags(long & preference_flags, long & requirement_flags) const
+    {
+    preference_flags  = _preference_flags;
+    requirement_flags = precisionFlags(_requirement_flags);
     if (_prefer_gpu)
-        preferenceFlags |= BEAGLE_FLAG_PROCESSOR_GPU;
-    else
-        preferenceFlags |= BEAGLE_FLAG_PROCESSOR_CPU;
+        {
+        preference_flags &= ~BEAGLE_FLAG_PROCESSOR_CPU;
+        preference_flags |= BEAGLE_FLAG_PROCESSOR_GPU;
+        }
 
-    requirementFlags |= BEAGLE_FLAG_SCALING_MANUAL;
+    // Use flags chosen by tuneBeagleLib if tuning has been done for data of this shape
+    tuned_flags_map_t::const_iterator it = _tuned_flags.find(getDatasetShape());
+    if (it != _tuned_flags.end())
+        {
+        preference_flags  = it->second.first;
+        requirement_flags = it->second.second;
+        }
+    }
 
-    BeagleInstanceDetails instance_details;
-    _instance = beagleCreateInstance(
-         _ntaxa,                    // tips
-         num_internals,             // partials
-         _ntaxa,                    // sequences
-         _nstates,                  // states
-         _npatterns,                // patterns
-         1,                         // models
-         num_transition_probs,      // transition matrices
-         _model->_num_categ,        // rate categories
-         num_internals + 1,         // scale buffers
-         NULL,                      // resource restrictions
-         0,                         // length of resource list
-         preferenceFlags,           // preferred flags
-         requirementFlags,          // required flags
-         &instance_details);        // pointer for details
+inline void Likelihood::tuneBeagleLib(typename Tree::SharedPtr t, unsigned nreps)
+    {
+    // Times nreps log-likelihood calculations on tree t using each combination of CPU
+    // vectorization and threading flags, and remembers the fastest combination for all
+    // Likelihood objects handling data of the same shape. Combinations that BeagleLib
+    // cannot provide on this machine are skipped.
+    if (!_using_data)
+        return;
+    if (!_data)
+        throw XStrom("must call setData before tuneBeagleLib");
 
-    if (_instance < 0)
+    initBeagleLib();    // sets _ntaxa, _npatterns, _nstates and _subsets
+    std::string shape = getDatasetShape();
+    tuned_flags_map_t::iterator it = _tuned_flags.find(shape);
+    if (it != _tuned_flags.end())
         {
-        // beagleCreateInstance returns one of the following:
-        //   valid instance (0, 1, 2, ...)
-        //   error code (negative integer)
-        throw XStrom(boost::str(boost::format("Likelihood init function failed to create Likelihood instance (BeagleLib error code was %d)") % _beagle_error[_instance]));
+        std::cout << boost::str(boost::format("Using BeagleLib flags previously tuned for data with %s: %s") % shape % flagsAsString(it->second.first | it->second.second)) << std::endl;
+        return;
+        }
+    finalizeInstances();
+
+    std::vector<long> vector_flags    = {BEAGLE_FLAG_VECTOR_NONE, BEAGLE_FLAG_VECTOR_SSE, BEAGLE_FLAG_VECTOR_AVX};
+    std::vector<long> threading_flags = {BEAGLE_FLAG_THREADING_NONE, BEAGLE_FLAG_THREADING_CPP};
+
+    std::cout << boost::str(boost::format("\nTuning BeagleLib (%d likelihood calculations per configuration, %s):") % nreps % shape) << std::endl;
+    std::cout << boost::str(boost::format("%12s %12s %s") % "seconds" % "lnL" % "configuration") << std::endl;
+
+    double best_seconds = 0.0;
+    double reference_lnL = 0.0;
+    long best_preference_flags  = 0;
+    long best_requirement_flags = 0;
+    std::string best_details;
+    for (long vflag : vector_flags)
+        {
+        for (long tflag : threading_flags)
+            {
+            long preference_flags  = BEAGLE_FLAG_PROCESSOR_CPU;
+            long requirement_flags = precisionFlags(_requirement_flags) | BEAGLE_FLAG_PROCESSOR_CPU | vflag | tflag;
+
+            // Every subset needs an instance with these flags; no subtree partials are
+            // saved, so that every repetition recomputes all partials
+            BeagleInstanceDetails instance_details;
+            int failure = 0;
+            unsigned num_internals = (_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
+            for (unsigned s = 0; s < _subsets.size() && failure == 0; ++s)
+                {
+                int instance = newInstance(s, num_internals, preference_flags, requirement_flags, instance_details);
+                if (instance >= 0)
+                    {
+                    _subsets[s].instance = instance;
+                    _subsets[s].uploaded_instance = -1;
+                    _subsets[s].scalers_cached = false;
+                    setTipStates(s, instance);
+                    setPatternWeights(s, instance);
+                    }
+                else
+                    failure = instance;
+                }
+            if (failure != 0)
+                {
+                finalizeInstances();
+                std::cout << boost::str(boost::format("%12s %12s %s (%s)") % "---" % "---" % flagsAsString(requirement_flags) % _beagle_error[failure]) << std::endl;
+                continue;
+                }
+
+            double lnL = calcSubsetsLogLikelihood(t);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (unsigned rep = 0; rep < nreps; ++rep)
+                lnL = calcSubsetsLogLikelihood(t);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            finalizeInstances();
+
+            std::string details = boost::str(boost::format("%s on %s (resource %d): %s") % instance_details.implName % instance_details.resourceName % instance_details.resourceNumber % flagsAsString(instance_details.flags));
+            std::cout << boost::str(boost::format("%12.5f %12.5f %s") % elapsed.count() % lnL % details) << std::endl;
+
+            double tolerance = (_single_precision ? _precision_tolerance : 1.e-6*std::fabs(reference_lnL));
+            if (best_details.empty())
+                reference_lnL = lnL;
+            else if (std::fabs(lnL - reference_lnL) > tolerance)
+                throw XStrom(boost::str(boost::format("BeagleLib configuration (%s) gave log-likelihood %.5f but expecting %.5f") % details % lnL % reference_lnL));
+
+            if (best_details.empty() || elapsed.count() < best_seconds)
+                {
+                best_seconds            = elapsed.count();
+                best_preference_flags   = preference_flags;
+                best_requirement_flags  = requirement_flags;
+                best_details            = details;
+                }
+            }
         }
 
-    setTipStates();
-    setPatternWeights();
+    if (best_details.empty())
+        throw XStrom("no BeagleLib CPU configuration could be created during tuning");
+
+    std::cout << boost::str(boost::format("Fastest BeagleLib configuration: %s\n") % best_details) << std::endl;
+    _tuned_flags[shape] = std::make_pair(best_preference_flags, best_requirement_flags);
+
+    initBeagleLib();
+    }
+
+inline std::string Likelihood::getHostName()
+    {
+    char host_name[256] = {0};
+    if (gethostname(host_name, sizeof(host_name) - 1) != 0)
+        return "unknown";
+    return host_name;
+    }
 
-    //std::cout << boost::str(boost::format("BeagleLib instance (%d) created.") % _instance) << std::endl;
+inline void Likelihood::readTunedFlags(const std::string file_name)
+    {
+    // Adds the BeagleLib flags saved by writeTunedFlags for this machine to those already
+    // tuned, so that tuneBeagleLib does not repeat the benchmark for data of the same shape.
+    // Each line holds the host name, preference and requirement flags, then the data shape.
+    std::ifstream inf(file_name.c_str());
+    if (!inf.is_open())
+        return;
+    std::string host_name = getHostName();
+    std::string line;
+    while (std::getline(inf, line))
+        {
+        std::istringstream iss(line);
+        std::string host;
+        long preference_flags  = 0;
+        long requirement_flags = 0;
+        std::string shape;
+        if (!(iss >> host >> preference_flags >> requirement_flags))
+            continue;
+        std::getline(iss >> std::ws, shape);
+        if (host == host_name && !shape.empty() && _tuned_flags.find(shape) == _tuned_flags.end())
+            _tuned_flags[shape] = std::make_pair(preference_flags, requirement_flags);
+        }
     }
 
-inline void Likelihood::setTipStates()
+inline void Likelihood::writeTunedFlags(const std::string file_name)
+    {
+    // Saves the tuned flags, keeping those saved earlier for other machines. Written to a
+    // temporary file and renamed so that an interrupted run never leaves a truncated file.
+    std::string host_name = getHostName();
+    std::vector<std::string> other_hosts;
+    std::ifstream inf(file_name.c_str());
+    std::string line;
+    while (std::getline(inf, line))
+        {
+        std::istringstream iss(line);
+        std::string host;
+        if (iss >> host && host != host_name)
+            other_hosts.push_back(line);
+        }
+    inf.close();
+
+    std::string tmp_file_name = file_name + ".tmp";
+    std::ofstream outf(tmp_file_name.c_str());
+    if (!outf.is_open())
+        {
+        std::cerr << boost::str(boost::format("Warning: could not save tuned BeagleLib flags in \"%s\"") % file_name) << std::endl;
+        return;
+        }
+    for (auto & other : other_hosts)
+        outf << other << "\n";
+    for (auto & tuned : _tuned_flags)
+        outf << boost::str(boost::format("%s %d %d %s") % host_name % tuned.second.first % tuned.second.second % tuned.first) << "\n";
+    outf.close();
+    if (!outf || std::rename(tmp_file_name.c_str(), file_name.c_str()) != 0)
+        {
+        std::remove(tmp_file_name.c_str());
+        std::cerr << boost::str(boost::format("Warning: could not save tuned BeagleLib flags in \"%s\"") % file_name) << std::endl;
+        }
+    }
+
+inline void Likelihood::setTipStates(unsigned s, int instance)
     {
     assert(_data);
+    Subset & sub = _subsets[s];
 
     const Data::data_matrix_t & data_matrix = _data->getDataMatrix();
-    unsigned i = 0;
 
-    typedef const std::vector<int> & ref_int_vect_t;
-    for (ref_int_vect_t v : data_matrix)
+    // States are stored packed, so unpack one taxon at a time into the
+    // int vector that BeagleLib expects, keeping only the patterns of subset s
+    std::vector<int> row;
+    std::vector<double> partials;
+    for (unsigned i = 0; i < data_matrix.getNumRows(); ++i)
         {
-        int code = beagleSetTipStates(
-            _instance,      // Instance number
-            i,              // Index of destination compactBuffer
-            &v[0]);         // Pointer to compact states vector
+        data_matrix.copyRow(i, row);
+        std::vector<int> v(row.begin() + sub.first_pattern, row.begin() + sub.first_pattern + sub.npatterns);
+        int code = 0;
+        if (sub.tip_partials[i])
+            {
+            // Partial ambiguities: each pattern gets a partial of 1 for every
+            // nucleotide consistent with the observed state and 0 otherwise
+            partials.assign(v.size()*_nstates, 0.0);
+            for (unsigned k = 0; k < v.size(); ++k)
+                {
+                unsigned mask = StateMatrix::nucleotideMask(v[k]);
+                for (unsigned j = 0; j < _nstates; ++j)
+                    partials[k*_nstates + j] = ((mask >> j) & 1 ? 1.0 : 0.0);
+                }
+            code = beagleSetTipPartials(
+                instance,       // Instance number
+                i,              // Index of destination partialsBuffer
+                &partials[0]);  // Pointer to partials vector
+            }
+        else
+            {
+            code = beagleSetTipStates(
+                instance,       // Instance number
+                i,              // Index of destination compactBuffer
+                &v[0]);         // Pointer to compact states vector
+            }
 
         if (code != 0)
             throw XStrom(boost::str(boost::format("failed to set tip state for taxon %d (\"%s\"; BeagleLib error code was %d)") % (i+1) % _data->getTaxonNames()[i] % code % _beagle_error[code]));
-        ++i;
         }
     }
 
-inline void Likelihood::setPatternWeights()
+inline void Likelihood::setPatternWeights(unsigned s, int instance)
     {
     assert(_data);
+    Subset & sub = _subsets[s];
 
     int code = 0;
     const Data::pattern_counts_t & v = _data->getPatternCounts();
@@ -256,48 +1029,58 @@ inline void Likelihood::setPatternWeights()
         throw XStrom(boost::str(boost::format("failed to set pattern weights because data matrix has empty pattern count vector") % code));
 
     code = beagleSetPatternWeights(
-       _instance,     // instance number
-       &v[0]);        // vector of pattern counts
+       instance,                    // instance number
+       &v[sub.first_pattern]);      // vector of pattern counts
 
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to set pattern weights. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
     }
 
-inline void Likelihood::setDiscreteGammaShape()
+inline void Likelihood::setDiscreteGammaShape(unsigned s, int instance)
     {
-    int code = _model->setBeagleAmongSiteRateVariationRates(_instance);
+    Subset & sub = _subsets[s];
+    int code = sub.model->setBeagleAmongSiteRateVariationRates(instance);
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to set category rates. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
 
-    code = _model->setBeagleAmongSiteRateVariationProbs(_instance);
+    code = sub.model->setBeagleAmongSiteRateVariationProbs(instance);
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to set category probabilities. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
     }
 
-inline void Likelihood::setModelRateMatrix()
+inline void Likelihood::setModelRateMatrix(unsigned s, int instance, bool derivatives)
     {
-    int code = _model->setBeagleStateFrequencies(_instance);
+    // The eigen decomposition is not needed by models with closed-form transition
+    // probabilities (see updateTransitionMatrices) unless derivatives will be computed
+    Subset & sub = _subsets[s];
+    int code = sub.model->setBeagleStateFrequencies(instance);
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to set state frequencies. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
 
-    code = _model->setBeagleEigenDecomposition(_instance);
-    if (code != 0)
-        throw XStrom(boost::str(boost::format("failed to set eigen decomposition. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+    if (derivatives || !sub.model->hasClosedFormTransitions())
+        {
+        code = sub.model->setBeagleEigenDecomposition(instance);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to set eigen decomposition. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        }
 
-    code = _model->setBeagleAmongSiteRateVariationRates(_instance);
+    code = sub.model->setBeagleAmongSiteRateVariationRates(instance);
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to set among-site rate variation rates. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
 
-    code = _model->setBeagleAmongSiteRateVariationProbs(_instance);
+    code = sub.model->setBeagleAmongSiteRateVariationProbs(instance);
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to set among-site rate variation weights. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
     }
 
-inline void Likelihood::defineOperations(typename Tree::SharedPtr t)
+inline void Likelihood::defineOperations(unsigned s, typename Tree::SharedPtr t, scaling_policy_t scaling)
     {
-    _operations.clear();
-    _pmatrix_index.clear();
-    _edge_lengths.clear();
+    // Called concurrently for different subsets, so the tree is only read here
+    Subset & sub = _subsets[s];
+    sub.operations.clear();
+    sub.pmatrix_index.clear();
+    sub.edge_lengths.clear();
+    std::vector<unsigned> node_heights(t->_nodes.size(), 0);
 
     for (auto nd : boost::adaptors::reverse(t->_levelorder))
         {
@@ -305,88 +1088,308 @@ inline void Likelihood::defineOperations(typename Tree::SharedPtr t)
         if (!nd->_left_child)
             {
             // This is a leaf
-            _pmatrix_index.push_back(nd->_number);
-            _edge_lengths.push_back(nd->_edge_length);
+            sub.pmatrix_index.push_back(nd->_number);
+            sub.edge_lengths.push_back(nd->_edge_length);
             }
         else
             {
             // This is an internal node
-            _pmatrix_index.push_back(nd->_number);
-            _edge_lengths.push_back(nd->_edge_length);
+            sub.pmatrix_index.push_back(nd->_number);
+            sub.edge_lengths.push_back(nd->_edge_length);
 
             // Internal nodes have partials to be calculated, so define
             // an operation to compute the partials for this node
 
             // 1. destination partial to be calculated
             int partial = nd->_number;
-            _operations.push_back(partial);
+            sub.operations.push_back(partial);
 
-            // 2. destination scaling buffer index to write to
-            int scaler = nd->_number - _ntaxa + 1;
-            _operations.push_back(scaler);
+            // Height is the number of edges on the longest path to a tip
+            unsigned height = 0;
+            for (Node * child = nd->_left_child; child; child = child->_right_sib)
+                height = std::max(height, node_heights[child->_number] + 1);
+            node_heights[nd->_number] = height;
 
+            // 2. destination scaling buffer index to write to
             // 3. destination scaling buffer index to read from
-            _operations.push_back(BEAGLE_OP_NONE);
+            int scaler = nd->_number - _ntaxa + 1;
+            if (scaling == ScaleAlways || (scaling == ScaleEveryKLevels && height % _scaling_interval == 0))
+                {
+                sub.operations.push_back(scaler);
+                sub.operations.push_back(BEAGLE_OP_NONE);
+                }
+            else if (scaling == ScaleDynamic)
+                {
+                sub.operations.push_back(BEAGLE_OP_NONE);
+                sub.operations.push_back(scaler);
+                }
+            else
+                {
+                sub.operations.push_back(BEAGLE_OP_NONE);
+                sub.operations.push_back(BEAGLE_OP_NONE);
+                }
 
             // 4. left child partial index
             partial = nd->_left_child->_number;
-            _operations.push_back(partial);
+            sub.operations.push_back(partial);
 
             // 5. left child transition matrix index
             int tmatrix = nd->_left_child->_number;
-            _operations.push_back(tmatrix);
+            sub.operations.push_back(tmatrix);
 
             // 6. right child partial index
             assert(nd->_left_child);
             assert(nd->_left_child->_right_sib);
             partial = nd->_left_child->_right_sib->_number;
-            _operations.push_back(partial); // assumes binary tree
+            sub.operations.push_back(partial); // assumes binary tree
 
             // 7. right child transition matrix index
             tmatrix = nd->_left_child->_right_sib->_number;
-            _operations.push_back(tmatrix);
+            sub.operations.push_back(tmatrix);
         }
     }
 
     // if tree is unrooted and thus "rooted" at a leaf, need to
     // use the transition matrix associated with the leaf
     if (!t->_is_rooted)
-        _pmatrix_index[_pmatrix_index.size()-1] = t->_root->_number;
+        sub.pmatrix_index[sub.pmatrix_index.size()-1] = t->_root->_number;
     }
 
-inline void Likelihood::updateTransitionMatrices()
+inline int Likelihood::defineCachedOperations(unsigned s, typename Tree::SharedPtr t, scaling_policy_t scaling)
     {
-    int code = beagleUpdateTransitionMatrices(
-        _instance,                      // Instance number
-        0,                              // Index of eigen-decomposition buffer
-        &_pmatrix_index[0],             // transition probability matrices to update
-        NULL,                           // first derivative matrices to update
-        NULL,                           // second derivative matrices to update
-        &_edge_lengths[0],              // List of edge lengths
-        (int)_pmatrix_index.size());    // Length of lists
+    // Like defineOperations, but the partials of internal nodes are saved in the subtree
+    // cache of the subset, and operations are defined only for nodes whose partials are not
+    // already there. After a change to the tree (e.g. a pruned and regrafted subtree or a
+    // new edge length) only the partials on the paths from the changed edges to the root
+    // are recomputed, and only the edges below those nodes need new transition matrices;
+    // rejecting the change costs nothing, as the partials of the previous tree are still
+    // saved. Returns the partials buffer of the only child of the root. Called concurrently
+    // for different subsets, so the tree is only read here.
+    //
+    // Whether partials are rescaled depends on the scaling policy and, under ScaleDynamic,
+    // on the factors already in the scale buffer, so saved partials are identified by the
+    // partials they were computed from (the leaf number or, for an internal node, a number
+    // unique to each computation) and the edge lengths of the children rather than by the
+    // subtree alone. Under ScaleAlways, saved partials not rescaled when they were computed
+    // are recomputed, which gives new numbers to them and, in turn, to their ancestors.
+    Subset & sub = _subsets[s];
+    sub.operations.clear();
+    sub.pmatrix_index.clear();
+    sub.edge_lengths.clear();
+    sub.scalers.clear();
+    ++sub.cache.clock;
+
+    std::vector<int> buffer(t->_nodes.size(), 0);
+    std::vector<std::size_t> contents(t->_nodes.size(), 0);
+    std::vector<unsigned> node_heights(t->_nodes.size(), 0);
+    for (auto nd : boost::adaptors::reverse(t->_levelorder))
+        {
+        if (!nd->_left_child)
+            {
+            // Leaves use their own (tip) buffers
+            buffer[nd->_number] = nd->_number;
+            contents[nd->_number] = nd->_number;
+            continue;
+            }
+
+        Node * lchild = nd->_left_child;
+        Node * rchild = lchild->_right_sib;
+        assert(rchild && !rchild->_right_sib);
+        subtree_key_t key = makeSubtreeKey(contents[lchild->_number], lchild->_edge_length, contents[rchild->_number], rchild->_edge_length);
+        unsigned height = std::max(node_heights[lchild->_number], node_heights[rchild->_number]) + 1;
+        node_heights[nd->_number] = height;
+
+        bool found = false;
+        unsigned k = findSubtreeBuffer(sub.cache, key, found);
+        if (!found || (scaling == ScaleAlways && !sub.buffer_rescaled[k]))
+            {
+            // Under ScaleDynamic, partials are divided by the factors left in the scale
+            // buffer by the last partials rescaled in this buffer, if there were any
+            int scale_write = BEAGLE_OP_NONE;
+            int scale_read = BEAGLE_OP_NONE;
+            if (scaling == ScaleAlways || (scaling == ScaleEveryKLevels && height % _scaling_interval == 0))
+                {
+                scale_write = k + 1;
+                sub.buffer_factors[k] = true;
+                sub.buffer_rescaled[k] = true;
+                }
+            else
+                {
+                if (scaling == ScaleDynamic && sub.buffer_factors[k])
+                    scale_read = k + 1;
+                else
+                    sub.buffer_factors[k] = false;
+                sub.buffer_rescaled[k] = false;
+                }
+            sub.cache.buffer_contents[k] = sub.cache.next_contents++;
+
+            sub.operations.push_back(_ntaxa + k);                   // destination partial
+            sub.operations.push_back(scale_write);                  // scaling buffer to write to
+            sub.operations.push_back(scale_read);                   // scaling buffer to read from
+            sub.operations.push_back(buffer[lchild->_number]);      // left child partial
+            sub.operations.push_back(lchild->_number);              // left child transition matrix
+            sub.operations.push_back(buffer[rchild->_number]);      // right child partial
+            sub.operations.push_back(rchild->_number);              // right child transition matrix
+
+            sub.pmatrix_index.push_back(lchild->_number);
+            sub.edge_lengths.push_back(lchild->_edge_length);
+            sub.pmatrix_index.push_back(rchild->_number);
+            sub.edge_lengths.push_back(rchild->_edge_length);
+            }
+        buffer[nd->_number] = _ntaxa + k;
+        contents[nd->_number] = sub.cache.buffer_contents[k];
+        if (sub.buffer_factors[k])
+            sub.scalers.push_back(k + 1);
+        }
+
+    // The edge from the root (leaf 0) to its only child
+    sub.pmatrix_index.push_back(t->_root->_number);
+    sub.edge_lengths.push_back(t->_preorder[0]->_edge_length);
+    return buffer[t->_preorder[0]->_number];
+    }
+
+inline void Likelihood::updateTransitionMatrices(unsigned s, int instance, const std::vector<int> & pmatrix_index, const std::vector<double> & edge_lengths)
+    {
+    // Special cases of GTR supply their transition probabilities in closed form, which
+    // avoids the eigen decomposition and the matrix products BeagleLib would otherwise do
+    Subset & sub = _subsets[s];
+    int code = 0;
+    if (sub.model->hasClosedFormTransitions())
+        {
+        std::vector<double> matrices;
+        sub.model->calcBeagleTransitionMatrices(edge_lengths, matrices);
+        std::vector<double> padded_values(pmatrix_index.size(), 1.0);
+        code = beagleSetTransitionMatrices(
+            instance,                   // Instance number
+            &pmatrix_index[0],          // transition probability matrices to set
+            &matrices[0],               // matrices (categories x states x states for each)
+            &padded_values[0],          // value used for ambiguous states
+            (int)pmatrix_index.size()); // Length of lists
+        }
+    else
+        {
+        code = beagleUpdateTransitionMatrices(
+            instance,                   // Instance number
+            0,                          // Index of eigen-decomposition buffer
+            &pmatrix_index[0],          // transition probability matrices to update
+            NULL,                       // first derivative matrices to update
+            NULL,                       // second derivative matrices to update
+            &edge_lengths[0],           // List of edge lengths
+            (int)pmatrix_index.size()); // Length of lists
+        }
 
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to update transition matrices. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
     }
 
-inline void Likelihood::calculatePartials()
+inline void Likelihood::calculatePartials(unsigned s, scaling_policy_t scaling)
     {
-    int code = beagleResetScaleFactors(_instance, 0);
-    if (code != 0)
-        throw XStrom(boost::str(boost::format("failed to reset scale factors in calculatePartials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+    // When reusing cached scale factors (ScaleDynamic) no scale buffer is written, and
+    // scale buffer 0 still holds the factors accumulated at the last rescaling
+    Subset & sub = _subsets[s];
+    int code = 0;
+    int cumulative_scaler = BEAGLE_OP_NONE;
+    if (scaling != ScaleDynamic)
+        {
+        code = beagleResetScaleFactors(sub.instance, 0);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to reset scale factors in calculatePartials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        cumulative_scaler = 0;
+        }
 
     // Calculate or queue for calculation partials using a list of operations
-    int totalOperations = (int)(_operations.size()/7);
+    int totalOperations = (int)(sub.operations.size()/7);
     code = beagleUpdatePartials(
-        _instance,                              // Instance number
-        (BeagleOperation *) &_operations[0],    // BeagleOperation list specifying operations
-        totalOperations,                        // Number of operations
-        0);                                     // Index number of scaleBuffer to store accumulated factors
+        sub.instance,                               // Instance number
+        (BeagleOperation *) &sub.operations[0],     // BeagleOperation list specifying operations
+        totalOperations,                            // Number of operations
+        cumulative_scaler);                         // Index number of scaleBuffer to store accumulated factors
 
     if (code != 0)
         throw XStrom(boost::str(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
     }
 
+inline void Likelihood::calculateCachedPartials(unsigned s)
+    {
+    // Computes the partials for the operations defined by defineCachedOperations and
+    // accumulates in scale buffer 0 the factors of every buffer used by the tree
+    // (including those saved earlier) whose partials were divided by them
+    Subset & sub = _subsets[s];
+    int code = 0;
+    if (!sub.operations.empty())
+        {
+        code = beagleUpdatePartials(sub.instance, (BeagleOperation *) &sub.operations[0], (int)(sub.operations.size()/7), BEAGLE_OP_NONE);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        }
+
+    code = beagleResetScaleFactors(sub.instance, 0);
+    if (code == 0 && !sub.scalers.empty())
+        code = beagleAccumulateScaleFactors(sub.instance, &sub.scalers[0], (int)sub.scalers.size(), 0);
+    if (code != 0)
+        throw XStrom(boost::str(boost::format("failed to accumulate scale factors. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+    }
+
+inline double Likelihood::addInvariableSites(unsigned s, int instance, std::vector<double> & site_log_likelihoods, double log_likelihood)
+    {
+    // BeagleLib supplies log_likelihood = sum_i w_i log L_i, where L_i is the likelihood of
+    // pattern i given that it evolves at a variable rate. Under +I the likelihood of a
+    // variable pattern is (1 - pinvar) L_i, while a constant pattern also gets a closed-form
+    // contribution pinvar sum_s pi_s (s ranging over the nucleotides it could be constant
+    // for) that needs no partials; only constant patterns need their site values.
+    Subset & sub = _subsets[s];
+    const Data::pattern_counts_t & counts = _data->getPatternCounts();
+    const Data::constant_masks_t & masks = _data->getConstantMasks();
+    double pinvar = sub.model->_pinvar;
+    double log_variable = std::log(1.0 - pinvar);
+
+    site_log_likelihoods.resize(sub.npatterns);
+    int code = beagleGetSiteLogLikelihoods(instance, &site_log_likelihoods[0]);
+    if (code != 0)
+        throw XStrom(boost::str(boost::format("failed to get site log-likelihoods. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+    double total_weight = 0.0;
+    double adjustment = 0.0;
+    for (unsigned k = 0; k < sub.npatterns; ++k)
+        {
+        unsigned i = sub.first_pattern + k;
+        total_weight += counts[i];
+        if (masks[i] == 0)
+            continue;
+
+        double invariable = 0.0;
+        for (unsigned j = 0; j < 4; ++j)
+            if ((masks[i] >> j) & 1)
+                invariable += sub.model->_state_freqs[j];
+
+        // log((1 - pinvar) L_i + pinvar*invariable) - log((1 - pinvar) L_i), computed
+        // without exponentiating the (possibly very small) site log-likelihood
+        double log_site_variable = log_variable + site_log_likelihoods[k];
+        double log_invariable = std::log(pinvar*invariable);
+        double hi = std::max(log_site_variable, log_invariable);
+        double lo = std::min(log_site_variable, log_invariable);
+        double log_site = hi + std::log1p(std::exp(lo - hi));
+        adjustment += counts[i]*(log_site - log_site_variable);
+        }
+
+    return log_likelihood + total_weight*log_variable + adjustment;
+    }
+
+inline void Likelihood::calcTreeSignature(typename Tree::SharedPtr t, std::vector<double> & signature)
+    {
+    // Number, parent number (-1 for the root) and edge length of each node of t in
+    // preorder, used to recognize a tree whose log-likelihood has already been computed
+    // (compared exactly, so that a different tree is never mistaken for it)
+    signature.clear();
+    signature.reserve(3*t->_preorder.size());
+    for (auto nd : t->_preorder)
+        {
+        signature.push_back(nd->_number);
+        signature.push_back(nd->_parent ? nd->_parent->_number : -1);
+        signature.push_back(nd->_edge_length);
+        }
+    }
+
 inline double Likelihood::calcLogLikelihood(typename Tree::SharedPtr t)
     {
     if (!_using_data)
@@ -398,19 +1401,886 @@ inline double Likelihood::calcLogLikelihood(typename Tree::SharedPtr t)
     if (!_data)
         throw XStrom("must call setData before calcLogLikelihood");
 
-    initBeagleLib(); // this is a no-op if a valid instance already exists
+    initBeagleLib(); // this is a no-op if valid instances already exist
+
+    // Only subsets whose model has changed since their log-likelihood was last
+    // computed need to be recomputed, unless the tree has changed too
+    std::vector<double> signature;
+    calcTreeSignature(t, signature);
+    std::vector<unsigned> stale;
+    for (unsigned s = 0; s < _subsets.size(); ++s)
+        {
+        Subset & sub = _subsets[s];
+        if (!sub.valid || sub.tree_signature != signature || sub.model_version != sub.model->_version)
+            stale.push_back(s);
+        }
+
+    if (_thread_pool)
+        _thread_pool->run((unsigned)stale.size(), [this, &stale, t](unsigned i) {calcSubsetLogLikelihood(stale[i], t);});
+    else
+        {
+        for (unsigned s : stale)
+            calcSubsetLogLikelihood(s, t);
+        }
+
+    double log_likelihood = 0.0;
+    for (auto & sub : _subsets)
+        {
+        sub.tree_signature = signature;
+        log_likelihood += sub.log_likelihood;
+        }
+    return log_likelihood;
+    }
+
+inline double Likelihood::calcSubsetsLogLikelihood(typename Tree::SharedPtr t)
+    {
+    // Recomputes the log-likelihood of every subset (ignoring any saved values)
+    if (_thread_pool)
+        _thread_pool->run((unsigned)_subsets.size(), [this, t](unsigned s) {calcSubsetLogLikelihood(s, t);});
+    else
+        {
+        for (unsigned s = 0; s < _subsets.size(); ++s)
+            calcSubsetLogLikelihood(s, t);
+        }
+
+    double log_likelihood = 0.0;
+    for (auto & sub : _subsets)
+        log_likelihood += sub.log_likelihood;
+    return log_likelihood;
+    }
+
+inline double Likelihood::calcSubsetLogLikelihood(unsigned s, typename Tree::SharedPtr t)
+    {
+    // Computes and saves the log-likelihood of subset s; runs concurrently with the
+    // calculations for other subsets, so touches only the data of subset s
+    Subset & sub = _subsets[s];
+    sub.model_version = sub.model->_version;
+    sub.valid = false;
+    double log_likelihood = calcInstanceLogLikelihood(s, t);
+    if (sub.single_precision)
+        log_likelihood = checkPrecision(s, t, log_likelihood);
+    sub.log_likelihood = log_likelihood;
+    sub.valid = true;
+    return log_likelihood;
+    }
+
+inline std::vector<double> Likelihood::calcLogLikelihoods(const std::vector<typename Tree::SharedPtr> & trees)
+    {
+    // Computes the log-likelihoods of many trees under the current model parameters.
+    // The model is sent to BeagleLib once, and the partials of a subtree computed for
+    // one tree are reused for later trees containing the same subtree (with the same
+    // edge lengths), so this is fastest if similar trees are adjacent in trees. Each
+    // subset, and (given enough threads) each contiguous block of trees, is handled
+    // by its own instance on the thread pool. Partials are rescaled at every node,
+    // in double precision, regardless of the scaling policy and precision settings.
+    std::vector<double> log_likelihoods(trees.size(), 0.0);
+    if (!_using_data || trees.empty())
+        return log_likelihoods;
+
+    for (auto t : trees)
+        {
+        if (t->_is_rooted)
+            throw XStrom("can only compute likelihoods for unrooted trees currently");
+        }
+
+    if (!_data)
+        throw XStrom("must call setData before calcLogLikelihoods");
+
+    initBeagleLib(); // this is a no-op if valid instances already exist
+
+    unsigned ntrees = (unsigned)trees.size();
+    unsigned nsubsets = (unsigned)_subsets.size();
+    unsigned nthreads = (_thread_pool ? _thread_pool->getNumThreads() : 1);
+    unsigned nchunks = std::min(std::max(nthreads/nsubsets, 1U), ntrees);
+    initBatchInstances(nchunks);
+
+    // Task i computes the log-likelihoods for subset i % nsubsets of block i / nsubsets of trees
+    std::vector< std::vector<double> > subset_log_likelihoods(nsubsets, std::vector<double>(ntrees, 0.0));
+    ThreadPool::task_t task = [this, &trees, &subset_log_likelihoods, nsubsets, nchunks, ntrees](unsigned i)
+        {
+        unsigned chunk = i/nsubsets;
+        BatchInstance & batch = _batch_instances[i];
+        calcBatchLogLikelihoods(batch, trees, chunk*ntrees/nchunks, (chunk + 1)*ntrees/nchunks, subset_log_likelihoods[batch.subset]);
+        };
+    if (_thread_pool)
+        _thread_pool->run(nchunks*nsubsets, task);
+    else
+        {
+        for (unsigned i = 0; i < nchunks*nsubsets; ++i)
+            task(i);
+        }
+
+    for (auto & v : subset_log_likelihoods)
+        for (unsigned i = 0; i < ntrees; ++i)
+            log_likelihoods[i] += v[i];
+    return log_likelihoods;
+    }
+
+inline void Likelihood::initBatchInstances(unsigned nchunks)
+    {
+    // Creates any batch instances still needed for nchunks blocks of trees and sends them
+    // the current model (discarding saved subtree partials if the model has changed).
+    // Done before any tasks run, as sending a model to BeagleLib modifies the Model.
+    unsigned nsubsets = (unsigned)_subsets.size();
+    unsigned num_internals = (_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
+    unsigned num_buffers = 2*num_internals;
+
+    long preference_flags  = 0;
+    long requirement_flags = 0;
+    getInstanceFlags(preference_flags, requirement_flags);
+    requirement_flags = (requirement_flags & ~BEAGLE_FLAG_PRECISION_SINGLE) | BEAGLE_FLAG_PRECISION_DOUBLE;
+
+    while (_batch_instances.size() < nchunks*nsubsets)
+        {
+        BatchInstance batch;
+        batch.subset = (unsigned)_batch_instances.size() % nsubsets;
+        batch.instance = createInstance(batch.subset, num_buffers, preference_flags, requirement_flags);
+        batch.uploaded = false;
+        batch.model_version = 0;
+        _batch_instances.push_back(batch);
+        }
+
+    for (auto & batch : _batch_instances)
+        {
+        Model::SharedPtr model = _subsets[batch.subset].model;
+        if (batch.uploaded && batch.model_version == model->_version)
+            continue;
+        setModelRateMatrix(batch.subset, batch.instance, false);
+        setDiscreteGammaShape(batch.subset, batch.instance);
+        batch.uploaded = true;
+        batch.model_version = model->_version;
+        resetSubtreeCache(batch.cache, num_buffers, _ntaxa);
+        }
+    }
+
+inline void Likelihood::calcBatchLogLikelihoods(BatchInstance & batch, const std::vector<typename Tree::SharedPtr> & trees, unsigned first, unsigned last, std::vector<double> & log_likelihoods)
+    {
+    // Stores in log_likelihoods[i] the log-likelihood for the subset of batch of
+    // trees[i], for i in [first, last); runs concurrently with other batch instances
+    std::vector<int> operations;
+    std::vector<int> pmatrix_index;
+    std::vector<double> edge_lengths;
+    std::vector<int> scalers;
+    std::vector<unsigned> buffer;
+    std::vector<std::size_t> contents;
+    for (unsigned i = first; i < last; ++i)
+        {
+        Tree::SharedPtr t = trees[i];
+
+        // Assuming "root" is leaf 0
+        assert(t->_root->_number == 0 && t->_root->_left_child == t->_preorder[0] && !t->_preorder[0]->_right_sib);
+
+        // Buffers last used for this tree may not be overwritten while it is processed
+        ++batch.cache.clock;
+        operations.clear();
+        pmatrix_index.clear();
+        edge_lengths.clear();
+        scalers.clear();
+        buffer.assign(t->_nodes.size(), 0);
+        contents.assign(t->_nodes.size(), 0);
+        for (auto nd : boost::adaptors::reverse(t->_levelorder))
+            {
+            if (!nd->_left_child)
+                {
+                // Leaves use their own (tip) buffers
+                buffer[nd->_number] = nd->_number;
+                contents[nd->_number] = nd->_number;
+                continue;
+                }
+
+            Node * lchild = nd->_left_child;
+            Node * rchild = lchild->_right_sib;
+            assert(rchild && !rchild->_right_sib);
+            subtree_key_t key = makeSubtreeKey(contents[lchild->_number], lchild->_edge_length, contents[rchild->_number], rchild->_edge_length);
+
+            bool found = false;
+            unsigned k = findSubtreeBuffer(batch.cache, key, found);
+            if (!found)
+                {
+                batch.cache.buffer_contents[k] = batch.cache.next_contents++;
+                operations.push_back(_ntaxa + k);                   // destination partial
+                operations.push_back(k + 1);                        // scaling buffer to write to
+                operations.push_back(BEAGLE_OP_NONE);               // scaling buffer to read from
+                operations.push_back(buffer[lchild->_number]);      // left child partial
+                operations.push_back(lchild->_number);              // left child transition matrix
+                operations.push_back(buffer[rchild->_number]);      // right child partial
+                operations.push_back(rchild->_number);              // right child transition matrix
+
+                pmatrix_index.push_back(lchild->_number);
+                edge_lengths.push_back(lchild->_edge_length);
+                pmatrix_index.push_back(rchild->_number);
+                edge_lengths.push_back(rchild->_edge_length);
+                }
+            buffer[nd->_number] = _ntaxa + k;
+            contents[nd->_number] = batch.cache.buffer_contents[k];
+            scalers.push_back(k + 1);
+            }
+
+        // The edge from the root (leaf 0) to its only child
+        int index_focal_child  = t->_root->_number;
+        int index_focal_parent = buffer[t->_preorder[0]->_number];
+        pmatrix_index.push_back(index_focal_child);
+        edge_lengths.push_back(t->_preorder[0]->_edge_length);
+
+        updateTransitionMatrices(batch.subset, batch.instance, pmatrix_index, edge_lengths);
+
+        int code = 0;
+        if (!operations.empty())
+            {
+            code = beagleUpdatePartials(batch.instance, (BeagleOperation *) &operations[0], (int)(operations.size()/7), BEAGLE_OP_NONE);
+            if (code != 0)
+                throw XStrom(boost::str(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+            }
+
+        // Scale factors of reused partials are still in their scale buffers
+        code = beagleResetScaleFactors(batch.instance, 0);
+        if (code == 0)
+            code = beagleAccumulateScaleFactors(batch.instance, &scalers[0], (int)scalers.size(), 0);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to accumulate scale factors. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+        int stateFrequencyIndex  = 0;
+        int categoryWeightsIndex = 0;
+        int cumulativeScalingIndex = 0;
+        double log_likelihood = 0.0;
+        code = beagleCalculateEdgeLogLikelihoods(batch.instance, &index_focal_parent, &index_focal_child, &index_focal_child, NULL, NULL,
+            &categoryWeightsIndex, &stateFrequencyIndex, &cumulativeScalingIndex, 1, &log_likelihood, NULL, NULL);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to calculate edge logLikelihoods in calcLogLikelihoods. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+        Model::SharedPtr model = _subsets[batch.subset].model;
+        if (model->_is_invar_model && model->_pinvar > 0.0)
+            log_likelihood = addInvariableSites(batch.subset, batch.instance, batch.site_log_likelihoods, log_likelihood);
+
+        log_likelihoods[i] = log_likelihood;
+        }
+    }
+
+inline void Likelihood::resetSubtreeCache(SubtreeCache & cache, unsigned num_buffers, unsigned ntaxa)
+    {
+    // Forgets the partials held by all num_buffers buffers of cache (partials computed
+    // from now on are numbered from ntaxa, as leaves 0, ..., ntaxa - 1 use their numbers)
+    cache.clock = 0;
+    cache.subtree_buffers.clear();
+    cache.buffer_subtrees.assign(num_buffers, subtree_key_t());
+    cache.buffer_last_used.assign(num_buffers, 0);
+    cache.buffer_contents.assign(num_buffers, 0);
+    cache.next_contents = ntaxa;
+    }
+
+inline Likelihood::subtree_key_t Likelihood::makeSubtreeKey(std::size_t left_contents, double left_edge_length, std::size_t right_contents, double right_edge_length)
+    {
+    // The key does not depend on the order of the children (assumes binary tree); as the
+    // numbers of the children's partials are never reused, partials with the same key
+    // are the same
+    if (std::make_pair(right_contents, right_edge_length) < std::make_pair(left_contents, left_edge_length))
+        return std::make_tuple(right_contents, right_edge_length, left_contents, left_edge_length);
+    return std::make_tuple(left_contents, left_edge_length, right_contents, right_edge_length);
+    }
+
+inline unsigned Likelihood::findSubtreeBuffer(SubtreeCache & cache, const subtree_key_t & key, bool & found)
+    {
+    // Returns the buffer holding the partials with the given key (setting found to true)
+    // or, if there is none, the least recently used buffer not yet used for the current
+    // tree (the clock is advanced for each tree), now assigned to those partials
+    unsigned k = 0;
+    std::map<subtree_key_t, unsigned>::iterator it = cache.subtree_buffers.find(key);
+    found = (it != cache.subtree_buffers.end());
+    if (found)
+        k = it->second;
+    else
+        {
+        for (unsigned j = 1; j < cache.buffer_last_used.size(); ++j)
+            {
+            if (cache.buffer_last_used[j] < cache.buffer_last_used[k])
+                k = j;
+            }
+        assert(cache.buffer_last_used[k] < cache.clock);
+        if (cache.buffer_last_used[k] > 0)
+            cache.subtree_buffers.erase(cache.buffer_subtrees[k]);
+        cache.subtree_buffers[key] = k;
+        cache.buffer_subtrees[k] = key;
+        }
+    cache.buffer_last_used[k] = cache.clock;
+    return k;
+    }
+
+inline void Likelihood::runTasks(unsigned ntasks, ThreadPool::task_t task)
+    {
+    // Runs task(0), ..., task(ntasks - 1) on the thread pool, if there is one
+    if (_thread_pool)
+        _thread_pool->run(ntasks, task);
+    else
+        {
+        for (unsigned i = 0; i < ntasks; ++i)
+            task(i);
+        }
+    }
+
+inline double Likelihood::optimizeEdgeLengths(typename Tree::SharedPtr t, double tolerance, unsigned max_sweeps)
+    {
+    // Maximizes the log-likelihood over the edge lengths of t (holding model parameters
+    // fixed) by Newton-Raphson on one edge at a time, visiting edges in preorder, for up to
+    // max_sweeps sweeps or until a sweep improves the log-likelihood by less than tolerance.
+    // Partials on both sides of each edge are kept current, so each edge is optimized
+    // given the lengths already chosen for all others. Returns the final log-likelihood.
+    if (!_using_data)
+        return 0.0;
+    if (t->_is_rooted)
+        throw XStrom("can only compute likelihoods for unrooted trees currently");
+    if (!_data)
+        throw XStrom("must call setData before optimizeEdgeLengths");
+
+    initBeagleLib(); // this is a no-op if valid instances already exist
+
+    std::vector<OptimizationInstance> optimization;
+    double log_likelihood = 0.0;
+    try
+        {
+        initOptimizationInstances(optimization);
+        log_likelihood = calcOptimizationPartials(optimization, t);
+        for (unsigned sweep = 0; sweep < max_sweeps; ++sweep)
+            {
+            visitSubtree(optimization, t, t->_preorder[0], [this, &optimization, t](Node * nd) {optimizeEdgeLength(optimization, t, nd);}, true);
+
+            // Recompute everything from scratch, which also resets accumulated rounding error
+            double prev_log_likelihood = log_likelihood;
+            log_likelihood = calcOptimizationPartials(optimization, t);
+            if (log_likelihood - prev_log_likelihood < tolerance)
+                break;
+            }
+        }
+    catch (XStrom &)
+        {
+        for (auto & opt : optimization)
+            beagleFinalizeInstance(opt.instance);
+        throw;
+        }
+
+    for (auto & opt : optimization)
+        {
+        int code = beagleFinalizeInstance(opt.instance);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("Likelihood failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]));
+        }
+    return log_likelihood;
+    }
+
+inline void Likelihood::initOptimizationInstances(std::vector<OptimizationInstance> & optimization)
+    {
+    // One double-precision instance per subset, with partials buffers for the internal
+    // nodes followed by one for every node for the partials returned by upperBuffer
+    unsigned num_internals = (_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
+    unsigned num_nodes     = (_rooted ? (2*_ntaxa - 1) : (2*_ntaxa - 2));
+
+    long preference_flags  = 0;
+    long requirement_flags = 0;
+    getInstanceFlags(preference_flags, requirement_flags);
+    requirement_flags = (requirement_flags & ~BEAGLE_FLAG_PRECISION_SINGLE) | BEAGLE_FLAG_PRECISION_DOUBLE;
+
+    for (unsigned s = 0; s < _subsets.size(); ++s)
+        {
+        OptimizationInstance opt;
+        opt.subset = s;
+        opt.instance = createInstance(s, num_internals + num_nodes, preference_flags, requirement_flags);
+        optimization.push_back(opt);
+        setModelRateMatrix(s, opt.instance, true);
+        setDiscreteGammaShape(s, opt.instance);
+        optimization.back().model_version = _subsets[s].model->_version;
+        }
+    }
+
+inline void Likelihood::initEdgeInstances()
+    {
+    // Creates the instances used by visitEdges the first time they are needed, and
+    // afterwards sends them the model of any subset whose parameters have changed
+    if (_edge_instances.empty())
+        {
+        initOptimizationInstances(_edge_instances);
+        return;
+        }
+    for (auto & opt : _edge_instances)
+        {
+        Model::SharedPtr model = _subsets[opt.subset].model;
+        if (opt.model_version == model->_version)
+            continue;
+        setModelRateMatrix(opt.subset, opt.instance, true);
+        setDiscreteGammaShape(opt.subset, opt.instance);
+        opt.model_version = model->_version;
+        }
+    }
+
+inline double Likelihood::visitEdges(typename Tree::SharedPtr t, edge_visitor_t visitor)
+    {
+    // Calls visitor for the edge below each node of t, in preorder, passing the node, the
+    // log-likelihood, and a function returning the log-likelihood (and its derivatives) for
+    // another length of that edge, all other edge lengths held fixed. The visitor may change
+    // the length of that edge but nothing else in t. As in optimizeEdgeLengths, the partials
+    // on both sides of the edge are kept current, so evaluating a length costs one transition
+    // matrix and one edge log-likelihood rather than a pass over the tree, and the walk adds
+    // about two partials updates per node. Returns the log-likelihood for the final lengths.
+    if (!_using_data)
+        {
+        edge_function_t unit = [](double, double & first_derivative, double & second_derivative)
+            {
+            first_derivative = second_derivative = 0.0;
+            return 0.0;
+            };
+        for (auto nd : t->_preorder)
+            visitor(nd, 0.0, unit);
+        return 0.0;
+        }
+    if (t->_is_rooted)
+        throw XStrom("can only compute likelihoods for unrooted trees currently");
+    if (!_data)
+        throw XStrom("must call setData before visitEdges");
+
+    initBeagleLib(); // this is a no-op if valid instances already exist
+    initEdgeInstances();
+
+    double log_likelihood = calcOptimizationPartials(_edge_instances, t);
+    visitSubtree(_edge_instances, t, t->_preorder[0], [this, t, &visitor, &log_likelihood](Node * nd)
+        {
+        double first_derivative = 0.0;
+        double second_derivative = 0.0;
+        double evaluated_length = nd->_edge_length;
+        log_likelihood = calcEdgeDerivatives(_edge_instances, t, nd, evaluated_length, true, first_derivative, second_derivative);
+        edge_function_t f = [this, t, nd, &evaluated_length, &log_likelihood](double edge_length, double & d1, double & d2)
+            {
+            evaluated_length = edge_length;
+            log_likelihood = calcEdgeDerivatives(_edge_instances, t, nd, edge_length, false, d1, d2);
+            return log_likelihood;
+            };
+        visitor(nd, log_likelihood, f);
+
+        // The rest of the walk needs the transition matrix for the length the visitor kept
+        if (nd->_edge_length != evaluated_length)
+            log_likelihood = calcEdgeDerivatives(_edge_instances, t, nd, nd->_edge_length, false, first_derivative, second_derivative);
+        }, true);
+    return log_likelihood;
+    }
+
+inline int Likelihood::upperBuffer(typename Tree::SharedPtr t, Node * nd) const
+    {
+    // Partials buffer holding the partials of everything but the subtree below nd, at the
+    // parent of nd. For the only child of the root this is simply the root (leaf 0).
+    if (nd == t->_preorder[0])
+        return t->_root->_number;
+    return (int)(2*_ntaxa - 2) + nd->_number;
+    }
+
+inline int Likelihood::edgeMatrix(typename Tree::SharedPtr t, Node * nd) const
+    {
+    // Transition matrix for the edge below nd (as in defineOperations, the edge below
+    // the only child of the root uses the matrix of the root)
+    return (nd == t->_preorder[0] ? t->_root->_number : nd->_number);
+    }
+
+inline double Likelihood::calcOptimizationPartials(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t)
+    {
+    // Computes transition matrices for all edges and partials for all internal nodes, then
+    // stores the (correctly scaled) site log-likelihoods; returns the log-likelihood
+    std::vector<double> log_likelihoods(optimization.size(), 0.0);
+    runTasks((unsigned)optimization.size(), [this, &optimization, &log_likelihoods, t](unsigned i)
+        {
+        OptimizationInstance & opt = optimization[i];
+        Subset & sub = _subsets[opt.subset];
+        defineOperations(opt.subset, t, ScaleAlways);
+        updateTransitionMatrices(opt.subset, opt.instance, sub.pmatrix_index, sub.edge_lengths);
+        int code = beagleResetScaleFactors(opt.instance, 0);
+        if (code == 0)
+            code = beagleUpdatePartials(opt.instance, (BeagleOperation *) &sub.operations[0], (int)(sub.operations.size()/7), 0);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to compute partials for edge length optimization. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+        int stateFrequencyIndex  = 0;
+        int categoryWeightsIndex = 0;
+        int cumulativeScalingIndex = 0;
+        int index_focal_child  = t->_root->_number;
+        int index_focal_parent = t->_preorder[0]->_number;
+        double log_likelihood = 0.0;
+        code = beagleCalculateEdgeLogLikelihoods(opt.instance, &index_focal_parent, &index_focal_child, &index_focal_child, NULL, NULL,
+            &categoryWeightsIndex, &stateFrequencyIndex, &cumulativeScalingIndex, 1, &log_likelihood, NULL, NULL);
+        if (code == 0)
+            {
+            opt.site_log_likelihoods.resize(sub.npatterns);
+            code = beagleGetSiteLogLikelihoods(opt.instance, &opt.site_log_likelihoods[0]);
+            }
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to calculate log-likelihood for edge length optimization. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+        double first_derivative = 0.0;
+        double second_derivative = 0.0;
+        opt.first_derivatives.clear();
+        log_likelihoods[i] = sumSiteLogLikelihoods(opt, first_derivative, second_derivative);
+        });
+
+    return std::accumulate(log_likelihoods.begin(), log_likelihoods.end(), 0.0);
+    }
+
+inline void Likelihood::updateOptimizationPartial(std::vector<OptimizationInstance> & optimization, int destination, int child1, int matrix1, int child2, int matrix2)
+    {
+    // Recomputes one partials buffer in every subset; each buffer has its own scale buffer,
+    // so partials stay in range, but scale factors are never accumulated because site
+    // log-likelihoods are tracked relative to known values (see calcEdgeDerivatives)
+    int scaler = destination - _ntaxa + 1;
+    BeagleOperation operation = {destination, scaler, BEAGLE_OP_NONE, child1, matrix1, child2, matrix2};
+    runTasks((unsigned)optimization.size(), [this, &optimization, &operation](unsigned i)
+        {
+        int code = beagleUpdatePartials(optimization[i].instance, &operation, 1, BEAGLE_OP_NONE);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to update partials for edge length optimization. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        });
+    }
+
+inline double Likelihood::sumSiteLogLikelihoods(const OptimizationInstance & opt, double & first_derivative, double & second_derivative) const
+    {
+    // Returns the log-likelihood of the subset given the site log-likelihoods of the variable-rate
+    // component, and (if site derivatives are available) its first and second derivatives.
+    // Under +I, a constant pattern's log-likelihood is log((1 - pinvar) L + pinvar*invariable),
+    // with derivatives r g and r h + r (1 - r) g^2, where g and h are the derivatives of log L
+    // and r is the fraction of the pattern's likelihood due to the variable-rate component.
+    const Subset & sub = _subsets[opt.subset];
+    const Data::pattern_counts_t & counts = _data->getPatternCounts();
+    const Data::constant_masks_t & masks = _data->getConstantMasks();
+    double pinvar = (sub.model->_is_invar_model ? sub.model->_pinvar : 0.0);
+    double log_variable = (pinvar > 0.0 ? std::log(1.0 - pinvar) : 0.0);
+    bool derivatives = !opt.first_derivatives.empty();
+
+    double log_likelihood = 0.0;
+    first_derivative = 0.0;
+    second_derivative = 0.0;
+    for (unsigned k = 0; k < sub.npatterns; ++k)
+        {
+        unsigned i = sub.first_pattern + k;
+        double log_site = log_variable + opt.site_log_likelihoods[k];
+        double r = 1.0;
+        if (pinvar > 0.0 && masks[i] != 0)
+            {
+            double invariable = 0.0;
+            for (unsigned j = 0; j < 4; ++j)
+                if ((masks[i] >> j) & 1)
+                    invariable += sub.model->_state_freqs[j];
+            double log_site_variable = log_site;
+            double log_invariable = std::log(pinvar*invariable);
+            double hi = std::max(log_site_variable, log_invariable);
+            double lo = std::min(log_site_variable, log_invariable);
+            log_site = hi + std::log1p(std::exp(lo - hi));
+            r = std::exp(log_site_variable - log_site);
+            }
+        log_likelihood += counts[i]*log_site;
+        if (derivatives)
+            {
+            double g = opt.first_derivatives[k];
+            double h = opt.second_derivatives[k];
+            first_derivative  += counts[i]*r*g;
+            second_derivative += counts[i]*(r*h + r*(1.0 - r)*g*g);
+            }
+        }
+    return log_likelihood;
+    }
+
+inline double Likelihood::calcEdgeDerivatives(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t, Node * nd, double edge_length, bool new_edge, double & first_derivative, double & second_derivative)
+    {
+    // Sets the length of the edge below nd to edge_length and returns the log-likelihood and
+    // its first and second derivatives with respect to that length. Partials on either side of
+    // the edge have been rescaled, but not in a way that depends on the edge length, so the
+    // unscaled site log-likelihoods BeagleLib reports differ from the true ones by constants;
+    // these are found (new_edge = true) while the stored site log-likelihoods are still current.
+    int matrix = edgeMatrix(t, nd);
+    int first_derivative_matrix = (int)(2*_ntaxa - 3);
+    int second_derivative_matrix = first_derivative_matrix + 1;
+    int parent = upperBuffer(t, nd);
+    int child = nd->_number;
+    if (nd == t->_preorder[0])
+        std::swap(parent, child);   // the root (leaf 0) has no partials buffer of its own
+
+    std::vector<double> log_likelihoods(optimization.size(), 0.0);
+    std::vector<double> first_derivatives(optimization.size(), 0.0);
+    std::vector<double> second_derivatives(optimization.size(), 0.0);
+    runTasks((unsigned)optimization.size(), [&](unsigned i)
+        {
+        OptimizationInstance & opt = optimization[i];
+        unsigned npatterns = _subsets[opt.subset].npatterns;
+        int code = beagleUpdateTransitionMatrices(opt.instance, 0, &matrix, &first_derivative_matrix, &second_derivative_matrix, &edge_length, 1);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to update transition matrices. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+        int stateFrequencyIndex  = 0;
+        int categoryWeightsIndex = 0;
+        int cumulativeScalingIndex = BEAGLE_OP_NONE;
+        double log_likelihood = 0.0;
+        double sum_first = 0.0;
+        double sum_second = 0.0;
+        code = beagleCalculateEdgeLogLikelihoods(opt.instance, &parent, &child, &matrix, &first_derivative_matrix, &second_derivative_matrix,
+            &categoryWeightsIndex, &stateFrequencyIndex, &cumulativeScalingIndex, 1, &log_likelihood, &sum_first, &sum_second);
+        if (code == 0)
+            {
+            opt.edge_site_log_likelihoods.resize(npatterns);
+            opt.first_derivatives.resize(npatterns);
+            opt.second_derivatives.resize(npatterns);
+            code = beagleGetSiteLogLikelihoods(opt.instance, &opt.edge_site_log_likelihoods[0]);
+            }
+        if (code == 0)
+            code = beagleGetSiteDerivatives(opt.instance, &opt.first_derivatives[0], &opt.second_derivatives[0]);
+        if (code != 0)
+            throw XStrom(boost::str(boost::format("failed to calculate edge log-likelihood derivatives. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+        if (new_edge)
+            {
+            opt.site_offsets.resize(npatterns);
+            for (unsigned k = 0; k < npatterns; ++k)
+                opt.site_offsets[k] = opt.site_log_likelihoods[k] - opt.edge_site_log_likelihoods[k];
+            }
+        for (unsigned k = 0; k < npatterns; ++k)
+            opt.site_log_likelihoods[k] = opt.edge_site_log_likelihoods[k] + opt.site_offsets[k];
+
+        log_likelihoods[i] = sumSiteLogLikelihoods(opt, first_derivatives[i], second_derivatives[i]);
+        });
+
+    first_derivative  = std::accumulate(first_derivatives.begin(), first_derivatives.end(), 0.0);
+    second_derivative = std::accumulate(second_derivatives.begin(), second_derivatives.end(), 0.0);
+    return std::accumulate(log_likelihoods.begin(), log_likelihoods.end(), 0.0);
+    }
+
+inline void Likelihood::optimizeEdgeLength(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t, Node * nd)
+    {
+    // Newton-Raphson (falling back to a step uphill where the log-likelihood is not concave),
+    // halving any step that would lower the log-likelihood. Leaves the transition matrix and
+    // site log-likelihoods computed for the final length. Lengths are kept well above
+    // Node::_smallest_edge_length, as MCMC updaters may shrink the edges of a starting tree.
+    const unsigned max_iterations = 20;
+    const unsigned max_halvings = 20;
+    const double min_edge_length = 1.e-8;
+    const double max_edge_length = 100.0;
+
+    double first_derivative = 0.0;
+    double second_derivative = 0.0;
+    double curr_length = nd->_edge_length;
+    double curr_log_likelihood = calcEdgeDerivatives(optimization, t, nd, curr_length, true, first_derivative, second_derivative);
+    bool curr_evaluated_last = true;
+    for (unsigned iteration = 0; iteration < max_iterations; ++iteration)
+        {
+        double step = 0.0;
+        if (second_derivative < 0.0)
+            step = -first_derivative/second_derivative;
+        else
+            step = (first_derivative > 0.0 ? curr_length : -0.5*curr_length);
+        double new_length = std::min(std::max(curr_length + step, min_edge_length), max_edge_length);
+
+        bool improved = false;
+        for (unsigned halving = 0; halving < max_halvings && !improved; ++halving)
+            {
+            double d1 = 0.0;
+            double d2 = 0.0;
+            double new_log_likelihood = calcEdgeDerivatives(optimization, t, nd, new_length, false, d1, d2);
+            curr_evaluated_last = false;
+            if (new_log_likelihood >= curr_log_likelihood)
+                {
+                improved = true;
+                step = new_length - curr_length;
+                curr_length = new_length;
+                curr_log_likelihood = new_log_likelihood;
+                first_derivative = d1;
+                second_derivative = d2;
+                curr_evaluated_last = true;
+                }
+            else
+                new_length = 0.5*(curr_length + new_length);
+            }
+        if (!improved || std::fabs(step) < 1.e-8*std::max(1.0, curr_length))
+            break;
+        }
+
+    if (!curr_evaluated_last)
+        calcEdgeDerivatives(optimization, t, nd, curr_length, false, first_derivative, second_derivative);
+    nd->setEdgeLength(curr_length);
+    }
+
+inline double Likelihood::calcEdgeLengthGradient(typename Tree::SharedPtr t, std::vector<double> & gradient)
+    {
+    // Returns the log-likelihood of t, and in gradient its derivatives with respect to the
+    // edge lengths (gradient[i] for the edge below t->_preorder[i]). Takes time linear in
+    // the size of the tree: one pass computes the partials below every node, then the walk
+    // of visitEdges computes those above each edge, where BeagleLib computes the derivative
+    // of the edge log-likelihood from the derivative of its transition matrix.
+    gradient.assign(t->_preorder.size(), 0.0);
+    if (!_using_data)
+        return 0.0;
+    if (t->_is_rooted)
+        throw XStrom("can only compute likelihoods for unrooted trees currently");
+    if (!_data)
+        throw XStrom("must call setData before calcEdgeLengthGradient");
+
+    initBeagleLib(); // this is a no-op if valid instances already exist
+    initEdgeInstances();
+
+    std::vector<unsigned> position(t->_nodes.size(), 0);
+    for (unsigned i = 0; i < t->_preorder.size(); ++i)
+        position[t->_preorder[i]->_number] = i;
+
+    double log_likelihood = calcOptimizationPartials(_edge_instances, t);
+    visitSubtree(_edge_instances, t, t->_preorder[0], [this, t, &gradient, &position](Node * nd)
+        {
+        double second_derivative = 0.0;
+        calcEdgeDerivatives(_edge_instances, t, nd, nd->_edge_length, true, gradient[position[nd->_number]], second_derivative);
+        }, false);
+    return log_likelihood;
+    }
+
+inline void Likelihood::visitSubtree(std::vector<OptimizationInstance> & optimization, typename Tree::SharedPtr t, Node * nd, std::function<void(Node *)> visit, bool changing_lengths)
+    {
+    // Visits the edge below nd and then the edges in the subtree above it. On entry the
+    // partials of the subtree and upperBuffer(t, nd) are current; visit(nd) may change the
+    // length of the edge below nd, leaving its transition matrix current. On exit the
+    // partials of nd have been recomputed using the new edge lengths in its subtree
+    // (unless changing_lengths is false, in which case they are still current).
+    visit(nd);
+    if (!nd->_left_child)
+        return;
+
+    Node * a = nd->_left_child;
+    Node * b = a->_right_sib;
+    assert(b && !b->_right_sib);    // assumes binary tree
+    int upper = upperBuffer(t, nd);
+    int matrix = edgeMatrix(t, nd);
+
+    updateOptimizationPartial(optimization, upperBuffer(t, a), upper, matrix, b->_number, b->_number);
+    visitSubtree(optimization, t, a, visit, changing_lengths);
+    updateOptimizationPartial(optimization, upperBuffer(t, b), upper, matrix, a->_number, a->_number);
+    visitSubtree(optimization, t, b, visit, changing_lengths);
+    if (changing_lengths)
+        updateOptimizationPartial(optimization, nd->_number, a->_number, a->_number, b->_number, b->_number);
+    }
+
+inline void Likelihood::initPartialsCache(unsigned s)
+    {
+    // Saves subtree partials in the current working instance of subset s from now on,
+    // forgetting any saved before (as happens whenever the model changes)
+    Subset & sub = _subsets[s];
+    unsigned num_buffers = 2*(_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
+    sub.cached_instance = sub.instance;
+    sub.cached_model_version = sub.model->_version;
+    resetSubtreeCache(sub.cache, num_buffers, _ntaxa);
+    sub.buffer_factors.assign(num_buffers, false);
+    sub.buffer_rescaled.assign(num_buffers, false);
+    }
+
+inline double Likelihood::checkPrecision(unsigned s, typename Tree::SharedPtr t, double log_likelihood)
+    {
+    // Periodically recompute log_likelihood in double precision and switch
+    // subset s permanently to double precision if the single-precision value has drifted
+    Subset & sub = _subsets[s];
+    ++sub.num_evaluations;
+    bool finite = std::isfinite(log_likelihood);
+    if (finite && sub.num_evaluations % _precision_check_freq != 0)
+        return log_likelihood;
+
+    assert(sub.reference_instance >= 0);
+    std::swap(sub.instance, sub.reference_instance);
+    double reference_log_likelihood = computeLogLikelihood(s, t, ScaleAlways);
+    std::swap(sub.instance, sub.reference_instance);
+
+    double discrepancy = std::fabs(log_likelihood - reference_log_likelihood);
+    if (finite && discrepancy <= _precision_tolerance)
+        return log_likelihood;
+
+    std::cout << boost::str(boost::format("Single-precision log-likelihood (%.5f) differs from double-precision value (%.5f) after %d evaluations; switching to double precision") % log_likelihood % reference_log_likelihood % sub.num_evaluations) << std::endl;
+    switchToDoublePrecision(s);
+    return reference_log_likelihood;
+    }
+
+inline void Likelihood::switchToDoublePrecision(unsigned s)
+    {
+    // Subset s uses its double-precision reference instance from now on
+    Subset & sub = _subsets[s];
+    assert(sub.single_precision && sub.reference_instance >= 0);
+    int code = beagleFinalizeInstance(sub.instance);
+    if (code != 0)
+        throw XStrom(boost::str(boost::format("failed to finalize single-precision BeagleLib instance. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+    sub.instance = sub.reference_instance;
+    sub.reference_instance = -1;
+    sub.single_precision = false;
+    initPartialsCache(s);
+    }
+
+inline double Likelihood::calcInstanceLogLikelihood(unsigned s, typename Tree::SharedPtr t)
+    {
+    // Computes the log-likelihood of tree t for subset s using its working instance,
+    // scaling partials according to the scaling policy of the subset
+    Subset & sub = _subsets[s];
+    if (sub.scaling_policy == ScaleAlways)
+        return computeLogLikelihood(s, t, ScaleAlways);
+
+    ++sub.num_scaled_evaluations;
+    bool check = (sub.num_scaled_evaluations % _scaling_check_freq == 0);
+    double log_likelihood = 0.0;
+    if (sub.scaling_policy == ScaleDynamic && !sub.scalers_cached)
+        check = false;
+    else
+        {
+        log_likelihood = computeLogLikelihood(s, t, sub.scaling_policy);
+        if (!check && std::isfinite(log_likelihood))
+            return log_likelihood;
+        }
+
+    // Rescale every internal node (this also refreshes the cached scale factors)
+    ++sub.num_rescales;
+    double rescaled_log_likelihood = computeLogLikelihood(s, t, ScaleAlways);
+
+    // Underflow is the expected trigger for rescaling under the dynamic policy, but a
+    // finite result that differs from the fully rescaled one means the policy is unsafe
+    bool failed = (check && std::fabs(log_likelihood - rescaled_log_likelihood) > _scaling_tolerance);
+    if (sub.scaling_policy == ScaleEveryKLevels && !std::isfinite(log_likelihood))
+        failed = true;
+    if (failed)
+        {
+        std::cout << boost::str(boost::format("Log-likelihood computed with reduced scaling (%.5f) differs from fully rescaled value (%.5f); rescaling at every internal node from now on") % log_likelihood % rescaled_log_likelihood) << std::endl;
+        sub.scaling_policy = ScaleAlways;
+        }
+
+    return rescaled_log_likelihood;
+    }
+
+inline double Likelihood::computeLogLikelihood(unsigned s, typename Tree::SharedPtr t, scaling_policy_t scaling)
+    {
+    Subset & sub = _subsets[s];
 
     // Assuming "root" is leaf 0
     assert(t->_root->_number == 0 && t->_root->_left_child == t->_preorder[0] && !t->_preorder[0]->_right_sib);
 
-    // Assuming there are as many transition matrices as there are edge lengths
-    assert(_pmatrix_index.size() == _edge_lengths.size());
+    // The model needs to be sent to the instance only if it has changed since it was last sent
+    if (sub.uploaded_instance != sub.instance || sub.uploaded_version != sub.model->_version)
+        {
+        setModelRateMatrix(s, sub.instance, false);
+        setDiscreteGammaShape(s, sub.instance);
+        sub.uploaded_instance = sub.instance;
+        sub.uploaded_version = sub.model->_version;
+        }
+
+    // index_focal_parent is the only child of root node; only the working instance
+    // saves subtree partials (the reference instance recomputes them all)
+    int index_focal_parent = t->_preorder[0]->_number;
+    if (sub.instance == sub.cached_instance)
+        {
+        if (sub.cached_model_version != sub.model->_version)
+            initPartialsCache(s);
+        index_focal_parent = defineCachedOperations(s, t, scaling);
+        updateTransitionMatrices(s, sub.instance, sub.pmatrix_index, sub.edge_lengths);
+        calculateCachedPartials(s);
+        }
+    else
+        {
+        defineOperations(s, t, scaling);
 
-    setModelRateMatrix();
-    setDiscreteGammaShape();
-    defineOperations(t);
-    updateTransitionMatrices();
-    calculatePartials();
+        // Assuming there are as many transition matrices as there are edge lengths
+        assert(sub.pmatrix_index.size() == sub.edge_lengths.size());
+
+        updateTransitionMatrices(s, sub.instance, sub.pmatrix_index, sub.edge_lengths);
+        calculatePartials(s, scaling);
+        }
+    if (scaling == ScaleAlways)
+        sub.scalers_cached = true;
 
     // The beagleCalculateEdgeLogLikelihoods function integrates a list of partials
     // at a parent and child node with respect to a set of partials-weights and
@@ -423,11 +2293,8 @@ inline double Likelihood::calcLogLikelihood(typename Tree::SharedPtr t)
     // index_focal_child is the root node
     int index_focal_child  = t->_root->_number;
 
-    // index_focal_parent is the only child of root node
-    int index_focal_parent = t->_preorder[0]->_number;
-
     int code = beagleCalculateEdgeLogLikelihoods(
-        _instance,                  // instance number
+        sub.instance,               // instance number
         &index_focal_parent,        // indices of parent partialsBuffers
         &index_focal_child,         // indices of child partialsBuffers
         &index_focal_child,         // transition probability matrices for this edge
@@ -441,8 +2308,19 @@ inline double Likelihood::calcLogLikelihood(typename Tree::SharedPtr t)
         NULL,                       // destination for first derivative
         NULL);                      // destination for second derivative
 
-    if (code != 0)
+    if (code != 0 && code != BEAGLE_ERROR_FLOATING_POINT)
         throw XStrom(boost::str(boost::format("failed to calculate edge logLikelihoods in CalcLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+    if (code == BEAGLE_ERROR_FLOATING_POINT)
+        {
+        // Underflow: report a non-finite value so that the caller can rescale
+        // (or, in single precision, switch to double precision)
+        if (scaling == ScaleAlways && !sub.single_precision)
+            throw XStrom("log-likelihood could not be computed even though partials were rescaled at every internal node");
+        log_likelihood = -std::numeric_limits<double>::infinity();
+        }
+
+    if (sub.model->_is_invar_model && sub.model->_pinvar > 0.0 && std::isfinite(log_likelihood))
+        log_likelihood = addInvariableSites(s, sub.instance, sub.site_log_likelihoods, log_likelihood);
 
     return log_likelihood;
     }
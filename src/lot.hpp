@@ -1,6 +1,8 @@
 #pragma once
 
 #include <ctime>
+#include <string>
+#include <sstream>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_real.hpp>
 #include <boost/random/normal_distribution.hpp>
@@ -23,6 +25,9 @@ namespace strom
             double                  gamma(double shape, double scale);
             double                  logUniform();
 
+            std::string             getState() const;
+            void                    setState(const std::string & state);
+
             typedef boost::shared_ptr<Lot> SharedPtr;
 
         private:
@@ -54,6 +59,21 @@ namespace strom
         _generator.seed(_seed > 0 ? _seed : static_cast<unsigned int>(std::time(0)));
         }
 
+    inline std::string Lot::getState() const
+        {
+        // The state of the generator (and of the normal distribution, in case it keeps
+        // values between calls) as text, so that a restored Lot continues the same sequence
+        std::ostringstream state;
+        state << _generator << " " << _normal_variate_generator->distribution();
+        return state.str();
+        }
+
+    inline void Lot::setState(const std::string & state)
+        {
+        std::istringstream in(state);
+        in >> _generator >> _normal_variate_generator->distribution();
+        }
+
     inline double Lot::uniform()
         {
         return (*_uniform_variate_generator)();
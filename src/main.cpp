@@ -10,6 +10,22 @@ unsigned    Strom::_major_version   = 1;
 unsigned    Strom::_minor_version   = 0;
 const double Node::_smallest_edge_length  = 1.0e-12;
 const double Updater::_log_minus_infinity = std::numeric_limits<double>::lowest();
+const unsigned Data::_min_sites_per_thread = 10000;
+const unsigned StateMatrix::_alignment = 32;
+const unsigned StateMatrix::_missing_nucleotide = 4;
+const unsigned Data::_cache_version = 4;
+const int AlignmentReader::_invalid_state = -1;
+Likelihood::tuned_flags_map_t Likelihood::_tuned_flags;
+const unsigned MLOptimizer::_max_rounds = 10;
+const unsigned MLOptimizer::_max_sweeps = 20;
+const unsigned Model::_gamma_rates_cache_size = 8;
+const unsigned Chain::_weight_adapt_interval = 100;
+const unsigned ModelBlockUpdater::_min_samples = 100;
+const std::string Checkpoint::_magic = "STROMCKP";
+const unsigned Checkpoint::_version = 5;
+const unsigned ConvergenceMonitor::_max_batches = 32;
+volatile std::sig_atomic_t Strom::_stop_requested = 0;
+const unsigned Strom::_min_convergence_samples = 100;
 
 int main(int argc, const char * argv[])
     {
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/format.hpp>
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class MappedFile
+        {
+        public:
+                                        MappedFile();
+                                        MappedFile(const std::string filename);
+                                        ~MappedFile();
+
+            void                        open(const std::string filename);
+            void                        close();
+
+            bool                        isOpen() const;
+            const char *                getData() const;
+            std::size_t                 getSize() const;
+
+        private:
+
+                                        MappedFile(const MappedFile &);
+            MappedFile &                operator=(const MappedFile &);
+
+            int                         _fd;
+            void *                      _data;
+            std::size_t                 _size;
+
+        public:
+
+            typedef std::shared_ptr< MappedFile > SharedPtr;
+        };
+
+inline MappedFile::MappedFile() : _fd(-1), _data(0), _size(0)
+    {
+    //std::cout << "Constructing a MappedFile" << std::endl;
+    }
+
+inline MappedFile::MappedFile(const std::string filename) : _fd(-1), _data(0), _size(0)
+    {
+    //std::cout << "Constructing a MappedFile" << std::endl;
+    open(filename);
+    }
+
+inline MappedFile::~MappedFile()
+    {
+    //std::cout << "Destroying a MappedFile" << std::endl;
+    close();
+    }
+
+inline void MappedFile::open(const std::string filename)
+    {
+    close();
+
+    _fd = ::open(filename.c_str(), O_RDONLY);
+    if (_fd < 0)
+        throw XStrom(boost::str(boost::format("Could not open file \"%s\"") % filename));
+
+    struct stat sb;
+    if (::fstat(_fd, &sb) != 0)
+        {
+        close();
+        throw XStrom(boost::str(boost::format("Could not determine size of file \"%s\"") % filename));
+        }
+    _size = (std::size_t)sb.st_size;
+
+    // mmap refuses zero-length mappings, so an empty file is left unmapped
+    if (_size > 0)
+        {
+        _data = ::mmap(0, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (_data == MAP_FAILED)
+            {
+            _data = 0;
+            close();
+            throw XStrom(boost::str(boost::format("Could not memory-map file \"%s\"") % filename));
+            }
+
+        // Files are always scanned from beginning to end
+        ::madvise(_data, _size, MADV_SEQUENTIAL);
+        }
+    }
+
+inline void MappedFile::close()
+    {
+    if (_data)
+        ::munmap(_data, _size);
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd     = -1;
+    _data   = 0;
+    _size   = 0;
+    }
+
+inline bool MappedFile::isOpen() const
+    {
+    return _fd >= 0;
+    }
+
+inline const char * MappedFile::getData() const
+    {
+    return (const char *)_data;
+    }
+
+inline std::size_t MappedFile::getSize() const
+    {
+    return _size;
+    }
+
+    }
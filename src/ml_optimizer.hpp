@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <functional>
+#include <boost/format.hpp>
+#include "model.hpp"
+#include "likelihood.hpp"
+#include "tree_manip.hpp"
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class MLOptimizer
+        {
+        public:
+                                        MLOptimizer();
+                                        ~MLOptimizer();
+
+            void                        clear();
+
+            void                        setLikelihood(Likelihood::SharedPtr likelihood);
+            void                        setTreeManip(TreeManip::SharedPtr tm);
+            void                        setTolerance(double tolerance);
+            void                        setOptimizeModel(bool optimize_model);
+
+            double                      optimize();
+
+        private:
+
+            typedef std::function<void(double)> setter_t;
+
+            double                      maximize(setter_t setter, double lower, double upper, double start);
+
+            Likelihood::SharedPtr       _likelihood;
+            TreeManip::SharedPtr        _tree_manipulator;
+            double                      _tolerance;
+            bool                        _optimize_model;
+
+            static const unsigned       _max_rounds;
+            static const unsigned       _max_sweeps;
+
+        public:
+
+            typedef std::shared_ptr< MLOptimizer > SharedPtr;
+        };
+
+inline MLOptimizer::MLOptimizer()
+    {
+    //std::cout << "Constructing a MLOptimizer" << std::endl;
+    clear();
+    }
+
+inline MLOptimizer::~MLOptimizer()
+    {
+    //std::cout << "Destroying a MLOptimizer" << std::endl;
+    }
+
+inline void MLOptimizer::clear()
+    {
+    _likelihood       = nullptr;
+    _tree_manipulator = nullptr;
+    _tolerance        = 0.01;
+    _optimize_model   = false;
+    }
+
+inline void MLOptimizer::setLikelihood(Likelihood::SharedPtr likelihood)
+    {
+    _likelihood = likelihood;
+    }
+
+inline void MLOptimizer::setTreeManip(TreeManip::SharedPtr tm)
+    {
+    _tree_manipulator = tm;
+    }
+
+inline void MLOptimizer::setTolerance(double tolerance)
+    {
+    if (tolerance <= 0.0)
+        throw XStrom("the tolerance used in maximum likelihood optimization must be positive");
+    _tolerance = tolerance;
+    }
+
+inline void MLOptimizer::setOptimizeModel(bool optimize_model)
+    {
+    _optimize_model = optimize_model;
+    }
+
+inline double MLOptimizer::optimize()
+    {
+    // Maximizes the log-likelihood over the edge lengths of the tree and (if requested) the
+    // gamma shape and proportion of invariable sites of each subset's model, alternating
+    // between edge lengths and model parameters until a round improves the log-likelihood
+    // by less than the tolerance. Returns the maximized log-likelihood.
+    if (!_likelihood || !_tree_manipulator)
+        throw XStrom("MLOptimizer needs a likelihood and a tree before it can optimize");
+    Tree::SharedPtr tree = _tree_manipulator->getTree();
+
+    double log_likelihood = _likelihood->optimizeEdgeLengths(tree, _tolerance, _max_sweeps);
+    if (!_optimize_model)
+        return log_likelihood;
+
+    for (unsigned round = 0; round < _max_rounds; ++round)
+        {
+        double prev_log_likelihood = log_likelihood;
+        for (auto m : _likelihood->getModels())
+            {
+            if (m->getGammaNCateg() > 1)
+                {
+                // Shape is searched on a log scale
+                double log_shape = maximize([m](double x) {m->setGammaShape(std::exp(x));},
+                    std::log(0.01), std::log(100.0), std::log(m->getGammaShape()));
+                m->setGammaShape(std::exp(log_shape));
+                }
+            if (m->isInvarModel())
+                {
+                double pinvar = maximize([m](double x) {m->setPinvar(x);},
+                    0.0, 0.99, m->getPinvar());
+                m->setPinvar(pinvar);
+                }
+            }
+        log_likelihood = _likelihood->optimizeEdgeLengths(tree, _tolerance, _max_sweeps);
+        if (log_likelihood - prev_log_likelihood < _tolerance)
+            break;
+        }
+    return log_likelihood;
+    }
+
+inline double MLOptimizer::maximize(setter_t setter, double lower, double upper, double start)
+    {
+    // Golden-section search for the value in [lower, upper] maximizing the log-likelihood
+    // as a function of the parameter that setter assigns. The starting value is kept unless
+    // the search finds a better one, so the log-likelihood never decreases.
+    const double golden = 0.5*(std::sqrt(5.0) - 1.0);
+    Tree::SharedPtr tree = _tree_manipulator->getTree();
+    auto f = [this, &setter, tree](double x) {setter(x); return _likelihood->calcLogLikelihood(tree);};
+
+    double best_x = start;
+    double best_f = f(start);
+
+    double a = lower;
+    double b = upper;
+    double x1 = b - golden*(b - a);
+    double x2 = a + golden*(b - a);
+    double f1 = f(x1);
+    double f2 = f(x2);
+    while (b - a > 1.e-4*std::max(1.0, std::fabs(a) + std::fabs(b)))
+        {
+        if (f1 > f2)
+            {
+            b = x2;
+            x2 = x1;
+            f2 = f1;
+            x1 = b - golden*(b - a);
+            f1 = f(x1);
+            }
+        else
+            {
+            a = x1;
+            x1 = x2;
+            f1 = f2;
+            x2 = a + golden*(b - a);
+            f2 = f(x2);
+            }
+        }
+
+    if (f1 > best_f)
+        {
+        best_x = x1;
+        best_f = f1;
+        }
+    if (f2 > best_f)
+        best_x = x2;
+    return best_x;
+    }
+
+    }
@@ -2,8 +2,10 @@
 
 #include <algorithm>
 #include <vector>
+#include <cmath>
+#include <limits>
+#include <boost/algorithm/string.hpp>
 #include "libhmsbeagle/beagle.h"
-#include <boost/math/distributions/gamma.hpp>
 #include <Eigen/Dense>
 
 namespace strom
@@ -17,6 +19,14 @@ namespace strom
             typedef Eigen::Matrix<double, 4, 4, Eigen::RowMajor>    EigenMatrix4d;
             typedef Eigen::Vector4d                                 EigenVector4d;
 
+            // Special cases of GTR, from least to most constrained
+            enum submodel_t
+                {
+                SubmodelGTR     = 0,
+                SubmodelHKY     = 1,
+                SubmodelK80     = 2,
+                SubmodelJC69    = 3
+                };
 
                                         Model();
                                         ~Model();
@@ -31,20 +41,33 @@ namespace strom
             std::vector<double>         getDiscreteGammaRelRates() const;
             std::vector<double>         getDiscreteGammaCategBoundaries() const;
             std::vector<double>         getDiscreteGammaRateProbs() const;
+            bool                        isInvarModel() const;
+            double                      getSubsetRelRate() const;
+            double                      getPinvar() const;
+            submodel_t                  getSubmodel() const;
+            submodel_t                  getSubmodelConstraint() const;
+            bool                        hasClosedFormTransitions() const;
 
             void                        setGammaShape(double shape);
             void                        setGammaNCateg(unsigned ncateg);
+            void                        setIsInvarModel(bool is_invar_model);
+            void                        setPinvar(double pinvar);
+            void                        setSubsetRelRate(double relrate);
             void                        setExchangeabilities(const std::vector<double> & exchangeabilities);
             void                        setStateFreqs(const std::vector<double> & state_frequencies);
             void                        setExchangeabilitiesAndStateFreqs(const std::vector<double> & exchangeabilities, const std::vector<double> & state_frequencies);
+            void                        setSubmodel(const std::string submodel);
 
-            std::string                 paramNamesAsString(std::string sep) const;
+            static std::string          submodelName(submodel_t submodel);
+
+            std::string                 paramNamesAsString(std::string sep, std::string suffix) const;
             std::string                 paramValuesAsString(std::string sep) const;
 
             int                         setBeagleEigenDecomposition(int beagle_instance);
             int                         setBeagleStateFrequencies(int beagle_instance);
             int                         setBeagleAmongSiteRateVariationRates(int beagle_instance);
             int                         setBeagleAmongSiteRateVariationProbs(int beagle_instance);
+            void                        calcBeagleTransitionMatrices(const std::vector<double> & edge_lengths, std::vector<double> & matrices) const;
 
                                         EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -54,7 +77,11 @@ namespace strom
 
             void                        clear();
             void                        recalcRateMatrix();
+            void                        recalcEigenSystem();
             void                        recalcGammaRates();
+            static double               calcGammaP(double alpha, double x, double log_gamma_alpha);
+            static double               calcGammaQuantile(double alpha, double p, double log_gamma_alpha);
+            submodel_t                  detectSubmodel() const;
 
             // substitution model specification
             std::vector<double>         _state_freqs;
@@ -67,6 +94,16 @@ namespace strom
             EigenMatrix4d               _eigenvectors;
             EigenMatrix4d               _inverse_eigenvectors;
             EigenVector4d               _eigenvalues;
+            bool                        _eigen_current;
+
+            // nested special case of GTR (for which transition probabilities have a closed
+            // form), whether it is detected from parameter values, and which special case
+            // parameter values are required to satisfy
+            submodel_t                  _submodel;
+            submodel_t                  _submodel_constraint;
+            bool                        _detecting_submodel;
+            double                      _transition_rate;
+            double                      _transversion_rate;
 
             // among-site rate heterogeneity specification
             unsigned                    _num_categ;
@@ -74,6 +111,31 @@ namespace strom
             std::vector<double>         _relative_rates;
             std::vector<double>         _categ_boundaries;
             std::vector<double>         _rate_probs;
+            std::vector<double>         _beagle_rates;
+
+            // category rates and boundaries for recently used shapes, since a rejected
+            // shape proposal restores the previous shape (see recalcGammaRates)
+            struct GammaRates
+                {
+                double                  shape;
+                unsigned                ncateg;
+                std::vector<double>     relative_rates;
+                std::vector<double>     categ_boundaries;
+                };
+            std::vector<GammaRates>     _gamma_rates_cache;
+            unsigned                    _gamma_rates_cache_next;
+            static const unsigned       _gamma_rates_cache_size;
+
+            // proportion of invariable sites (+I)
+            bool                        _is_invar_model;
+            double                      _pinvar;
+
+            // rate of this partition subset relative to the mean over all sites
+            double                      _subset_relrate;
+
+            // incremented whenever a parameter changes, so that Likelihood
+            // can tell when log-likelihoods computed earlier are still valid
+            unsigned                    _version;
 
             bool                        _using_data;
         };
@@ -89,9 +151,21 @@ inline Model::~Model()
 
 inline void Model::clear()
     {
+    _version = 0;
     _using_data = true;
+    _subset_relrate = 1.0;
     _num_categ = 1;
     _gamma_shape = 0.5;
+    _is_invar_model = false;
+    _pinvar = 0.0;
+    _eigen_current = false;
+    _submodel = SubmodelGTR;
+    _submodel_constraint = SubmodelGTR;
+    _detecting_submodel = true;
+    _transition_rate = 1.0;
+    _transversion_rate = 1.0;
+    _gamma_rates_cache.clear();
+    _gamma_rates_cache_next = 0;
 
     // Set up GTR rate matrix representing the JC69 model by default
     setExchangeabilitiesAndStateFreqs({1.0, 1.0, 1.0, 1.0, 1.0, 1.0}, {0.25, 0.25, 0.25, 0.25});
@@ -107,10 +181,15 @@ inline std::string Model::describeModel() const
     {
     std::string s;
     s += "\n----------------- Model Info ------------------\n";
+    s += boost::str(boost::format("Substitution model:\n  %s%s\n") % submodelName(_submodel) % (_submodel_constraint != SubmodelGTR ? " (constrained)" : ""));
     s += boost::str(boost::format("State frequencies:   \n  piA = %g\n  piC = %g\n  piG = %g\n  piT = %g") % _state_freqs[0] % _state_freqs[1] % _state_freqs[2] % _state_freqs[3]);
     s += boost::str(boost::format("\nRelative rates:    \n  rAC = %g\n  rAG = %g\n  rAT = %g\n  rCG = %g\n  rCT = %g\n  rGT = %g") % _exchangeabilities[0] % _exchangeabilities[1] % _exchangeabilities[2] % _exchangeabilities[3] % _exchangeabilities[4] % _exchangeabilities[5]);
     s += boost::str(boost::format("\nRate categories:   \n  %d") % _num_categ);
     s += boost::str(boost::format("\nGamma shape:       \n  %g") % _gamma_shape);
+    if (_is_invar_model)
+        s += boost::str(boost::format("\nProportion of invariable sites:\n  %g") % _pinvar);
+    if (_subset_relrate != 1.0)
+        s += boost::str(boost::format("\nSubset relative rate:\n  %g") % _subset_relrate);
     if (_num_categ > 1)
         {
         s += "\nCategory boundaries and relative rate means:";
@@ -158,12 +237,100 @@ inline std::vector<double> Model::getDiscreteGammaRateProbs() const
     return _rate_probs;
     }
 
+inline bool Model::isInvarModel() const
+    {
+    return _is_invar_model;
+    }
+
+inline double Model::getPinvar() const
+    {
+    return _pinvar;
+    }
+
+inline double Model::getSubsetRelRate() const
+    {
+    return _subset_relrate;
+    }
+
+inline Model::submodel_t Model::getSubmodel() const
+    {
+    return _submodel;
+    }
+
+inline Model::submodel_t Model::getSubmodelConstraint() const
+    {
+    return _submodel_constraint;
+    }
+
+inline bool Model::hasClosedFormTransitions() const
+    {
+    return _submodel != SubmodelGTR;
+    }
+
+inline std::string Model::submodelName(submodel_t submodel)
+    {
+    switch (submodel)
+        {
+        case SubmodelHKY:   return "HKY";
+        case SubmodelK80:   return "K80";
+        case SubmodelJC69:  return "JC69";
+        default:            return "GTR";
+        }
+    }
+
+inline void Model::setSubmodel(const std::string submodel)
+    {
+    // "auto" recognizes special cases from the current parameter values (whenever they
+    // change), "gtr" always treats the model as GTR, and "hky", "k80" or "jc69" require
+    // parameter values to satisfy the constraints of that special case
+    std::string name = boost::to_lower_copy(submodel);
+    _detecting_submodel = (name != "gtr");
+    if (name == "auto" || name == "gtr")
+        _submodel_constraint = SubmodelGTR;
+    else if (name == "hky")
+        _submodel_constraint = SubmodelHKY;
+    else if (name == "k80")
+        _submodel_constraint = SubmodelK80;
+    else if (name == "jc69" || name == "jc")
+        _submodel_constraint = SubmodelJC69;
+    else
+        throw XStrom(boost::str(boost::format("submodel must be auto, gtr, hky, k80 or jc69 but \"%s\" was supplied") % submodel));
+    recalcRateMatrix();
+    }
+
+inline void Model::setSubsetRelRate(double relrate)
+    {
+    if (relrate <= 0.0)
+        throw XStrom(boost::str(boost::format("subset relative rate must be greater than zero but the value %.5f was supplied") % relrate));
+    _subset_relrate = relrate;
+    ++_version;
+    }
+
+inline void Model::setIsInvarModel(bool is_invar_model)
+    {
+    ++_version;
+    _is_invar_model = is_invar_model;
+    if (!_is_invar_model)
+        _pinvar = 0.0;
+    }
+
+inline void Model::setPinvar(double pinvar)
+    {
+    if (pinvar < 0.0 || pinvar >= 1.0)
+        throw XStrom(boost::str(boost::format("proportion of invariable sites must be in the interval [0, 1) but the value %.5f was supplied") % pinvar));
+    if (pinvar > 0.0 && !_is_invar_model)
+        throw XStrom("proportion of invariable sites can only be set for an invariable sites model");
+    _pinvar = pinvar;
+    ++_version;
+    }
+
 inline void Model::setGammaNCateg(unsigned ncateg)
     {
     if (ncateg < 1)
         throw XStrom(boost::str(boost::format("number of categories used for among-site rate variation must be greater than zero but the value %d was supplied") % ncateg));
     _num_categ = ncateg;
     recalcGammaRates();
+    ++_version;
     }
 
 inline void Model::setGammaShape(double shape)
@@ -172,6 +339,7 @@ inline void Model::setGammaShape(double shape)
         throw XStrom(boost::str(boost::format("gamma shape must be greater than zero but the value %.5f was supplied") % shape));
     _gamma_shape = shape;
     recalcGammaRates();
+    ++_version;
     }
 
 inline void Model::setExchangeabilities(const std::vector<double> & exchangeabilities)
@@ -207,10 +375,53 @@ inline void Model::setExchangeabilitiesAndStateFreqs(const std::vector<double> &
 inline void Model::useStoredData(bool using_data)
     {
     _using_data = using_data;
+    ++_version;
+    }
+
+inline Model::submodel_t Model::detectSubmodel() const
+    {
+    // HKY has one exchangeability for transitions (A<->G, C<->T) and another for
+    // transversions; K80 also has equal state frequencies, and JC69 equal exchangeabilities
+    auto same = [](double a, double b) {return std::fabs(a - b) <= 1.e-10*std::max(std::fabs(a), std::fabs(b));};
+    const std::vector<double> & r = _exchangeabilities;
+    const std::vector<double> & pi = _state_freqs;
+    if (!same(r[1], r[4]) || !same(r[0], r[2]) || !same(r[0], r[3]) || !same(r[0], r[5]))
+        return SubmodelGTR;
+    if (!same(pi[0], pi[1]) || !same(pi[0], pi[2]) || !same(pi[0], pi[3]))
+        return SubmodelHKY;
+    if (!same(r[0], r[1]))
+        return SubmodelK80;
+    return SubmodelJC69;
     }
 
 inline void Model::recalcRateMatrix()
     {
+    // Special cases get their transition probabilities in closed form, so the eigensystem
+    // is only computed for them if requested (see setBeagleEigenDecomposition)
+    ++_version;
+    _submodel = (_detecting_submodel ? detectSubmodel() : SubmodelGTR);
+    if (_submodel < _submodel_constraint)
+        throw XStrom(boost::str(boost::format("the exchangeabilities and state frequencies supplied do not satisfy the constraints of the %s model") % submodelName(_submodel_constraint)));
+
+    _eigen_current = false;
+    if (_submodel != SubmodelGTR)
+        {
+        // Rates of each transition and transversion, scaled so that the mean rate is 1
+        double piR = _state_freqs[0] + _state_freqs[2];
+        double piY = _state_freqs[1] + _state_freqs[3];
+        double rTs = _exchangeabilities[1];
+        double rTv = _exchangeabilities[0];
+        double inverse_scaling_factor = 2.0*rTs*(_state_freqs[0]*_state_freqs[2] + _state_freqs[1]*_state_freqs[3]) + 2.0*rTv*piR*piY;
+        _transition_rate   = rTs/inverse_scaling_factor;
+        _transversion_rate = rTv/inverse_scaling_factor;
+        }
+    else
+        recalcEigenSystem();
+    }
+
+inline void Model::recalcEigenSystem()
+    {
+    _eigen_current = true;
     if (_using_data)
         {
         double piA = _state_freqs[0];
@@ -274,12 +485,26 @@ inline void Model::recalcGammaRates()
     if (_num_categ == 1)
         return;
 
+    for (auto & cached : _gamma_rates_cache)
+        {
+        if (cached.shape == _gamma_shape && cached.ncateg == _num_categ)
+            {
+            _relative_rates = cached.relative_rates;
+            _categ_boundaries = cached.categ_boundaries;
+            return;
+            }
+        }
+
+    // Rates have a Gamma(alpha, 1/alpha) distribution (mean 1), so boundaries are quantiles
+    // of Gamma(alpha, 1) divided by alpha. The mean rate of a category is the probability
+    // under Gamma(alpha + 1, 1) of the same interval divided by the probability under
+    // Gamma(alpha, 1) (which is just the category probability), and needs no further
+    // special function evaluations because P(alpha + 1, x) = P(alpha, x) - x^alpha e^-x/Gamma(alpha + 1)
+    // (unless that difference loses too many digits, as for the lowest categories when alpha is small).
     assert(_gamma_shape > 0.0);
     double alpha = _gamma_shape;
-    double beta = 1.0/_gamma_shape;
-
-    boost::math::gamma_distribution<> my_gamma(_gamma_shape, 1.0/_gamma_shape);
-    boost::math::gamma_distribution<> my_gamma_plus(_gamma_shape + 1.0, 1.0/_gamma_shape);
+    double log_gamma_alpha = std::lgamma(alpha);
+    double log_gamma_alpha_plus = std::lgamma(alpha + 1.0);
 
     double cum_upper        = 0.0;
     double cum_upper_plus   = 0.0;
@@ -294,9 +519,12 @@ inline void Model::recalcGammaRates()
 
         if (i < _num_categ)
             {
-            upper                   = boost::math::quantile(my_gamma, cum_prob);
-            cum_upper_plus          = boost::math::cdf(my_gamma_plus, upper);
-            cum_upper               = boost::math::cdf(my_gamma, upper);
+            double x                = calcGammaQuantile(alpha, cum_prob, log_gamma_alpha);
+            upper                   = x/alpha;
+            cum_upper               = cum_prob;
+            cum_upper_plus          = (x > 0.0 ? cum_prob - std::exp(alpha*std::log(x) - x - log_gamma_alpha_plus) : 0.0);
+            if (cum_upper_plus < 1.e-3*cum_prob)
+                cum_upper_plus      = calcGammaP(alpha + 1.0, x, log_gamma_alpha_plus);
             }
         else
             {
@@ -306,14 +534,113 @@ inline void Model::recalcGammaRates()
 
         double numer                = cum_upper_plus - cum_lower_plus;
         double denom                = cum_upper - cum_lower;
-        double r_mean               = (denom > 0.0 ? (alpha*beta*numer/denom) : 0.0);
+        double r_mean               = (denom > 0.0 ? (numer/denom) : 0.0);
         _relative_rates[i-1]        = r_mean;
         _categ_boundaries[i-1]      = lower;
         }
+
+    GammaRates computed = {_gamma_shape, _num_categ, _relative_rates, _categ_boundaries};
+    if (_gamma_rates_cache.size() < _gamma_rates_cache_size)
+        _gamma_rates_cache.push_back(computed);
+    else
+        {
+        _gamma_rates_cache[_gamma_rates_cache_next] = computed;
+        _gamma_rates_cache_next = (_gamma_rates_cache_next + 1) % _gamma_rates_cache_size;
+        }
+    }
+
+inline double Model::calcGammaP(double alpha, double x, double log_gamma_alpha)
+    {
+    // Regularized lower incomplete gamma function P(alpha, x), from its series if
+    // x < alpha + 1 and otherwise from the continued fraction for 1 - P(alpha, x),
+    // evaluated by Lentz's method (log_gamma_alpha is log Gamma(alpha))
+    if (x <= 0.0)
+        return 0.0;
+    const double epsilon = std::numeric_limits<double>::epsilon();
+    const double tiny = std::numeric_limits<double>::min()/epsilon;
+    double log_prefactor = alpha*std::log(x) - x - log_gamma_alpha;
+    if (x < alpha + 1.0)
+        {
+        double a = alpha;
+        double term = 1.0/alpha;
+        double sum = term;
+        for (unsigned n = 0; n < 1000 && term > sum*epsilon; ++n)
+            {
+            a += 1.0;
+            term *= x/a;
+            sum += term;
+            }
+        return sum*std::exp(log_prefactor);
+        }
+    double b = x + 1.0 - alpha;
+    double c = 1.0/tiny;
+    double d = 1.0/b;
+    double h = d;
+    for (unsigned n = 1; n < 1000; ++n)
+        {
+        double a = -(n*(n - alpha));
+        b += 2.0;
+        d = a*d + b;
+        if (std::fabs(d) < tiny)
+            d = tiny;
+        c = b + a/c;
+        if (std::fabs(c) < tiny)
+            c = tiny;
+        d = 1.0/d;
+        h *= d*c;
+        if (std::fabs(d*c - 1.0) < epsilon)
+            break;
+        }
+    return 1.0 - std::exp(log_prefactor)*h;
+    }
+
+inline double Model::calcGammaQuantile(double alpha, double p, double log_gamma_alpha)
+    {
+    // The x for which P(alpha, x) = p (0 < p < 1), starting from the Wilson-Hilferty
+    // approximation (the cube root of a Gamma(alpha, 1) variable is nearly normal) if
+    // alpha > 1, or otherwise from P(alpha, x) ~ x^alpha/Gamma(alpha + 1) for small x and
+    // an exponential tail for large x, and refined by Halley's method using the density
+    // x^(alpha - 1) e^-x/Gamma(alpha), which usually takes two or three steps
+    double x = 0.0;
+    if (alpha > 1.0)
+        {
+        // Rational approximation of the standard normal quantile z of p
+        double t = std::sqrt(-2.0*std::log(p < 0.5 ? p : 1.0 - p));
+        double z = t - (2.30753 + 0.27061*t)/(1.0 + t*(0.99229 + 0.04481*t));
+        if (p < 0.5)
+            z = -z;
+        x = std::max(1.e-3, alpha*std::pow(1.0 - 1.0/(9.0*alpha) + z/(3.0*std::sqrt(alpha)), 3.0));
+        }
+    else
+        {
+        double t = 1.0 - alpha*(0.253 + alpha*0.12);
+        if (p < t)
+            x = std::pow(p/t, 1.0/alpha);
+        else
+            x = 1.0 - std::log(1.0 - (p - t)/(1.0 - t));
+        }
+
+    for (unsigned iter = 0; iter < 20 && x > 0.0; ++iter)
+        {
+        double density = std::exp((alpha - 1.0)*std::log(x) - x - log_gamma_alpha);
+        if (density == 0.0)
+            break;
+        double u = (calcGammaP(alpha, x, log_gamma_alpha) - p)/density;
+        double step = u/(1.0 - 0.5*std::min(1.0, u*((alpha - 1.0)/x - 1.0)));
+        x -= step;
+        if (x <= 0.0)
+            x = 0.5*(x + step);
+        if (std::fabs(step) < 1.e-10*x)
+            break;
+        }
+    return x;
     }
 
 inline int Model::setBeagleEigenDecomposition(int beagle_instance)
     {
+    if (!_eigen_current)
+        recalcEigenSystem();
+
     int code = beagleSetEigenDecomposition(
         beagle_instance,
         0,
@@ -336,9 +663,17 @@ inline int Model::setBeagleStateFrequencies(int beagle_instance)
 
 inline int Model::setBeagleAmongSiteRateVariationRates(int beagle_instance)
     {
+    // Under +I, variable sites evolve faster so that the mean rate over all sites is 1
+    // (invariable sites are handled by Likelihood using the constant patterns); all
+    // rates are multiplied by the relative rate of this subset
+    _beagle_rates.assign(_relative_rates.begin(), _relative_rates.end());
+    double multiplier = _subset_relrate/(_is_invar_model ? (1.0 - _pinvar) : 1.0);
+    for (auto & r : _beagle_rates)
+        r *= multiplier;
+
     int code = beagleSetCategoryRates(
         beagle_instance,
-        &_relative_rates[0]);
+        &_beagle_rates[0]);
 
     return code;
     }
@@ -353,18 +688,67 @@ inline int Model::setBeagleAmongSiteRateVariationProbs(int beagle_instance)
     return code;
     }
 
-inline std::string Model::paramNamesAsString(std::string sep) const
+inline void Model::calcBeagleTransitionMatrices(const std::vector<double> & edge_lengths, std::vector<double> & matrices) const
+    {
+    // Closed-form HKY transition probabilities (which also cover K80 and JC69) for each
+    // edge length and each rate category, laid out as BeagleLib expects: edge, then
+    // category, then from-state, then to-state. Uses the rates most recently sent to
+    // BeagleLib by setBeagleAmongSiteRateVariationRates.
+    assert(_submodel != SubmodelGTR);
+    assert(_beagle_rates.size() == _num_categ);
+    const double * pi = &_state_freqs[0];
+    double piR = pi[0] + pi[2];
+    double piY = pi[1] + pi[3];
+    matrices.resize(edge_lengths.size()*_num_categ*16);
+    double * p = &matrices[0];
+    for (double v : edge_lengths)
+        {
+        for (double rate : _beagle_rates)
+            {
+            // Transversions occur at rate _transversion_rate whatever the starting state; within
+            // purines (or pyrimidines) the remaining decay is governed by the second eigenvalue
+            double t = v*rate;
+            double e_tv = std::exp(-_transversion_rate*t);
+            double e_R = std::exp(-(piR*_transition_rate + piY*_transversion_rate)*t);
+            double e_Y = std::exp(-(piY*_transition_rate + piR*_transversion_rate)*t);
+            for (unsigned i = 0; i < 4; ++i)
+                {
+                bool purine_i = (i == 0 || i == 2);
+                for (unsigned j = 0; j < 4; ++j)
+                    {
+                    bool purine_j = (j == 0 || j == 2);
+                    if (purine_i != purine_j)
+                        *p++ = pi[j]*(1.0 - e_tv);
+                    else
+                        {
+                        double pi_class = (purine_j ? piR : piY);
+                        double e_class = (purine_j ? e_R : e_Y);
+                        *p++ = pi[j] + pi[j]*(1.0/pi_class - 1.0)*e_tv + ((i == j ? 1.0 : 0.0) - pi[j]/pi_class)*e_class;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+inline std::string Model::paramNamesAsString(std::string sep, std::string suffix) const
     {
+    // suffix is appended to every name (e.g. to identify the partition subset)
+    std::vector<std::string> names = {"r(A<->C)", "r(A<->G)", "r(A<->T)", "r(C<->G)", "r(C<->T)", "r(G<->T)", "pi(A)", "pi(C)", "pi(G)", "pi(T)", "alpha"};
+    if (_is_invar_model)
+        names.push_back("pinvar");
     std::string s = "";
-    s += "r(A<->C)" + sep + "r(A<->G)" + sep + "r(A<->T)" + sep + "r(C<->G)" + sep + "r(C<->T)" + sep + "r(G<->T)" + sep;
-    s += "	pi(A)" + sep + "pi(C)" + sep + "pi(G)" + sep + "pi(T)" + sep;
-    s += "alpha";
+    for (auto & name : names)
+        s += (s.empty() ? "" : sep) + name + suffix;
     return s;
     }
 
 inline std::string Model::paramValuesAsString(std::string sep) const
     {
-    return boost::str(boost::format("%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f") % _exchangeabilities[0] % sep % _exchangeabilities[1] % sep % _exchangeabilities[2] % sep % _exchangeabilities[3] % sep % _exchangeabilities[4] % sep % _exchangeabilities[5] % sep % _state_freqs[0] % sep % _state_freqs[1] % sep % _state_freqs[2] % sep % _state_freqs[3] % sep % _gamma_shape);
+    std::string s = boost::str(boost::format("%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f%s%.5f") % _exchangeabilities[0] % sep % _exchangeabilities[1] % sep % _exchangeabilities[2] % sep % _exchangeabilities[3] % sep % _exchangeabilities[4] % sep % _exchangeabilities[5] % sep % _state_freqs[0] % sep % _state_freqs[1] % sep % _state_freqs[2] % sep % _state_freqs[3] % sep % _gamma_shape);
+    if (_is_invar_model)
+        s += boost::str(boost::format("%s%.5f") % sep % _pinvar);
+    return s;
     }
 
 }
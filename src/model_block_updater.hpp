@@ -0,0 +1,372 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Dense>
+#include "updater.hpp"
+#include "statefreq_updater.hpp"
+#include "exchangeability_updater.hpp"
+#include "gamma_shape_updater.hpp"
+#include "pinvar_updater.hpp"
+
+namespace strom
+{
+
+    class Chain;
+
+    class ModelBlockUpdater : public Updater
+        {
+        friend class Chain;
+
+        public:
+
+                                        ModelBlockUpdater();
+                                        ~ModelBlockUpdater();
+
+            void                        setComponents(StateFreqUpdater::SharedPtr statefreq_updater, ExchangeabilityUpdater::SharedPtr exchangeability_updater, GammaShapeUpdater::SharedPtr shape_updater, PinvarUpdater::SharedPtr pinvar_updater);
+
+            virtual void                clear();
+            virtual double              calcLogPrior() const;
+            virtual bool                isApplicable() const;
+
+            virtual void                saveState(Checkpoint & checkpoint) const;
+            virtual void                restoreState(Checkpoint & checkpoint);
+
+            // mandatory overrides of pure virtual functions
+            virtual void                pullCurrentStateFromModel();
+            virtual void                pushCurrentStateToModel() const;
+            virtual void                proposeNewState();
+            virtual void                revert();
+
+        protected:
+
+            virtual void                tune(bool accepted);
+
+        private:
+
+            double                      setComponentPoints(const std::vector<double> & y) const;
+            static double               appendLogRatios(const std::vector<double> & p, std::vector<double> & y);
+            static double               calcProportions(const std::vector<double> & y, unsigned & offset, std::vector<double> & p);
+            void                        addSample(const std::vector<double> & y);
+
+            StateFreqUpdater::SharedPtr         _statefreq_updater;
+            ExchangeabilityUpdater::SharedPtr   _exchangeability_updater;
+            GammaShapeUpdater::SharedPtr        _shape_updater;
+            PinvarUpdater::SharedPtr            _pinvar_updater;
+
+            // current and previous points on the transformed scale, and the log of the
+            // Jacobian of the transformation back to the parameters at the current point
+            std::vector<double>         _curr_point;
+            std::vector<double>         _prev_point;
+            double                      _log_jacobian;
+
+            // points of the component updaters and log of the Jacobian before the last
+            // proposal, restored exactly by revert (rather than recomputed from _prev_point)
+            std::vector<double>         _prev_state_freqs;
+            std::vector<double>         _prev_exchangeabilities;
+            double                      _prev_shape;
+            double                      _prev_pinvar;
+            double                      _prev_log_jacobian;
+
+            // running mean and sum of squared deviations of the points visited while tuning
+            unsigned                    _nsamples;
+            Eigen::VectorXd             _sample_mean;
+            Eigen::MatrixXd             _sample_sumsq;
+
+            static const unsigned       _min_samples;
+
+        public:
+            typedef std::shared_ptr< ModelBlockUpdater > SharedPtr;
+        };
+
+inline ModelBlockUpdater::ModelBlockUpdater()
+    {
+    //std::cout << "ModelBlockUpdater being created" << std::endl;
+    clear();
+    _name = "Model Parameters";
+    }
+
+inline ModelBlockUpdater::~ModelBlockUpdater()
+    {
+    //std::cout << "ModelBlockUpdater being destroyed" << std::endl;
+    }
+
+inline void ModelBlockUpdater::clear()
+    {
+    Updater::clear();
+    _statefreq_updater.reset();
+    _exchangeability_updater.reset();
+    _shape_updater.reset();
+    _pinvar_updater.reset();
+    _curr_point.clear();
+    _prev_point.clear();
+    _log_jacobian = 0.0;
+    _prev_state_freqs.clear();
+    _prev_exchangeabilities.clear();
+    _prev_shape = 0.0;
+    _prev_pinvar = 0.0;
+    _prev_log_jacobian = 0.0;
+    _nsamples = 0;
+    reset();
+    }
+
+inline void ModelBlockUpdater::setComponents(StateFreqUpdater::SharedPtr statefreq_updater, ExchangeabilityUpdater::SharedPtr exchangeability_updater, GammaShapeUpdater::SharedPtr shape_updater, PinvarUpdater::SharedPtr pinvar_updater)
+    {
+    // The updaters of the parameters in the block (null for parameters not in the model of
+    // this subset) supply the priors and the link to the model; they are not used to update
+    _statefreq_updater       = statefreq_updater;
+    _exchangeability_updater = exchangeability_updater;
+    _shape_updater           = shape_updater;
+    _pinvar_updater          = pinvar_updater;
+    _nsamples = 0;
+    }
+
+inline bool ModelBlockUpdater::isApplicable() const
+    {
+    return _statefreq_updater || _exchangeability_updater || _shape_updater || _pinvar_updater;
+    }
+
+inline double ModelBlockUpdater::calcLogPrior() const
+    {
+    // Parameters of different kinds are independent a priori
+    double log_prior = 0.0;
+    if (_statefreq_updater)
+        log_prior += _statefreq_updater->calcLogPrior();
+    if (_exchangeability_updater)
+        log_prior += _exchangeability_updater->calcLogPrior();
+    if (_shape_updater)
+        log_prior += _shape_updater->calcLogPrior();
+    if (_pinvar_updater)
+        log_prior += _pinvar_updater->calcLogPrior();
+    return log_prior;
+    }
+
+inline void ModelBlockUpdater::pullCurrentStateFromModel()
+    {
+    // Each parameter is moved to the real line: proportions (state frequencies and
+    // exchangeabilities) as logs of their ratios to the last proportion, the gamma shape
+    // as its log and pinvar as its logit. The points of the component updaters are left
+    // as pulled (not mapped back from _curr_point) so that a rejected proposal restores the
+    // model exactly; the log of the Jacobian is computed from the same values.
+    _curr_point.clear();
+    _log_jacobian = 0.0;
+    if (_statefreq_updater)
+        {
+        _statefreq_updater->pullCurrentStateFromModel();
+        _log_jacobian += appendLogRatios(_statefreq_updater->getCurrentPoint(), _curr_point);
+        }
+    if (_exchangeability_updater)
+        {
+        _exchangeability_updater->pullCurrentStateFromModel();
+        _log_jacobian += appendLogRatios(_exchangeability_updater->getCurrentPoint(), _curr_point);
+        }
+    if (_shape_updater)
+        {
+        _shape_updater->pullCurrentStateFromModel();
+        double shape = _shape_updater->getCurrentPoint();
+        _curr_point.push_back(log(shape));
+        _log_jacobian += log(shape);
+        }
+    if (_pinvar_updater)
+        {
+        _pinvar_updater->pullCurrentStateFromModel();
+        double pinvar = _pinvar_updater->getCurrentPoint();
+        _curr_point.push_back(log(pinvar) - log(1.0 - pinvar));
+        _log_jacobian += log(pinvar) + log(1.0 - pinvar);
+        }
+    }
+
+inline double ModelBlockUpdater::appendLogRatios(const std::vector<double> & p, std::vector<double> & y)
+    {
+    // Appends the logs of the ratios of the proportions p to the last of them; returns the
+    // log of the Jacobian of calcProportions at p, the sum of the logs of the proportions
+    double log_jacobian = 0.0;
+    for (unsigned i = 0; i < p.size(); ++i)
+        {
+        if (i + 1 < p.size())
+            y.push_back(log(p[i]) - log(p.back()));
+        log_jacobian += log(p[i]);
+        }
+    return log_jacobian;
+    }
+
+inline double ModelBlockUpdater::calcProportions(const std::vector<double> & y, unsigned & offset, std::vector<double> & p)
+    {
+    // Inverse of appendLogRatios for the p.size() - 1 log ratios starting at y[offset] (which
+    // is advanced past them); returns the log of the Jacobian, the product of the proportions
+    unsigned k = (unsigned)p.size();
+    double largest = 0.0;
+    for (unsigned i = 0; i + 1 < k; ++i)
+        largest = std::max(largest, y[offset + i]);
+    double sum = 0.0;
+    for (unsigned i = 0; i < k; ++i)
+        {
+        p[i] = exp((i + 1 < k ? y[offset + i] : 0.0) - largest);
+        sum += p[i];
+        }
+    double log_jacobian = 0.0;
+    for (auto & x : p)
+        {
+        x /= sum;
+        log_jacobian += log(x);
+        }
+    offset += k - 1;
+    return log_jacobian;
+    }
+
+inline double ModelBlockUpdater::setComponentPoints(const std::vector<double> & y) const
+    {
+    // Sets the points of the component updaters from a point on the transformed scale and
+    // returns the log of the Jacobian of the transformation back to the parameters (for the
+    // shape this is the shape, and for pinvar pinvar*(1 - pinvar))
+    double log_jacobian = 0.0;
+    unsigned offset = 0;
+    if (_statefreq_updater)
+        {
+        std::vector<double> p = _statefreq_updater->getCurrentPoint();
+        log_jacobian += calcProportions(y, offset, p);
+        _statefreq_updater->setCurrentPoint(p);
+        }
+    if (_exchangeability_updater)
+        {
+        std::vector<double> p = _exchangeability_updater->getCurrentPoint();
+        log_jacobian += calcProportions(y, offset, p);
+        _exchangeability_updater->setCurrentPoint(p);
+        }
+    if (_shape_updater)
+        {
+        _shape_updater->setCurrentPoint(exp(y[offset]));
+        log_jacobian += y[offset];
+        ++offset;
+        }
+    if (_pinvar_updater)
+        {
+        double pinvar = 1.0/(1.0 + exp(-y[offset]));
+        _pinvar_updater->setCurrentPoint(pinvar);
+        log_jacobian += log(pinvar) + log(1.0 - pinvar);
+        ++offset;
+        }
+    assert(offset == y.size());
+    return log_jacobian;
+    }
+
+inline void ModelBlockUpdater::pushCurrentStateToModel() const
+    {
+    if (_statefreq_updater)
+        _statefreq_updater->pushCurrentStateToModel();
+    if (_exchangeability_updater)
+        _exchangeability_updater->pushCurrentStateToModel();
+    if (_shape_updater)
+        _shape_updater->pushCurrentStateToModel();
+    if (_pinvar_updater)
+        _pinvar_updater->pushCurrentStateToModel();
+    }
+
+inline void ModelBlockUpdater::proposeNewState()
+    {
+    // Adaptive Metropolis: a multivariate normal step on the transformed scale, with
+    // covariance (2.38 _lambda)^2/d times the covariance of the points visited so far while
+    // tuning, for d dimensions (once there are enough of them; until then, and if it is
+    // singular, a small multiple of the identity is used). _lambda is tuned toward the
+    // target acceptance rate. After tuning the covariance no longer changes.
+    _prev_point = _curr_point;
+    _prev_log_jacobian = _log_jacobian;
+    if (_statefreq_updater)
+        _prev_state_freqs = _statefreq_updater->getCurrentPoint();
+    if (_exchangeability_updater)
+        _prev_exchangeabilities = _exchangeability_updater->getCurrentPoint();
+    if (_shape_updater)
+        _prev_shape = _shape_updater->getCurrentPoint();
+    if (_pinvar_updater)
+        _prev_pinvar = _pinvar_updater->getCurrentPoint();
+    unsigned d = (unsigned)_curr_point.size();
+
+    Eigen::MatrixXd covariance = 0.01*Eigen::MatrixXd::Identity(d, d);
+    if (_nsamples >= _min_samples)
+        covariance = _sample_sumsq/(_nsamples - 1.0) + 1.e-6*Eigen::MatrixXd::Identity(d, d);
+    Eigen::LLT<Eigen::MatrixXd> cholesky(covariance);
+    if (cholesky.info() != Eigen::Success)
+        cholesky.compute(0.01*Eigen::MatrixXd::Identity(d, d));
+
+    Eigen::VectorXd z(d);
+    for (unsigned i = 0; i < d; ++i)
+        z(i) = _lot->normal();
+    Eigen::VectorXd step = cholesky.matrixL()*z;
+    double scale = 2.38*_lambda/std::sqrt((double)d);
+    for (unsigned i = 0; i < d; ++i)
+        _curr_point[i] += scale*step(i);
+
+    // The proposal is symmetric on the transformed scale
+    _log_jacobian = setComponentPoints(_curr_point);
+    _log_hastings_ratio = _log_jacobian - _prev_log_jacobian;
+    }
+
+inline void ModelBlockUpdater::revert()
+    {
+    _curr_point = _prev_point;
+    _log_jacobian = _prev_log_jacobian;
+    if (_statefreq_updater)
+        _statefreq_updater->setCurrentPoint(_prev_state_freqs);
+    if (_exchangeability_updater)
+        _exchangeability_updater->setCurrentPoint(_prev_exchangeabilities);
+    if (_shape_updater)
+        _shape_updater->setCurrentPoint(_prev_shape);
+    if (_pinvar_updater)
+        _pinvar_updater->setCurrentPoint(_prev_pinvar);
+    }
+
+inline void ModelBlockUpdater::tune(bool accepted)
+    {
+    Updater::tune(accepted);
+    if (_tuning)
+        addSample(_curr_point);
+    }
+
+inline void ModelBlockUpdater::saveState(Checkpoint & checkpoint) const
+    {
+    // The points visited while tuning determine later proposals
+    Updater::saveState(checkpoint);
+    checkpoint.write(_nsamples);
+    if (_nsamples > 0)
+        {
+        unsigned d = (unsigned)_sample_mean.size();
+        checkpoint.write(std::vector<double>(_sample_mean.data(), _sample_mean.data() + d));
+        checkpoint.write(std::vector<double>(_sample_sumsq.data(), _sample_sumsq.data() + d*d));
+        }
+    }
+
+inline void ModelBlockUpdater::restoreState(Checkpoint & checkpoint)
+    {
+    Updater::restoreState(checkpoint);
+    checkpoint.read(_nsamples);
+    if (_nsamples > 0)
+        {
+        std::vector<double> mean;
+        std::vector<double> sumsq;
+        checkpoint.read(mean);
+        checkpoint.read(sumsq);
+        unsigned d = (unsigned)mean.size();
+        if (sumsq.size() != d*d)
+            throw XStrom("checkpoint has a damaged covariance for the model parameter block updater");
+        _sample_mean = Eigen::Map<Eigen::VectorXd>(&mean[0], d);
+        _sample_sumsq = Eigen::Map<Eigen::MatrixXd>(&sumsq[0], d, d);
+        }
+    }
+
+inline void ModelBlockUpdater::addSample(const std::vector<double> & y)
+    {
+    // Welford's updates of the mean and sum of squared deviations
+    unsigned d = (unsigned)y.size();
+    Eigen::VectorXd x = Eigen::Map<const Eigen::VectorXd>(&y[0], d);
+    if (_nsamples == 0)
+        {
+        _sample_mean = Eigen::VectorXd::Zero(d);
+        _sample_sumsq = Eigen::MatrixXd::Zero(d, d);
+        }
+    ++_nsamples;
+    Eigen::VectorXd delta = x - _sample_mean;
+    _sample_mean += delta/(double)_nsamples;
+    _sample_sumsq += delta*(x - _sample_mean).transpose();
+    }
+
+}
@@ -5,6 +5,9 @@
 #include "model.hpp"
 #include "xstrom.hpp"
 #include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
 
 namespace strom
     {
@@ -19,14 +22,24 @@ namespace strom
             void                                                setTreeManip(TreeManip::SharedPtr tm) {_tree_manip = tm;}
 
             void                                                openTreeFile(std::string filename, Data::SharedPtr data);
-            void                                                openParameterFile(std::string filename, Model::SharedPtr model);
+            void                                                openParameterFile(std::string filename, const std::vector<Model::SharedPtr> & models, Data::SharedPtr data);
 
             void                                                closeTreeFile();
             void                                                closeParameterFile();
 
+            void                                                reopenTreeFile(std::string filename, std::streamoff offset);
+            void                                                reopenParameterFile(std::string filename, std::streamoff offset, const std::vector<Model::SharedPtr> & models, Data::SharedPtr data);
+            std::streamoff                                      getTreeFileOffset();
+            std::streamoff                                      getParameterFileOffset();
+
             void                                                outputConsole(std::string s);
             void                                                outputTree(unsigned iter, TreeManip::SharedPtr tm);
-            void                                                outputParameters(unsigned iter, double lnL, double lnP, double TL, Model::SharedPtr model);
+            void                                                outputTree(unsigned iter, const std::string & newick);
+            void                                                outputParameters(unsigned iter, double lnL, double lnP, double TL, const std::vector<Model::SharedPtr> & models);
+            void                                                outputParameters(unsigned iter, double lnL, double lnP, double TL, const std::string & values);
+
+            static std::string                                  makeNewick(TreeManip::SharedPtr tm);
+            static std::string                                  makeParameterValues(const std::vector<Model::SharedPtr> & models);
 
 
         private:
@@ -37,6 +50,7 @@ namespace strom
             std::ofstream                                       _parameterfile;
             std::string                                         _tree_file_name;
             std::string                                         _param_file_name;
+            std::vector<std::string>                            _subset_suffixes;
 
         public:
 
@@ -77,15 +91,25 @@ inline void OutputManager::closeTreeFile()
     _treefile.close();
     }
 
-inline void OutputManager::openParameterFile(std::string filename, Model::SharedPtr model)
+inline void OutputManager::openParameterFile(std::string filename, const std::vector<Model::SharedPtr> & models, Data::SharedPtr data)
     {
-    assert(model);
+    assert(!models.empty());
     assert(!_parameterfile.is_open());
     _param_file_name = filename;
     _parameterfile.open(_param_file_name.c_str());
     if (!_parameterfile.is_open())
         throw XStrom(boost::str(boost::format("Could not open parameter file \"%s\"") % _param_file_name));
-    _parameterfile << boost::str(boost::format("%s\t%s\t%s\t%s\t%s") % "iter" % "lnL" % "lnPr" % "TL" % model->paramNamesAsString("\t")) << std::endl;
+
+    // Parameter names are qualified by subset name if the data are partitioned
+    std::string names;
+    _subset_suffixes.assign(models.size(), "");
+    for (unsigned s = 0; s < models.size(); ++s)
+        {
+        if (models.size() > 1)
+            _subset_suffixes[s] = "[" + data->getSubsetName(s) + "]";
+        names += "\t" + models[s]->paramNamesAsString("\t", _subset_suffixes[s]);
+        }
+    _parameterfile << boost::str(boost::format("%s\t%s\t%s\t%s%s") % "iter" % "lnL" % "lnPr" % "TL" % names) << std::endl;
     }
 
 inline void OutputManager::closeParameterFile()
@@ -94,23 +118,96 @@ inline void OutputManager::closeParameterFile()
     _parameterfile.close();
     }
 
+inline void OutputManager::reopenTreeFile(std::string filename, std::streamoff offset)
+    {
+    // Resuming from a checkpoint: samples written after the checkpoint are discarded
+    // (they will be made again) and new samples are appended
+    assert(!_treefile.is_open());
+    _tree_file_name = filename;
+    if (truncate(_tree_file_name.c_str(), offset) != 0)
+        throw XStrom(boost::str(boost::format("Could not truncate tree file \"%s\" to the checkpoint (%s)") % _tree_file_name % std::strerror(errno)));
+    _treefile.open(_tree_file_name.c_str(), std::ios::in | std::ios::out);
+    if (!_treefile.is_open())
+        throw XStrom(boost::str(boost::format("Could not open tree file \"%s\"") % _tree_file_name));
+    _treefile.seekp(0, std::ios::end);
+    }
+
+inline void OutputManager::reopenParameterFile(std::string filename, std::streamoff offset, const std::vector<Model::SharedPtr> & models, Data::SharedPtr data)
+    {
+    assert(!models.empty());
+    assert(!_parameterfile.is_open());
+    _param_file_name = filename;
+    if (truncate(_param_file_name.c_str(), offset) != 0)
+        throw XStrom(boost::str(boost::format("Could not truncate parameter file \"%s\" to the checkpoint (%s)") % _param_file_name % std::strerror(errno)));
+    _parameterfile.open(_param_file_name.c_str(), std::ios::in | std::ios::out);
+    if (!_parameterfile.is_open())
+        throw XStrom(boost::str(boost::format("Could not open parameter file \"%s\"") % _param_file_name));
+    _parameterfile.seekp(0, std::ios::end);
+
+    _subset_suffixes.assign(models.size(), "");
+    for (unsigned s = 0; s < models.size(); ++s)
+        {
+        if (models.size() > 1)
+            _subset_suffixes[s] = "[" + data->getSubsetName(s) + "]";
+        }
+    }
+
+inline std::streamoff OutputManager::getTreeFileOffset()
+    {
+    // The length of what has been written so far (flushed, so that it is all in the file)
+    assert(_treefile.is_open());
+    _treefile.flush();
+    return _treefile.tellp();
+    }
+
+inline std::streamoff OutputManager::getParameterFileOffset()
+    {
+    assert(_parameterfile.is_open());
+    _parameterfile.flush();
+    return _parameterfile.tellp();
+    }
+
 inline void OutputManager::outputConsole(std::string s)
     {
     std::cout << s << std::endl;
     }
 
+inline std::string OutputManager::makeNewick(TreeManip::SharedPtr tm)
+    {
+    assert(tm);
+    return tm->makeNewick(5);
+    }
+
+inline std::string OutputManager::makeParameterValues(const std::vector<Model::SharedPtr> & models)
+    {
+    std::string values;
+    for (auto & model : models)
+        values += "\t" + model->paramValuesAsString("\t");
+    return values;
+    }
+
 inline void OutputManager::outputTree(unsigned iter, TreeManip::SharedPtr tm)
     {
+    outputTree(iter, makeNewick(tm));
+    }
+
+inline void OutputManager::outputTree(unsigned iter, const std::string & newick)
+    {
+    // Samples made in another process arrive already formatted
     assert(_treefile.is_open());
-    assert(tm);
-    _treefile << boost::str(boost::format("  tree iter_%d = %s;") % iter % tm->makeNewick(5)) << std::endl;
+    _treefile << boost::str(boost::format("  tree iter_%d = %s;") % iter % newick) << std::endl;
+    }
+
+inline void OutputManager::outputParameters(unsigned iter, double lnL, double lnP, double TL, const std::vector<Model::SharedPtr> & models)
+    {
+    assert(models.size() == _subset_suffixes.size());
+    outputParameters(iter, lnL, lnP, TL, makeParameterValues(models));
     }
 
-inline void OutputManager::outputParameters(unsigned iter, double lnL, double lnP, double TL, Model::SharedPtr model)
+inline void OutputManager::outputParameters(unsigned iter, double lnL, double lnP, double TL, const std::string & values)
     {
-    assert(model);
     assert(_parameterfile.is_open());
-    _parameterfile << boost::str(boost::format("%d\t%.5f\t%.5f\t%.5f\t%s") % iter % lnL % lnP % TL % model->paramValuesAsString("\t")) << std::endl;
+    _parameterfile << boost::str(boost::format("%d\t%.5f\t%.5f\t%.5f%s") % iter % lnL % lnP % TL % values) << std::endl;
     }
 
 
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <regex>
+#include <cassert>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class Partition
+        {
+        public:
+            typedef std::map<std::string, std::string>  charsets_t;
+            typedef std::vector<unsigned>               site_subsets_t;
+
+                                        Partition();
+                                        ~Partition();
+
+            void                        clear();
+            void                        addSubset(const std::string subset_definition);
+            void                        finalize(unsigned nsites, const charsets_t & charsets);
+
+            unsigned                    getNumSubsets() const;
+            std::string                 getSubsetName(unsigned subset) const;
+            const site_subsets_t &      getSiteSubsets() const;
+            std::string                 describe() const;
+
+        private:
+
+            void                        addSites(unsigned subset, const std::string sites, unsigned nsites);
+
+            std::vector<std::string>    _subset_names;
+            std::vector<std::string>    _subset_sites;
+            site_subsets_t              _site_subsets;
+
+        public:
+
+            typedef std::shared_ptr< Partition > SharedPtr;
+        };
+
+inline Partition::Partition()
+    {
+    //std::cout << "Constructing a Partition" << std::endl;
+    clear();
+    }
+
+inline Partition::~Partition()
+    {
+    //std::cout << "Destroying a Partition" << std::endl;
+    }
+
+inline void Partition::clear()
+    {
+    _subset_names.clear();
+    _subset_sites.clear();
+    _site_subsets.clear();
+    }
+
+inline void Partition::addSubset(const std::string subset_definition)
+    {
+    // A subset is defined either as "name:sites", where sites is a list such as
+    // "1-1234\3, 1300-." (a period denotes the last site), or as the name of a
+    // charset defined in the data file
+    std::string name = subset_definition;
+    std::string sites;
+    std::size_t colon = subset_definition.find(':');
+    if (colon != std::string::npos)
+        {
+        name = subset_definition.substr(0, colon);
+        sites = subset_definition.substr(colon + 1);
+        boost::trim(sites);
+        if (sites.empty())
+            throw XStrom(boost::str(boost::format("no sites were specified for subset \"%s\"") % name));
+        }
+    boost::trim(name);
+    if (name.empty())
+        throw XStrom(boost::str(boost::format("subset definition \"%s\" has no name") % subset_definition));
+    if (std::find(_subset_names.begin(), _subset_names.end(), name) != _subset_names.end())
+        throw XStrom(boost::str(boost::format("subset \"%s\" was defined more than once") % name));
+    _subset_names.push_back(name);
+    _subset_sites.push_back(sites);
+    }
+
+inline void Partition::finalize(unsigned nsites, const charsets_t & charsets)
+    {
+    // Assigns each of the nsites sites to a subset, looking up subsets defined only
+    // by name in charsets. Every site must belong to exactly one subset. If no subsets
+    // were defined, all sites belong to a single subset named "default".
+    if (_subset_names.empty())
+        {
+        _site_subsets.assign(nsites, 0);
+        return;
+        }
+
+    const unsigned unassigned = (unsigned)_subset_names.size();
+    _site_subsets.assign(nsites, unassigned);
+    for (unsigned s = 0; s < _subset_names.size(); ++s)
+        {
+        std::string sites = _subset_sites[s];
+        if (sites.empty())
+            {
+            charsets_t::const_iterator it = charsets.find(_subset_names[s]);
+            if (it == charsets.end())
+                throw XStrom(boost::str(boost::format("subset \"%s\" has no sites specified and the data file defines no charset with that name") % _subset_names[s]));
+            sites = it->second;
+            }
+        addSites(s, sites, nsites);
+        }
+
+    for (unsigned i = 0; i < nsites; ++i)
+        {
+        if (_site_subsets[i] == unassigned)
+            throw XStrom(boost::str(boost::format("site %d is not in any subset") % (i+1)));
+        }
+    }
+
+inline void Partition::addSites(unsigned subset, const std::string sites, unsigned nsites)
+    {
+    // Ranges are separated by commas or whitespace; each is a site, a range
+    // (e.g. 2-100), or a range with a stride (e.g. 2-100\3)
+    std::regex range_pattern("(\\d+)(?:\\s*-\\s*(\\d+|\\.))?(?:\\s*\\\\\\s*(\\d+))?");
+    std::vector<std::string> ranges;
+    std::string spaced = std::regex_replace(sites, std::regex("\\s*([-\\\\])\\s*"), "$1");
+    boost::split(ranges, spaced, boost::is_any_of(", \t"), boost::token_compress_on);
+    for (auto & r : ranges)
+        {
+        if (r.empty())
+            continue;
+        std::smatch match;
+        if (!std::regex_match(r, match, range_pattern))
+            throw XStrom(boost::str(boost::format("could not interpret \"%s\" in the sites of subset \"%s\"") % r % _subset_names[subset]));
+        unsigned first = (unsigned)std::stoul(match[1].str());
+        unsigned last = first;
+        if (match[2].matched)
+            last = (match[2].str() == "." ? nsites : (unsigned)std::stoul(match[2].str()));
+        unsigned stride = (match[3].matched ? (unsigned)std::stoul(match[3].str()) : 1);
+        if (first < 1 || last > nsites || first > last || stride < 1)
+            throw XStrom(boost::str(boost::format("sites \"%s\" of subset \"%s\" are not within 1-%d") % r % _subset_names[subset] % nsites));
+        for (unsigned i = first; i <= last; i += stride)
+            {
+            unsigned & site_subset = _site_subsets[i-1];
+            if (site_subset != _subset_names.size() && site_subset != subset)
+                throw XStrom(boost::str(boost::format("site %d is in both subset \"%s\" and subset \"%s\"") % i % _subset_names[site_subset] % _subset_names[subset]));
+            site_subset = subset;
+            }
+        }
+    }
+
+inline unsigned Partition::getNumSubsets() const
+    {
+    return (_subset_names.empty() ? 1 : (unsigned)_subset_names.size());
+    }
+
+inline std::string Partition::getSubsetName(unsigned subset) const
+    {
+    assert(subset < getNumSubsets());
+    return (_subset_names.empty() ? "default" : _subset_names[subset]);
+    }
+
+inline const Partition::site_subsets_t & Partition::getSiteSubsets() const
+    {
+    return _site_subsets;
+    }
+
+inline std::string Partition::describe() const
+    {
+    // Text uniquely identifying the subset definitions (used to validate cached data)
+    std::string s;
+    for (unsigned i = 0; i < _subset_names.size(); ++i)
+        s += _subset_names[i] + ":" + _subset_sites[i] + ";";
+    return s;
+    }
+
+    }
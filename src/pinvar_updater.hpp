@@ -0,0 +1,138 @@
+#pragma once
+
+#include "model.hpp"
+#include "updater.hpp"
+
+namespace strom
+{
+
+    class PinvarUpdater : public Updater
+        {
+        public:
+
+                                        PinvarUpdater();
+                                        ~PinvarUpdater();
+
+            virtual void                clear();
+            virtual double              calcLogPrior() const;
+            virtual bool                isApplicable() const;
+            virtual double              getStateSummary(double log_likelihood) const;
+
+            // mandatory overrides of pure virtual functions
+            virtual void                pullCurrentStateFromModel();
+            virtual void                pushCurrentStateToModel() const;
+            virtual void                proposeNewState();
+            virtual void                revert();
+
+            double                      getCurrentPoint() const;
+            void                        setCurrentPoint(double point);
+
+        private:
+
+            double                      _prev_point;
+            double                      _curr_point;
+
+        public:
+            typedef std::shared_ptr< PinvarUpdater > SharedPtr;
+        };
+
+inline PinvarUpdater::PinvarUpdater()
+    {
+    //std::cout << "PinvarUpdater being created" << std::endl;
+    clear();
+    _name = "Proportion of Invariable Sites";
+    }
+
+inline PinvarUpdater::~PinvarUpdater()
+    {
+    //std::cout << "PinvarUpdater being destroyed" << std::endl;
+    }
+
+inline double PinvarUpdater::getCurrentPoint() const
+    {
+    return _curr_point;
+    }
+
+inline void PinvarUpdater::setCurrentPoint(double point)
+    {
+    _curr_point = point;
+    }
+
+inline void PinvarUpdater::clear()
+    {
+    Updater::clear();
+    _prev_point             = 0.0;
+    _curr_point             = 0.0;
+    reset();
+    }
+
+inline double PinvarUpdater::calcLogPrior() const
+    {
+    // Beta(prior_a, prior_b) prior
+    assert(_prior_parameters.size() == 2);
+    double prior_a = _prior_parameters[0];
+    double prior_b = _prior_parameters[1];
+
+    if (_curr_point <= 0.0 || _curr_point >= 1.0)
+        return _log_minus_infinity;
+
+    double log_prior = 0.0;
+    log_prior += (prior_a - 1.0)*log(_curr_point);
+    log_prior += (prior_b - 1.0)*log(1.0 - _curr_point);
+    log_prior += std::lgamma(prior_a + prior_b);
+    log_prior -= std::lgamma(prior_a);
+    log_prior -= std::lgamma(prior_b);
+    return log_prior;
+    }
+
+inline bool PinvarUpdater::isApplicable() const
+    {
+    // Pinvar is a parameter only of +I models
+    return _likelihood->getModel(_subset)->isInvarModel();
+    }
+
+inline double PinvarUpdater::getStateSummary(double log_likelihood) const
+    {
+    return _curr_point;
+    }
+
+inline void PinvarUpdater::pullCurrentStateFromModel()
+    {
+    Model::SharedPtr gtr = _likelihood->getModel(_subset);
+    _curr_point = gtr->getPinvar();
+    }
+
+inline void PinvarUpdater::pushCurrentStateToModel() const
+    {
+    Model::SharedPtr gtr = _likelihood->getModel(_subset);
+    gtr->setPinvar(_curr_point);
+    }
+
+inline void PinvarUpdater::proposeNewState()
+    {
+    // Save copy of _curr_point in case revert is necessary.
+    _prev_point = _curr_point;
+
+    // Let _curr_point be proposed value (a sliding window of width _lambda,
+    // reflected back into the interval (0, 1) if necessary)
+    _curr_point = _prev_point + _lambda*(_lot->uniform() - 0.5);
+    while (_curr_point < 0.0 || _curr_point > 1.0)
+        {
+        if (_curr_point < 0.0)
+            _curr_point = -_curr_point;
+        else
+            _curr_point = 2.0 - _curr_point;
+        }
+    if (_curr_point == 0.0 || _curr_point == 1.0)
+        _curr_point = _prev_point;
+
+    // proposal is symmetric
+    _log_hastings_ratio = 0.0;
+    }
+
+inline void PinvarUpdater::revert()
+    {
+    _curr_point = _prev_point;
+    }
+
+}
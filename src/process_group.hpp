@@ -0,0 +1,238 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class ProcessGroup
+        {
+        public:
+                                        ProcessGroup();
+                                        ~ProcessGroup();
+
+            void                        start(unsigned nprocesses);
+            void                        finish();
+
+            unsigned                    getRank() const;
+            unsigned                    getNumProcesses() const;
+            int                         getLostRank() const;
+
+            void                        send(unsigned rank, const std::vector<double> & values);
+            void                        receive(unsigned rank, std::vector<double> & values);
+            void                        sendString(unsigned rank, const std::string & s);
+            std::string                 receiveString(unsigned rank);
+
+        private:
+
+                                        ProcessGroup(const ProcessGroup &);
+            ProcessGroup &              operator=(const ProcessGroup &);
+
+            int                         getSocket(unsigned rank) const;
+            void                        writeAll(unsigned rank, const void * data, std::size_t nbytes);
+            void                        readAll(unsigned rank, void * data, std::size_t nbytes);
+
+            unsigned                    _rank;
+            unsigned                    _nprocesses;
+            int                         _lost_rank;
+            std::vector<int>            _sockets;
+            std::vector<pid_t>          _pids;
+
+        public:
+
+            typedef std::shared_ptr< ProcessGroup > SharedPtr;
+        };
+
+inline ProcessGroup::ProcessGroup()
+    {
+    //std::cout << "Constructing a ProcessGroup" << std::endl;
+    _rank       = 0;
+    _nprocesses = 1;
+    _lost_rank  = -1;
+    }
+
+inline ProcessGroup::~ProcessGroup()
+    {
+    //std::cout << "Destroying a ProcessGroup" << std::endl;
+    finish();
+    }
+
+inline void ProcessGroup::start(unsigned nprocesses)
+    {
+    // Forks nprocesses - 1 worker processes, each connected to this one (the coordinator,
+    // rank 0) by a Unix domain socket. Every process returns from start and carries on
+    // from there, telling which one it is by getRank. Workers only talk to the coordinator.
+    // Must be called before any threads are started.
+    assert(_sockets.empty());
+    _rank       = 0;
+    _nprocesses = nprocesses;
+    _lost_rank  = -1;
+    _sockets.assign(1, -1);
+    for (unsigned rank = 1; rank < nprocesses; ++rank)
+        {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            throw XStrom(boost::str(boost::format("could not create a socket for process %d (%s)") % rank % std::strerror(errno)));
+
+        // Output still buffered would otherwise be written by both processes
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if (pid < 0)
+            throw XStrom(boost::str(boost::format("could not start process %d (%s)") % rank % std::strerror(errno)));
+
+        if (pid == 0)
+            {
+            // Worker: keep only the socket connecting it to the coordinator
+            close(fds[0]);
+            for (auto fd : _sockets)
+                {
+                if (fd >= 0)
+                    close(fd);
+                }
+            _sockets.assign(1, fds[1]);
+            _pids.clear();
+            _rank = rank;
+            return;
+            }
+
+        close(fds[1]);
+        _sockets.push_back(fds[0]);
+        _pids.push_back(pid);
+        }
+    }
+
+inline void ProcessGroup::finish()
+    {
+    // Closing the sockets tells the other side that this process is done, so a
+    // coordinator stopped by an error also stops workers waiting to hear from it
+    for (auto fd : _sockets)
+        {
+        if (fd >= 0)
+            close(fd);
+        }
+    _sockets.clear();
+    for (auto pid : _pids)
+        {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        }
+    _pids.clear();
+    }
+
+inline unsigned ProcessGroup::getRank() const
+    {
+    return _rank;
+    }
+
+inline unsigned ProcessGroup::getNumProcesses() const
+    {
+    return _nprocesses;
+    }
+
+inline int ProcessGroup::getLostRank() const
+    {
+    // The rank of a process found to have stopped (its socket was closed) while this one
+    // was sending to or receiving from it, or -1 if none was
+    return _lost_rank;
+    }
+
+inline int ProcessGroup::getSocket(unsigned rank) const
+    {
+    assert(_rank == 0 ? (rank > 0 && rank < _sockets.size()) : rank == 0);
+    return (_rank == 0 ? _sockets[rank] : _sockets[0]);
+    }
+
+inline void ProcessGroup::writeAll(unsigned rank, const void * data, std::size_t nbytes)
+    {
+    // MSG_NOSIGNAL turns writing to a process that has stopped into an error rather than SIGPIPE
+    const char * p = static_cast<const char *>(data);
+    int fd = getSocket(rank);
+    while (nbytes > 0)
+        {
+        ssize_t n = ::send(fd, p, nbytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EPIPE || errno == ECONNRESET))
+            {
+            _lost_rank = (int)rank;
+            throw XStrom(boost::str(boost::format("process %d stopped unexpectedly") % rank));
+            }
+        if (n <= 0)
+            throw XStrom(boost::str(boost::format("process %d could not send to process %d (%s)") % _rank % rank % std::strerror(errno)));
+        p += n;
+        nbytes -= (std::size_t)n;
+        }
+    }
+
+inline void ProcessGroup::readAll(unsigned rank, void * data, std::size_t nbytes)
+    {
+    char * p = static_cast<char *>(data);
+    int fd = getSocket(rank);
+    while (nbytes > 0)
+        {
+        ssize_t n = ::recv(fd, p, nbytes, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (n < 0 && errno == ECONNRESET))
+            {
+            _lost_rank = (int)rank;
+            throw XStrom(boost::str(boost::format("process %d stopped unexpectedly") % rank));
+            }
+        if (n < 0)
+            throw XStrom(boost::str(boost::format("process %d could not receive from process %d (%s)") % _rank % rank % std::strerror(errno)));
+        p += n;
+        nbytes -= (std::size_t)n;
+        }
+    }
+
+inline void ProcessGroup::send(unsigned rank, const std::vector<double> & values)
+    {
+    // Messages are a count followed by that many values
+    std::uint64_t n = values.size();
+    writeAll(rank, &n, sizeof(n));
+    if (n > 0)
+        writeAll(rank, &values[0], n*sizeof(double));
+    }
+
+inline void ProcessGroup::receive(unsigned rank, std::vector<double> & values)
+    {
+    std::uint64_t n = 0;
+    readAll(rank, &n, sizeof(n));
+    values.resize(n);
+    if (n > 0)
+        readAll(rank, &values[0], n*sizeof(double));
+    }
+
+inline void ProcessGroup::sendString(unsigned rank, const std::string & s)
+    {
+    std::uint64_t n = s.size();
+    writeAll(rank, &n, sizeof(n));
+    if (n > 0)
+        writeAll(rank, s.data(), n);
+    }
+
+inline std::string ProcessGroup::receiveString(unsigned rank)
+    {
+    std::uint64_t n = 0;
+    readAll(rank, &n, sizeof(n));
+    std::string s(n, '\0');
+    if (n > 0)
+        readAll(rank, &s[0], n);
+    return s;
+    }
+
+}
@@ -72,11 +72,12 @@ inline double PWK::logMarginalLikelihood()
 
     std::cout << "\nTopologies sorted by sample frequency:" << std::endl;
     std::cout << boost::str(boost::format("%20s %20s") % "topology" % "frequency") << std::endl;
+    // Topologies are numbered from the most frequent
+    unsigned t = 0;
     for (auto & ntrees_topol_pair : boost::adaptors::reverse(_sorted_trees))
         {
         unsigned n = ntrees_topol_pair.first;
-        unsigned t = ntrees_topol_pair.second;
-        std::cout << boost::str(boost::format("%20d %20d") % t % n) << std::endl;
+        std::cout << boost::str(boost::format("%20d %20d") % ++t % n) << std::endl;
         }
 
     return 0.0;
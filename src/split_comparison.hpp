@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <algorithm>
+#include <boost/format.hpp>
+#include "checkpoint.hpp"
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class SplitComparison
+        {
+        public:
+                                        SplitComparison();
+                                        ~SplitComparison();
+
+            void                        clear();
+            void                        setNumReplicates(unsigned nreplicates);
+            void                        addSplits(unsigned replicate, const std::vector<std::string> & split_patterns);
+            double                      calcASDSF(double min_frequency) const;
+
+            void                        saveState(Checkpoint & checkpoint) const;
+            void                        restoreState(Checkpoint & checkpoint);
+
+        private:
+
+            bool                        isTrivial(const std::string & pattern) const;
+
+            // Number of trees added from each replicate, and for each split (by its pattern
+            // representation) the number of them containing it
+            std::vector<unsigned>                           _num_trees;
+            std::map< std::string, std::vector<unsigned> >  _split_counts;
+
+        public:
+
+            typedef std::shared_ptr< SplitComparison > SharedPtr;
+        };
+
+inline SplitComparison::SplitComparison()
+    {
+    //std::cout << "Constructing a SplitComparison" << std::endl;
+    clear();
+    }
+
+inline SplitComparison::~SplitComparison()
+    {
+    //std::cout << "Destroying a SplitComparison" << std::endl;
+    }
+
+inline void SplitComparison::clear()
+    {
+    _num_trees.clear();
+    _split_counts.clear();
+    }
+
+inline void SplitComparison::setNumReplicates(unsigned nreplicates)
+    {
+    // Forgets any trees already added
+    clear();
+    _num_trees.assign(nreplicates, 0);
+    }
+
+inline bool SplitComparison::isTrivial(const std::string & pattern) const
+    {
+    // Splits separating a single leaf from the rest are in every tree
+    unsigned nset = (unsigned)std::count(pattern.begin(), pattern.end(), '*');
+    return nset < 2 || nset + 2 > pattern.size();
+    }
+
+inline void SplitComparison::addSplits(unsigned replicate, const std::vector<std::string> & split_patterns)
+    {
+    // Adds a tree sampled by the replicate, given by the pattern representations of its
+    // splits (as passed back by ConvergenceMonitor::addSample)
+    assert(replicate < _num_trees.size());
+    for (auto & pattern : split_patterns)
+        {
+        if (isTrivial(pattern))
+            continue;
+        std::vector<unsigned> & counts = _split_counts[pattern];
+        if (counts.empty())
+            counts.assign(_num_trees.size(), 0);
+        counts[replicate]++;
+        }
+    _num_trees[replicate]++;
+    }
+
+inline double SplitComparison::calcASDSF(double min_frequency) const
+    {
+    // Average standard deviation of split frequencies: for each nontrivial split with
+    // frequency at least min_frequency in some replicate, the standard deviation of its
+    // frequencies in the replicates, averaged over these splits. Infinity means there is
+    // nothing to compare (some replicate has no trees yet, or no split is that frequent),
+    // which must not be taken for agreement between the replicates.
+    unsigned nreplicates = (unsigned)_num_trees.size();
+    if (nreplicates < 2 || *std::min_element(_num_trees.begin(), _num_trees.end()) == 0)
+        return std::numeric_limits<double>::infinity();
+    double total_sd = 0.0;
+    unsigned nsplits = 0;
+    std::vector<double> frequencies(nreplicates);
+    for (auto & pattern_counts : _split_counts)
+        {
+        double mean = 0.0;
+        double max_frequency = 0.0;
+        for (unsigned r = 0; r < nreplicates; ++r)
+            {
+            frequencies[r] = (double)pattern_counts.second[r]/_num_trees[r];
+            mean += frequencies[r];
+            max_frequency = std::max(max_frequency, frequencies[r]);
+            }
+        if (max_frequency < min_frequency)
+            continue;
+        mean /= nreplicates;
+        double sumsq = 0.0;
+        for (auto f : frequencies)
+            sumsq += (f - mean)*(f - mean);
+        total_sd += std::sqrt(sumsq/(nreplicates - 1.0));
+        ++nsplits;
+        }
+    return (nsplits > 0 ? total_sd/nsplits : std::numeric_limits<double>::infinity());
+    }
+
+inline void SplitComparison::saveState(Checkpoint & checkpoint) const
+    {
+    checkpoint.write(_num_trees);
+    checkpoint.write((unsigned)_split_counts.size());
+    for (auto & pattern_counts : _split_counts)
+        {
+        checkpoint.write(pattern_counts.first);
+        checkpoint.write(pattern_counts.second);
+        }
+    }
+
+inline void SplitComparison::restoreState(Checkpoint & checkpoint)
+    {
+    std::vector<unsigned> num_trees;
+    checkpoint.read(num_trees);
+    if (num_trees.size() != _num_trees.size())
+        throw XStrom(boost::str(boost::format("checkpoint compares %d replicates but there are %d") % num_trees.size() % _num_trees.size()));
+    _num_trees = num_trees;
+    unsigned nsplits = 0;
+    checkpoint.read(nsplits);
+    _split_counts.clear();
+    for (unsigned i = 0; i < nsplits; ++i)
+        {
+        std::string pattern;
+        checkpoint.read(pattern);
+        checkpoint.read(_split_counts[pattern]);
+        }
+    }
+
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <utility>
+#include "tree_updater.hpp"
+
+namespace strom
+    {
+
+    class Chain;
+
+    class SPRUpdater : public TreeUpdater
+        {
+        friend class Chain;
+
+        public:
+
+                                                SPRUpdater();
+                                                ~SPRUpdater();
+
+            void                                setRadius(unsigned radius);
+            void                                setTBR(bool tbr);
+
+        private:
+
+            virtual void                        revert();
+            virtual void                        proposeNewState();
+            virtual void                        tune(bool accepted);
+
+            virtual void                        reset();
+
+            void                                saveEdgeLength(Node * nd);
+
+            unsigned                            _radius;
+            bool                                _tbr;
+
+            bool                                _regrafted;
+            bool                                _rerooted;
+            Node *                              _pruned;
+            Node *                              _sibling;
+            Node *                              _other;
+            std::vector< std::pair<Node *, double> > _orig_edge_lengths;
+
+        public:
+            typedef std::shared_ptr< SPRUpdater > SharedPtr;
+        };
+
+inline SPRUpdater::SPRUpdater()
+    {
+    // std::cout << "Creating a SPRUpdater" << std::endl;
+    _name = "Subtree Prune and Regraft";
+    _radius = 0;
+    _tbr = false;
+    reset();
+    }
+
+inline SPRUpdater::~SPRUpdater()
+    {
+    // std::cout << "Destroying a SPRUpdater" << std::endl;
+    }
+
+inline void SPRUpdater::reset()
+    {
+    Updater::reset();
+    _regrafted  = false;
+    _rerooted   = false;
+    _pruned     = 0;
+    _sibling    = 0;
+    _other      = 0;
+    _orig_edge_lengths.clear();
+    }
+
+inline void SPRUpdater::setRadius(unsigned radius)
+    {
+    // Subtrees are regrafted (and, for TBR, rerooted) at most radius nodes away from
+    // where they were attached; 0 means anywhere
+    _radius = radius;
+    }
+
+inline void SPRUpdater::setTBR(bool tbr)
+    {
+    _tbr = tbr;
+    _name = (tbr ? "Tree Bisection and Reconnection" : "Subtree Prune and Regraft");
+    }
+
+inline void SPRUpdater::tune(bool accepted)
+    {
+    // The move has no tuning parameter
+    _nattempts++;
+    }
+
+inline void SPRUpdater::saveEdgeLength(Node * nd)
+    {
+    _orig_edge_lengths.push_back(std::make_pair(nd, nd->getEdgeLength()));
+    }
+
+inline void SPRUpdater::proposeNewState()
+    {
+    // Prunes the subtree of a random node x (which, with its parent p, is detached, the
+    // edges on either side of p being joined) and regrafts it on an edge at most _radius
+    // nodes away, chosen uniformly, dividing that edge uniformly at random between its
+    // upper end and p. A TBR move also moves, with probability 1 - 1/(m + 1), where m is
+    // the number of candidates, the point where the edge from p attaches to the subtree
+    // to one of its edges within _radius nodes (see TreeManip::rerootSubtree). The tree
+    // length is unchanged; each half of the move has Hastings ratio (number of candidates
+    // forward)/(number of candidates in reverse) times the Jacobian (length of the edge
+    // divided)/(length of the joined edge).
+    //
+    // Only the nodes on the paths from the old and new attachment points to the root (and,
+    // for TBR, on the rerooted path) get new subtrees, so only their partials are
+    // recomputed (see Likelihood::defineCachedOperations).
+    _log_hastings_ratio = 0.0;
+    _regrafted = false;
+    _rerooted = false;
+    _orig_edge_lengths.clear();
+
+    _pruned = _tree_manipulator->randomPrunableNode(_lot->uniform());
+    Node * p = _pruned->getParent();
+    Node * s = (_pruned == p->getLeftChild() ? _pruned->getRightSib() : p->getLeftChild());
+    saveEdgeLength(s);
+    saveEdgeLength(p);
+
+    _sibling = _tree_manipulator->pruneSubtree(_pruned);
+    Node::PtrVector edges;
+    _tree_manipulator->collectRegraftEdges(_sibling, _radius, edges);
+    if (edges.empty())
+        {
+        // The rest of the tree is a single edge, so x can only go back where it was
+        _tree_manipulator->regraftSubtree(_pruned, _sibling, 0.5);
+        for (auto & saved : _orig_edge_lengths)
+            saved.first->setEdgeLength(saved.second);
+        }
+    else
+        {
+        Node * y = edges[(unsigned)std::floor(_lot->uniform()*edges.size())];
+        saveEdgeLength(y);
+        double joined_length = _sibling->getEdgeLength();
+        double divided_length = y->getEdgeLength();
+
+        Node::PtrVector reverse_edges;
+        _tree_manipulator->collectRegraftEdges(y, _radius, reverse_edges);
+        _log_hastings_ratio += std::log((double)edges.size()) - std::log((double)reverse_edges.size());
+        _log_hastings_ratio += std::log(divided_length) - std::log(joined_length);
+
+        _tree_manipulator->regraftSubtree(_pruned, y, _lot->uniform());
+        _regrafted = true;
+        }
+
+    if (!_tbr)
+        return;
+
+    edges.clear();
+    _tree_manipulator->collectRerootEdges(_pruned, _radius, edges);
+    unsigned chosen = (unsigned)std::floor(_lot->uniform()*(edges.size() + 1));
+    if (chosen == edges.size())
+        return;
+
+    Node * z = edges[chosen];
+    Node * v1 = z;
+    while (v1->getParent() != _pruned)
+        v1 = v1->getParent();
+    _other = (v1 == _pruned->getLeftChild() ? v1->getRightSib() : _pruned->getLeftChild());
+    saveEdgeLength(_other);
+    for (Node * nd = z; nd != _pruned; nd = nd->getParent())
+        saveEdgeLength(nd);
+    double joined_length = _other->getEdgeLength() + v1->getEdgeLength();
+    double divided_length = z->getEdgeLength();
+
+    _tree_manipulator->rerootSubtree(_pruned, z, _lot->uniform());
+    _rerooted = true;
+
+    Node::PtrVector reverse_edges;
+    _tree_manipulator->collectRerootEdges(_pruned, _radius, reverse_edges);
+    _log_hastings_ratio += std::log((double)edges.size() + 1.0) - std::log((double)reverse_edges.size() + 1.0);
+    _log_hastings_ratio += std::log(divided_length) - std::log(joined_length);
+    }
+
+inline void SPRUpdater::revert()
+    {
+    // Undoes the moves in reverse order, then restores the exact edge lengths so that
+    // the partials saved for the original tree are found again
+    if (_rerooted)
+        _tree_manipulator->rerootSubtree(_pruned, _other, 0.5);
+    if (_regrafted)
+        {
+        _tree_manipulator->pruneSubtree(_pruned);
+        _tree_manipulator->regraftSubtree(_pruned, _sibling, 0.5);
+        }
+    for (auto & saved : boost::adaptors::reverse(_orig_edge_lengths))
+        saved.first->setEdgeLength(saved.second);
+    }
+
+}
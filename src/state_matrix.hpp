@@ -0,0 +1,234 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cassert>
+#include <cstring>
+#include <utility>
+#include <Eigen/Core>
+
+namespace strom
+    {
+
+    class StateMatrix
+        {
+        public:
+            typedef unsigned char                                           byte_t;
+            typedef std::vector< byte_t, Eigen::aligned_allocator<byte_t> > byte_vect_t;
+
+                                        StateMatrix();
+                                        ~StateMatrix();
+
+            void                        clear();
+            void                        resize(unsigned nrows, unsigned ncols, bool nibble_packed, unsigned row_alignment);
+            void                        swap(StateMatrix & other);
+
+            unsigned                    getNumRows() const;
+            unsigned                    getNumCols() const;
+            bool                        isNibblePacked() const;
+            unsigned                    getMaxState() const;
+            std::size_t                 getRowBytes() const;
+            std::size_t                 getRowStride() const;
+            std::size_t                 getMemoryBytes() const;
+
+            const byte_t *              getRowPtr(unsigned row) const;
+            byte_t *                    getRowPtr(unsigned row);
+
+            unsigned                    getState(unsigned row, unsigned col) const;
+            void                        setState(unsigned row, unsigned col, unsigned state);
+            void                        copyRow(unsigned row, std::vector<int> & v) const;
+            bool                        hasStateAbove(unsigned row, unsigned state) const;
+
+            static unsigned             nucleotideMask(unsigned state);
+            static unsigned             nucleotideState(unsigned mask);
+
+            static const unsigned       _alignment;
+            static const unsigned       _missing_nucleotide;
+
+        private:
+
+            unsigned                    _nrows;
+            unsigned                    _ncols;
+            bool                        _nibble_packed;
+            std::size_t                 _row_bytes;
+            std::size_t                 _row_stride;
+            byte_vect_t                 _states;
+
+        public:
+
+            typedef std::shared_ptr< StateMatrix > SharedPtr;
+        };
+
+inline StateMatrix::StateMatrix()
+    {
+    //std::cout << "Constructing a StateMatrix" << std::endl;
+    clear();
+    }
+
+inline StateMatrix::~StateMatrix()
+    {
+    //std::cout << "Destroying a StateMatrix" << std::endl;
+    }
+
+inline void StateMatrix::clear()
+    {
+    _nrows          = 0;
+    _ncols          = 0;
+    _nibble_packed  = false;
+    _row_bytes      = 0;
+    _row_stride     = 0;
+    byte_vect_t().swap(_states);
+    }
+
+inline void StateMatrix::resize(unsigned nrows, unsigned ncols, bool nibble_packed, unsigned row_alignment)
+    {
+    // Each row occupies _row_bytes bytes (one byte per state, or two states per byte
+    // if nibble packed) and rows begin at multiples of row_alignment bytes (use
+    // _alignment for rows that will be read by SIMD code, 1 for tightly packed rows).
+    // Padding bytes are always zero so that rows may be compared with memcmp.
+    assert(row_alignment > 0);
+    _nrows          = nrows;
+    _ncols          = ncols;
+    _nibble_packed  = nibble_packed;
+    _row_bytes      = (_nibble_packed ? ((std::size_t)ncols + 1)/2 : (std::size_t)ncols);
+    _row_stride     = ((_row_bytes + row_alignment - 1)/row_alignment)*row_alignment;
+    byte_vect_t().swap(_states);
+    _states.assign(_row_stride*nrows, 0);
+    }
+
+inline void StateMatrix::swap(StateMatrix & other)
+    {
+    std::swap(_nrows, other._nrows);
+    std::swap(_ncols, other._ncols);
+    std::swap(_nibble_packed, other._nibble_packed);
+    std::swap(_row_bytes, other._row_bytes);
+    std::swap(_row_stride, other._row_stride);
+    _states.swap(other._states);
+    }
+
+inline unsigned StateMatrix::getNumRows() const
+    {
+    return _nrows;
+    }
+
+inline unsigned StateMatrix::getNumCols() const
+    {
+    return _ncols;
+    }
+
+inline bool StateMatrix::isNibblePacked() const
+    {
+    return _nibble_packed;
+    }
+
+inline unsigned StateMatrix::getMaxState() const
+    {
+    return (_nibble_packed ? 0x0F : 0xFF);
+    }
+
+inline std::size_t StateMatrix::getRowBytes() const
+    {
+    return _row_bytes;
+    }
+
+inline std::size_t StateMatrix::getRowStride() const
+    {
+    return _row_stride;
+    }
+
+inline std::size_t StateMatrix::getMemoryBytes() const
+    {
+    return _states.size();
+    }
+
+inline const StateMatrix::byte_t * StateMatrix::getRowPtr(unsigned row) const
+    {
+    assert(row < _nrows);
+    return &_states[row*_row_stride];
+    }
+
+inline StateMatrix::byte_t * StateMatrix::getRowPtr(unsigned row)
+    {
+    assert(row < _nrows);
+    return &_states[row*_row_stride];
+    }
+
+inline unsigned StateMatrix::getState(unsigned row, unsigned col) const
+    {
+    assert(row < _nrows && col < _ncols);
+    const byte_t * p = &_states[row*_row_stride];
+    if (!_nibble_packed)
+        return p[col];
+
+    // The state for an even column lives in the high nibble, so that comparing
+    // packed rows byte by byte orders them the same way as the unpacked states
+    byte_t b = p[col/2];
+    return (col % 2 == 0 ? (b >> 4) : (b & 0x0F));
+    }
+
+inline void StateMatrix::setState(unsigned row, unsigned col, unsigned state)
+    {
+    assert(row < _nrows && col < _ncols);
+    assert(state <= getMaxState());
+    byte_t * p = &_states[row*_row_stride];
+    if (!_nibble_packed)
+        p[col] = (byte_t)state;
+    else if (col % 2 == 0)
+        p[col/2] = (byte_t)((p[col/2] & 0x0F) | (state << 4));
+    else
+        p[col/2] = (byte_t)((p[col/2] & 0xF0) | state);
+    }
+
+inline bool StateMatrix::hasStateAbove(unsigned row, unsigned state) const
+    {
+    const byte_t * p = getRowPtr(row);
+    if (!_nibble_packed)
+        {
+        for (unsigned i = 0; i < _ncols; ++i)
+            if (p[i] > state)
+                return true;
+        }
+    else
+        {
+        for (std::size_t i = 0; i < _row_bytes; ++i)
+            if ((p[i] >> 4) > state || (p[i] & 0x0F) > state)
+                return true;
+        }
+    return false;
+    }
+
+inline unsigned StateMatrix::nucleotideMask(unsigned state)
+    {
+    // Nucleotide state codes: 0-3 are A, C, G and T; 4 (_missing_nucleotide) is any
+    // base (N, gaps and missing data); 5-14 are the partial ambiguities M R W S Y K
+    // V H D B. Masks have bit 0 set for A, bit 1 for C, bit 2 for G and bit 3 for T.
+    static const unsigned masks[] = {1, 2, 4, 8, 15, 3, 5, 9, 6, 10, 12, 7, 11, 13, 14};
+    assert(state < 15);
+    return masks[state];
+    }
+
+inline unsigned StateMatrix::nucleotideState(unsigned mask)
+    {
+    // Inverse of nucleotideMask (mask 0, no base allowed, is treated as missing)
+    static const unsigned states[] = {4, 0, 1, 5, 2, 6, 8, 11, 3, 7, 9, 12, 10, 13, 14, 4};
+    assert(mask < 16);
+    return states[mask];
+    }
+
+inline void StateMatrix::copyRow(unsigned row, std::vector<int> & v) const
+    {
+    v.resize(_ncols);
+    const byte_t * p = getRowPtr(row);
+    if (!_nibble_packed)
+        {
+        for (unsigned i = 0; i < _ncols; ++i)
+            v[i] = p[i];
+        }
+    else
+        {
+        for (unsigned i = 0; i < _ncols; ++i)
+            v[i] = (i % 2 == 0 ? (p[i/2] >> 4) : (p[i/2] & 0x0F));
+        }
+    }
+
+    }
@@ -12,10 +12,12 @@ namespace strom
                                         StateFreqUpdater();
                                         ~StateFreqUpdater();
 
+            virtual bool                isApplicable() const;
             virtual void                pullCurrentStateFromModel();
             virtual void                pushCurrentStateToModel() const;
 
             std::vector<double>         getCurrentPoint() const;
+            void                        setCurrentPoint(const std::vector<double> & point);
 
         public:
             typedef std::shared_ptr< StateFreqUpdater > SharedPtr;
@@ -38,9 +40,21 @@ inline std::vector<double> StateFreqUpdater::getCurrentPoint() const
     return _curr_point;
     }
 
+inline void StateFreqUpdater::setCurrentPoint(const std::vector<double> & point)
+    {
+    _curr_point = point;
+    }
+
+inline bool StateFreqUpdater::isApplicable() const
+    {
+    // State frequencies are all equal under K80 and JC69
+    Model::submodel_t constraint = _likelihood->getModel(_subset)->getSubmodelConstraint();
+    return constraint != Model::SubmodelK80 && constraint != Model::SubmodelJC69;
+    }
+
 inline void StateFreqUpdater::pullCurrentStateFromModel()
     {
-    Model::SharedPtr model = _likelihood->getModel();
+    Model::SharedPtr model = _likelihood->getModel(_subset);
     const std::vector<double> & freqs = model->getStateFreqs();
     _curr_point.assign(freqs.begin(), freqs.end());
     }
@@ -51,7 +65,7 @@ inline void StateFreqUpdater::pushCurrentStateToModel() const
     assert(_curr_point.size() == 4);
     assert(fabs(std::accumulate(_curr_point.begin(), _curr_point.end(), 0.0) - 1.0) < 1.e-8);
 
-    Model::SharedPtr model = _likelihood->getModel();
+    Model::SharedPtr model = _likelihood->getModel(_subset);
     model->setStateFreqs(_curr_point);
     }
 
@@ -1,16 +1,22 @@
 #pragma once
 
 #include <iostream>
+#include <sstream>
+#include <chrono>
+#include <csignal>
+#include <boost/algorithm/string.hpp>
 #include "tree_summary.hpp"
 #include "data.hpp"
 #include "likelihood.hpp"
+#include "ml_optimizer.hpp"
 #include "lot.hpp"
-#if 1
-#   include "pwk.hpp"
-#else
-#   include "chain.hpp"
-#   include "gamma_shape_updater.hpp"
-#endif
+#include "process_group.hpp"
+#include "checkpoint.hpp"
+#include "convergence_monitor.hpp"
+#include "split_comparison.hpp"
+#include "pwk.hpp"
+#include "chain.hpp"
+#include "gamma_shape_updater.hpp"
 #include <boost/program_options.hpp>
 #include "output_manager.hpp"
 
@@ -34,39 +40,175 @@ class Strom
         double                      _expected_log_likelihood;
         double                      _gamma_shape;
         unsigned                    _num_categ;
+        bool                        _invar_model;
+        double                      _pinvar;
         std::vector<double>         _state_frequencies;
         std::vector<double>         _exchangeabilities;
+        std::vector<std::string>    _subset_definitions;
+        std::vector<double>         _subset_relrates;
+        std::string                 _submodel;
 
         Data::SharedPtr             _data;
         Model::SharedPtr            _model;
         Likelihood::SharedPtr       _likelihood;
         TreeSummary::SharedPtr      _tree_summary;
         Lot::SharedPtr              _lot;
+        ThreadPool::SharedPtr       _thread_pool;
 
+        bool                        _estimating_marginal_likelihood;
         unsigned                    _random_seed;
         unsigned                    _num_iter;
         unsigned                    _num_burnin_iter;
         bool                        _using_stored_data;
+        bool                        _using_data_cache;
+        bool                        _rebuild_data_cache;
+        std::string                 _data_cache_dir;
+        bool                        _beagle_tune;
+        unsigned                    _beagle_tune_reps;
+        std::string                 _precision;
+        double                      _precision_tolerance;
+        unsigned                    _precision_check_freq;
+        std::string                 _scaling;
+        unsigned                    _scaling_interval;
+        unsigned                    _scaling_check_freq;
+        double                      _scaling_tolerance;
         unsigned                    _sample_freq;
+        unsigned                    _num_threads;
+        bool                        _optimize;
+        bool                        _optimize_model;
+        double                      _optimize_tolerance;
+
+        std::string                 _scheduler;
+        std::vector<std::string>    _updater_weight_definitions;
+        std::map<std::string, double> _updater_weights;
+        std::string                 _topology_updater;
+        unsigned                    _spr_radius;
+        bool                        _edge_length_updater;
+        bool                        _hmc_updater;
+        unsigned                    _hmc_steps;
+        bool                        _model_block_updater;
 
         unsigned                    _num_chains;
         double                      _heating_lambda;
         std::vector<Chain>          _chains;
+
+        // _num_replicates independent analyses, each of _num_chains chains, are run
+        // together. Chain number k belongs to replicate k / _num_chains (and starts at
+        // position k % _num_chains in its ladder). Chains may be divided among processes,
+        // chain number k running in process k % _num_processes. _chains holds only this
+        // process's chains, whose numbers are in _chain_numbers. The coordinating process
+        // (rank 0) decides swaps from the states of all chains in _chain_states and writes
+        // all samples.
+        struct ChainState
+            {
+            unsigned                index;
+            double                  log_kernel;
+            std::vector<double>     lambdas;
+            };
+        unsigned                    _num_replicates;
+        unsigned                    _num_processes;
+        ProcessGroup::SharedPtr     _process_group;
+        std::vector<unsigned>       _chain_numbers;
+        std::vector<ChainState>     _chain_states;
+        std::vector<unsigned>       _cold_chain_numbers;
+
+        // Checkpoints of the whole run are saved every _checkpoint_freq iterations (0 for
+        // never) and, followed by stopping, when SIGTERM is received (by any process); each
+        // process saves its own file (named with its rank appended, except the coordinator)
+        std::string                 _checkpoint_file_name;
+        unsigned                    _checkpoint_freq;
+        bool                        _checkpoint_saved;
+        bool                        _resume;
+        bool                        _stopping;
+        std::vector<std::streamoff> _tree_file_offsets;
+        std::vector<std::streamoff> _parameter_file_offsets;
+        static volatile std::sig_atomic_t _stop_requested;
+        static const unsigned       _min_convergence_samples;
+
+        // Convergence of the cold chain of each replicate is monitored as it is sampled (by
+        // the coordinator): every _ess_check_freq iterations the run stops early if the ESS
+        // of every monitored quantity has reached _target_ess (0 to always run _num_iter
+        // iterations) and split frequencies in the two halves of the sample differ by at
+        // most _split_tolerance (if positive), and, with more than one replicate, if the
+        // average standard deviation of the frequencies of splits (with frequency at least
+        // _asdsf_min_frequency) in the replicates is at most _asdsf_tolerance (if positive).
+        // Time spent is accumulated across resumed runs.
+        double                      _target_ess;
+        unsigned                    _ess_check_freq;
+        double                      _split_tolerance;
+        double                      _asdsf_tolerance;
+        double                      _asdsf_min_frequency;
+        std::vector<ConvergenceMonitor::SharedPtr> _convergence_monitors;
+        SplitComparison::SharedPtr  _split_comparison;
+        double                      _elapsed_seconds;
+        std::chrono::steady_clock::time_point _start_time;
+
+        // Heating powers are shared by the replicates; swaps (counted separately for each
+        // replicate, in _num_chains by _num_chains blocks) only occur within a replicate
         std::vector<double>         _heating_powers;
         std::vector<unsigned>       _swaps;
 
-        void                        sample(unsigned iter, Chain & chain);
+        // Temperature ladder tuning during burn-in: log differences between the
+        // temperatures (reciprocal heating powers) of adjacent chains, with the mean
+        // acceptance probability of swaps between each adjacent pair and overall
+        bool                        _adapt_heating;
+        bool                        _adapting_heating;
+        std::vector<double>         _log_temperature_gaps;
+        std::vector<double>         _gap_swap_acceptance;
+        std::vector<unsigned>       _gap_swap_attempts;
+        double                      _mean_swap_acceptance;
+        unsigned                    _num_adjacent_swaps;
+
+        // Swap scheme (random pair or deterministic even-odd) and round trips of each
+        // chain between the cold and hottest heating powers: the extreme each chain
+        // visited last (-1 if neither yet, 0 cold, 1 hottest) and the trips completed
+        std::string                 _swap_scheme;
+        unsigned                    _num_swap_rounds;
+        std::vector<int>            _last_extreme_visited;
+        std::vector<unsigned>       _round_trips;
+
+        void                        runChains();
+        void                        estimateMarginalLikelihood();
+        void                        sample(unsigned iter, unsigned replicate);
 
         void                        calcHeatingPowers();
+        void                        adaptHeatingPowers(unsigned gap, double acceptance);
+        void                        showHeatingPowers() const;
         void                        initChains();
+        std::string                 randomizeTree(const std::string & newick, Lot::SharedPtr lot) const;
+        void                        calcSubsetRelRates();
         void                        stopTuningChains();
+        Likelihood::scaling_policy_t getScalingPolicy() const;
         void                        stepChains(unsigned iteration, bool sampling);
         void                        swapChains();
+        void                        attemptSwap(unsigned i, unsigned j);
+        void                        countRoundTrips();
+        void                        resetSwapStats();
+        void                        gatherChainStates();
+        void                        scatterChainStates();
+        void                        receiveSample(unsigned iteration, unsigned replicate);
+        void                        writeSample(unsigned iteration, unsigned replicate, double logLike, double logPrior, double TL, const std::string & newick, const std::string & parameter_values);
+        std::string                 getOutputFileName(const std::string & prefix, const std::string & extension, unsigned replicate) const;
+        bool                        isCoordinator() const;
+        bool                        isStopping();
+        bool                        checkpoint(unsigned iteration, bool sampling);
+        std::string                 getCheckpointFileName() const;
+        std::string                 getTunedFlagsFileName() const;
+        void                        saveCheckpoint(unsigned iteration, bool sampling);
+        void                        restoreCheckpoint(unsigned & iteration, bool & sampling);
+        void                        openCheckpoint(Checkpoint & checkpoint, const std::string & file_name, unsigned & iteration, bool & sampling);
+        void                        reportLostProcess() const;
+        static void                 requestStop(int signal);
+        void                        initConvergenceMonitor();
+        void                        monitorSample(unsigned replicate, double logLike, double TL, const std::string & newick, const std::string & parameter_values);
+        bool                        checkConvergence(unsigned iteration);
+        double                      calcElapsedSeconds() const;
+        void                        convergenceSummary() const;
         void                        stopChains();
         void                        swapSummary() const;
         void                        showLambdas() const;
 
-        OutputManager::SharedPtr    _output_manager;
+        std::vector<OutputManager::SharedPtr> _output_managers;
 
         static std::string          _program_name;
         static unsigned             _major_version;
@@ -94,23 +236,87 @@ inline void Strom::clear()
     _likelihood              = nullptr;
     _tree_summary            = nullptr;
     _lot                     = nullptr;
-    _output_manager          = nullptr;
+    _thread_pool             = nullptr;
     _expected_log_likelihood = 0.0;
+    _invar_model             = false;
+    _pinvar                  = 0.2;
     _gamma_shape             = 0.5;
     _num_categ               = 1;
     _random_seed             = 1;
     _num_iter                = 1000;
     _sample_freq             = 1;
+    _num_threads             = 1;
+    _optimize                = false;
+    _optimize_model          = false;
+    _optimize_tolerance      = 0.01;
     _num_burnin_iter         = 1000;
     _heating_lambda          = 0.5;
+    _adapt_heating           = false;
+    _adapting_heating        = false;
+    _mean_swap_acceptance    = 0.0;
+    _num_adjacent_swaps      = 0;
+    _swap_scheme             = "random";
+    _num_swap_rounds         = 0;
     _num_chains              = 1;
+    _num_processes           = 1;
+    _num_replicates          = 1;
+    _checkpoint_file_name    = "checkpoint.bin";
+    _checkpoint_freq         = 0;
+    _checkpoint_saved        = false;
+    _resume                  = false;
+    _stopping                = false;
+    _target_ess              = 0.0;
+    _ess_check_freq          = 1000;
+    _split_tolerance         = 0.0;
+    _asdsf_tolerance         = 0.0;
+    _asdsf_min_frequency     = 0.1;
+    _split_comparison        = nullptr;
+    _elapsed_seconds         = 0.0;
+    _estimating_marginal_likelihood = false;
     _using_stored_data       = true;
+    _using_data_cache        = false;
+    _rebuild_data_cache      = false;
+    _data_cache_dir          = ".";
+    _beagle_tune             = false;
+    _beagle_tune_reps        = 200;
+    _precision               = "double";
+    _submodel                = "auto";
+    _scheduler               = "fixed";
+    _topology_updater        = "none";
+    _spr_radius              = 3;
+    _edge_length_updater     = false;
+    _hmc_updater             = false;
+    _hmc_steps               = 10;
+    _model_block_updater     = false;
+    _precision_tolerance     = 0.01;
+    _precision_check_freq    = 100;
+    _scaling                 = "dynamic";
+    _scaling_interval        = 2;
+    _scaling_check_freq      = 100;
+    _scaling_tolerance       = 0.001;
 
     _state_frequencies.resize(0);
     _exchangeabilities.resize(0);
+    _subset_definitions.resize(0);
+    _subset_relrates.resize(0);
+    _updater_weight_definitions.resize(0);
+    _updater_weights.clear();
     _chains.resize(0);
+    _chain_numbers.resize(0);
+    _chain_states.resize(0);
+    _cold_chain_numbers.resize(0);
+    _process_group           = nullptr;
+    _tree_file_offsets.resize(0);
+    _parameter_file_offsets.resize(0);
+    _convergence_monitors.resize(0);
+    _output_managers.resize(0);
     _heating_powers.resize(0);
     _swaps.resize(0);
+    _log_temperature_gaps.resize(0);
+    _gap_swap_acceptance.resize(0);
+    _gap_swap_attempts.resize(0);
+    _last_extreme_visited.resize(0);
+    _round_trips.resize(0);
     }
 
 inline void Strom::processCommandLineOptions(int argc, const char * argv[])
@@ -126,14 +332,56 @@ inline void Strom::processCommandLineOptions(int argc, const char * argv[])
         ("datafile,d",  boost::program_options::value(&_data_file_name)->required(), "name of data file in NEXUS format")
         ("treefile,t",  boost::program_options::value(&_tree_file_name)->required(), "name of data file in NEXUS format")
         ("expectedLnL", boost::program_options::value(&_expected_log_likelihood)->default_value(0.0), "log likelihood expected")
+        ("pwk",         boost::program_options::value(&_estimating_marginal_likelihood)->default_value(false), "estimate the marginal likelihood (PWK method) from the trees in treefile instead of running MCMC")
         ("gammashape,s", boost::program_options::value(&_gamma_shape)->default_value(0.5), "shape parameter of the Gamma among-site rate heterogeneity model")
         ("ncateg,c",     boost::program_options::value(&_num_categ)->default_value(1),     "number of categories in the discrete Gamma rate heterogeneity model")
+        ("invarmodel",   boost::program_options::value(&_invar_model)->default_value(false), "add a proportion of invariable sites (+I) to the model")
+        ("pinvar",       boost::program_options::value(&_pinvar)->default_value(0.2),      "starting proportion of invariable sites (used only if invarmodel is yes)")
         ("statefreq,f",  boost::program_options::value(&_state_frequencies)->multitoken()->default_value(std::vector<double> {0.25, 0.25, 0.25, 0.25}, "0.25 0.25 0.25 0.25"),  "state frequencies in the order A C G T (will be normalized to sum to 1)")
         ("rmatrix,r",    boost::program_options::value(&_exchangeabilities)->multitoken()->default_value(std::vector<double> {1, 1, 1, 1, 1, 1}, "1 1 1 1 1 1"),                "GTR exchangeabilities in the order AC AG AT CG CT GT (will be normalized to sum to 1)")
+        ("submodel",      boost::program_options::value(&_submodel)->default_value("auto"),             "auto (recognize HKY, K80 and JC69 from statefreq and rmatrix), gtr, or hky, k80 or jc69 to constrain the model to that special case of GTR")
+        ("subset",        boost::program_options::value(&_subset_definitions)->composing(),           "a partition subset, defined as name:sites (e.g. first:1-.\\3) or as the name of a charset in the data file (specify once for each subset)")
+        ("subsetrelrates", boost::program_options::value(&_subset_relrates)->multitoken(),             "relative substitution rate of each subset, in the order subsets were defined (rescaled so that the mean rate per site is 1)")
+        ("nthreads",      boost::program_options::value(&_num_threads)->default_value(1),               "number of threads used to compute the log-likelihoods of partition subsets concurrently")
         ("nchains",       boost::program_options::value(&_num_chains)->default_value(1),                "number of chains")
+        ("nreplicates",   boost::program_options::value(&_num_replicates)->default_value(1),            "number of independent analyses (each of nchains chains) run together, to compare their samples of trees (each starts from the next tree in treefile if there is one for every replicate, and otherwise from a random rearrangement of the first; with more than one, output files are named trees.runN.tre and params.runN.txt)")
+        ("nprocesses",    boost::program_options::value(&_num_processes)->default_value(1),             "number of processes the chains (of all replicates) are divided among (on this machine, communicating through local sockets; each process has its own BeagleLib instances and nthreads threads)")
+        ("scheduler",     boost::program_options::value(&_scheduler)->default_value("fixed"),           "order of updates in an iteration: fixed (every updater once), random (updaters chosen by weight), or adaptive (random, with weights adapted during burn-in)")
+        ("updaterweight", boost::program_options::value(&_updater_weight_definitions)->composing(),   "weight of a kind of updater used by random and adaptive schedulers, as kind:weight where kind is shape, statefreq, exchangeability, pinvar, tree, treelength, spr, edgelength, hmc or model (default weight 1)")
+        ("blockupdater",  boost::program_options::value(&_model_block_updater)->default_value(false),   "update the model parameters of each subset jointly, with proposals adapted to their posterior covariance during burn-in, instead of one kind at a time")
+        ("topologyupdater", boost::program_options::value(&_topology_updater)->default_value("none"),   "moves changing the topology in addition to the local tree updater: none, spr (subtree prune and regraft) or tbr (tree bisection and reconnection)")
+        ("sprradius",     boost::program_options::value(&_spr_radius)->default_value(3),                "largest number of nodes between where a subtree is pruned and where it is regrafted by spr or tbr moves (0 means anywhere)")
+        ("edgeupdater",   boost::program_options::value(&_edge_length_updater)->default_value(false),   "also update edge lengths one at a time, each evaluated from the partials on either side of the edge")
+        ("hmcupdater",    boost::program_options::value(&_hmc_updater)->default_value(false),           "also update all edge lengths jointly by Hamiltonian Monte Carlo, using the gradient of the log-likelihood")
+        ("hmcsteps",      boost::program_options::value(&_hmc_steps)->default_value(10),                "largest number of leapfrog steps in an HMC trajectory (the number is chosen uniformly from 1 to this)")
+        ("swapscheme",    boost::program_options::value(&_swap_scheme)->default_value("random"),       "which chains are proposed to swap heat each iteration: random (one pair chosen at random) or deo (all pairs adjacent in heat, alternating between pairs starting at even and at odd heat ranks)")
         ("heatfactor",    boost::program_options::value(&_heating_lambda)->default_value(0.5),          "determines how hot the heated chains are")
+        ("adaptheating",  boost::program_options::value(&_adapt_heating)->default_value(false),         "adjust the heating of the chains during burn-in so that swaps between chains adjacent in heat are accepted equally often (the hottest chain keeps the heat given by heatfactor)")
         ("burnin",        boost::program_options::value(&_num_burnin_iter)->default_value(100),         "number of iterations used to burn in chains")
+        ("checkpointfile", boost::program_options::value(&_checkpoint_file_name)->default_value("checkpoint.bin"), "file in which the state of the run is saved, so that it can be continued with --resume (each additional process saves a file with its number appended)")
+        ("checkpointfreq", boost::program_options::value(&_checkpoint_freq)->default_value(0),         "save a checkpoint every this many iterations (0 means only when the run is stopped by SIGTERM)")
+        ("resume",        boost::program_options::bool_switch(&_resume),                                "continue the run saved in checkpointfile, with the same options, from where it stopped (trees.tre and params.txt are cut back to the checkpoint and extended)")
+        ("targetess",     boost::program_options::value(&_target_ess)->default_value(0.0),              "stop sampling early once the effective sample size of lnL, TL and every model parameter reaches this (0 means always run niter iterations); early stopping is not considered until every replicate has 100 samples")
+        ("esscheckfreq",  boost::program_options::value(&_ess_check_freq)->default_value(1000),         "check effective sample sizes against targetess (and the average standard deviation of split frequencies against asdsftol) every this many sampling iterations")
+        ("asdsftol",      boost::program_options::value(&_asdsf_tolerance)->default_value(0.0),        "with more than one replicate, stop sampling early once the average standard deviation of split frequencies in the replicates is at most this (0 means not used), checked every esscheckfreq iterations")
+        ("asdsfminfreq",  boost::program_options::value(&_asdsf_min_frequency)->default_value(0.1),     "splits with a lower frequency than this in every replicate are left out of the average standard deviation of split frequencies")
+        ("splittol",      boost::program_options::value(&_split_tolerance)->default_value(0.0),         "also require split frequencies in the first and second halves of the sample to differ by at most this to stop early (0 means not required)")
         ("usedata",       boost::program_options::value(&_using_stored_data)->default_value(true),      "use the stored data in calculating likelihoods (specify no to explore the prior)")
+        ("datacache",     boost::program_options::value(&_using_data_cache)->default_value(false),      "store compressed data in a binary cache file (datafile name + .cache, in cachedir) and reuse it while datafile is unchanged")
+        ("cachedir",      boost::program_options::value(&_data_cache_dir)->default_value("."),          "directory in which the data cache file and the BeagleLib flags chosen by beagletune are stored (the working directory by default)")
+        ("rebuild-cache", boost::program_options::bool_switch(&_rebuild_data_cache),                    "ignore any existing data cache file and regenerate it")
+        ("beagletune",    boost::program_options::value(&_beagle_tune)->default_value(false),           "benchmark BeagleLib CPU vectorization/threading options at startup and use the fastest (the choice is saved in beagletune.txt in cachedir and reused for data of the same shape on the same machine)")
+        ("beagletunereps", boost::program_options::value(&_beagle_tune_reps)->default_value(200),       "number of likelihood calculations timed for each BeagleLib configuration when tuning")
+        ("precision",     boost::program_options::value(&_precision)->default_value("double"),          "floating point precision used by BeagleLib (single or double); single precision reverts to double if results drift")
+        ("precisiontol",  boost::program_options::value(&_precision_tolerance)->default_value(0.01),    "largest tolerated difference between single- and double-precision log-likelihoods")
+        ("precisioncheckfreq", boost::program_options::value(&_precision_check_freq)->default_value(100), "check single-precision log-likelihoods against double precision every this many evaluations")
+        ("scaling",       boost::program_options::value(&_scaling)->default_value("dynamic"),           "how partials are rescaled to avoid underflow: always (every internal node), levels (every scalinginterval levels), or dynamic (only after underflow)")
+        ("scalinginterval", boost::program_options::value(&_scaling_interval)->default_value(2),        "number of levels between rescaled internal nodes when scaling is levels")
+        ("scalingcheckfreq", boost::program_options::value(&_scaling_check_freq)->default_value(100),   "compare log-likelihoods with fully rescaled values every this many evaluations")
+        ("scalingtol",    boost::program_options::value(&_scaling_tolerance)->default_value(0.001),     "largest tolerated difference from the fully rescaled log-likelihood")
+        ("optimize",      boost::program_options::value(&_optimize)->default_value(false),              "start all chains from maximum likelihood edge lengths for the starting tree")
+        ("optimizemodel", boost::program_options::value(&_optimize_model)->default_value(false),        "also start from maximum likelihood gamma shape and pinvar values (used only if optimize is yes)")
+        ("optimizetol",   boost::program_options::value(&_optimize_tolerance)->default_value(0.01),     "stop optimizing once a round improves the log-likelihood by less than this")
         ;
     boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
     try
@@ -183,77 +431,323 @@ inline void Strom::processCommandLineOptions(int argc, const char * argv[])
     if (_gamma_shape <= 0.0)
         throw XStrom("gamma shape must be a positive real number");
 
+    // Be sure proportion of invariable sites is a valid proportion
+    if (_invar_model && (_pinvar <= 0.0 || _pinvar >= 1.0))
+        throw XStrom("pinvar must be greater than 0 and less than 1");
+
     // Be sure number of gamma rate categories is greater than or equal to 1
     if (_num_categ < 1)
         throw XStrom("ncateg must be a positive integer greater than 0");
 
+    // Be sure scheduler is valid and updater weights are well formed
+    if (_scheduler != "fixed" && _scheduler != "random" && _scheduler != "adaptive")
+        throw XStrom(boost::str(boost::format("scheduler must be fixed, random or adaptive (not %s)") % _scheduler));
+    std::vector<std::string> updater_kinds = {"shape", "statefreq", "exchangeability", "pinvar", "tree", "treelength", "spr", "edgelength", "hmc", "model"};
+    for (auto & definition : _updater_weight_definitions)
+        {
+        std::vector<std::string> parts;
+        boost::split(parts, definition, boost::is_any_of(":"));
+        double weight = -1.0;
+        if (parts.size() == 2)
+            {
+            boost::trim(parts[0]);
+            try
+                {
+                weight = std::stod(parts[1]);
+                }
+            catch (std::exception &)
+                {
+                weight = -1.0;
+                }
+            }
+        if (weight < 0.0 || std::find(updater_kinds.begin(), updater_kinds.end(), parts[0]) == updater_kinds.end())
+            throw XStrom(boost::str(boost::format("updaterweight should be kind:weight, with kind one of shape, statefreq, exchangeability, pinvar, tree, treelength, spr, edgelength, hmc or model and a non-negative weight (not %s)") % definition));
+        _updater_weights[parts[0]] = weight;
+        }
+
+    // Be sure topology updater is valid
+    if (_topology_updater != "none" && _topology_updater != "spr" && _topology_updater != "tbr")
+        throw XStrom(boost::str(boost::format("topologyupdater must be none, spr or tbr (not %s)") % _topology_updater));
+
+    // Be sure HMC trajectories have at least one step
+    if (_hmc_updater && _hmc_steps < 1)
+        throw XStrom("hmcsteps must be a positive integer");
+
+    // Be sure submodel is one Model recognizes
+    std::string submodel = boost::to_lower_copy(_submodel);
+    if (submodel != "auto" && submodel != "gtr" && submodel != "hky" && submodel != "k80" && submodel != "jc69" && submodel != "jc")
+        throw XStrom(boost::str(boost::format("submodel must be auto, gtr, hky, k80 or jc69 but \"%s\" was supplied") % _submodel));
+
+    // Be sure precision is either single or double
+    if (_precision != "single" && _precision != "double")
+        throw XStrom(boost::str(boost::format("precision must be either single or double (not %s)") % _precision));
+    if (_precision_tolerance <= 0.0)
+        throw XStrom("precisiontol must be a positive real number");
+    if (_precision_check_freq < 1)
+        throw XStrom("precisioncheckfreq must be a positive integer greater than 0");
+
+    // Be sure scaling policy is valid
+    if (_scaling != "always" && _scaling != "levels" && _scaling != "dynamic")
+        throw XStrom(boost::str(boost::format("scaling must be always, levels or dynamic (not %s)") % _scaling));
+    if (_scaling_interval < 1)
+        throw XStrom("scalinginterval must be a positive integer greater than 0");
+    if (_scaling_check_freq < 1)
+        throw XStrom("scalingcheckfreq must be a positive integer greater than 0");
+    if (_scaling_tolerance <= 0.0)
+        throw XStrom("scalingtol must be a positive real number");
+    if (_optimize_tolerance <= 0.0)
+        throw XStrom("optimizetol must be a positive real number");
+
+    // Be sure there is a relative rate for each subset (if any were specified)
+    if (!_subset_relrates.empty() && _subset_relrates.size() != std::max((std::size_t)1, _subset_definitions.size()))
+        throw XStrom(boost::str(boost::format("%d subset relative rates were specified but there are %d subsets") % _subset_relrates.size() % std::max((std::size_t)1, _subset_definitions.size())));
+    for (auto relrate : _subset_relrates)
+        {
+        if (relrate <= 0.0)
+            throw XStrom("all subsetrelrates entries must be positive real numbers");
+        }
+
+    // Be sure number of threads is greater than or equal to 1
+    if (_num_threads < 1)
+        throw XStrom("nthreads must be a positive integer greater than 0");
+
     // Be sure number of chains is greater than or equal to 1
     if (_num_chains < 1)
         throw XStrom("nchains must be a positive integer greater than 0");
 
+    if (_num_replicates < 1)
+        throw XStrom("nreplicates must be a positive integer greater than 0");
+
+    if (_num_processes < 1 || _num_processes > _num_chains*_num_replicates)
+        throw XStrom("nprocesses must be a positive integer no greater than the number of chains in all replicates (nchains times nreplicates)");
+
     // Be sure heatfactor is between 0 and 1
     if (_heating_lambda <= 0.0 || _heating_lambda > 1.0)
         throw XStrom("heatfactor must be a real number in the interval (0.0,1.0]");
 
+    if (_swap_scheme != "random" && _swap_scheme != "deo")
+        throw XStrom(boost::str(boost::format("swapscheme must be random or deo, not %s") % _swap_scheme));
+
+    if (_target_ess < 0.0)
+        throw XStrom("targetess must be a non-negative real number");
+    if (_ess_check_freq < 1)
+        throw XStrom("esscheckfreq must be a positive integer greater than 0");
+    if (_split_tolerance < 0.0 || _split_tolerance > 1.0)
+        throw XStrom("splittol must be a real number in the interval [0.0,1.0]");
+    if (_asdsf_tolerance < 0.0)
+        throw XStrom("asdsftol must be a non-negative real number");
+    if (_asdsf_min_frequency < 0.0 || _asdsf_min_frequency > 1.0)
+        throw XStrom("asdsfminfreq must be a real number in the interval [0.0,1.0]");
+
     if (!_using_stored_data)
         std::cout << "\n*** Not using stored data (posterior = prior) ***\n" << std::endl;
     }
 
 inline void Strom::calcHeatingPowers()
     {
-    // Specify chain heating power (e.g. _heating_lambda = 0.2)
+    // Specify chain heating power from the gaps between the temperatures 1/power
+    // of adjacent chains, which all start at _heating_lambda (e.g. 0.2)
     // chain_index  power
     //      0       1.000 = 1/(1 + 0.2*0)
     //      1       0.833 = 1/(1 + 0.2*1)
     //      2       0.714 = 1/(1 + 0.2*2)
     //      3       0.625 = 1/(1 + 0.2*3)
+    if (_log_temperature_gaps.size() + 1 != _heating_powers.size())
+        _log_temperature_gaps.assign(_heating_powers.size() - 1, log(_heating_lambda));
+    double temperature = 1.0;
     unsigned i = 0;
     for (auto & h : _heating_powers)
         {
-        h = 1.0/(1.0 + _heating_lambda*i++);
+        if (i > 0)
+            temperature += exp(_log_temperature_gaps[i - 1]);
+        h = 1.0/temperature;
+        ++i;
         }
     }
 
-inline void Strom::initChains()
+inline void Strom::adaptHeatingPowers(unsigned gap, double acceptance)
     {
-    // Create _num_chains chains
-    _chains.resize(_num_chains);
+    // Stochastic approximation toward equal swap acceptance between adjacent chains:
+    // the log temperature gap between chains gap and gap + 1 grows if swaps between them
+    // are accepted more often than the average of all adjacent pairs, and shrinks if
+    // less often, by steps that decrease as burn-in proceeds. The gaps are then rescaled
+    // so that the hottest chain keeps the temperature given by heatfactor.
+    ++_num_adjacent_swaps;
+    _mean_swap_acceptance += (acceptance - _mean_swap_acceptance)/_num_adjacent_swaps;
+    ++_gap_swap_attempts[gap];
+    _gap_swap_acceptance[gap] += (acceptance - _gap_swap_acceptance[gap])/_gap_swap_attempts[gap];
+
+    double step_size = 1.0/pow(_gap_swap_attempts[gap], 0.6);
+    _log_temperature_gaps[gap] += step_size*(acceptance - _mean_swap_acceptance);
+
+    double total_gap = 0.0;
+    for (auto log_gap : _log_temperature_gaps)
+        total_gap += exp(log_gap);
+    double log_rescale = log(_heating_lambda*_log_temperature_gaps.size()/total_gap);
+    for (auto & log_gap : _log_temperature_gaps)
+        log_gap += log_rescale;
+
+    calcHeatingPowers();
+    }
 
-    // Create _num_chains by _num_chains swap matrix
-    _swaps.assign(_num_chains*_num_chains, 0);
+inline void Strom::showHeatingPowers() const
+    {
+    if (_num_chains > 1)
+        {
+        std::cout << "\nHeating powers after burn-in (swap acceptance is the mean probability of accepting swaps with the next hotter chain):" << std::endl;
+        std::cout << boost::str(boost::format("%12s %12s %12s %12s") % "chain" % "power" % "temperature" % "swap accept") << std::endl;
+        for (unsigned i = 0; i < _num_chains; ++i)
+            {
+            if (i + 1 < _num_chains)
+                std::cout << boost::str(boost::format("%12d %12.5f %12.5f %12.5f") % i % _heating_powers[i] % (1.0/_heating_powers[i]) % _gap_swap_acceptance[i]) << std::endl;
+            else
+                std::cout << boost::str(boost::format("%12d %12.5f %12.5f %12s") % i % _heating_powers[i] % (1.0/_heating_powers[i]) % "---") << std::endl;
+            }
+        }
+    }
+
+inline void Strom::initChains()
+    {
+    // Create the chains run by this process (all _num_chains of each replicate unless the
+    // chains are divided among processes)
+    _chain_numbers.resize(0);
+    for (unsigned chain_number = _process_group->getRank(); chain_number < _num_chains*_num_replicates; chain_number += _num_processes)
+        _chain_numbers.push_back(chain_number);
+    _chains.resize(_chain_numbers.size());
+    _chain_states.resize(0);
+    _cold_chain_numbers.resize(_num_replicates);
+    for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+        _cold_chain_numbers[replicate] = replicate*_num_chains;
+
+    // Create _num_chains by _num_chains swap matrices and round trip counts
+    resetSwapStats();
     std::cout << "Number of chains = " << _num_chains << std::endl;
+    if (_num_replicates > 1)
+        std::cout << "Number of replicates = " << _num_replicates << std::endl;
 
     // Create heating power vector
     _heating_powers.assign(_num_chains, 1.0);
+    _log_temperature_gaps.resize(0);
     calcHeatingPowers();
+    _adapting_heating = _adapt_heating && _num_chains > 1;
+    _gap_swap_acceptance.assign(_num_chains - 1, 0.0);
+    _gap_swap_attempts.assign(_num_chains - 1, 0);
+    _mean_swap_acceptance = 0.0;
+    _num_adjacent_swaps = 0;
+
+    // Starting tree of each replicate: tree r of the tree file for replicate r if there is
+    // one for every replicate, and otherwise the first tree for replicate 0 and random
+    // rearrangements of it for the others (the same in every process), so that replicates
+    // agreeing says something about convergence
+    std::vector<std::string> start_newicks(_num_replicates, _tree_summary->getNewick(0));
+    if (_num_replicates > 1)
+        {
+        if (_tree_summary->getNumStoredTrees() >= _num_replicates)
+            {
+            for (unsigned replicate = 1; replicate < _num_replicates; ++replicate)
+                start_newicks[replicate] = _tree_summary->getNewick(replicate);
+            std::cout << "Replicates start from successive trees in the tree file" << std::endl;
+            }
+        else
+            {
+            Lot::SharedPtr start_lot(new Lot);
+            start_lot->setSeed(_random_seed + _num_processes);
+            for (unsigned replicate = 1; replicate < _num_replicates; ++replicate)
+                start_newicks[replicate] = randomizeTree(start_newicks[0], start_lot);
+            std::cout << "Replicates after the first start from random rearrangements of the starting tree" << std::endl;
+            }
+        }
+
+    // Starting model parameters of each replicate, which, with the edge lengths of its
+    // starting tree, are replaced by maximum likelihood estimates if optimize is yes
+    std::vector< std::vector<double> > start_gamma_shapes(_num_replicates, std::vector<double>(_data->getNumSubsets(), _gamma_shape));
+    std::vector< std::vector<double> > start_pinvars(_num_replicates, std::vector<double>(_data->getNumSubsets(), _pinvar));
+    std::vector<bool> optimized(_num_replicates, false);
 
     // Initialize chains
-    unsigned chain_index = 0;
+    unsigned k = 0;
     for (auto & c : _chains)
         {
+        unsigned chain_number = _chain_numbers[k];
+        unsigned chain_index = chain_number % _num_chains;
+        unsigned replicate = chain_number/_num_chains;
+
         // Give the chain a starting tree
-        std::string newick = _tree_summary->getNewick(0);
-        c.setTreeFromNewick(newick);
+        c.setTreeFromNewick(start_newicks[replicate]);
 
         // Set the pseudorandom number generator
         c.setLot(_lot);
 
-        // Create a substitution model
-        Model::SharedPtr model = Model::SharedPtr(new Model());
-        model->setExchangeabilitiesAndStateFreqs(_exchangeabilities, _state_frequencies);
-        model->setGammaShape(_gamma_shape);
-        model->setGammaNCateg(_num_categ);
-        model->useStoredData(_using_stored_data);
+        // Choose how updaters are scheduled (before setLikelihood creates them)
+        c.setScheduler(_scheduler != "fixed", _scheduler == "adaptive");
+        c.setUpdaterWeights(_updater_weights);
+        c.setTopologyUpdater(_topology_updater != "none", _topology_updater == "tbr", _spr_radius);
+        c.setEdgeLengthUpdater(_edge_length_updater);
+        c.setHMCUpdater(_hmc_updater, _hmc_steps);
+        c.setModelBlockUpdater(_model_block_updater);
+
+        // Create a substitution model for each partition subset
+        std::vector<Model::SharedPtr> models;
+        for (unsigned subset = 0; subset < _data->getNumSubsets(); ++subset)
+            {
+            Model::SharedPtr model = Model::SharedPtr(new Model());
+            model->setSubmodel(_submodel);
+            model->setExchangeabilitiesAndStateFreqs(_exchangeabilities, _state_frequencies);
+            model->setGammaShape(start_gamma_shapes[replicate][subset]);
+            model->setGammaNCateg(_num_categ);
+            model->setIsInvarModel(_invar_model);
+            if (_invar_model)
+                model->setPinvar(start_pinvars[replicate][subset]);
+            model->setSubsetRelRate(_subset_relrates[subset]);
+            model->useStoredData(_using_stored_data);
+            models.push_back(model);
+            }
 
         // Create a likelihood object that will compute log-likelihoods
         Likelihood::SharedPtr likelihood = Likelihood::SharedPtr(new Likelihood());
         likelihood->setData(_data);
-        likelihood->setModel(model);
+        likelihood->setModels(models);
+        likelihood->setThreadPool(_thread_pool);
         likelihood->useStoredData(_using_stored_data);
+        likelihood->useSinglePrecision(_precision == "single", _precision_tolerance, _precision_check_freq);
+        likelihood->setScalingPolicy(getScalingPolicy(), _scaling_interval, _scaling_check_freq, _scaling_tolerance);
+
+        // Benchmark BeagleLib configurations on the starting tree (the choice is used by
+        // the Likelihood objects of all chains of the process and saved for later runs)
+        if (_beagle_tune && k == 0)
+            {
+            Likelihood::readTunedFlags(getTunedFlagsFileName());
+            likelihood->tuneBeagleLib(_tree_summary->getTree(0), _beagle_tune_reps);
+            if (isCoordinator())
+                Likelihood::writeTunedFlags(getTunedFlagsFileName());
+            }
 
         // Provide the chain a likelihood calculator
         c.setLikelihood(likelihood);
 
+        // Optimize the starting state of the first chain of each replicate once and start
+        // the others from it (each process optimizes its own first chain of the replicate,
+        // which gives the same result; not needed when resuming, which replaces the state)
+        if (_optimize && !_resume && !optimized[replicate])
+            {
+            optimized[replicate] = true;
+            MLOptimizer optimizer;
+            optimizer.setLikelihood(likelihood);
+            optimizer.setTreeManip(c.getTreeManip());
+            optimizer.setTolerance(_optimize_tolerance);
+            optimizer.setOptimizeModel(_optimize_model);
+            double lnL = optimizer.optimize();
+            std::cout << boost::str(boost::format("maximum likelihood starting state: log likelihood = %.5f") % lnL) << std::endl;
+
+            start_newicks[replicate] = c.getTreeManip()->makeNewick(12);
+            for (unsigned subset = 0; subset < models.size(); ++subset)
+                {
+                start_gamma_shapes[replicate][subset] = models[subset]->getGammaShape();
+                if (_invar_model)
+                    start_pinvars[replicate][subset] = models[subset]->getPinvar();
+                }
+            }
+
         // Tell the chain that it should adapt its updators (at least initially)
         c.startTuning();
 
@@ -264,10 +758,16 @@ inline void Strom::initChains()
         // Print headers in output files and make sure each updator has its starting value
         c.start();
 
-        if (chain_index == 0)
+        if (chain_number == 0)
             {
-            // Summarize model
-            std::cout << model->describeModel() << std::endl;
+            // Summarize model(s)
+            for (unsigned subset = 0; subset < models.size(); ++subset)
+                {
+                if (models.size() > 1)
+                    std::cout << boost::str(boost::format("\nSubset %s:") % _data->getSubsetName(subset)) << std::endl;
+                std::cout << models[subset]->describeModel() << std::endl;
+                }
+            std::cout << likelihood->describeScaling() << std::endl;
 
             // Calculate the log-likelihood for the tree
             Tree::SharedPtr tree = _tree_summary->getTree(0);
@@ -277,36 +777,110 @@ inline void Strom::initChains()
                 std::cout << boost::str(boost::format("      (expecting %.5f)") % _expected_log_likelihood) << std::endl;
             }
 
-        ++chain_index;
+        ++k;
         }
     }
 
+inline std::string Strom::randomizeTree(const std::string & newick, Lot::SharedPtr lot) const
+    {
+    // A random rearrangement of the tree described by newick: the subtree of a random node
+    // is regrafted on a random edge anywhere in the tree 2n times (for n leaves), and each
+    // edge length is then multiplied by a random factor between 1/e and e
+    TreeManip tm;
+    tm.buildFromNewick(newick, false, false);
+    unsigned nmoves = 2*tm.getTree()->numLeaves();
+    for (unsigned move = 0; move < nmoves; ++move)
+        {
+        Node * x = tm.randomPrunableNode(lot->uniform());
+        Node * s = tm.pruneSubtree(x);
+        Node::PtrVector edges;
+        tm.collectRegraftEdges(s, 0, edges);
+        Node * y = (edges.empty() ? s : edges[(unsigned)std::floor(lot->uniform()*edges.size())]);
+        tm.regraftSubtree(x, y, lot->uniform());
+        }
+    std::vector<double> edge_lengths;
+    tm.getEdgeLengths(edge_lengths);
+    for (auto & edge_length : edge_lengths)
+        edge_length *= std::exp(2.0*lot->uniform() - 1.0);
+    tm.setEdgeLengths(edge_lengths);
+    return tm.makeNewick(12);
+    }
+
+inline void Strom::calcSubsetRelRates()
+    {
+    // Rescales the relative rates of the partition subsets so that their mean,
+    // weighted by the number of sites in each subset, is 1 (all subsets
+    // evolve at the same rate if no relative rates were specified)
+    unsigned nsubsets = _data->getNumSubsets();
+    if (_subset_relrates.empty())
+        _subset_relrates.assign(nsubsets, 1.0);
+    assert(_subset_relrates.size() == nsubsets);
+
+    double total_sites = 0.0;
+    double total_rate = 0.0;
+    for (unsigned subset = 0; subset < nsubsets; ++subset)
+        {
+        double nsites = _data->getSubsetNumSites(subset);
+        total_sites += nsites;
+        total_rate += nsites*_subset_relrates[subset];
+        }
+    for (auto & relrate : _subset_relrates)
+        relrate *= total_sites/total_rate;
+    }
+
 inline void Strom::showLambdas() const
     {
-    for (unsigned idx = 0; idx < _num_chains; ++idx)
+    // Only the chains run by this process are shown
+    for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
         {
-        for (auto & c : _chains)
+        for (unsigned idx = 0; idx < _num_chains; ++idx)
             {
-            if (c.getChainIndex() == idx)
+            for (unsigned k = 0; k < _chains.size(); ++k)
                 {
-                _output_manager->outputConsole(boost::str(boost::format("Chain %d (power %.5f)") % idx % c.getHeatingPower()));
-                std::vector<std::string> names = c.getUpdaterNames();
-                std::vector<double> lambdas    = c.getLambdas();
-                std::vector<double> acceptpcts = c.getAcceptPercentages();
-                unsigned n = (unsigned)names.size();
-                _output_manager->outputConsole(boost::str(boost::format("%30s %15s %15s") % "Updater" % "Tuning Param." % "Accept %"));
-                for (unsigned i = 0; i < n; ++i)
+                const Chain & c = _chains[k];
+                if (_chain_numbers[k]/_num_chains == replicate && c.getChainIndex() == idx)
                     {
-                    _output_manager->outputConsole(boost::str(boost::format("%30s %15.8f %15.1f") % names[i] % lambdas[i] % acceptpcts[i]));
+                    OutputManager::SharedPtr output_manager = _output_managers[replicate];
+                    if (_num_replicates > 1)
+                        output_manager->outputConsole(boost::str(boost::format("Replicate %d chain %d (power %.5f)") % (replicate + 1) % idx % c.getHeatingPower()));
+                    else
+                        output_manager->outputConsole(boost::str(boost::format("Chain %d (power %.5f)") % idx % c.getHeatingPower()));
+                    std::vector<std::string> names = c.getUpdaterNames();
+                    std::vector<double> lambdas    = c.getLambdas();
+                    std::vector<double> acceptpcts = c.getAcceptPercentages();
+                    std::vector<double> weights    = c.getWeights();
+                    std::vector<double> seconds    = c.getSecondsPerUpdate();
+                    unsigned n = (unsigned)names.size();
+                    if (_scheduler == "fixed")
+                        output_manager->outputConsole(boost::str(boost::format("%30s %15s %15s %15s") % "Updater" % "Tuning Param." % "Accept %" % "ms/update"));
+                    else
+                        output_manager->outputConsole(boost::str(boost::format("%30s %15s %15s %15s %15s") % "Updater" % "Tuning Param." % "Accept %" % "ms/update" % "Weight"));
+                    for (unsigned i = 0; i < n; ++i)
+                        {
+                        if (_scheduler == "fixed")
+                            output_manager->outputConsole(boost::str(boost::format("%30s %15.8f %15.1f %15.5f") % names[i] % lambdas[i] % acceptpcts[i] % (1000.0*seconds[i])));
+                        else
+                            output_manager->outputConsole(boost::str(boost::format("%30s %15.8f %15.1f %15.5f %15.5f") % names[i] % lambdas[i] % acceptpcts[i] % (1000.0*seconds[i]) % weights[i]));
+                        }
                     }
                 }
             }
         }
     }
 
+inline Likelihood::scaling_policy_t Strom::getScalingPolicy() const
+    {
+    if (_scaling == "always")
+        return Likelihood::ScaleAlways;
+    else if (_scaling == "levels")
+        return Likelihood::ScaleEveryKLevels;
+    return Likelihood::ScaleDynamic;
+    }
+
 inline void Strom::stopTuningChains()
     {
-    _swaps.assign(_num_chains*_num_chains, 0);
+    resetSwapStats();
+    _adapting_heating = false;
     for (auto & c : _chains)
         {
         c.stopTuning();
@@ -316,42 +890,93 @@ inline void Strom::stopTuningChains()
 inline void Strom::stepChains(unsigned iteration, bool sampling)
     {
     for (auto & c : _chains)
-        {
         c.nextStep(iteration);
-        if (sampling)
-            sample(iteration, c);
+
+    if (sampling && iteration % _sample_freq == 0)
+        {
+        for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+            sample(iteration, replicate);
         }
     }
 
+inline void Strom::resetSwapStats()
+    {
+    _swaps.assign(_num_replicates*_num_chains*_num_chains, 0);
+    _num_swap_rounds = 0;
+    _last_extreme_visited.assign(_num_replicates*_num_chains, -1);
+    _round_trips.assign(_num_replicates*_num_chains, 0);
+    }
+
 inline void Strom::swapChains()
     {
-    if (_num_chains == 1)
+    // With one chain per replicate there are no swaps, but the processes still exchange
+    // whether to stop
+    if (_num_chains == 1 && _num_processes == 1)
         return;
 
-    // Select two chains at random to swap
-    // If _num_chains = 3...
-    //  i  j  = (i + 1 + randint(0,1)) % _num_chains
-    // ---------------------------------------------
-    //  0  1  = (0 + 1 +      0      ) %     3
-    //     2  = (0 + 1 +      1      ) %     3
-    // ---------------------------------------------
-    //  1  2  = (1 + 1 +      0      ) %     3
-    //     0  = (1 + 1 +      1      ) %     3
-    // ---------------------------------------------
-    //  2  0  = (2 + 1 +      0      ) %     3
-    //     1  = (2 + 1 +      1      ) %     3
-    // ---------------------------------------------
-    unsigned i = _lot->randint(0, _num_chains-1);
-    unsigned j = i + 1 + _lot->randint(0, _num_chains-2);
-    j %= _num_chains;
-
-    assert(i != j && i >=0 && i < _num_chains && j >= 0 && j < _num_chains);
-
-    // Determine upper and lower triangle cells in _swaps vector
+    // Swaps are decided by the coordinator from the heat rank and log kernel of every
+    // chain, and the outcome is passed back to the processes running the chains
+    gatherChainStates();
+    if (!isCoordinator() || _num_chains == 1)
+        {
+        scatterChainStates();
+        return;
+        }
+
+    ++_num_swap_rounds;
+    for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+        {
+        unsigned first = replicate*_num_chains;
+        if (_swap_scheme == "deo")
+            {
+            // Deterministic even-odd scheme: propose swaps between all chains adjacent in
+            // heat, pairing heat ranks (0,1), (2,3), ... in odd rounds and (1,2), (3,4), ...
+            // in even rounds. The pairs are disjoint, and alternating between them lets a
+            // chain keep moving in the same direction along the ladder while its swaps are
+            // accepted, so round trips take time linear in the number of chains rather than
+            // quadratic as with the random walk of the random scheme.
+            std::vector<unsigned> by_index(_num_chains);
+            for (unsigned k = first; k < first + _num_chains; ++k)
+                by_index[_chain_states[k].index] = k;
+            for (unsigned idx = (_num_swap_rounds + 1) % 2; idx + 1 < _num_chains; idx += 2)
+                attemptSwap(by_index[idx], by_index[idx + 1]);
+            }
+        else
+            {
+            // Select two chains at random to swap
+            // If _num_chains = 3...
+            //  i  j  = (i + 1 + randint(0,1)) % _num_chains
+            // ---------------------------------------------
+            //  0  1  = (0 + 1 +      0      ) %     3
+            //     2  = (0 + 1 +      1      ) %     3
+            // ---------------------------------------------
+            //  1  2  = (1 + 1 +      0      ) %     3
+            //     0  = (1 + 1 +      1      ) %     3
+            // ---------------------------------------------
+            //  2  0  = (2 + 1 +      0      ) %     3
+            //     1  = (2 + 1 +      1      ) %     3
+            // ---------------------------------------------
+            unsigned i = _lot->randint(0, _num_chains-1);
+            unsigned j = i + 1 + _lot->randint(0, _num_chains-2);
+            j %= _num_chains;
+            attemptSwap(first + i, first + j);
+            }
+        }
+
+    countRoundTrips();
+    scatterChainStates();
+    }
+
+inline void Strom::attemptSwap(unsigned i, unsigned j)
+    {
+    assert(i != j && i / _num_chains == j / _num_chains && j / _num_chains < _num_replicates);
+
+    // Determine upper and lower triangle cells in the replicate's block of the _swaps vector
+    unsigned block = (i/_num_chains)*_num_chains*_num_chains;
     unsigned smaller = _num_chains;
     unsigned larger  = _num_chains;
-    double index_i   = _chains[i].getChainIndex();
-    double index_j   = _chains[j].getChainIndex();
+    unsigned index_i = _chain_states[i].index;
+    unsigned index_j = _chain_states[j].index;
     if (index_i < index_j)
         {
         smaller = index_i;
@@ -362,8 +987,8 @@ inline void Strom::swapChains()
         smaller = index_j;
         larger  = index_i;
         }
-    unsigned upper = smaller*_num_chains + larger;
-    unsigned lower = larger*_num_chains  + smaller;
+    unsigned upper = block + smaller*_num_chains + larger;
+    unsigned lower = block + larger*_num_chains  + smaller;
     _swaps[upper]++;
 
     // Propose swap of chains i and j
@@ -376,11 +1001,11 @@ inline void Strom::swapChains()
     //      pi^a         pj^b
     // log R = (a-b) [log(pj) - log(pi)]
 
-    double heat_i       = _chains[i].getHeatingPower();
-    double log_kernel_i = _chains[i].calcLogLikelihood() + _chains[i].calcLogJointPrior();
+    double heat_i       = _heating_powers[index_i];
+    double log_kernel_i = _chain_states[i].log_kernel;
 
-    double heat_j       = _chains[j].getHeatingPower();
-    double log_kernel_j = _chains[j].calcLogLikelihood() + _chains[j].calcLogJointPrior();
+    double heat_j       = _heating_powers[index_j];
+    double log_kernel_j = _chain_states[j].log_kernel;
 
     double logR = (heat_i - heat_j)*(log_kernel_j - log_kernel_i);
 
@@ -389,16 +1014,119 @@ inline void Strom::swapChains()
         {
         // accept swap
         _swaps[lower]++;
-        _chains[j].setHeatingPower(heat_i);
-        _chains[i].setHeatingPower(heat_j);
-        _chains[j].setChainIndex(index_i);
-        _chains[i].setChainIndex(index_j);
-        std::vector<double> lambdas_i = _chains[i].getLambdas();
-        std::vector<double> lambdas_j = _chains[j].getLambdas();
-        _chains[i].setLambdas(lambdas_j);
-        _chains[j].setLambdas(lambdas_i);
+        _chain_states[j].index = index_i;
+        _chain_states[i].index = index_j;
+        std::swap(_chain_states[i].lambdas, _chain_states[j].lambdas);
+        }
+
+    // Swaps between chains adjacent in heat inform the temperature gap between them
+    if (_adapting_heating && larger == smaller + 1)
+        adaptHeatingPowers(smaller, std::min(1.0, exp(logR)));
+    }
+
+inline void Strom::countRoundTrips()
+    {
+    // A round trip is completed when a chain returns to the cold heating power after
+    // visiting the hottest one (having visited the cold one before that)
+    for (unsigned k = 0; k < _num_chains*_num_replicates; ++k)
+        {
+        unsigned idx = _chain_states[k].index;
+        if (idx == 0)
+            {
+            if (_last_extreme_visited[k] == 1)
+                _round_trips[k]++;
+            _last_extreme_visited[k] = 0;
+            }
+        else if (idx == _num_chains - 1 && _last_extreme_visited[k] == 0)
+            _last_extreme_visited[k] = 1;
+        }
+    }
+
+inline void Strom::gatherChainStates()
+    {
+    // Each process reports whether it was asked to stop and the state of its chains to the
+    // coordinator, as records of chain number, heat rank, log kernel, number of updaters
+    // and their lambdas
+    std::vector<double> records;
+    records.push_back(_stop_requested != 0 ? 1.0 : 0.0);
+    for (unsigned k = 0; k < _chains.size(); ++k)
+        {
+        Chain & c = _chains[k];
+        std::vector<double> lambdas = c.getLambdas();
+        records.push_back(_chain_numbers[k]);
+        records.push_back(c.getChainIndex());
+        records.push_back(c.calcLogLikelihood() + c.calcLogJointPrior());
+        records.push_back(lambdas.size());
+        records.insert(records.end(), lambdas.begin(), lambdas.end());
+        }
+
+    if (!isCoordinator())
+        {
+        _process_group->send(0, records);
+        return;
+        }
+
+    _chain_states.resize(_num_chains*_num_replicates);
+    _stopping = false;
+    for (unsigned rank = 0; rank < _num_processes; ++rank)
+        {
+        if (rank > 0)
+            _process_group->receive(rank, records);
+        if (records[0] != 0.0)
+            _stopping = true;
+        unsigned pos = 1;
+        while (pos < records.size())
+            {
+            ChainState & state = _chain_states[(unsigned)records[pos]];
+            state.index = (unsigned)records[pos + 1];
+            state.log_kernel = records[pos + 2];
+            unsigned nlambdas = (unsigned)records[pos + 3];
+            state.lambdas.assign(records.begin() + pos + 4, records.begin() + pos + 4 + nlambdas);
+            pos += 4 + nlambdas;
+            }
+        }
+    }
+
+inline void Strom::scatterChainStates()
+    {
+    // The coordinator sends each process whether to stop, and the heat rank, heating power
+    // and lambdas of each of its chains (in the order of _chain_numbers), and every process
+    // applies them
+    std::vector<double> records;
+    if (isCoordinator())
+        {
+        for (unsigned rank = _num_processes; rank-- > 0;)
+            {
+            records.clear();
+            records.push_back(_stopping ? 1.0 : 0.0);
+            for (unsigned chain_number = rank; chain_number < _num_chains*_num_replicates; chain_number += _num_processes)
+                {
+                const ChainState & state = _chain_states[chain_number];
+                records.push_back(state.index);
+                records.push_back(_heating_powers[state.index]);
+                records.insert(records.end(), state.lambdas.begin(), state.lambdas.end());
+                if (state.index == 0)
+                    _cold_chain_numbers[chain_number/_num_chains] = chain_number;
+                }
+            if (rank > 0)
+                _process_group->send(rank, records);
+            }
         }
+    else
+        _process_group->receive(0, records);
 
+    _stopping = (records[0] != 0.0);
+    unsigned pos = 1;
+    for (auto & c : _chains)
+        {
+        std::vector<double> lambdas = c.getLambdas();
+        c.setChainIndex((unsigned)records[pos]);
+        c.setHeatingPower(records[pos + 1]);
+        lambdas.assign(records.begin() + pos + 2, records.begin() + pos + 2 + lambdas.size());
+        c.setLambdas(lambdas);
+        pos += 2 + (unsigned)lambdas.size();
+        }
+    assert(pos == records.size());
     }
 
 inline void Strom::stopChains()
@@ -409,9 +1137,12 @@ inline void Strom::stopChains()
 
 inline void Strom::swapSummary() const
     {
-    if (_num_chains > 1)
+    for (unsigned replicate = 0; replicate < _num_replicates && _num_chains > 1; ++replicate)
         {
         unsigned i, j;
+        unsigned first = replicate*_num_chains;
+        if (_num_replicates > 1)
+            std::cout << boost::str(boost::format("\nReplicate %d") % (replicate + 1)) << std::endl;
         std::cout << "\nSwap summary (upper triangle = no. attempted swaps; lower triangle = no. successful swaps):" << std::endl;
 
         // column headers
@@ -435,7 +1166,7 @@ inline void Strom::swapSummary() const
                 if (i == j)
                     std::cout << boost::str(boost::format(" %12s") % "---");
                 else
-                    std::cout << boost::str(boost::format(" %12.5f") % _swaps[i*_num_chains + j]);
+                    std::cout << boost::str(boost::format(" %12.5f") % _swaps[first*_num_chains + i*_num_chains + j]);
                 }
             std::cout << std::endl;
             }
@@ -445,20 +1176,455 @@ inline void Strom::swapSummary() const
         for (i = 0; i < _num_chains; ++i)
             std::cout << boost::str(boost::format("-%12s") % "------------");
         std::cout << std::endl;
+
+        // round trips between the cold and hottest chains (each chain here is one state
+        // moving between heating powers, numbered by the heat rank it started with)
+        unsigned total_round_trips = std::accumulate(_round_trips.begin() + first, _round_trips.begin() + first + _num_chains, 0U);
+        std::cout << boost::str(boost::format("\nRound trips between cold and hottest chains (%s swap scheme): %d in %d swap rounds") % _swap_scheme % total_round_trips % _num_swap_rounds) << std::endl;
+        if (_num_swap_rounds > 0)
+            std::cout << boost::str(boost::format("  %.5f round trips per 1000 swap rounds") % (1000.0*total_round_trips/_num_swap_rounds)) << std::endl;
+        std::cout << boost::str(boost::format("%12s") % "round trips");
+        for (i = 0; i < _num_chains; ++i)
+            std::cout << boost::str(boost::format(" %12d") % _round_trips[first + i]);
+        std::cout << std::endl;
         }
     }
 
-inline void Strom::sample(unsigned iteration, Chain & chain)
+inline void Strom::sample(unsigned iteration, unsigned replicate)
     {
-    if (chain.getHeatingPower() == 1 && iteration % _sample_freq == 0)
+    // Samples the cold chain of the replicate: the process running it writes the sample
+    // if it is the coordinator, and otherwise sends it to the coordinator (which receives
+    // it in receiveSample)
+    for (unsigned k = 0; k < _chains.size(); ++k)
         {
+        Chain & chain = _chains[k];
+        if (_chain_numbers[k]/_num_chains != replicate || chain.getChainIndex() != 0)
+            continue;
         double logLike = chain.calcLogLikelihood();
         double logPrior = chain.calcLogJointPrior();
         double TL = chain.getTreeManip()->calcTreeLength();
-        _output_manager->outputConsole(boost::str(boost::format("%12d %12.5f %12.5f %12.5f") % iteration % logLike % logPrior % TL));
-        _output_manager->outputTree(iteration, chain.getTreeManip());
-        _output_manager->outputParameters(iteration, logLike, logPrior, TL, chain.getModel());
+        std::string newick = OutputManager::makeNewick(chain.getTreeManip());
+        std::string parameter_values = OutputManager::makeParameterValues(chain.getModels());
+        if (isCoordinator())
+            writeSample(iteration, replicate, logLike, logPrior, TL, newick, parameter_values);
+        else
+            {
+            _process_group->send(0, {logLike, logPrior, TL});
+            _process_group->sendString(0, newick);
+            _process_group->sendString(0, parameter_values);
+            }
+        return;
         }
+
+    if (isCoordinator())
+        receiveSample(iteration, replicate);
+    }
+
+inline void Strom::receiveSample(unsigned iteration, unsigned replicate)
+    {
+    // Writes the sample sent by the process running the cold chain of the replicate
+    unsigned rank = _cold_chain_numbers[replicate] % _num_processes;
+    std::vector<double> values;
+    _process_group->receive(rank, values);
+    std::string newick = _process_group->receiveString(rank);
+    std::string parameter_values = _process_group->receiveString(rank);
+    assert(values.size() == 3);
+    writeSample(iteration, replicate, values[0], values[1], values[2], newick, parameter_values);
+    }
+
+inline void Strom::writeSample(unsigned iteration, unsigned replicate, double logLike, double logPrior, double TL, const std::string & newick, const std::string & parameter_values)
+    {
+    // Samples made in this process and those sent by another are written the same way
+    OutputManager::SharedPtr output_manager = _output_managers[replicate];
+    if (_num_replicates > 1)
+        output_manager->outputConsole(boost::str(boost::format("%12d %12d %12.5f %12.5f %12.5f") % (replicate + 1) % iteration % logLike % logPrior % TL));
+    else
+        output_manager->outputConsole(boost::str(boost::format("%12d %12.5f %12.5f %12.5f") % iteration % logLike % logPrior % TL));
+    output_manager->outputTree(iteration, newick);
+    output_manager->outputParameters(iteration, logLike, logPrior, TL, parameter_values);
+    if (iteration > 0)
+        monitorSample(replicate, logLike, TL, newick, parameter_values);
+    }
+
+inline std::string Strom::getOutputFileName(const std::string & prefix, const std::string & extension, unsigned replicate) const
+    {
+    // trees.tre and params.txt, or trees.run1.tre, params.run1.txt, ... for replicates
+    if (_num_replicates == 1)
+        return prefix + "." + extension;
+    return boost::str(boost::format("%s.run%d.%s") % prefix % (replicate + 1) % extension);
+    }
+
+inline void Strom::initConvergenceMonitor()
+    {
+    // The quantities monitored are those in the parameter file other than the log prior
+    if (!isCoordinator())
+        return;
+    std::vector<std::string> names = {"lnL", "TL"};
+    const std::vector<Model::SharedPtr> & models = _chains[0].getModels();
+    for (unsigned s = 0; s < models.size(); ++s)
+        {
+        std::string suffix = (models.size() > 1 ? "[" + _data->getSubsetName(s) + "]" : "");
+        std::vector<std::string> model_names;
+        std::string joined = models[s]->paramNamesAsString("\t", suffix);
+        boost::split(model_names, joined, boost::is_any_of("\t"));
+        names.insert(names.end(), model_names.begin(), model_names.end());
+        }
+    _convergence_monitors.resize(_num_replicates);
+    for (auto & monitor : _convergence_monitors)
+        {
+        monitor = ConvergenceMonitor::SharedPtr(new ConvergenceMonitor());
+        monitor->setQuantityNames(names);
+        }
+
+    // Split frequencies in the trees sampled by the replicates are compared as they are added
+    _split_comparison = SplitComparison::SharedPtr(new SplitComparison());
+    _split_comparison->setNumReplicates(_num_replicates);
+    }
+
+inline void Strom::monitorSample(unsigned replicate, double logLike, double TL, const std::string & newick, const std::string & parameter_values)
+    {
+    // Parameter values are taken from the text written to the parameter file (the same for
+    // samples made in this process and those sent by another)
+    assert(replicate < _convergence_monitors.size());
+    std::vector<double> values = {logLike, TL};
+    std::istringstream in(parameter_values);
+    double x = 0.0;
+    while (in >> x)
+        values.push_back(x);
+    std::vector<std::string> split_patterns;
+    _convergence_monitors[replicate]->addSample(values, newick, split_patterns);
+    if (_num_replicates > 1)
+        _split_comparison->addSplits(replicate, split_patterns);
+    }
+
+inline bool Strom::checkConvergence(unsigned iteration)
+    {
+    // Called every _ess_check_freq sampling iterations if _target_ess or (with more than one
+    // replicate) _asdsf_tolerance is positive; the coordinator decides whether to stop, and
+    // tells the other processes
+    bool converged = false;
+    if (isCoordinator())
+        {
+        // Convergence is not judged until every replicate has _min_convergence_samples
+        // samples: with fewer, ESSs and split frequencies mean little (or nothing, with none)
+        unsigned min_samples = std::numeric_limits<unsigned>::max();
+        for (auto & monitor : _convergence_monitors)
+            min_samples = std::min(min_samples, monitor->getNumSamples());
+        if (min_samples < _min_convergence_samples)
+            std::cout << boost::str(boost::format("Iteration %d: %d samples%s, too few to check convergence") % iteration % min_samples % (_num_replicates > 1 ? " in some replicate" : "")) << std::endl;
+        else
+            {
+            double min_ess = std::numeric_limits<double>::max();
+            std::string min_ess_name;
+            double split_difference = 0.0;
+            for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+                {
+                unsigned which = 0;
+                double ess = _convergence_monitors[replicate]->calcMinESS(which);
+                if (ess < min_ess)
+                    {
+                    min_ess = ess;
+                    min_ess_name = _convergence_monitors[replicate]->getQuantityName(which);
+                    if (_num_replicates > 1)
+                        min_ess_name += boost::str(boost::format(" in replicate %d") % (replicate + 1));
+                    }
+                split_difference = std::max(split_difference, _convergence_monitors[replicate]->calcMaxSplitDifference());
+                }
+            converged = (_target_ess == 0.0 || min_ess >= _target_ess) && (_split_tolerance == 0.0 || split_difference <= _split_tolerance);
+            std::string asdsf_text;
+            if (_num_replicates > 1)
+                {
+                // The ASDSF is infinite if there is nothing to compare
+                double asdsf = _split_comparison->calcASDSF(_asdsf_min_frequency);
+                converged = converged && (_asdsf_tolerance == 0.0 || asdsf <= _asdsf_tolerance);
+                asdsf_text = (std::isinf(asdsf) ? std::string(", ASDSF not available") : boost::str(boost::format(", ASDSF %.5f") % asdsf));
+                }
+            std::cout << boost::str(boost::format("Iteration %d: smallest ESS %.1f (%s), largest split frequency difference %.3f%s%s") % iteration % min_ess % min_ess_name % split_difference % asdsf_text % (converged ? "; target reached, stopping" : "")) << std::endl;
+            }
+        for (unsigned rank = 1; rank < _num_processes; ++rank)
+            _process_group->send(rank, {converged ? 1.0 : 0.0});
+        }
+    else
+        {
+        std::vector<double> flag;
+        _process_group->receive(0, flag);
+        converged = (flag[0] != 0.0);
+        }
+    return converged;
+    }
+
+inline double Strom::calcElapsedSeconds() const
+    {
+    std::chrono::duration<double> since_start = std::chrono::steady_clock::now() - _start_time;
+    return _elapsed_seconds + since_start.count();
+    }
+
+inline void Strom::convergenceSummary() const
+    {
+    // ESS of each monitored quantity (in each replicate), and the smallest ESS (summed over
+    // replicates) per hour of run time (burn-in included) as the measure of how quickly the
+    // run produces independent samples
+    if (!isCoordinator() || _convergence_monitors[0]->getNumSamples() == 0)
+        return;
+    std::cout << boost::str(boost::format("\nEffective sample sizes (batch means, %d samples):") % _convergence_monitors[0]->getNumSamples()) << std::endl;
+    std::cout << boost::str(boost::format("%20s") % "quantity");
+    for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+        std::cout << boost::str(boost::format(" %12s") % (_num_replicates > 1 ? boost::str(boost::format("ESS run%d") % (replicate + 1)) : std::string("ESS")));
+    std::cout << std::endl;
+
+    double min_ess = std::numeric_limits<double>::max();
+    std::string min_ess_name;
+    for (unsigned i = 0; i < _convergence_monitors[0]->getNumQuantities(); ++i)
+        {
+        const std::string & name = _convergence_monitors[0]->getQuantityName(i);
+        std::cout << boost::str(boost::format("%20s") % name);
+        double total_ess = 0.0;
+        bool fixed = true;
+        for (auto & monitor : _convergence_monitors)
+            {
+            if (monitor->isFixed(i))
+                std::cout << boost::str(boost::format(" %12s") % "fixed");
+            else
+                {
+                double ess = monitor->calcESS(i);
+                std::cout << boost::str(boost::format(" %12.1f") % ess);
+                total_ess += ess;
+                fixed = false;
+                }
+            }
+        std::cout << std::endl;
+        if (!fixed && total_ess < min_ess)
+            {
+            min_ess = total_ess;
+            min_ess_name = name;
+            }
+        }
+
+    for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+        {
+        std::string which = (_num_replicates > 1 ? boost::str(boost::format(" (replicate %d)") % (replicate + 1)) : std::string());
+        std::cout << boost::str(boost::format("Largest difference in split frequencies between halves of the sample%s: %.3f") % which % _convergence_monitors[replicate]->calcMaxSplitDifference()) << std::endl;
+        }
+    if (_num_replicates > 1)
+        {
+        double asdsf = _split_comparison->calcASDSF(_asdsf_min_frequency);
+        if (std::isinf(asdsf))
+            std::cout << boost::str(boost::format("Average standard deviation of split frequencies not available (too few trees in some replicate, or no split with frequency at least %g)") % _asdsf_min_frequency) << std::endl;
+        else
+            std::cout << boost::str(boost::format("Average standard deviation of split frequencies (splits with frequency at least %g): %.5f") % _asdsf_min_frequency % asdsf) << std::endl;
+        }
+
+    double hours = calcElapsedSeconds()/3600.0;
+    std::cout << boost::str(boost::format("\nSmallest ESS %.1f (%s) in %.4f hours: %.1f ESS per hour") % min_ess % min_ess_name % hours % (hours > 0.0 ? min_ess/hours : 0.0)) << std::endl;
+    }
+
+inline bool Strom::isCoordinator() const
+    {
+    return _process_group->getRank() == 0;
+    }
+
+inline void Strom::requestStop(int signal)
+    {
+    // Signal handler: the run stops, after saving a checkpoint, at the end of the iteration
+    _stop_requested = 1;
+    }
+
+inline bool Strom::isStopping()
+    {
+    // With more than one chain, whether any process was asked to stop is passed around
+    // with the chain states when swapping, so that all processes stop after the same iteration
+    if (_num_chains == 1 && _num_processes == 1)
+        _stopping = (_stop_requested != 0);
+    return _stopping;
+    }
+
+inline bool Strom::checkpoint(unsigned iteration, bool sampling)
+    {
+    // Called at the end of each iteration; returns true if the run should stop
+    bool stopping = isStopping();
+    if (stopping || (_checkpoint_freq > 0 && iteration % _checkpoint_freq == 0))
+        saveCheckpoint(iteration, sampling);
+    return stopping;
+    }
+
+inline std::string Strom::getTunedFlagsFileName() const
+    {
+    if (_data_cache_dir.empty())
+        return "beagletune.txt";
+    if (_data_cache_dir.back() == '/')
+        return _data_cache_dir + "beagletune.txt";
+    return _data_cache_dir + "/beagletune.txt";
+    }
+
+inline std::string Strom::getCheckpointFileName() const
+    {
+    unsigned rank = _process_group->getRank();
+    return (rank == 0 ? _checkpoint_file_name : boost::str(boost::format("%s.%d") % _checkpoint_file_name % rank));
+    }
+
+inline void Strom::saveCheckpoint(unsigned iteration, bool sampling)
+    {
+    // Saves the state of this process: the iteration completed, the random number generator,
+    // the temperature ladder and swap statistics, how much of the output files had been
+    // written (coordinator only) and the state of each chain
+    Checkpoint checkpoint;
+    checkpoint.openForWriting(getCheckpointFileName());
+    checkpoint.write(_num_chains);
+    checkpoint.write(_num_replicates);
+    checkpoint.write(_num_processes);
+    checkpoint.write(_process_group->getRank());
+    checkpoint.write(sampling);
+    checkpoint.write(iteration);
+    checkpoint.write(_lot->getState());
+
+    checkpoint.write(_heating_powers);
+    checkpoint.write(_log_temperature_gaps);
+    checkpoint.write(_adapting_heating);
+    checkpoint.write(_gap_swap_acceptance);
+    checkpoint.write(_gap_swap_attempts);
+    checkpoint.write(_mean_swap_acceptance);
+    checkpoint.write(_num_adjacent_swaps);
+    checkpoint.write(_swaps);
+    checkpoint.write(_num_swap_rounds);
+    checkpoint.write(_last_extreme_visited);
+    checkpoint.write(_round_trips);
+    checkpoint.write(_cold_chain_numbers);
+
+    if (isCoordinator())
+        {
+        for (auto & output_manager : _output_managers)
+            {
+            checkpoint.write((double)output_manager->getTreeFileOffset());
+            checkpoint.write((double)output_manager->getParameterFileOffset());
+            }
+        checkpoint.write(calcElapsedSeconds());
+        for (auto & monitor : _convergence_monitors)
+            monitor->saveState(checkpoint);
+        _split_comparison->saveState(checkpoint);
+        }
+
+    checkpoint.write((unsigned)_chains.size());
+    for (auto & c : _chains)
+        c.saveState(checkpoint);
+    checkpoint.commit();
+    _checkpoint_saved = true;
+    }
+
+inline void Strom::restoreCheckpoint(unsigned & iteration, bool & sampling)
+    {
+    // Restores what saveCheckpoint saved, into chains already created with the same options.
+    // A process that stopped while replacing its checkpoint leaves the others one checkpoint
+    // ahead of it (the processes swap chain states every iteration, so none can get further
+    // ahead), so every process restores the last checkpoint they all finished, going back to
+    // its previous one if need be.
+    Checkpoint checkpoint;
+    openCheckpoint(checkpoint, getCheckpointFileName(), iteration, sampling);
+    if (_num_processes > 1)
+        {
+        // Iterations are ordered by counting sampling iterations after those of burn-in
+        auto position = [&]() {return (sampling ? _num_burnin_iter : 0.0) + iteration;};
+        std::vector<double> where = {position()};
+        if (isCoordinator())
+            {
+            double latest = where[0];
+            for (unsigned rank = 1; rank < _num_processes; ++rank)
+                {
+                _process_group->receive(rank, where);
+                latest = std::min(latest, where[0]);
+                }
+            where[0] = latest;
+            for (unsigned rank = 1; rank < _num_processes; ++rank)
+                _process_group->send(rank, where);
+            }
+        else
+            {
+            _process_group->send(0, where);
+            _process_group->receive(0, where);
+            }
+        if (position() != where[0])
+            {
+            checkpoint.close();
+            std::string previous_file_name = Checkpoint::getPreviousFileName(getCheckpointFileName());
+            openCheckpoint(checkpoint, previous_file_name, iteration, sampling);
+            if (position() != where[0])
+                throw XStrom(boost::str(boost::format("the checkpoints of process %d (in %s and %s) are not from the iteration of those of the other processes") % _process_group->getRank() % getCheckpointFileName() % previous_file_name));
+            }
+        }
+
+    std::string lot_state;
+    checkpoint.read(lot_state);
+    _lot->setState(lot_state);
+
+    checkpoint.read(_heating_powers);
+    checkpoint.read(_log_temperature_gaps);
+    checkpoint.read(_adapting_heating);
+    checkpoint.read(_gap_swap_acceptance);
+    checkpoint.read(_gap_swap_attempts);
+    checkpoint.read(_mean_swap_acceptance);
+    checkpoint.read(_num_adjacent_swaps);
+    checkpoint.read(_swaps);
+    checkpoint.read(_num_swap_rounds);
+    checkpoint.read(_last_extreme_visited);
+    checkpoint.read(_round_trips);
+    checkpoint.read(_cold_chain_numbers);
+
+    if (isCoordinator())
+        {
+        _tree_file_offsets.resize(_num_replicates);
+        _parameter_file_offsets.resize(_num_replicates);
+        for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+            {
+            double tree_file_offset = 0.0;
+            double parameter_file_offset = 0.0;
+            checkpoint.read(tree_file_offset);
+            checkpoint.read(parameter_file_offset);
+            _tree_file_offsets[replicate] = (std::streamoff)tree_file_offset;
+            _parameter_file_offsets[replicate] = (std::streamoff)parameter_file_offset;
+            }
+        checkpoint.read(_elapsed_seconds);
+        for (auto & monitor : _convergence_monitors)
+            monitor->restoreState(checkpoint);
+        _split_comparison->restoreState(checkpoint);
+        }
+
+    unsigned nchains = 0;
+    checkpoint.read(nchains);
+    assert(nchains == _chains.size());
+    for (auto & c : _chains)
+        c.restoreState(checkpoint);
+    checkpoint.close();
+    _checkpoint_saved = true;
+    }
+
+inline void Strom::openCheckpoint(Checkpoint & checkpoint, const std::string & file_name, unsigned & iteration, bool & sampling)
+    {
+    // Opens a checkpoint of this process and reads which iteration it was saved after
+    checkpoint.openForReading(file_name);
+    unsigned num_chains = 0;
+    unsigned num_replicates = 0;
+    unsigned num_processes = 0;
+    unsigned rank = 0;
+    checkpoint.read(num_chains);
+    checkpoint.read(num_replicates);
+    checkpoint.read(num_processes);
+    checkpoint.read(rank);
+    if (num_chains != _num_chains || num_replicates != _num_replicates || num_processes != _num_processes || rank != _process_group->getRank())
+        throw XStrom(boost::str(boost::format("checkpoint was saved by process %d of a run with %d chains in each of %d replicates in %d processes; nchains, nreplicates and nprocesses must be the same to resume") % rank % num_chains % num_replicates % num_processes));
+    checkpoint.read(sampling);
+    checkpoint.read(iteration);
+    }
+
+inline void Strom::reportLostProcess() const
+    {
+    // Only the coordinator reports: workers only talk to the coordinator, so a worker that
+    // lost touch with it just stops
+    if (!isCoordinator())
+        return;
+    std::cout << boost::str(boost::format("\nProcess %d stopped unexpectedly, so the other processes were stopped too") % _process_group->getLostRank()) << std::endl;
+    if (_checkpoint_saved)
+        std::cout << boost::str(boost::format("The run can be continued with --resume from the last checkpoint in %s saved by all processes") % _checkpoint_file_name) << std::endl;
+    else
+        std::cout << "No checkpoint had been saved (see checkpointfreq), so the run cannot be continued" << std::endl;
     }
 
 inline void Strom::run()
@@ -469,65 +1635,185 @@ inline void Strom::run()
         {
         // Read and store data
         _data = Data::SharedPtr(new Data());
+        _data->useCache(_using_data_cache, _rebuild_data_cache, _data_cache_dir);
+        Partition::SharedPtr partition = Partition::SharedPtr(new Partition());
+        for (auto & subset_definition : _subset_definitions)
+            partition->addSubset(subset_definition);
+        _data->setPartition(partition);
         _data->getDataFromFile(_data_file_name);
+        calcSubsetRelRates();
+
+        if (_estimating_marginal_likelihood)
+            estimateMarginalLikelihood();
+        else
+            runChains();
+        }
+    catch (XStrom & x)
+        {
+        std::cerr << "Strom encountered a problem:\n  " << x.what() << std::endl;
+        }
 
-        // Read in trees
-        _tree_summary = TreeSummary::SharedPtr(new TreeSummary());
-        _tree_summary->readTreefile(_tree_file_name, 0);
+    // Wait for the other processes to finish (or, after an error, tell them to stop)
+    if (_process_group)
+        _process_group->finish();
 
-        // Create a Lot object that generates (pseudo)random numbers
-        _lot = Lot::SharedPtr(new Lot);
-        _lot->setSeed(_random_seed);
+    std::cout << "\nFinished!" << std::endl;
+    }
 
-#if 1
-        PWK pwk(_lot, _tree_summary);
-        pwk.logMarginalLikelihood();
-#else
-        // Create  Chain objects
-        initChains();
+inline void Strom::estimateMarginalLikelihood()
+    {
+    // Uses only the trees in the tree file (no chains, so no worker processes or threads)
+    _tree_summary = TreeSummary::SharedPtr(new TreeSummary());
+    _tree_summary->readTreefile(_tree_file_name, 0);
 
-        // Create an output manager and open output files
-        _output_manager.reset(new OutputManager);
-        _output_manager->outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s") % "iteration" % "logLike" % "logPrior" % "TL"));
-        _output_manager->openTreeFile("trees.tre", _data);
-        _output_manager->openParameterFile("params.txt", _chains[0].getModel());
-        sample(0, _chains[0]);
+    _lot = Lot::SharedPtr(new Lot);
+    _lot->setSeed(_random_seed);
 
-        // Burn-in the chains
-        std::cout << "Burning in for " << _num_burnin_iter << " iterations... " << std::endl;
-        for (unsigned iteration = 1; iteration <= _num_burnin_iter; ++iteration)
+    PWK pwk(_lot, _tree_summary);
+    pwk.logMarginalLikelihood();
+    }
+
+inline void Strom::runChains()
+    {
+    // Start the processes among which the chains are divided (before any threads are
+    // started); each carries on from here, and only the coordinator writes output
+    _process_group = ProcessGroup::SharedPtr(new ProcessGroup());
+    _process_group->start(_num_processes);
+    if (!isCoordinator())
+        std::cout.setstate(std::ios_base::badbit);
+
+    // Create the threads used to compute subset log-likelihoods concurrently
+    _thread_pool = ThreadPool::SharedPtr(new ThreadPool());
+    _thread_pool->setNumThreads(std::min(_num_threads, _data->getNumSubsets()));
+
+    // Read in trees
+    _tree_summary = TreeSummary::SharedPtr(new TreeSummary());
+    _tree_summary->readTreefile(_tree_file_name, 0);
+
+    // Create a Lot object that generates (pseudo)random numbers (with a different
+    // seed in each process)
+    _lot = Lot::SharedPtr(new Lot);
+    _lot->setSeed(_random_seed + _process_group->getRank());
+
+    // Create  Chain objects
+    initChains();
+    initConvergenceMonitor();
+
+    // Continue from a checkpoint if requested (the iteration saved was completed)
+    unsigned first_iteration = 1;
+    bool sampling = false;
+    if (_resume)
+        {
+        unsigned iteration = 0;
+        restoreCheckpoint(iteration, sampling);
+        first_iteration = iteration + 1;
+        std::cout << boost::str(boost::format("Resuming after %s iteration %d") % (sampling ? "sampling" : "burn-in") % iteration) << std::endl;
+        }
+    std::signal(SIGTERM, requestStop);
+    _start_time = std::chrono::steady_clock::now();
+
+    // Create an output manager for each replicate and open output files
+    _output_managers.resize(_num_replicates);
+    for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+        {
+        OutputManager::SharedPtr output_manager(new OutputManager);
+        std::string tree_file_name = getOutputFileName("trees", "tre", replicate);
+        std::string parameter_file_name = getOutputFileName("params", "txt", replicate);
+        if (isCoordinator() && _resume)
             {
-            stepChains(iteration, false);
-            swapChains();
+            output_manager->reopenTreeFile(tree_file_name, _tree_file_offsets[replicate]);
+            output_manager->reopenParameterFile(parameter_file_name, _parameter_file_offsets[replicate], _chains[0].getModels(), _data);
+            }
+        else if (isCoordinator())
+            {
+            output_manager->openTreeFile(tree_file_name, _data);
+            output_manager->openParameterFile(parameter_file_name, _chains[0].getModels(), _data);
             }
+        _output_managers[replicate] = output_manager;
+        }
+    if (_num_replicates > 1)
+        _output_managers[0]->outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s") % "replicate" % "iteration" % "logLike" % "logPrior" % "TL"));
+    else
+        _output_managers[0]->outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s") % "iteration" % "logLike" % "logPrior" % "TL"));
 
-        std::cout << "Burn-in finished, no longer tuning updaters." << std::endl;
-        stopTuningChains();
-        showLambdas();
+    // If another process stops unexpectedly (which this one finds out the next time it talks
+    // to it) the others stop too, without replacing their checkpoints, and the run can be
+    // continued from the last checkpoint all of them saved
+    bool stopped = false;
+    bool lost = false;
+    try
+        {
+        if (!_resume)
+            {
+            for (unsigned replicate = 0; replicate < _num_replicates; ++replicate)
+                sample(0, replicate);
+            }
 
-        // Sample the chains
-        for (unsigned iteration = 1; iteration <= _num_iter; ++iteration)
+        // Burn-in the chains
+        if (!sampling)
+            {
+            std::cout << "Burning in for " << _num_burnin_iter << " iterations... " << std::endl;
+            for (unsigned iteration = first_iteration; iteration <= _num_burnin_iter && !stopped; ++iteration)
+                {
+                stepChains(iteration, false);
+                swapChains();
+                stopped = checkpoint(iteration, false);
+                }
+            first_iteration = 1;
+
+            if (!stopped)
+                {
+                std::cout << "Burn-in finished, no longer tuning updaters." << std::endl;
+                stopTuningChains();
+                if (_adapt_heating)
+                    showHeatingPowers();
+                showLambdas();
+                }
+            }
+
+        // Sample the chains (until the target ESS or ASDSF is reached, if there is one)
+        bool early_stopping = (_target_ess > 0.0 || (_num_replicates > 1 && _asdsf_tolerance > 0.0));
+        bool converged = false;
+        for (unsigned iteration = first_iteration; iteration <= _num_iter && !stopped && !converged; ++iteration)
             {
             stepChains(iteration, true);
             swapChains();
+            if (early_stopping && iteration % _ess_check_freq == 0)
+                converged = checkConvergence(iteration);
+            stopped = checkpoint(iteration, true);
             }
+        }
+    catch (XStrom & x)
+        {
+        if (_process_group->getLostRank() < 0)
+            throw;
+        lost = true;
+        }
+
+    if (lost)
+        reportLostProcess();
+    else if (stopped)
+        std::cout << boost::str(boost::format("\nStopped; the run was saved in %s and can be continued with --resume") % _checkpoint_file_name) << std::endl;
+    else
+        {
         showLambdas();
         stopChains();
 
         // Create swap summary
         swapSummary();
-
-        // Close output files
-        _output_manager->closeTreeFile();
-        _output_manager->closeParameterFile();
-#endif
+        convergenceSummary();
+        std::cout << "\n" << _chains[0].getLikelihood()->describeScaling() << std::endl;
         }
-    catch (XStrom & x)
+
+    // Close output files
+    if (isCoordinator())
         {
-        std::cerr << "Strom encountered a problem:\n  " << x.what() << std::endl;
+        for (auto & output_manager : _output_managers)
+            {
+            output_manager->closeTreeFile();
+            output_manager->closeParameterFile();
+            }
         }
-
-    std::cout << "\nFinished!" << std::endl;
     }
 
 } // namespace strom
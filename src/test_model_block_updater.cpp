@@ -0,0 +1,79 @@
+#include <iostream>
+#include <limits>
+#include <boost/format.hpp>
+#include "model_block_updater.hpp"
+
+using namespace strom;
+
+// static data member initializations
+const double Node::_smallest_edge_length  = 1.0e-12;
+const double Updater::_log_minus_infinity = std::numeric_limits<double>::lowest();
+const unsigned StateMatrix::_missing_nucleotide = 4;
+Likelihood::tuned_flags_map_t Likelihood::_tuned_flags;
+const unsigned Model::_gamma_rates_cache_size = 8;
+const unsigned ModelBlockUpdater::_min_samples = 100;
+
+// Checks that a proposal of the model parameter block that is rejected (revert followed by
+// pushCurrentStateToModel, as in Updater::update) leaves the parameters of the model
+// bit-identical to what they were before the proposal
+int main(int argc, const char * argv[])
+    {
+    Model::SharedPtr model(new Model());
+    model->setExchangeabilitiesAndStateFreqs({0.05, 0.3, 0.1, 0.15, 0.35, 0.05}, {0.1, 0.2, 0.3, 0.4});
+    model->setGammaNCateg(4);
+    model->setGammaShape(0.3);
+    model->setIsInvarModel(true);
+    model->setPinvar(0.2);
+
+    Likelihood::SharedPtr likelihood(new Likelihood());
+    likelihood->setModel(model);
+    likelihood->useStoredData(false);
+
+    Lot::SharedPtr lot(new Lot());
+    lot->setSeed(1);
+
+    StateFreqUpdater::SharedPtr statefreq_updater(new StateFreqUpdater);
+    ExchangeabilityUpdater::SharedPtr exchangeability_updater(new ExchangeabilityUpdater);
+    GammaShapeUpdater::SharedPtr shape_updater(new GammaShapeUpdater);
+    PinvarUpdater::SharedPtr pinvar_updater(new PinvarUpdater);
+    std::vector<Updater::SharedPtr> components = {statefreq_updater, exchangeability_updater, shape_updater, pinvar_updater};
+    for (auto u : components)
+        {
+        u->setLikelihood(likelihood);
+        u->setLot(lot);
+        }
+
+    ModelBlockUpdater block_updater;
+    block_updater.setLikelihood(likelihood);
+    block_updater.setLot(lot);
+    block_updater.setLambda(1.0);
+    block_updater.setComponents(statefreq_updater, exchangeability_updater, shape_updater, pinvar_updater);
+
+    const std::vector<double> state_freqs       = model->getStateFreqs();
+    const std::vector<double> exchangeabilities = model->getExchangeabilities();
+    const double shape                          = model->getGammaShape();
+    const double pinvar                         = model->getPinvar();
+
+    unsigned nfailures = 0;
+    for (unsigned i = 0; i < 1000; ++i)
+        {
+        block_updater.pullCurrentStateFromModel();
+        block_updater.proposeNewState();
+        block_updater.pushCurrentStateToModel();
+        block_updater.revert();
+        block_updater.pushCurrentStateToModel();
+
+        if (model->getStateFreqs() != state_freqs || model->getExchangeabilities() != exchangeabilities
+            || model->getGammaShape() != shape || model->getPinvar() != pinvar)
+            {
+            std::cerr << boost::str(boost::format("model parameters changed by rejected proposal %d") % (i + 1)) << std::endl;
+            ++nfailures;
+            break;
+            }
+        }
+
+    if (nfailures > 0)
+        return 1;
+    std::cout << "rejected proposals of the model parameter block leave the model unchanged" << std::endl;
+    return 0;
+    }
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+#include "xstrom.hpp"
+
+namespace strom
+    {
+
+    class ThreadPool
+        {
+        public:
+            typedef std::function<void(unsigned)>   task_t;
+
+                                        ThreadPool();
+                                        ~ThreadPool();
+
+            void                        setNumThreads(unsigned nthreads);
+            unsigned                    getNumThreads() const;
+
+            void                        run(unsigned ntasks, task_t task);
+
+        private:
+
+                                        ThreadPool(const ThreadPool &);
+            ThreadPool &                operator=(const ThreadPool &);
+
+            void                        stopWorkers();
+            void                        workerLoop();
+            bool                        runNextTask(std::unique_lock<std::mutex> & lock);
+
+            std::vector<std::thread>    _workers;
+            std::mutex                  _mutex;
+            std::condition_variable     _work_available;
+            std::condition_variable     _work_finished;
+            task_t                      _task;
+            unsigned                    _ntasks;
+            unsigned                    _next_task;
+            unsigned                    _ncompleted;
+            unsigned                    _generation;
+            bool                        _stopping;
+            std::exception_ptr          _exception;
+
+        public:
+
+            typedef std::shared_ptr< ThreadPool > SharedPtr;
+        };
+
+inline ThreadPool::ThreadPool()
+    {
+    //std::cout << "Constructing a ThreadPool" << std::endl;
+    _ntasks     = 0;
+    _next_task  = 0;
+    _ncompleted = 0;
+    _generation = 0;
+    _stopping   = false;
+    }
+
+inline ThreadPool::~ThreadPool()
+    {
+    //std::cout << "Destroying a ThreadPool" << std::endl;
+    stopWorkers();
+    }
+
+inline void ThreadPool::setNumThreads(unsigned nthreads)
+    {
+    // The thread calling run also executes tasks, so only nthreads - 1 workers are started
+    stopWorkers();
+    for (unsigned i = 1; i < nthreads; ++i)
+        _workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+inline unsigned ThreadPool::getNumThreads() const
+    {
+    return (unsigned)_workers.size() + 1;
+    }
+
+inline void ThreadPool::stopWorkers()
+    {
+        {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _stopping = true;
+        }
+    _work_available.notify_all();
+    for (auto & t : _workers)
+        t.join();
+    _workers.clear();
+    _stopping = false;
+    }
+
+inline void ThreadPool::run(unsigned ntasks, task_t task)
+    {
+    // Calls task(0), task(1), ..., task(ntasks - 1), spreading the calls over the
+    // threads of the pool, and returns once all have finished. If any call throws,
+    // the first exception is rethrown here. Not reentrant: a task must not call run.
+    if (ntasks == 0)
+        return;
+    if (_workers.empty() || ntasks == 1)
+        {
+        for (unsigned i = 0; i < ntasks; ++i)
+            task(i);
+        return;
+        }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _task       = task;
+    _ntasks     = ntasks;
+    _next_task  = 0;
+    _ncompleted = 0;
+    _exception  = nullptr;
+    ++_generation;
+    _work_available.notify_all();
+
+    while (runNextTask(lock))
+        ;
+    _work_finished.wait(lock, [this] {return _ncompleted == _ntasks;});
+
+    _task = nullptr;
+    if (_exception)
+        std::rethrow_exception(_exception);
+    }
+
+inline bool ThreadPool::runNextTask(std::unique_lock<std::mutex> & lock)
+    {
+    // Claims and runs the next unclaimed task (releasing the lock while it runs);
+    // returns false if every task has already been claimed
+    if (_next_task >= _ntasks)
+        return false;
+    unsigned i = _next_task++;
+    task_t task = _task;
+    lock.unlock();
+    try
+        {
+        task(i);
+        }
+    catch (...)
+        {
+        lock.lock();
+        if (!_exception)
+            _exception = std::current_exception();
+        lock.unlock();
+        }
+    lock.lock();
+    if (++_ncompleted == _ntasks)
+        _work_finished.notify_all();
+    return true;
+    }
+
+inline void ThreadPool::workerLoop()
+    {
+    std::unique_lock<std::mutex> lock(_mutex);
+    unsigned generation = _generation;
+    while (true)
+        {
+        _work_available.wait(lock, [this, generation] {return _stopping || _generation != generation;});
+        if (_stopping)
+            return;
+        generation = _generation;
+        while (runNextTask(lock))
+            ;
+        }
+    }
+
+    }
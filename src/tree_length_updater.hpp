@@ -19,6 +19,7 @@ namespace strom
             virtual void                revert();
 
             virtual double              calcLogPrior() const;
+            virtual double              getStateSummary(double log_likelihood) const;
 
         private:
 
@@ -55,6 +56,11 @@ inline double TreeLengthUpdater::calcLogPrior() const
     return Updater::calcEdgeLengthPrior();
     }
 
+inline double TreeLengthUpdater::getStateSummary(double log_likelihood) const
+    {
+    return std::log(_curr_point);
+    }
+
 inline void TreeLengthUpdater::pullCurrentStateFromModel()
     {
     _curr_point = _tree_manipulator->calcTreeLength();
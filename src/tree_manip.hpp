@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include <memory>
 #include <stack>
 #include <boost/format.hpp>
@@ -26,6 +27,8 @@ namespace strom
             Tree::SharedPtr             getTree();
             double                      calcTreeLength() const;
             void                        scaleAllEdgeLengths(double scaler);
+            void                        getEdgeLengths(std::vector<double> & edge_lengths) const;
+            void                        setEdgeLengths(const std::vector<double> & edge_lengths);
             void                        createTestTree();
             void                        clear();
 
@@ -37,6 +40,13 @@ namespace strom
             void                        nniNodeSwap(Node * a, Node * b);
             Node *                      randomInternalEdge(double uniform01);
 
+            Node *                      randomPrunableNode(double uniform01);
+            Node *                      pruneSubtree(Node * x);
+            void                        regraftSubtree(Node * x, Node * y, double uniform01);
+            void                        rerootSubtree(Node * x, Node * z, double uniform01);
+            void                        collectRegraftEdges(Node * nd, unsigned radius, Node::PtrVector & edges) const;
+            void                        collectRerootEdges(Node * x, unsigned radius, Node::PtrVector & edges) const;
+
         private:
 
             void                        refreshPreorder();
@@ -47,6 +57,8 @@ namespace strom
             unsigned                    countNewickLeaves(const std::string newick);
             void                        stripOutNexusComments(std::string & newick);
             bool                        canHaveSibling(Node * nd, bool rooted, bool allow_polytomies);
+            void                        replaceChild(Node * parent, Node * old_child, Node * new_child);
+            void                        collectDescendantEdges(Node * nd, unsigned distance, unsigned radius, Node::PtrVector & edges) const;
 
             Tree::SharedPtr             _tree;
 
@@ -107,6 +119,22 @@ inline void TreeManip::scaleAllEdgeLengths(double scaler)
         }
     }
 
+inline void TreeManip::getEdgeLengths(std::vector<double> & edge_lengths) const
+    {
+    // Edge lengths in preorder (the length of the edge below _tree->_preorder[i] is edge_lengths[i])
+    edge_lengths.clear();
+    for (auto nd : _tree->_preorder)
+        edge_lengths.push_back(nd->_edge_length);
+    }
+
+inline void TreeManip::setEdgeLengths(const std::vector<double> & edge_lengths)
+    {
+    // Sets edge lengths in preorder, as returned by getEdgeLengths
+    assert(edge_lengths.size() == _tree->_preorder.size());
+    for (unsigned i = 0; i < edge_lengths.size(); ++i)
+        _tree->_preorder[i]->setEdgeLength(edge_lengths[i]);
+    }
+
 inline void TreeManip::createTestTree()
     {
     clear();
@@ -1070,4 +1098,205 @@ inline void TreeManip::nniNodeSwap(Node * a, Node * b)
     refreshLevelorder();
     }
 
+inline Node * TreeManip::randomPrunableNode(double uniform_deviate)
+    {
+    // Chooses a node whose subtree can be pruned by pruneSubtree: any node except the
+    // root and its only child (whose subtree is the rest of the tree), so every tree has
+    // the same number (2n - 4 for n leaves) of choices
+    assert(uniform_deviate >= 0.0);
+    assert(uniform_deviate < 1.0);
+    assert(!_tree->_is_rooted);
+    unsigned num_prunable = (unsigned)_tree->_preorder.size() - 1;
+    unsigned index_of_chosen = 1 + (unsigned)std::floor(uniform_deviate*num_prunable);
+    return _tree->_preorder[index_of_chosen];
+    }
+
+inline void TreeManip::replaceChild(Node * parent, Node * old_child, Node * new_child)
+    {
+    // new_child takes the place of old_child among the children of parent
+    new_child->_parent = parent;
+    new_child->_right_sib = old_child->_right_sib;
+    if (parent->_left_child == old_child)
+        parent->_left_child = new_child;
+    else
+        {
+        Node * child = parent->_left_child;
+        while (child->_right_sib != old_child)
+            child = child->_right_sib;
+        child->_right_sib = new_child;
+        }
+    old_child->_parent = 0;
+    old_child->_right_sib = 0;
+    }
+
+inline Node * TreeManip::pruneSubtree(Node * x)
+    {
+    //       x                   x
+    //        \   s              |
+    //         \ /               p     s
+    //          p       ==>            |
+    //          |                      |
+    //          g                      g
+    //
+    // Detaches the subtree rooted at x together with its parent p. The other child s of
+    // p takes the place of p, its edge becoming as long as the two edges it replaces.
+    // Returns s. The preorder and level-order sequences are left as they were, so the
+    // tree may not be used until x is reattached by regraftSubtree.
+    Node * p = x->_parent;
+    assert(p && p->_parent);
+    Node * s = (x == p->_left_child ? x->_right_sib : p->_left_child);
+    assert(s);
+
+    s->setEdgeLength(s->_edge_length + p->_edge_length);
+    s->_parent = 0;
+    s->_right_sib = 0;
+    replaceChild(p->_parent, p, s);
+
+    p->_left_child = x;
+    x->_right_sib = 0;
+    return s;
+    }
+
+inline void TreeManip::regraftSubtree(Node * x, Node * y, double uniform_deviate)
+    {
+    //                           x
+    //    x                       \   y
+    //    |                        \ /
+    //    p     y       ==>         p
+    //          |                   |
+    //          |                   |
+    //          z                   z
+    //
+    // Attaches the subtree rooted at x, detached by pruneSubtree, by inserting its parent
+    // p into the edge below y, which is divided between y and p in the proportions
+    // uniform_deviate and 1 - uniform_deviate.
+    Node * p = x->_parent;
+    assert(p && !p->_parent && p->_left_child == x && !x->_right_sib);
+    assert(y->_parent);
+
+    double edge_length = y->_edge_length;
+    replaceChild(y->_parent, y, p);
+    p->_left_child = y;
+    y->_parent = p;
+    y->_right_sib = x;
+
+    y->setEdgeLength(uniform_deviate*edge_length);
+    p->setEdgeLength((1.0 - uniform_deviate)*edge_length);
+
+    refreshPreorder();
+    refreshLevelorder();
+    }
+
+inline void TreeManip::rerootSubtree(Node * x, Node * z, double uniform_deviate)
+    {
+    //      w1  z                  w1  other
+    //       \ /                    \ /
+    // other  v1                     v1   z
+    //     \ /           ==>          \ /
+    //      x                         x
+    //      |                         |
+    //
+    // Moves the place where the subtree rooted at x is attached to the rest of the tree
+    // from x to the edge below z, a descendant of x separated from it by at least one
+    // node. The two edges that met at x become a single edge (that of other), the edges
+    // on the path from x to z are reversed, and the edge of z is divided between z and
+    // its former parent in the proportions uniform_deviate and 1 - uniform_deviate.
+    Node::PtrVector path;
+    for (Node * nd = z; nd != x; nd = nd->_parent)
+        {
+        assert(nd);
+        path.push_back(nd);
+        }
+    path.push_back(x);
+    std::reverse(path.begin(), path.end());
+    unsigned k = (unsigned)path.size() - 1;
+    assert(k >= 2);
+
+    Node * v1 = path[1];
+    Node * other = (x->_left_child == v1 ? v1->_right_sib : x->_left_child);
+    assert(other && other != v1);
+
+    // children of v1, ..., v(k-1) that are not on the path
+    Node::PtrVector off_path(k, 0);
+    for (unsigned i = 1; i < k; ++i)
+        {
+        Node * next = path[i + 1];
+        off_path[i] = (path[i]->_left_child == next ? next->_right_sib : path[i]->_left_child);
+        }
+
+    std::vector<double> edge_lengths(k + 1, 0.0);
+    for (unsigned i = 1; i <= k; ++i)
+        edge_lengths[i] = path[i]->_edge_length;
+    other->setEdgeLength(other->_edge_length + edge_lengths[1]);
+    for (unsigned i = 1; i + 1 < k; ++i)
+        path[i]->setEdgeLength(edge_lengths[i + 1]);
+    path[k - 1]->setEdgeLength((1.0 - uniform_deviate)*edge_lengths[k]);
+    z->setEdgeLength(uniform_deviate*edge_lengths[k]);
+
+    // Every node except x is the child of one node afterwards, so setting each
+    // child list in full leaves no stale sibling pointers
+    auto set_children = [](Node * nd, Node * first, Node * second)
+        {
+        nd->_left_child = first;
+        first->_parent = nd;
+        first->_right_sib = second;
+        second->_parent = nd;
+        second->_right_sib = 0;
+        };
+    set_children(x, z, path[k - 1]);
+    for (unsigned i = k - 1; i > 1; --i)
+        set_children(path[i], off_path[i], path[i - 1]);
+    set_children(v1, off_path[1], other);
+
+    refreshPreorder();
+    refreshLevelorder();
+    }
+
+inline void TreeManip::collectRegraftEdges(Node * nd, unsigned radius, Node::PtrVector & edges) const
+    {
+    // Appends to edges (each identified by the node at its upper end) the edges other
+    // than that of nd separated from it by at most radius nodes, or all of them if radius
+    // is 0. Used after pruneSubtree to find where the pruned subtree could be regrafted.
+    collectDescendantEdges(nd, 1, radius, edges);
+    unsigned distance = 1;
+    for (Node * child = nd, * anc = nd->_parent; anc; child = anc, anc = anc->_parent, ++distance)
+        {
+        if (radius > 0 && distance > radius)
+            break;
+        for (Node * sib = anc->_left_child; sib; sib = sib->_right_sib)
+            {
+            if (sib != child)
+                {
+                edges.push_back(sib);
+                collectDescendantEdges(sib, distance + 1, radius, edges);
+                }
+            }
+
+        // The root has no edge of its own
+        if (anc->_parent)
+            edges.push_back(anc);
+        }
+    }
+
+inline void TreeManip::collectRerootEdges(Node * x, unsigned radius, Node::PtrVector & edges) const
+    {
+    // Appends to edges the edges in the subtree rooted at x to which rerootSubtree can move
+    // its attachment point, namely those separated by at most radius nodes (any number if
+    // radius is 0) from the single edge the two edges meeting at x would form without x
+    for (Node * child = x->_left_child; child; child = child->_right_sib)
+        collectDescendantEdges(child, 1, radius, edges);
+    }
+
+inline void TreeManip::collectDescendantEdges(Node * nd, unsigned distance, unsigned radius, Node::PtrVector & edges) const
+    {
+    // The edges of the children of nd are distance nodes away from the edge where the search began
+    if (radius > 0 && distance > radius)
+        return;
+    for (Node * child = nd->_left_child; child; child = child->_right_sib)
+        {
+        edges.push_back(child);
+        collectDescendantEdges(child, distance + 1, radius, edges);
+        }
+    }
+
 }
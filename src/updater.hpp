@@ -5,6 +5,7 @@
 #include "lot.hpp"
 #include "xstrom.hpp"
 #include "likelihood.hpp"
+#include "checkpoint.hpp"
 
 namespace strom
 {
@@ -27,19 +28,34 @@ namespace strom
             void                    setTuning(bool on);
             void                    setTargetAcceptanceRate(double target);
             void                    setPriorParameters(const std::vector<double> & c);
+            void                    setSubset(unsigned subset, std::string subset_name);
+            void                    setWeight(double weight);
 
             TreeManip::SharedPtr    getTreeManip() const;
             double                  getLambda() const;
             double                  getAcceptPct() const;
             std::string             getUpdaterName() const;
+            unsigned                getSubset() const;
+            double                  getWeight() const;
+            double                  getSecondsPerUpdate() const;
+            double                  getLag1Autocorrelation() const;
+            unsigned                getNumTimedUpdates() const;
 
             virtual void            clear();
+            virtual bool            isApplicable() const;
 
             virtual double          calcLogPrior() const = 0;
             double                  calcEdgeLengthPrior() const;
             double                  calcLogLikelihood() const;
             virtual double          update(double prev_lnL);
 
+            virtual double          getStateSummary(double log_likelihood) const;
+            void                    recordUpdateStats(double seconds, double log_likelihood);
+            void                    resetUpdateStats();
+
+            virtual void            saveState(Checkpoint & checkpoint) const;
+            virtual void            restoreState(Checkpoint & checkpoint);
+
         protected:
 
             virtual void            reset();
@@ -54,6 +70,7 @@ namespace strom
             Likelihood::SharedPtr   _likelihood;
             TreeManip::SharedPtr    _tree_manipulator;
             std::string             _name;
+            unsigned                _subset;
             double                  _lambda;
             double                  _log_hastings_ratio;
             double                  _target_acceptance;
@@ -64,7 +81,22 @@ namespace strom
 
             double                  _heating_power;
 
+            // relative probability of being chosen by a random-scan Chain, and the cost
+            // of updates and lag-1 autocorrelation of a summary of the state between
+            // successive updates (used to adapt the weight)
+            double                  _weight;
+            unsigned                _ntimed;
+            double                  _seconds;
+            double                  _summary_prev;
+            double                  _summary_sum;
+            double                  _summary_sumsq;
+            double                  _summary_sumlag;
+
             static const double     _log_minus_infinity;
+
+        public:
+
+            typedef std::shared_ptr< Updater > SharedPtr;
         };
 
 inline Updater::Updater()
@@ -81,13 +113,16 @@ inline Updater::~Updater()
 inline void Updater::clear()
     {
     _name                   = "updater";
+    _subset                 = 0;
     _tuning                 = true;
     _lambda                 = 0.0001;
     _target_acceptance      = 0.3;
     _naccepts               = 0;
     _nattempts              = 0;
     _heating_power          = 1.0;
+    _weight                 = 1.0;
     _prior_parameters.clear();
+    resetUpdateStats();
     reset();
     }
 
@@ -161,6 +196,128 @@ inline void Updater::setPriorParameters(const std::vector<double> & c)
     _prior_parameters.assign(c.begin(), c.end());
     }
 
+inline void Updater::setSubset(unsigned subset, std::string subset_name)
+    {
+    // Model parameters are updated separately for each partition subset; the subset
+    // name is appended to the updater name only if there is more than one subset
+    _subset = subset;
+    if (_likelihood && _likelihood->getNumSubsets() > 1)
+        _name += " (" + subset_name + ")";
+    }
+
+inline unsigned Updater::getSubset() const
+    {
+    return _subset;
+    }
+
+inline void Updater::setWeight(double weight)
+    {
+    if (weight < 0.0)
+        throw XStrom(boost::str(boost::format("weight of updater \"%s\" must not be negative but the value %.5f was supplied") % _name % weight));
+    _weight = weight;
+    }
+
+inline double Updater::getWeight() const
+    {
+    return _weight;
+    }
+
+inline double Updater::getStateSummary(double log_likelihood) const
+    {
+    // A scalar function of the state this updater changes, used to estimate how quickly
+    // successive updates decorrelate; updaters of a single parameter override this
+    return log_likelihood;
+    }
+
+inline void Updater::recordUpdateStats(double seconds, double log_likelihood)
+    {
+    double x = getStateSummary(log_likelihood);
+    if (_ntimed > 0)
+        _summary_sumlag += x*_summary_prev;
+    _summary_prev = x;
+    _summary_sum += x;
+    _summary_sumsq += x*x;
+    _seconds += seconds;
+    _ntimed++;
+    }
+
+inline void Updater::resetUpdateStats()
+    {
+    _ntimed         = 0;
+    _seconds        = 0.0;
+    _summary_prev   = 0.0;
+    _summary_sum    = 0.0;
+    _summary_sumsq  = 0.0;
+    _summary_sumlag = 0.0;
+    }
+
+inline void Updater::saveState(Checkpoint & checkpoint) const
+    {
+    // Tuning state and update statistics; the parameters updated are saved with the model
+    // and tree. Updaters with more state of their own extend this.
+    checkpoint.write(_name);
+    checkpoint.write(_lambda);
+    checkpoint.write(_naccepts);
+    checkpoint.write(_nattempts);
+    checkpoint.write(_tuning);
+    checkpoint.write(_weight);
+    checkpoint.write(_ntimed);
+    checkpoint.write(_seconds);
+    checkpoint.write(_summary_prev);
+    checkpoint.write(_summary_sum);
+    checkpoint.write(_summary_sumsq);
+    checkpoint.write(_summary_sumlag);
+    }
+
+inline void Updater::restoreState(Checkpoint & checkpoint)
+    {
+    std::string name;
+    checkpoint.read(name);
+    if (name != _name)
+        throw XStrom(boost::str(boost::format("checkpoint has state for updater \"%s\" where \"%s\" was expected (were the same options used?)") % name % _name));
+    checkpoint.read(_lambda);
+    checkpoint.read(_naccepts);
+    checkpoint.read(_nattempts);
+    checkpoint.read(_tuning);
+    checkpoint.read(_weight);
+    checkpoint.read(_ntimed);
+    checkpoint.read(_seconds);
+    checkpoint.read(_summary_prev);
+    checkpoint.read(_summary_sum);
+    checkpoint.read(_summary_sumsq);
+    checkpoint.read(_summary_sumlag);
+    }
+
+inline unsigned Updater::getNumTimedUpdates() const
+    {
+    return _ntimed;
+    }
+
+inline double Updater::getSecondsPerUpdate() const
+    {
+    return (_ntimed == 0 ? 0.0 : _seconds/_ntimed);
+    }
+
+inline double Updater::getLag1Autocorrelation() const
+    {
+    // Returns 1 (no decorrelation) if there are too few updates or the summary never changed
+    if (_ntimed < 3)
+        return 1.0;
+    double n = (double)_ntimed;
+    double mean = _summary_sum/n;
+    double variance = _summary_sumsq/n - mean*mean;
+    if (variance <= 1.e-12*std::max(1.0, mean*mean))
+        return 1.0;
+    double lag_covariance = _summary_sumlag/(n - 1.0) - mean*mean;
+    return std::max(-1.0, std::min(1.0, lag_covariance/variance));
+    }
+
+inline bool Updater::isApplicable() const
+    {
+    // Returns false if the parameter updated is not part of the model
+    return true;
+    }
+
 inline double Updater::getLambda() const
     {
     return _lambda;